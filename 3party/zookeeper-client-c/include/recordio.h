@@ -64,10 +64,21 @@ struct oarchive {
     void *priv;
 };
 
+/* realloc-like allocator of buffer archives: a NULL ptr allocates, a 0 size frees */
+typedef void *(*archive_alloc_fn)(void *ctx, void *ptr, size_t size);
+
 struct oarchive *create_buffer_oarchive(void);
+/* the archive and its buffer come from alloc, so does a buffer closed with free_buffer 0 */
+struct oarchive *create_buffer_oarchive_alloc(archive_alloc_fn alloc, void *ctx);
 void close_buffer_oarchive(struct oarchive **oa, int free_buffer);
 struct iarchive *create_buffer_iarchive(char *buffer, int len);
+struct iarchive *create_buffer_iarchive_alloc(char *buffer, int len,
+        archive_alloc_fn alloc, void *ctx);
 void close_buffer_iarchive(struct iarchive **ia);
+/* like deserialize_Buffer of a buffer iarchive, but points into the archive
+ * instead of copying; *buff is NULL for a null buffer */
+int ia_deserialize_buffer_view(struct iarchive *ia, const char *name,
+        const char **buff, int32_t *len);
 char *get_buffer(struct oarchive *);
 int get_buffer_len(struct oarchive *);
 
@@ -136,7 +136,8 @@ enum ZOO_ERRORS {
   ZEPHEMERALONLOCALSESSION = -120, /*!< Attempt to create ephemeral node on a local session */
   ZNOWATCHER = -121, /*!< The watcher couldn't be found */
   ZRECONFIGDISABLED = -123, /*!< Attempts to perform a reconfiguration operation when reconfiguration feature is disabled */
-  ZSESSIONCLOSEDREQUIRESASLAUTH = -124 /*!< The session has been closed by server because server requires client to do SASL authentication, but client is not configured with SASL authentication or configuted with SASL but failed (i.e. wrong credential used.). */
+  ZSESSIONCLOSEDREQUIRESASLAUTH = -124, /*!< The session has been closed by server because server requires client to do SASL authentication, but client is not configured with SASL authentication or configuted with SASL but failed (i.e. wrong credential used.). */
+  ZTHROTTLEDOP = -127 /*!< Operation was throttled and not executed at all */
 };
 
 #ifdef __cplusplus
@@ -167,6 +168,21 @@ extern ZOOAPI const int ZOO_PERM_ALL;
 /** Disable logging of the client environment at initialization time. */
 #define ZOO_NO_LOG_CLIENTENV 2
 
+/**
+ * Serve the handle from the process wide IO thread instead of giving it an IO
+ * thread of its own. Only available in the multithreaded library on Linux,
+ * elsewhere the flag is ignored.
+ */
+#define ZOO_SHARED_IO        4
+
+/**
+ * Run asynchronous completions and watchers on n threads instead of one.
+ * Callbacks for the same path keep their order, session events and multi
+ * results wait for every callback queued before them. Ignored by the
+ * single threaded library.
+ */
+#define ZOO_COMPLETION_THREADS(n) (((n) & 0xff) << 8)
+
 /** This Id represents anyone. */
 extern ZOOAPI struct Id ZOO_ANYONE_ID_UNSAFE;
 /** This Id is only usable to set ACLs. It will get substituted with the
@@ -632,6 +648,176 @@ ZOOAPI void zoo_cycle_next_server(zhandle_t *zh);
  */
 ZOOAPI const char* zoo_get_current_server(zhandle_t* zh);
 
+/**
+ * \brief counters of the buffer pools of a zookeeper handle.
+ *
+ * Packets, completion entries and serialization archives are recycled through
+ * per-handle size-classed free lists. In steady state every allocation should
+ * be a hit; growing fallbacks mean the pools are too small for the load.
+ */
+struct zoo_pool_stats {
+    int64_t hits;       /* allocations served from a free list */
+    int64_t fallbacks;  /* allocations that went to malloc */
+    int64_t cached;     /* free blocks currently held by the pools */
+};
+
+/**
+ * \brief get the buffer pool counters of a zookeeper handle.
+ *
+ * \param zh the zookeeper handle obtained by a call to \ref zookeeper_init
+ * \param stats receives the counters
+ * \return ZOK on success or ZBADARGUMENTS if an argument is NULL
+ */
+ZOOAPI int zoo_get_pool_stats(zhandle_t *zh, struct zoo_pool_stats *stats);
+
+/**
+ * \brief check whether the calling thread runs the completions of a handle.
+ *
+ * Code that may block until other requests complete must not do so on these
+ * threads. Always 0 in the single-threaded library, where completions run in
+ * whatever thread calls \ref zookeeper_process.
+ *
+ * \param zh the zookeeper handle obtained by a call to \ref zookeeper_init
+ * \return 1 on the completion thread or one of its lanes, 0 otherwise
+ */
+ZOOAPI int zoo_is_completion_thread(zhandle_t *zh);
+
+/* watch paths per SetWatches packet by default, well below the server's jute.maxbuffer */
+#define ZOO_REWATCH_CHUNK_BYTES (128 * 1024)
+/* SetWatches packets sent ahead of their responses by default */
+#define ZOO_REWATCH_WINDOW 4
+
+/**
+ * \brief timings of the watch replay that follows every reconnect.
+ *
+ * A replay starts when the session is re-established and ends when the server
+ * acknowledged the last SetWatches packet. Durations are in microseconds.
+ */
+struct zoo_rewatch_stats {
+    int64_t replays;            /* completed replays */
+    int64_t last_duration;      /* duration of the last completed replay */
+    int64_t max_duration;
+    int64_t total_duration;
+    int64_t last_paths;         /* watch paths sent by the last replay */
+    int64_t last_chunks;        /* SetWatches packets of the last replay */
+    int64_t last_bytes;         /* serialized size of the last replay */
+    int32_t in_progress;        /* non-zero while a replay is unacknowledged */
+};
+
+/**
+ * \brief get the watch replay timings of a zookeeper handle.
+ *
+ * \param zh the zookeeper handle obtained by a call to \ref zookeeper_init
+ * \param stats receives the timings
+ * \return ZOK on success or ZBADARGUMENTS if an argument is NULL
+ */
+ZOOAPI int zoo_get_rewatch_stats(zhandle_t *zh, struct zoo_rewatch_stats *stats);
+
+/**
+ * \brief bound the SetWatches packets sent after a reconnect.
+ *
+ * The watches are split into packets of about chunk_bytes of paths, all queued
+ * ahead of other requests so none reaches the server before the watches of its
+ * path. Only window packets are written ahead of their responses, so a large
+ * watch set neither exceeds the server's packet limit nor floods the
+ * connection. The limits apply to the next replay.
+ *
+ * \param zh the zookeeper handle obtained by a call to \ref zookeeper_init
+ * \param chunk_bytes path bytes per packet, 0 for \ref ZOO_REWATCH_CHUNK_BYTES
+ * \param window packets in flight, 0 for \ref ZOO_REWATCH_WINDOW
+ * \return ZOK on success or ZBADARGUMENTS if zh is NULL or a limit is negative
+ */
+ZOOAPI int zoo_set_rewatch_limits(zhandle_t *zh, int chunk_bytes, int window);
+
+/**
+ * \brief queue depths and watch counts of a zookeeper handle.
+ *
+ * The depths are read without locks and may be a moment old.
+ */
+struct zoo_queue_stats {
+    int32_t outstanding;    /* requests queued or sent and not answered yet */
+    int32_t completions;    /* responses and events waiting for the completion thread */
+    int32_t data_watches;   /* paths with a data watch */
+    int32_t exist_watches;  /* paths with an exists watch on a missing node */
+    int32_t child_watches;  /* paths with a child watch */
+    int32_t io_iterations;  /* times the IO thread served the handle */
+};
+
+/**
+ * \brief get the queue depths and watch counts of a zookeeper handle.
+ *
+ * \param zh the zookeeper handle obtained by a call to \ref zookeeper_init
+ * \param stats receives the counts
+ * \return ZOK on success or ZBADARGUMENTS if an argument is NULL
+ */
+ZOOAPI int zoo_get_queue_stats(zhandle_t *zh, struct zoo_queue_stats *stats);
+
+/* the phases a request's latency is split into, see \ref zoo_get_latency */
+#define ZOO_LATENCY_QUEUE 0     /* from the call until the request is written to the socket */
+#define ZOO_LATENCY_RTT 1       /* from the write until the response is read */
+#define ZOO_LATENCY_DISPATCH 2  /* from the response until its async completion starts */
+#define ZOO_LATENCY_CALLBACK 3  /* deserializing the response and running the completion */
+#define ZOO_LATENCY_PHASES 4
+
+/* the operations latency is recorded for, creates of every mode count as create */
+#define ZOO_LATENCY_CREATE 0
+#define ZOO_LATENCY_DELETE 1
+#define ZOO_LATENCY_EXISTS 2
+#define ZOO_LATENCY_GET_DATA 3
+#define ZOO_LATENCY_SET_DATA 4
+#define ZOO_LATENCY_GET_CHILDREN 5
+#define ZOO_LATENCY_MULTI 6
+#define ZOO_LATENCY_OTHER 7
+#define ZOO_LATENCY_OPS 8
+
+/* values below 32 usec have their own bucket, above that each power of two
+ * is split into 16 buckets, so a bucket is at most 1/16 wider than its floor */
+#define ZOO_LATENCY_BUCKETS 448
+
+/**
+ * \brief a latency histogram, all values are in microseconds.
+ *
+ * Values of 2^31 usec or more are counted in the last bucket.
+ */
+struct zoo_latency_histogram {
+    int64_t count;
+    int64_t sum;
+    int64_t max;
+    int64_t buckets[ZOO_LATENCY_BUCKETS];
+};
+
+/**
+ * \brief copy the latency histogram of one operation and phase.
+ *
+ * The histograms are updated with atomic adds by the IO and completion
+ * threads, so a copy taken while requests complete may be off by the
+ * requests in flight. With reset set every field is swapped with zero.
+ *
+ * \param zh the zookeeper handle obtained by a call to \ref zookeeper_init
+ * \param op one of the ZOO_LATENCY_ operations
+ * \param phase one of the ZOO_LATENCY_ phases
+ * \param hist receives the histogram
+ * \param reset non-zero to clear the histogram
+ * \return ZOK on success or ZBADARGUMENTS if an argument is NULL or out of range
+ */
+ZOOAPI int zoo_get_latency(zhandle_t *zh, int op, int phase,
+        struct zoo_latency_histogram *hist, int reset);
+
+/**
+ * \brief the smallest latency counted in a histogram bucket, in microseconds.
+ */
+ZOOAPI int64_t zoo_latency_bucket_floor(int bucket);
+
+/**
+ * \brief the latency below which the given fraction of a histogram falls.
+ *
+ * \param hist a histogram filled by \ref zoo_get_latency
+ * \param fraction between 0 and 1, e.g. 0.99 for the 99th percentile
+ * \return the floor of the bucket holding the percentile, 0 for an empty histogram
+ */
+ZOOAPI int64_t zoo_latency_percentile(const struct zoo_latency_histogram *hist,
+        double fraction);
+
 /**
  * \brief close the zookeeper handle and free up any resources.
  *
@@ -810,6 +996,43 @@ typedef void (*stat_completion_t)(int rc, const struct Stat *stat,
 typedef void (*data_completion_t)(int rc, const char *value, int value_len,
         const struct Stat *stat, const void *data);
 
+/**
+ * \brief the value lent to a \ref data_view_completion_t.
+ */
+struct zoo_data_view;
+
+/**
+ * \brief signature of a completion function that borrows the returned data.
+ *
+ * Same as \ref data_completion_t, except that value points straight into the
+ * buffer the response was received in instead of into a copy. The bytes stay
+ * valid until the completion returns, \ref zoo_data_view_take keeps them.
+ * \param view the buffer holding value, NULL if the call failed.
+ */
+typedef void (*data_view_completion_t)(int rc, const char *value, int value_len,
+        const struct Stat *stat, struct zoo_data_view *view, const void *data);
+
+/**
+ * \brief keep the value of a \ref data_view_completion_t after the completion.
+ *
+ * Must be called from the completion. A response too large for a receive
+ * chunk (64KB) was read into a body of its own, which is handed over as is and
+ * value stays where it is. A smaller value shares its chunk with other
+ * responses and is copied into a block of its own. Either way the block
+ * does not depend on the handle: it may outlive the session and the handle.
+ *
+ * \param view the view passed to the completion
+ * \param value receives where the kept bytes are
+ * \return the block to pass to \ref zoo_data_view_release, NULL for a NULL
+ * value, when out of memory, or when the view was already taken.
+ */
+ZOOAPI void *zoo_data_view_take(struct zoo_data_view *view, const char **value);
+
+/**
+ * \brief release a value taken with \ref zoo_data_view_take, NULL is ignored.
+ */
+ZOOAPI void zoo_data_view_release(void *owner);
+
 /**
  * \brief signature of a completion function that returns a list of strings.
  *
@@ -1228,6 +1451,25 @@ ZOOAPI int zoo_awget(zhandle_t *zh, const char *path,
         watcher_fn watcher, void* watcherCtx,
         data_completion_t completion, const void *data);
 
+/**
+ * \brief gets the data associated with a node without copying it.
+ *
+ * Same as \ref zoo_aget, but the completion borrows the value from the
+ * receive buffer, see \ref data_view_completion_t.
+ */
+ZOOAPI int zoo_aget_view(zhandle_t *zh, const char *path, int watch,
+        data_view_completion_t completion, const void *data);
+
+/**
+ * \brief gets the data associated with a node without copying it.
+ *
+ * Same as \ref zoo_awget, but the completion borrows the value from the
+ * receive buffer, see \ref data_view_completion_t.
+ */
+ZOOAPI int zoo_awget_view(zhandle_t *zh, const char *path,
+        watcher_fn watcher, void* watcherCtx,
+        data_view_completion_t completion, const void *data);
+
 /**
  * \brief gets the last committed configuration of the ZooKeeper cluster as it is known to
  * the server to which the client is connected.
@@ -27,11 +27,15 @@
 #define _GNU_SOURCE
 #endif
 
+#include "config.h"
 #include "zk_adaptor.h"
 #include "zookeeper_log.h"
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <stdint.h>
 #include <time.h>
 #include <fcntl.h>
 #include <assert.h>
@@ -44,6 +48,17 @@
 #include <sys/time.h>
 #endif
 
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_SYS_EVENTFD_H)
+#define USE_IO_LOOP
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
 int zoo_lock_auth(zhandle_t *zh)
 {
     return pthread_mutex_lock(&zh->auth_h.lock);
@@ -166,10 +181,57 @@ int create_socket_pair(zhandle_t* zh, SOCKET fds[2])
 void *do_io(void *);
 void *do_completion(void *);
 #endif
+/* A completion lane is a worker thread with a queue of its own. The completion
+ * thread spreads completions over the lanes by their key, so callbacks for one
+ * path run in order on one lane, while a completion without a key waits for
+ * every lane to go idle and then runs on the completion thread itself. */
+struct completion_lane {
+    pthread_t thread;
+    zhandle_t *zh;
+    completion_head_t queue;
+    int busy;                   // guarded by queue.lock
+    int stop;
+};
+
+static void start_completion_lanes(zhandle_t *zh);
+static int is_completion_lane(struct adaptor_threads *adaptor);
 
 
 int wakeup_io_thread(zhandle_t *zh);
 
+#ifdef USE_IO_LOOP
+/* An epoll set and an eventfd polled by one thread on behalf of any number of
+ * handles. A handle gets a loop of its own unless it was created with
+ * ZOO_SHARED_IO, then it joins the loop shared by the whole process.
+ *
+ * A wakeup only processes the handles that have work: those whose socket is
+ * ready, those kicked by wakeup_io_thread() and those whose deadline from
+ * zookeeper_interest() is due. The handles are kept in a heap by deadline, so
+ * one ready socket costs the same whatever the number of handles. */
+struct io_loop {
+    int epfd;
+    int wakefd;
+    pthread_t thread;
+    pthread_mutex_t lock;       // guards the heap, held while handles are processed
+    int refs;                   // attached handles, guarded by loops_lock
+    int shared;
+    volatile int stop;
+    int detached;               // released by its own thread, which frees it on exit
+    zhandle_t **heap;           // every attached handle, ordered by loop_deadline
+    zhandle_t **due;            // the handles of the current iteration
+    int count;
+    int due_count;
+    int capacity;               // of heap, due and kicked
+    unsigned removals;          // handles removed so far, to spot stale epoll events
+    pthread_mutex_t kick_lock;  // guards kicked, never held while taking another lock
+    zhandle_t **kicked;
+    int kick_count;
+};
+
+static int io_loop_attach(zhandle_t *zh);
+static void io_loop_detach(zhandle_t *zh);
+#endif
+
 #ifdef WIN32
 static int set_nonblock(SOCKET fd){
     ULONG nonblocking_flag = 1;
@@ -178,7 +240,7 @@ static int set_nonblock(SOCKET fd){
     else 
         return -1;
 }
-#else
+#elif !defined(USE_IO_LOOP)
 static int set_nonblock(int fd){
     long l = fcntl(fd, F_GETFL);
     if(l & O_NONBLOCK) return 0;
@@ -213,14 +275,21 @@ void start_threads(zhandle_t* zh)
     struct adaptor_threads* adaptor=zh->adaptor_priv;
     pthread_cond_init(&adaptor->cond,0);
     pthread_mutex_init(&adaptor->lock,0);
-    adaptor->threadsToWait=2;  // wait for 2 threads before opening the barrier
     
     // use api_prolog() to make sure zhandle doesn't get destroyed
     // while initialization is in progress
     api_prolog(zh);
     LOG_DEBUG(LOGCALLBACK(zh), "starting threads...");
+#ifdef USE_IO_LOOP
+    adaptor->threadsToWait=1;  // the IO loop doesn't take part in the barrier
+    rc=io_loop_attach(zh);
+    assert("io_loop_attach() failed for the IO thread"&&!rc);
+#else
+    adaptor->threadsToWait=2;  // wait for 2 threads before opening the barrier
     rc=pthread_create(&adaptor->io, 0, do_io, zh);
     assert("pthread_create() failed for the IO thread"&&!rc);
+#endif
+    start_completion_lanes(zh);
     rc=pthread_create(&adaptor->completion, 0, do_completion, zh);
     assert("pthread_create() failed for the completion thread"&&!rc);
     wait_for_others(zh);
@@ -236,6 +305,7 @@ int adaptor_init(zhandle_t *zh)
         return -1;
     }
 
+#ifndef USE_IO_LOOP
     /* We use a pipe for interrupting select() in unix/sol and socketpair in windows. */
 #ifdef WIN32   
     if (create_socket_pair(zh, adaptor_threads->self_pipe) == -1){
@@ -249,11 +319,14 @@ int adaptor_init(zhandle_t *zh)
     }
     set_nonblock(adaptor_threads->self_pipe[1]);
     set_nonblock(adaptor_threads->self_pipe[0]);
+#endif
+    adaptor_threads->loop_fd = -1;
 
     pthread_mutex_init(&zh->auth_h.lock,0);
 
     zh->adaptor_priv = adaptor_threads;
     pthread_mutex_init(&zh->to_process.lock,0);
+    pthread_mutex_init(&zh->rewatch_pending.lock,0);
     pthread_mutex_init(&adaptor_threads->zh_lock,0);
     pthread_mutex_init(&adaptor_threads->reconfig_lock,0);
     pthread_mutex_init(&adaptor_threads->watchers_lock,0);
@@ -282,16 +355,19 @@ void adaptor_finish(zhandle_t *zh)
         return;
     }
 
+#ifdef USE_IO_LOOP
+    io_loop_detach(zh);
+#else
     if(!pthread_equal(adaptor_threads->io,pthread_self())){
         wakeup_io_thread(zh);
         pthread_join(adaptor_threads->io, 0);
     }else
         pthread_detach(adaptor_threads->io);
+#endif
     
-    if(!pthread_equal(adaptor_threads->completion,pthread_self())){
-        pthread_mutex_lock(&zh->completions_to_process.lock);
-        pthread_cond_broadcast(&zh->completions_to_process.cond);
-        pthread_mutex_unlock(&zh->completions_to_process.lock);
+    if(!pthread_equal(adaptor_threads->completion,pthread_self())
+            && !is_completion_lane(adaptor_threads)){
+        unpark_completion_consumer(&zh->completions_to_process);
         pthread_join(adaptor_threads->completion, 0);
     }else
         pthread_detach(adaptor_threads->completion);
@@ -302,22 +378,33 @@ void adaptor_finish(zhandle_t *zh)
 void adaptor_destroy(zhandle_t *zh)
 {
     struct adaptor_threads *adaptor = zh->adaptor_priv;
+    int i;
     if(adaptor==0) return;
     
     pthread_cond_destroy(&adaptor->cond);
     pthread_mutex_destroy(&adaptor->lock);
     pthread_mutex_destroy(&zh->to_process.lock);
+    pthread_mutex_destroy(&zh->rewatch_pending.lock);
     pthread_mutex_destroy(&zh->to_send.lock);
     pthread_mutex_destroy(&zh->sent_requests.lock);
     pthread_cond_destroy(&zh->sent_requests.cond);
     pthread_mutex_destroy(&zh->completions_to_process.lock);
     pthread_cond_destroy(&zh->completions_to_process.cond);
     pthread_mutex_destroy(&adaptor->zh_lock);
+    for (i = 0; i < adaptor->lane_count; i++) {
+        pthread_mutex_destroy(&adaptor->lanes[i].queue.lock);
+        pthread_cond_destroy(&adaptor->lanes[i].queue.cond);
+    }
+    free(adaptor->lanes);
 
     pthread_mutex_destroy(&zh->auth_h.lock);
 
+#ifdef USE_IO_LOOP
+    io_loop_detach(zh);
+#else
     close(adaptor->self_pipe[0]);
     close(adaptor->self_pipe[1]);
+#endif
     free(adaptor);
     zh->adaptor_priv=0;
 }
@@ -326,7 +413,25 @@ int wakeup_io_thread(zhandle_t *zh)
 {
     struct adaptor_threads *adaptor_threads = zh->adaptor_priv;
     char c=0;
-#ifndef WIN32
+#ifdef USE_IO_LOOP
+    struct io_loop *loop = adaptor_threads->loop;
+    uint64_t one=1;
+    int kick;
+    (void)c;
+    if(loop==0)
+        return ZOK;
+    pthread_mutex_lock(&loop->kick_lock);
+    kick = adaptor_threads->loop_attached && !adaptor_threads->loop_kicked;
+    if (kick) {
+        adaptor_threads->loop_kicked = 1;
+        loop->kicked[loop->kick_count++] = zh;
+    }
+    pthread_mutex_unlock(&loop->kick_lock);
+    // already kicked, the loop is going to serve the handle anyway
+    if (!kick)
+        return ZOK;
+    return write(loop->wakefd,&one,sizeof(one))==sizeof(one)? ZOK: ZSYSTEMERROR;
+#elif !defined(WIN32)
     return write(adaptor_threads->self_pipe[1],&c,1)==1? ZOK: ZSYSTEMERROR;    
 #else
     return send(adaptor_threads->self_pipe[1], &c, 1, 0)==1? ZOK: ZSYSTEMERROR;    
@@ -460,6 +565,527 @@ void *do_io(void *v)
     return 0;
 }
 
+#ifdef USE_IO_LOOP
+#define IO_LOOP_MAX_EVENTS 64
+
+static pthread_mutex_t loops_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct io_loop *shared_loop;
+
+static void io_loop_free(struct io_loop *loop)
+{
+    close(loop->epfd);
+    close(loop->wakefd);
+    pthread_mutex_destroy(&loop->lock);
+    pthread_mutex_destroy(&loop->kick_lock);
+    free(loop->heap);
+    free(loop->due);
+    free(loop->kicked);
+    free(loop);
+}
+
+static int64_t io_loop_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int64_t heap_deadline(struct io_loop *loop, int i)
+{
+    return ((struct adaptor_threads*)loop->heap[i]->adaptor_priv)->loop_deadline;
+}
+
+static void heap_set(struct io_loop *loop, int i, zhandle_t *zh)
+{
+    loop->heap[i] = zh;
+    ((struct adaptor_threads*)zh->adaptor_priv)->loop_index = i;
+}
+
+static void heap_swap(struct io_loop *loop, int i, int j)
+{
+    zhandle_t *zh = loop->heap[i];
+    heap_set(loop, i, loop->heap[j]);
+    heap_set(loop, j, zh);
+}
+
+static void heap_fix(struct io_loop *loop, int i)
+{
+    while (i > 0 && heap_deadline(loop, (i - 1) / 2) > heap_deadline(loop, i)) {
+        heap_swap(loop, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    for (;;) {
+        int l = 2 * i + 1;
+        int min = i;
+        if (l < loop->count && heap_deadline(loop, l) < heap_deadline(loop, min))
+            min = l;
+        if (l + 1 < loop->count && heap_deadline(loop, l + 1) < heap_deadline(loop, min))
+            min = l + 1;
+        if (min == i)
+            break;
+        heap_swap(loop, i, min);
+        i = min;
+    }
+}
+
+// Only for epoll events that may be stale, a handle removed during the wait
+static int io_loop_contains(struct io_loop *loop, zhandle_t *zh)
+{
+    int i;
+    for (i = 0; i < loop->count; i++) {
+        if (loop->heap[i] == zh)
+            return 1;
+    }
+    return 0;
+}
+
+// Also stops wakeup_io_thread() from kicking the handle again
+static void io_loop_unkick(struct io_loop *loop, zhandle_t *zh)
+{
+    struct adaptor_threads *adaptor = zh->adaptor_priv;
+    int i;
+    pthread_mutex_lock(&loop->kick_lock);
+    adaptor->loop_attached = 0;
+    if (adaptor->loop_kicked) {
+        for (i = 0; i < loop->kick_count; i++) {
+            if (loop->kicked[i] == zh) {
+                loop->kicked[i] = loop->kicked[--loop->kick_count];
+                break;
+            }
+        }
+        adaptor->loop_kicked = 0;
+    }
+    pthread_mutex_unlock(&loop->kick_lock);
+}
+
+static void io_loop_remove(struct io_loop *loop, zhandle_t *zh)
+{
+    struct adaptor_threads *adaptor = zh->adaptor_priv;
+    int i = adaptor->loop_index;
+    // a socket that was closed has already left the epoll set, and its
+    // number may belong to another handle by now
+    if (adaptor->loop_fd != -1 && adaptor->loop_fd == zh->fd->sock)
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, adaptor->loop_fd, 0);
+    adaptor->loop_fd = -1;
+    io_loop_unkick(loop, zh);
+    loop->removals++;
+    if (i != --loop->count) {
+        heap_set(loop, i, loop->heap[loop->count]);
+        heap_fix(loop, i);
+    }
+}
+
+static void io_loop_mark_due(struct io_loop *loop, zhandle_t *zh)
+{
+    struct adaptor_threads *adaptor = zh->adaptor_priv;
+    if (!adaptor->loop_due) {
+        adaptor->loop_due = 1;
+        loop->due[loop->due_count++] = zh;
+    }
+}
+
+/* Bring the epoll registration of a handle in line with the socket and the
+ * interest zookeeper_interest() reported, epoll_ctl is only called when either
+ * of them changed. */
+static void io_loop_update(struct io_loop *loop, zhandle_t *zh, int interest)
+{
+    struct adaptor_threads *adaptor = zh->adaptor_priv;
+    struct epoll_event ev;
+    int fd = zh->fd->sock;
+
+    if (adaptor->loop_fd != fd) {
+        // the old socket was closed, and closing removed it from the set
+        adaptor->loop_fd = -1;
+    }
+    if (fd == -1 || (adaptor->loop_fd == fd && adaptor->loop_interest == interest))
+        return;
+
+    ev.events = (interest & ZOOKEEPER_READ) ? EPOLLIN : 0;
+    ev.events |= (interest & ZOOKEEPER_WRITE) ? EPOLLOUT : 0;
+    ev.data.ptr = zh;
+    if (adaptor->loop_fd == fd) {
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, fd, &ev) == -1 && errno == ENOENT)
+            epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev);
+    } else if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) == -1 && errno == EEXIST) {
+        epoll_ctl(loop->epfd, EPOLL_CTL_MOD, fd, &ev);
+    }
+    adaptor->loop_fd = fd;
+    adaptor->loop_interest = interest;
+}
+
+/* Run one handle like an iteration of do_io(), the other way round: what the
+ * last wait reported is processed first, then zookeeper_interest() says what
+ * to wait for and until when. */
+static void io_loop_serve(struct io_loop *loop, zhandle_t *zh, int64_t now)
+{
+    struct adaptor_threads *adaptor = zh->adaptor_priv;
+    struct timeval tv = {0, 0};
+    int ready = adaptor->loop_ready;
+    int fd;
+    int interest;
+
+    adaptor->loop_ready = 0;
+    adaptor->loop_due = 0;
+    // a closing handle waits for adaptor_finish() to detach it
+    if (zh->close_requested) {
+        io_loop_update(loop, zh, 0);
+        adaptor->loop_deadline = INT64_MAX;
+        heap_fix(loop, adaptor->loop_index);
+        return;
+    }
+    zh->io_count++;
+    // dispatch zookeeper events
+    zookeeper_process(zh, ready);
+    if (zh->fd->sock != adaptor->loop_fd)
+        adaptor->loop_fd = -1;
+    // stop serving the handle once it is_unrecoverable(), the completion
+    // thread still holds a reference so this can't be the last one
+    if (is_unrecoverable(zh)) {
+        io_loop_remove(loop, zh);
+        LOG_DEBUG(LOGCALLBACK(zh), "IO loop stopped serving the handle");
+        api_epilog(zh, 0);
+        return;
+    }
+    zookeeper_interest(zh, &fd, &interest, &tv);
+    io_loop_update(loop, zh, interest);
+    adaptor->loop_deadline = now + tv.tv_sec * 1000 + tv.tv_usec / 1000;
+    heap_fix(loop, adaptor->loop_index);
+}
+
+static void *io_loop_run(void *v)
+{
+    struct io_loop *loop = v;
+    struct epoll_event events[IO_LOOP_MAX_EVENTS];
+    int detached;
+
+    pthread_mutex_lock(&loop->lock);
+    while (!loop->stop) {
+        int timeout = -1;
+        unsigned removals;
+        int64_t now;
+        int i, n;
+
+        if (loop->count > 0) {
+            int64_t left = heap_deadline(loop, 0) - io_loop_now();
+            timeout = left <= 0 ? 0 : left > INT_MAX ? -1 : (int)left;
+        }
+        removals = loop->removals;
+        pthread_mutex_unlock(&loop->lock);
+
+        n = epoll_wait(loop->epfd, events, IO_LOOP_MAX_EVENTS, timeout);
+
+        pthread_mutex_lock(&loop->lock);
+        loop->due_count = 0;
+        for (i = 0; i < n; i++) {
+            zhandle_t *zh = events[i].data.ptr;
+            struct adaptor_threads *adaptor;
+            if (zh == 0) {
+                uint64_t count;
+                if (read(loop->wakefd, &count, sizeof(count)) < 0) {}
+                continue;
+            }
+            // the handle may have been detached while we were waiting
+            if (removals != loop->removals && !io_loop_contains(loop, zh))
+                continue;
+            adaptor = zh->adaptor_priv;
+            adaptor->loop_ready = (events[i].events & EPOLLIN) ? ZOOKEEPER_READ : 0;
+            adaptor->loop_ready |= (events[i].events & (EPOLLOUT|EPOLLHUP|EPOLLERR)) ? ZOOKEEPER_WRITE : 0;
+            io_loop_mark_due(loop, zh);
+        }
+        pthread_mutex_lock(&loop->kick_lock);
+        for (i = 0; i < loop->kick_count; i++) {
+            ((struct adaptor_threads*)loop->kicked[i]->adaptor_priv)->loop_kicked = 0;
+            io_loop_mark_due(loop, loop->kicked[i]);
+        }
+        loop->kick_count = 0;
+        pthread_mutex_unlock(&loop->kick_lock);
+        now = io_loop_now();
+        // the due handles leave the top of the heap one by one, their
+        // deadline is set again once they are served
+        while (loop->count > 0 && heap_deadline(loop, 0) <= now) {
+            zhandle_t *zh = loop->heap[0];
+            io_loop_mark_due(loop, zh);
+            ((struct adaptor_threads*)zh->adaptor_priv)->loop_deadline = INT64_MAX;
+            heap_fix(loop, 0);
+        }
+        for (i = 0; i < loop->due_count; i++)
+            io_loop_serve(loop, loop->due[i], now);
+    }
+    detached = loop->detached;
+    pthread_mutex_unlock(&loop->lock);
+    if (detached)
+        io_loop_free(loop);
+    return 0;
+}
+
+static struct io_loop *io_loop_create(int shared)
+{
+    struct epoll_event ev;
+    struct io_loop *loop = calloc(1, sizeof(*loop));
+    if (!loop)
+        return 0;
+    loop->shared = shared;
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    loop->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    ev.events = EPOLLIN;
+    ev.data.ptr = 0;
+    if (loop->epfd == -1 || loop->wakefd == -1
+            || epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wakefd, &ev) == -1) {
+        if (loop->epfd != -1)
+            close(loop->epfd);
+        if (loop->wakefd != -1)
+            close(loop->wakefd);
+        free(loop);
+        return 0;
+    }
+    pthread_mutex_init(&loop->lock, 0);
+    pthread_mutex_init(&loop->kick_lock, 0);
+    if (pthread_create(&loop->thread, 0, io_loop_run, loop) != 0) {
+        io_loop_free(loop);
+        return 0;
+    }
+    return loop;
+}
+
+static struct io_loop *io_loop_acquire(int shared)
+{
+    struct io_loop *loop;
+    pthread_mutex_lock(&loops_lock);
+    loop = shared ? shared_loop : 0;
+    if (!loop) {
+        loop = io_loop_create(shared);
+        if (loop && shared)
+            shared_loop = loop;
+    }
+    if (loop)
+        loop->refs++;
+    pthread_mutex_unlock(&loops_lock);
+    return loop;
+}
+
+static void io_loop_release(struct io_loop *loop)
+{
+    int last;
+    pthread_mutex_lock(&loops_lock);
+    last = --loop->refs == 0;
+    if (last && loop == shared_loop)
+        shared_loop = 0;
+    pthread_mutex_unlock(&loops_lock);
+    if (!last)
+        return;
+
+    if (pthread_equal(loop->thread, pthread_self())) {
+        // the last handle was closed from within the loop
+        pthread_mutex_lock(&loop->lock);
+        loop->stop = 1;
+        loop->detached = 1;
+        pthread_mutex_unlock(&loop->lock);
+        pthread_detach(loop->thread);
+        return;
+    }
+    pthread_mutex_lock(&loop->lock);
+    loop->stop = 1;
+    pthread_mutex_unlock(&loop->lock);
+    {
+        uint64_t one = 1;
+        if (write(loop->wakefd, &one, sizeof(one)) < 0) {}
+    }
+    pthread_join(loop->thread, 0);
+    io_loop_free(loop);
+}
+
+static int io_loop_attach(zhandle_t *zh)
+{
+    struct adaptor_threads *adaptor = zh->adaptor_priv;
+    struct io_loop *loop = io_loop_acquire(zh->shared_io);
+
+    if (!loop)
+        return -1;
+    pthread_mutex_lock(&loop->lock);
+    if (loop->count == loop->capacity) {
+        int capacity = loop->capacity ? loop->capacity * 2 : 4;
+        zhandle_t **heap = realloc(loop->heap, capacity * sizeof(*heap));
+        zhandle_t **due = heap ? realloc(loop->due, capacity * sizeof(*due)) : 0;
+        zhandle_t **kicked = due ? malloc(capacity * sizeof(*kicked)) : 0;
+        if (heap)
+            loop->heap = heap;
+        if (due)
+            loop->due = due;
+        if (!kicked) {
+            pthread_mutex_unlock(&loop->lock);
+            io_loop_release(loop);
+            return -1;
+        }
+        pthread_mutex_lock(&loop->kick_lock);
+        if (loop->kick_count)
+            memcpy(kicked, loop->kicked, loop->kick_count * sizeof(*kicked));
+        free(loop->kicked);
+        loop->kicked = kicked;
+        pthread_mutex_unlock(&loop->kick_lock);
+        loop->capacity = capacity;
+    }
+    // the loop keeps the handle alive like do_io() does
+    api_prolog(zh);
+    adaptor->loop = loop;
+    adaptor->loop_attached = 1;
+    adaptor->loop_fd = -1;
+    adaptor->loop_interest = 0;
+    adaptor->loop_ready = 0;
+    adaptor->loop_kicked = 0;
+    adaptor->loop_due = 0;
+    adaptor->loop_deadline = 0;  // served on the next wakeup
+    heap_set(loop, loop->count++, zh);
+    heap_fix(loop, loop->count - 1);
+    pthread_mutex_unlock(&loop->lock);
+    LOG_DEBUG(LOGCALLBACK(zh), "attached to the %s IO loop", loop->shared ? "shared" : "private");
+    return wakeup_io_thread(zh) == ZOK ? 0 : -1;
+}
+
+static void io_loop_detach(zhandle_t *zh)
+{
+    struct adaptor_threads *adaptor = zh->adaptor_priv;
+    struct io_loop *loop = adaptor->loop;
+    int attached;
+
+    if (!loop)
+        return;
+    pthread_mutex_lock(&loop->lock);
+    attached = adaptor->loop_attached;
+    if (attached)
+        io_loop_remove(loop, zh);
+    pthread_mutex_unlock(&loop->lock);
+    adaptor->loop = 0;
+    if (attached)
+        inc_ref_counter(zh, -1);
+    io_loop_release(loop);
+}
+
+#endif
+
+#ifdef WIN32
+static unsigned __stdcall do_completion_lane(void *v)
+#else
+static void *do_completion_lane(void *v)
+#endif
+{
+    struct completion_lane *lane = v;
+    struct _completion_list *cptr;
+
+    pthread_mutex_lock(&lane->queue.lock);
+    for (;;) {
+        while (!lane->queue.head && !lane->stop)
+            pthread_cond_wait(&lane->queue.cond, &lane->queue.lock);
+        if (!lane->queue.head)
+            break;
+        lane->busy = 1;
+        pthread_mutex_unlock(&lane->queue.lock);
+        while ((cptr = dequeue_completion(&lane->queue)) != 0)
+            process_completion(lane->zh, cptr);
+        pthread_mutex_lock(&lane->queue.lock);
+        lane->busy = 0;
+        if (!lane->queue.head)
+            pthread_cond_broadcast(&lane->queue.cond);
+    }
+    pthread_mutex_unlock(&lane->queue.lock);
+    return 0;
+}
+
+static void start_completion_lanes(zhandle_t *zh)
+{
+    struct adaptor_threads *adaptor = zh->adaptor_priv;
+    int i, rc;
+
+    if (zh->completion_threads <= 1)
+        return;
+    adaptor->lanes = calloc(zh->completion_threads, sizeof(*adaptor->lanes));
+    if (!adaptor->lanes) {
+        LOG_WARN(LOGCALLBACK(zh), "Out of memory, running completions on a single thread");
+        return;
+    }
+    for (i = 0; i < zh->completion_threads; i++) {
+        struct completion_lane *lane = &adaptor->lanes[i];
+        lane->zh = zh;
+        pthread_mutex_init(&lane->queue.lock, 0);
+        pthread_cond_init(&lane->queue.cond, 0);
+        rc = pthread_create(&lane->thread, 0, do_completion_lane, lane);
+        assert("pthread_create() failed for a completion lane"&&!rc);
+    }
+    adaptor->lane_count = zh->completion_threads;
+}
+
+static void wait_completion_lanes(struct adaptor_threads *adaptor)
+{
+    int i;
+    for (i = 0; i < adaptor->lane_count; i++) {
+        struct completion_lane *lane = &adaptor->lanes[i];
+        pthread_mutex_lock(&lane->queue.lock);
+        while (lane->queue.head || lane->busy)
+            pthread_cond_wait(&lane->queue.cond, &lane->queue.lock);
+        pthread_mutex_unlock(&lane->queue.lock);
+    }
+}
+
+static void stop_completion_lanes(struct adaptor_threads *adaptor)
+{
+    int i;
+    // the lanes drain their queues before they exit
+    for (i = 0; i < adaptor->lane_count; i++) {
+        struct completion_lane *lane = &adaptor->lanes[i];
+        pthread_mutex_lock(&lane->queue.lock);
+        lane->stop = 1;
+        pthread_cond_broadcast(&lane->queue.cond);
+        pthread_mutex_unlock(&lane->queue.lock);
+    }
+    for (i = 0; i < adaptor->lane_count; i++)
+        pthread_join(adaptor->lanes[i].thread, 0);
+}
+
+static int is_completion_lane(struct adaptor_threads *adaptor)
+{
+    int i;
+    for (i = 0; i < adaptor->lane_count; i++) {
+        if (pthread_equal(adaptor->lanes[i].thread, pthread_self()))
+            return 1;
+    }
+    return 0;
+}
+
+int zoo_is_completion_thread(zhandle_t *zh)
+{
+    struct adaptor_threads *adaptor;
+    if (!zh || !zh->adaptor_priv) {
+        return 0;
+    }
+    adaptor = zh->adaptor_priv;
+    return pthread_equal(adaptor->completion, pthread_self()) ||
+        is_completion_lane(adaptor);
+}
+
+static void dispatch_completions(zhandle_t *zh)
+{
+    struct adaptor_threads *adaptor = zh->adaptor_priv;
+    struct _completion_list *cptr;
+
+    if (adaptor->lane_count == 0) {
+        process_completions(zh);
+        return;
+    }
+    while ((cptr = pop_completion(&zh->completions_to_process)) != 0) {
+        uint32_t key = get_completion_key(cptr);
+        struct completion_lane *lane;
+        if (key == 0) {
+            wait_completion_lanes(adaptor);
+            process_completion(zh, cptr);
+            continue;
+        }
+        lane = &adaptor->lanes[key % adaptor->lane_count];
+        queue_completion(&lane->queue, cptr, 0);
+        pthread_mutex_lock(&lane->queue.lock);
+        pthread_cond_signal(&lane->queue.cond);
+        pthread_mutex_unlock(&lane->queue.lock);
+    }
+}
+
 #ifdef WIN32
 unsigned __stdcall do_completion( void * v)
 #else
@@ -471,13 +1097,10 @@ void *do_completion(void *v)
     notify_thread_ready(zh);
     LOG_DEBUG(LOGCALLBACK(zh), "started completion thread");
     while(!zh->close_requested) {
-        pthread_mutex_lock(&zh->completions_to_process.lock);
-        while(!zh->completions_to_process.head && !zh->close_requested) {
-            pthread_cond_wait(&zh->completions_to_process.cond, &zh->completions_to_process.lock);
-        }
-        pthread_mutex_unlock(&zh->completions_to_process.lock);
-        process_completions(zh);
+        park_completion_consumer(&zh->completions_to_process, &zh->close_requested);
+        dispatch_completions(zh);
     }
+    stop_completion_lanes(zh->adaptor_priv);
     api_epilog(zh, 0);    
     LOG_DEBUG(LOGCALLBACK(zh), "completion thread terminated");
     return 0;
@@ -502,6 +1125,77 @@ int32_t fetch_and_add(volatile int32_t* operand, int incr)
 #endif
 }
 
+void *exchange_pointer(void *volatile *ptr, void *value)
+{
+#ifndef WIN32
+    return __atomic_exchange_n(ptr, value, __ATOMIC_SEQ_CST);
+#else
+    return InterlockedExchangePointer(ptr, value);
+#endif
+}
+
+int32_t exchange_int32(volatile int32_t *ptr, int32_t value)
+{
+#ifndef WIN32
+    return __atomic_exchange_n(ptr, value, __ATOMIC_SEQ_CST);
+#else
+    return InterlockedExchange(ptr, value);
+#endif
+}
+
+int32_t load_int32(volatile int32_t *ptr)
+{
+#ifndef WIN32
+    return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+#else
+    return InterlockedCompareExchange(ptr, 0, 0);
+#endif
+}
+
+void *load_pointer(void *volatile *ptr)
+{
+#ifndef WIN32
+    return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+#else
+    return InterlockedCompareExchangePointer(ptr, 0, 0);
+#endif
+}
+
+void park_completion_consumer(completion_queue_t *q, volatile int *stop)
+{
+    if (has_completions(q) || *stop)
+        return;
+    exchange_int32(&q->sleeping, 1);
+    // recheck after announcing ourselves, a producer that linked its entry
+    // before the swap above did not see sleeping set
+    if (has_completions(q) || *stop) {
+        exchange_int32(&q->sleeping, 0);
+        return;
+    }
+#ifdef __linux__
+    while (load_int32(&q->sleeping) == 1)
+        syscall(SYS_futex, &q->sleeping, FUTEX_WAIT_PRIVATE, 1, NULL, NULL, 0);
+#else
+    pthread_mutex_lock(&q->lock);
+    while (load_int32(&q->sleeping) == 1)
+        pthread_cond_wait(&q->cond, &q->lock);
+    pthread_mutex_unlock(&q->lock);
+#endif
+}
+
+void unpark_completion_consumer(completion_queue_t *q)
+{
+    if (exchange_int32(&q->sleeping, 0) != 1)
+        return;
+#ifdef __linux__
+    syscall(SYS_futex, &q->sleeping, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#else
+    pthread_mutex_lock(&q->lock);
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+#endif
+}
+
 // make sure the static xid is initialized before any threads started
 __attribute__((constructor)) int32_t get_xid()
 {
@@ -45,15 +45,37 @@ struct buff_struct {
     int32_t len;
     int32_t off;
     char *buffer;
+    archive_alloc_fn alloc;
+    void *ctx;
 };
 
+/* an archive and its state are allocated together */
+struct oarchive_block {
+    struct oarchive oa;
+    struct buff_struct buff;
+};
+
+struct iarchive_block {
+    struct iarchive ia;
+    struct buff_struct buff;
+};
+
+static void *default_alloc(void *ctx, void *ptr, size_t size)
+{
+    if (size == 0) {
+        free(ptr);
+        return NULL;
+    }
+    return realloc(ptr, size);
+}
+
 static int resize_buffer(struct buff_struct *s, int newlen)
 {
     char *buffer= NULL;
     while (s->len < newlen) {
         s->len *= 2;
     }
-    buffer = (char*)realloc(s->buffer, s->len);
+    buffer = (char*)s->alloc(s->ctx, s->buffer, s->len);
     if (!buffer) {
         s->buffer = 0;
         return -ENOMEM;
@@ -257,6 +279,24 @@ int ia_deserialize_buffer(struct iarchive *ia, const char *name,
     priv->off += b->len;
     return 0;
 }
+int ia_deserialize_buffer_view(struct iarchive *ia, const char *name,
+        const char **buff, int32_t *len)
+{
+    struct buff_struct *priv = ia->priv;
+    int rc = ia_deserialize_int(ia, "len", len);
+    if (rc < 0)
+        return rc;
+    if ((priv->len - priv->off) < *len) {
+        return -E2BIG;
+    }
+    if (*len < 0) {
+        *buff = NULL;
+        return 0;
+    }
+    *buff = priv->buffer + priv->off;
+    priv->off += *len;
+    return 0;
+}
 int ia_deserialize_string(struct iarchive *ia, const char *name, char **s)
 {
     struct buff_struct *priv = ia->priv;
@@ -304,59 +344,59 @@ static struct oarchive oa_default = {
 
 struct iarchive *create_buffer_iarchive(char *buffer, int len)
 {
-    struct iarchive *ia;
-    struct buff_struct *buff;
-    ia = malloc(sizeof(*ia));
-    if (!ia) return 0;
-    buff = malloc(sizeof(struct buff_struct));
-    if (!buff) {
-        free(ia);
-        return 0;
-    }
-    *ia = ia_default;
-    buff->off = 0;
-    buff->buffer = buffer;
-    buff->len = len;
-    ia->priv = buff;
-    return ia;
+    return create_buffer_iarchive_alloc(buffer, len, default_alloc, 0);
+}
+
+struct iarchive *create_buffer_iarchive_alloc(char *buffer, int len,
+        archive_alloc_fn alloc, void *ctx)
+{
+    struct iarchive_block *block = alloc(ctx, 0, sizeof(*block));
+    if (!block) return 0;
+    block->ia = ia_default;
+    block->buff.off = 0;
+    block->buff.buffer = buffer;
+    block->buff.len = len;
+    block->buff.alloc = alloc;
+    block->buff.ctx = ctx;
+    block->ia.priv = &block->buff;
+    return &block->ia;
 }
 
 struct oarchive *create_buffer_oarchive()
 {
-    struct oarchive *oa;
-    struct buff_struct *buff;
-    oa = malloc(sizeof(*oa));
-    if (!oa) return 0;
-    buff = malloc(sizeof(struct buff_struct));
-    if (!buff) {
-        free(oa);
-        return 0;
-    }
-    *oa = oa_default;
-    buff->off = 0;
-    buff->buffer = malloc(128);
-    buff->len = 128;
-    oa->priv = buff;
-    return oa;
+    return create_buffer_oarchive_alloc(default_alloc, 0);
+}
+
+struct oarchive *create_buffer_oarchive_alloc(archive_alloc_fn alloc, void *ctx)
+{
+    struct oarchive_block *block = alloc(ctx, 0, sizeof(*block));
+    if (!block) return 0;
+    block->oa = oa_default;
+    block->buff.off = 0;
+    block->buff.buffer = alloc(ctx, 0, 128);
+    block->buff.len = 128;
+    block->buff.alloc = alloc;
+    block->buff.ctx = ctx;
+    block->oa.priv = &block->buff;
+    return &block->oa;
 }
 
 void close_buffer_iarchive(struct iarchive **ia)
 {
-    free((*ia)->priv);
-    free(*ia);
+    struct buff_struct *buff = (struct buff_struct *)(*ia)->priv;
+    buff->alloc(buff->ctx, *ia, 0);
     *ia = 0;
 }
 
 void close_buffer_oarchive(struct oarchive **oa, int free_buffer)
 {
+    struct buff_struct *buff = (struct buff_struct *)(*oa)->priv;
     if (free_buffer) {
-        struct buff_struct *buff = (struct buff_struct *)(*oa)->priv;
         if (buff->buffer) {
-            free(buff->buffer);
+            buff->alloc(buff->ctx, buff->buffer, 0);
         }
     }
-    free((*oa)->priv);
-    free(*oa);
+    buff->alloc(buff->ctx, *oa, 0);
     *oa = 0;
 }
 
@@ -64,6 +64,11 @@ void adaptor_destroy(zhandle_t *zh){}
 
 int flush_send_queue(zhandle_t *, int);
 
+int zoo_is_completion_thread(zhandle_t *zh)
+{
+    return 0;
+}
+
 int adaptor_send_queue(zhandle_t *zh, int timeout)
 {
     return flush_send_queue(zh, timeout);
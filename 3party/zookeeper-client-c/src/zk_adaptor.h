@@ -29,6 +29,8 @@
 #include "zookeeper.h"
 #include "zk_hashtable.h"
 #include "addrvec.h"
+#include "zk_pool.h"
+#include "zk_latency.h"
 
 /* predefined xid's values recognized as special by the server */
 #define WATCHER_EVENT_XID -1 
@@ -72,12 +74,29 @@ typedef struct _buffer_head {
 typedef struct _completion_head {
     struct _completion_list *volatile head;
     struct _completion_list *last;
+    volatile int32_t count;                 // entries, maintained for sent_requests only
 #ifdef THREADED
     pthread_cond_t cond;
     pthread_mutex_t lock;
 #endif
 } completion_head_t;
 
+/* Intrusive multi-producer single-consumer queue of completions. Producers
+ * only swap the head and link the previous entry, the consumer owns the tail,
+ * so neither side takes a lock. The consumer parks itself on sleeping and
+ * producers only make a wakeup call when they find it set. */
+typedef struct _completion_queue {
+    struct _completion_list *volatile head; // most recently pushed entry
+    struct _completion_list *tail;          // oldest entry, owned by the consumer
+    struct _completion_list *stub;          // keeps the queue non-empty
+    volatile int32_t depth;                 // pushed and not popped yet
+#ifdef THREADED
+    volatile int32_t sleeping;              // 1 while the consumer is parked
+    pthread_cond_t cond;                    // parking where there is no futex
+    pthread_mutex_t lock;
+#endif
+} completion_queue_t;
+
 int lock_buffer_list(buffer_head_t *l);
 int unlock_buffer_list(buffer_head_t *l);
 int lock_completion_list(completion_head_t *l);
@@ -122,6 +141,19 @@ typedef struct _auth_info {
     struct _auth_info *next;
 } auth_info;
 
+/**
+ * A block the IO thread receives into with a single recv. Responses that
+ * fit are framed in place: their buffer_list_t points into the chunk and
+ * holds a reference, the chunk goes back to the pool with the last one.
+ */
+typedef struct _recv_chunk {
+    volatile int32_t refs;  /* framed packets plus one while it is the current chunk */
+    int32_t size;           /* capacity of data */
+    int32_t used;           /* bytes received, only touched by the IO thread */
+    int32_t consumed;       /* bytes already split into packets */
+    char data[1];
+} recv_chunk_t;
+
 /**
  * This structure represents a packet being read or written.
  */
@@ -129,6 +161,8 @@ typedef struct _buffer_list {
     char *buffer;
     int len; /* This represents the length of sizeof(header) + length of buffer */
     int curr_offset; /* This is the offset into the header followed by offset into the buffer */
+    recv_chunk_t *chunk; /* The chunk buffer points into, if it was framed in place */
+    int plain; /* buffer is a plain malloc'd body, see zoo_data_view_take */
     struct _buffer_list *next;
 } buffer_list_t;
 
@@ -157,6 +191,9 @@ struct prime_struct {
 }; 
 
 #ifdef THREADED
+struct io_loop;
+struct completion_lane;
+
 /* this is used by mt_adaptor internally for thread management */
 struct adaptor_threads {
      pthread_t io;
@@ -172,6 +209,17 @@ struct adaptor_threads {
 #else
      int self_pipe[2];
 #endif
+     struct io_loop *loop;          // epoll loop serving this handle, replaces io and self_pipe
+     int loop_attached;             // the loop still polls the handle and holds a reference on it
+     int loop_fd;                   // socket registered with the loop, -1 if none
+     int loop_interest;             // ZOOKEEPER_READ/WRITE registered for loop_fd
+     int loop_ready;                // events reported for loop_fd by the last epoll_wait
+     int loop_index;                // position in the loop's deadline heap
+     int64_t loop_deadline;         // when zookeeper_interest() wants to run again, ms monotonic
+     int loop_kicked;               // in the loop's kick list, guarded by its kick_lock
+     int loop_due;                  // to be processed in the current loop iteration
+     struct completion_lane *lanes; // completion workers fed by the completion thread
+     int lane_count;                // 0 when the completion thread runs every callback itself
 };
 #endif
 
@@ -218,11 +266,21 @@ struct _zhandle {
 
     // Buffers
     buffer_list_t *input_buffer;        // current buffer being read in
+    recv_chunk_t *recv_chunk;           // current chunk being received into
     buffer_head_t to_process;           // buffers that have been read and ready to be processed
     buffer_head_t to_send;              // packets queued to send
     completion_head_t sent_requests;    // outstanding requests
-    completion_head_t completions_to_process; // completions that are ready to run
+    completion_queue_t completions_to_process; // completions that are ready to run
     int outstanding_sync;               // number of outstanding synchronous requests
+    zk_pool_t pool;                     // packets, completions and archives are recycled here
+    buffer_head_t rewatch_pending;      // SetWatches packets of a replay being built
+    int rewatch_unsent;                 // SetWatches packets in to_send, not written yet
+    int rewatch_in_flight;              // SetWatches packets written and not answered yet
+    int rewatch_chunk_bytes;            // see zoo_set_rewatch_limits
+    int rewatch_window;
+    int64_t rewatch_start;              // usec when the current replay began
+    struct zoo_rewatch_stats rewatch_stats; // guarded by the watchers lock
+    zk_latency_t *latency;              // per operation latency histograms, NULL if allocation failed
 
     /* read-only mode specific fields */
     struct timeval last_ping_rw; /* The last time we checked server for being r/w */
@@ -248,6 +306,8 @@ struct _zhandle {
     int32_t ref_counter;
     volatile int close_requested;
     void *adaptor_priv;
+    int shared_io;                      // ZOO_SHARED_IO was passed to zookeeper_init
+    int completion_threads;             // from ZOO_COMPLETION_THREADS, 0 or 1 for a single thread
 
     /* Used for debugging only: non-zero value indicates the time when the zookeeper_process
      * call returned while there was at least one unprocessed server response 
@@ -281,6 +341,19 @@ void notify_sync_completion(struct sync_completion *sc);
 int adaptor_send_queue(zhandle_t *zh, int timeout);
 int process_async(int outstanding_sync);
 void process_completions(zhandle_t *zh);
+void process_completion(zhandle_t *zh, struct _completion_list *cptr);
+struct _completion_list *dequeue_completion(completion_head_t *list);
+void queue_completion(completion_head_t *list, struct _completion_list *c,
+        int add_to_front);
+int init_completion_queue(completion_queue_t *q);
+void destroy_completion_queue(completion_queue_t *q);
+// may be called from any thread
+void push_completion(completion_queue_t *q, struct _completion_list *c);
+// only the consumer may call these
+struct _completion_list *pop_completion(completion_queue_t *q);
+int has_completions(completion_queue_t *q);
+// completions with the same non-zero key must run in order, 0 orders against all
+uint32_t get_completion_key(struct _completion_list *cptr);
 int flush_send_queue(zhandle_t*zh, int timeout);
 char* sub_string(zhandle_t *zh, const char* server_path);
 void free_duplicate_path(const char* free_path, const char* path);
@@ -310,6 +383,15 @@ int32_t inc_ref_counter(zhandle_t* zh,int i);
 #ifdef THREADED
 // atomic post-increment
 int32_t fetch_and_add(volatile int32_t* operand, int incr);
+// atomic swaps are full barriers, the loads are acquire loads
+void *exchange_pointer(void *volatile *ptr, void *value);
+int32_t exchange_int32(volatile int32_t *ptr, int32_t value);
+int32_t load_int32(volatile int32_t *ptr);
+void *load_pointer(void *volatile *ptr);
+// park the consumer of a completion queue until it has work or *stop is set
+void park_completion_consumer(completion_queue_t *q, volatile int *stop);
+// wake the consumer if it is parked
+void unpark_completion_consumer(completion_queue_t *q);
 // in mt mode process session event asynchronously by the completion thread
 #define PROCESS_SESSION_EVENT(zh,newstate) queue_session_event(zh,newstate)
 #else
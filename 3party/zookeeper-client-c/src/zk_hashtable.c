@@ -16,300 +16,421 @@
  * limitations under the License.
  */
 
+#include "config.h"
 #include "zk_hashtable.h"
 #include "zk_adaptor.h"
-#include "hashtable/hashtable.h"
-#include "hashtable/hashtable_itr.h"
+#include "zk_probes.h"
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <assert.h>
 
+/* watchers stored in the path entry itself before a list spills to the heap */
+#define INLINE_WATCHERS 2
+/* longer lists get an index, so merging all watchers on a session event stays linear */
+#define INDEXED_WATCHERS 16
+#define MIN_SLOTS 32
+
 typedef struct _watcher_object {
     watcher_fn watcher;
     void* context;
-    struct _watcher_object* next;
 } watcher_object_t;
 
+/**
+ * A list of watchers kept in insertion order. The first INLINE_WATCHERS live
+ * in the list, so a list can be moved with a plain struct copy as long as
+ * nothing points into it.
+ */
+struct watcher_object_list {
+    int count;
+    int capacity;                   // of spill, 0 while the inline array is used
+    watcher_object_t *spill;
+    int32_t *index;                 // item position + 1 per slot, 0 is empty
+    uint32_t index_mask;
+    watcher_object_t inline_items[INLINE_WATCHERS];
+};
+
+/**
+ * Path entries are probed linearly, the hash is kept in the entry so probing
+ * and growing rarely have to touch the path itself.
+ */
+typedef struct _zk_slot {
+    uint32_t hash;                  // 0 marks an empty slot
+    uint32_t len;
+    char *path;
+    watcher_object_list_t watchers;
+} zk_slot_t;
 
 struct _zk_hashtable {
-    struct hashtable* ht;
+    zk_slot_t *slots;
+    uint32_t mask;
+    uint32_t count;
 };
 
-struct watcher_object_list {
-    watcher_object_t* head;
-};
+static uint32_t path_hash(const char *path, uint32_t *len)
+{
+    const unsigned char *p = (const unsigned char *)path;
+    uint32_t hash = 2166136261u;
+    while (*p) {
+        hash = (hash ^ *p++) * 16777619u;
+    }
+    *len = (uint32_t)(p - (const unsigned char *)path);
+    return hash ? hash : 1;
+}
 
-/* the following functions are for testing only */
-typedef struct hashtable hashtable_impl;
+static uint32_t watcher_hash(const watcher_object_t *wo)
+{
+    uint64_t h = (uint64_t)(uintptr_t)wo->watcher * 0x9E3779B97F4A7C15ull;
+    h ^= (uint64_t)(uintptr_t)wo->context + (h >> 29);
+    h *= 0xBF58476D1CE4E5B9ull;
+    return (uint32_t)(h >> 32);
+}
 
-hashtable_impl* getImpl(zk_hashtable* ht){
-    return ht->ht;
+static watcher_object_t *list_items(watcher_object_list_t *wl)
+{
+    return wl->spill ? wl->spill : wl->inline_items;
+}
+
+static void list_clear(watcher_object_list_t *wl)
+{
+    free(wl->spill);
+    free(wl->index);
+    memset(wl, 0, sizeof(*wl));
+}
+
+static void list_index_add(watcher_object_list_t *wl, int pos)
+{
+    uint32_t i = watcher_hash(&list_items(wl)[pos]) & wl->index_mask;
+    while (wl->index[i]) {
+        i = (i + 1) & wl->index_mask;
+    }
+    wl->index[i] = pos + 1;
 }
 
-watcher_object_t* getFirstWatcher(zk_hashtable* ht,const char* path)
+static void list_reindex(watcher_object_list_t *wl)
 {
-    watcher_object_list_t* wl=hashtable_search(ht->ht,(void*)path);
-    if(wl!=0)
-        return wl->head;
-    return 0;
+    uint32_t size = 64;
+    int i;
+    while (size < (uint32_t)wl->count * 2) {
+        size <<= 1;
+    }
+    free(wl->index);
+    wl->index = calloc(size, sizeof(int32_t));
+    assert(wl->index);
+    wl->index_mask = size - 1;
+    for (i = 0; i < wl->count; i++) {
+        list_index_add(wl, i);
+    }
 }
-/* end of testing functions */
 
-watcher_object_t* clone_watcher_object(watcher_object_t* wo)
+// two watcher objects are equal if their watcher function and context pointers
+// are equal
+static int list_find(watcher_object_list_t *wl, watcher_fn watcher, void *ctx)
 {
-    watcher_object_t* res=calloc(1,sizeof(watcher_object_t));
-    assert(res);
-    res->watcher=wo->watcher;
-    res->context=wo->context;
-    return res;
+    watcher_object_t *items = list_items(wl);
+    int i;
+
+    if (wl->index) {
+        watcher_object_t e;
+        uint32_t slot;
+        e.watcher = watcher;
+        e.context = ctx;
+        slot = watcher_hash(&e) & wl->index_mask;
+        while (wl->index[slot]) {
+            i = wl->index[slot] - 1;
+            if (items[i].watcher == watcher && items[i].context == ctx)
+                return i;
+            slot = (slot + 1) & wl->index_mask;
+        }
+        return -1;
+    }
+    for (i = 0; i < wl->count; i++) {
+        if (items[i].watcher == watcher && items[i].context == ctx)
+            return i;
+    }
+    return -1;
 }
 
-static unsigned int string_hash_djb2(void *str) 
+static void list_append(watcher_object_list_t *wl, watcher_fn watcher, void *ctx)
 {
-    unsigned int hash = 5381;
-    int c;
-    const char* cstr = (const char*)str;
-    while ((c = *cstr++))
-        hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
+    watcher_object_t *items;
+
+    if (wl->count == INLINE_WATCHERS && !wl->spill) {
+        wl->capacity = INLINE_WATCHERS * 4;
+        wl->spill = malloc(wl->capacity * sizeof(watcher_object_t));
+        assert(wl->spill);
+        memcpy(wl->spill, wl->inline_items, sizeof(wl->inline_items));
+    } else if (wl->spill && wl->count == wl->capacity) {
+        wl->capacity *= 2;
+        wl->spill = realloc(wl->spill, wl->capacity * sizeof(watcher_object_t));
+        assert(wl->spill);
+    }
+    items = list_items(wl);
+    items[wl->count].watcher = watcher;
+    items[wl->count].context = ctx;
+    wl->count++;
+
+    if (wl->count > INDEXED_WATCHERS) {
+        if (!wl->index || (uint32_t)wl->count * 2 > wl->index_mask + 1) {
+            list_reindex(wl);
+        } else {
+            list_index_add(wl, wl->count - 1);
+        }
+    }
+}
 
-    return hash;
+static int add_to_list(watcher_object_list_t *wl, watcher_fn watcher, void *ctx)
+{
+    if (list_find(wl, watcher, ctx) >= 0)
+        return 0;
+    list_append(wl, watcher, ctx);
+    return 1;
 }
 
-static int string_equal(void *key1,void *key2)
+static void list_remove_at(watcher_object_list_t *wl, int pos)
 {
-    return strcmp((const char*)key1,(const char*)key2)==0;
+    watcher_object_t *items = list_items(wl);
+    memmove(items + pos, items + pos + 1,
+            (wl->count - pos - 1) * sizeof(watcher_object_t));
+    wl->count--;
+    // positions have shifted, the index is rebuilt by the next append
+    free(wl->index);
+    wl->index = NULL;
 }
 
-static watcher_object_t* create_watcher_object(watcher_fn watcher,void* ctx)
+/* moves the watchers of from into to, from is left empty */
+static void move_watchers(watcher_object_list_t *from, watcher_object_list_t *to)
 {
-    watcher_object_t* wo=calloc(1,sizeof(watcher_object_t));
-    assert(wo);
-    wo->watcher=watcher;
-    wo->context=ctx;
-    return wo;
+    if (to->count == 0) {
+        list_clear(to);
+        *to = *from;
+        memset(from, 0, sizeof(*from));
+        return;
+    }
+    {
+        watcher_object_t *items = list_items(from);
+        int i;
+        for (i = 0; i < from->count; i++) {
+            add_to_list(to, items[i].watcher, items[i].context);
+        }
+    }
+    list_clear(from);
 }
 
-static watcher_object_list_t* create_watcher_object_list(watcher_object_t* head) 
+static watcher_object_list_t* create_watcher_object_list()
 {
     watcher_object_list_t* wl=calloc(1,sizeof(watcher_object_list_t));
     assert(wl);
-    wl->head=head;
     return wl;
 }
 
 static void destroy_watcher_object_list(watcher_object_list_t* list)
 {
-    watcher_object_t* e = NULL;
-
     if(list==0)
         return;
-    e=list->head;
-    while(e!=0){
-        watcher_object_t* this=e;
-        e=e->next;
-        free(this);
-    }
+    list_clear(list);
     free(list);
 }
 
+static void alloc_slots(zk_hashtable *ht, uint32_t size)
+{
+    ht->slots = calloc(size, sizeof(zk_slot_t));
+    assert(ht->slots);
+    ht->mask = size - 1;
+}
+
 zk_hashtable* create_zk_hashtable()
 {
     struct _zk_hashtable *ht=calloc(1,sizeof(struct _zk_hashtable));
     assert(ht);
-    ht->ht=create_hashtable(32,string_hash_djb2,string_equal);
+    alloc_slots(ht, MIN_SLOTS);
     return ht;
 }
 
-static void do_clean_hashtable(zk_hashtable* ht)
-{
-    struct hashtable_itr *it;
-    int hasMore;
-    if(hashtable_count(ht->ht)==0)
-        return;
-    it=hashtable_iterator(ht->ht);
-    do {
-        watcher_object_list_t* w=hashtable_iterator_value(it);
-        destroy_watcher_object_list(w);
-        hasMore=hashtable_iterator_remove(it);
-    } while(hasMore);
-    free(it);
-}
-
 void destroy_zk_hashtable(zk_hashtable* ht)
 {
+    uint32_t i;
     if(ht!=0){
-        do_clean_hashtable(ht);
-        hashtable_destroy(ht->ht,0);
+        for (i = 0; i <= ht->mask; i++) {
+            if (ht->slots[i].hash) {
+                free(ht->slots[i].path);
+                list_clear(&ht->slots[i].watchers);
+            }
+        }
+        free(ht->slots);
         free(ht);
     }
 }
 
-// searches for a watcher object instance in a watcher object list;
-// two watcher objects are equal if their watcher function and context pointers
-// are equal
-static watcher_object_t* search_watcher(watcher_object_list_t** wl,watcher_object_t* wo)
+static zk_slot_t *find_slot(zk_hashtable *ht, const char *path)
 {
-    watcher_object_t* wobj=(*wl)->head;
-    while(wobj!=0){
-        if(wobj->watcher==wo->watcher && wobj->context==wo->context)
-            return wobj;
-        wobj=wobj->next;
+    uint32_t len;
+    uint32_t hash = path_hash(path, &len);
+    uint32_t i = hash & ht->mask;
+
+    for (; ht->slots[i].hash; i = (i + 1) & ht->mask) {
+        zk_slot_t *s = &ht->slots[i];
+        if (s->hash == hash && s->len == len && memcmp(s->path, path, len) == 0)
+            return s;
     }
-    return 0;
+    return NULL;
 }
 
-static int add_to_list(watcher_object_list_t **wl, watcher_object_t *wo,
-                       int clone)
+static void grow_slots(zk_hashtable *ht)
 {
-    if (search_watcher(wl, wo)==0) {
-        watcher_object_t* cloned=wo;
-        if (clone) {
-            cloned = clone_watcher_object(wo);
-            assert(cloned);
+    zk_slot_t *old = ht->slots;
+    uint32_t old_size = ht->mask + 1;
+    uint32_t i;
+
+    alloc_slots(ht, old_size * 2);
+    for (i = 0; i < old_size; i++) {
+        if (old[i].hash) {
+            uint32_t j = old[i].hash & ht->mask;
+            while (ht->slots[j].hash) {
+                j = (j + 1) & ht->mask;
+            }
+            ht->slots[j] = old[i];
         }
-        cloned->next = (*wl)->head;
-        (*wl)->head = cloned;
-        return 1;
-    } else if (!clone) {
-        // If it's here and we aren't supposed to clone, we must destroy
-        free(wo);
-    }
-    return 0;
-}
-
-static int do_insert_watcher_object(zk_hashtable *ht, const char *path, watcher_object_t* wo)
-{
-    int res=1;
-    watcher_object_list_t* wl;
-
-    wl=hashtable_search(ht->ht,(void*)path);
-    if(wl==0){
-        int res;
-        /* inserting a new path element */
-        res=hashtable_insert(ht->ht,strdup(path),create_watcher_object_list(wo));
-        assert(res);
-    }else{
-        /*
-         * Path already exists; check if the watcher already exists.
-         * Don't clone the watcher since it's allocated on the heap --- avoids
-         * a memory leak and saves a clone operation (calloc + copy).
-         */
-        res = add_to_list(&wl, wo, 0);
     }
-    return res;    
+    free(old);
 }
 
-
-char **collect_keys(zk_hashtable *ht, int *count)
+static zk_slot_t *insert_slot(zk_hashtable *ht, const char *path)
 {
-    char **list;
-    struct hashtable_itr *it;
-    int i;
+    uint32_t len;
+    uint32_t hash;
+    uint32_t i;
+
+    // keep the load factor at or below 3/4
+    if ((ht->count + 1) * 4 > (ht->mask + 1) * 3)
+        grow_slots(ht);
+
+    hash = path_hash(path, &len);
+    for (i = hash & ht->mask; ht->slots[i].hash; i = (i + 1) & ht->mask) {
+        zk_slot_t *s = &ht->slots[i];
+        if (s->hash == hash && s->len == len && memcmp(s->path, path, len) == 0)
+            return s;
+    }
+    ht->slots[i].hash = hash;
+    ht->slots[i].len = len;
+    ht->slots[i].path = malloc(len + 1);
+    assert(ht->slots[i].path);
+    memcpy(ht->slots[i].path, path, len + 1);
+    ht->count++;
+    return &ht->slots[i];
+}
 
-    *count = hashtable_count(ht->ht);
-    list = calloc(*count, sizeof(char*));
-    it=hashtable_iterator(ht->ht);
-    for(i = 0; i < *count; i++) {
-        list[i] = strdup(hashtable_iterator_key(it));
-        hashtable_iterator_advance(it);
+/*
+ * Frees the path of an entry and closes the gap by shifting back the entries
+ * of the same probe run, so lookups never need tombstones. The watchers must
+ * have been moved out or cleared already.
+ */
+static void remove_slot(zk_hashtable *ht, zk_slot_t *slot)
+{
+    uint32_t hole = (uint32_t)(slot - ht->slots);
+    uint32_t i;
+
+    free(slot->path);
+    for (i = (hole + 1) & ht->mask; ht->slots[i].hash; i = (i + 1) & ht->mask) {
+        uint32_t home = ht->slots[i].hash & ht->mask;
+        // the entry may only move back if its home is not between the hole and itself
+        if (((i - home) & ht->mask) >= ((i - hole) & ht->mask)) {
+            ht->slots[hole] = ht->slots[i];
+            hole = i;
+        }
     }
-    free(it);
-    return list;
+    memset(&ht->slots[hole], 0, sizeof(zk_slot_t));
+    ht->count--;
 }
 
-static int insert_watcher_object(zk_hashtable *ht, const char *path,
-                                 watcher_object_t* wo)
+int zk_hashtable_count(zk_hashtable *ht)
 {
-    int res;
-    res=do_insert_watcher_object(ht,path,wo);
-    return res;
+    return ht ? (int)ht->count : 0;
 }
 
-static void copy_watchers(watcher_object_list_t *from, watcher_object_list_t *to, int clone)
+const char *next_watched_path(zk_hashtable *ht, unsigned int *cursor, int *len)
 {
-    watcher_object_t* wo=from->head;
-    while(wo){
-        watcher_object_t *next = wo->next;
-        add_to_list(&to, wo, clone);
-        wo=next;
+    for (; *cursor <= ht->mask; (*cursor)++) {
+        zk_slot_t *s = &ht->slots[*cursor];
+        if (s->hash) {
+            (*cursor)++;
+            *len = (int)s->len;
+            return s->path;
+        }
     }
+    return NULL;
 }
 
 static void copy_table(zk_hashtable *from, watcher_object_list_t *to) {
-    struct hashtable_itr *it;
-    int hasMore;
-    if(hashtable_count(from->ht)==0)
-        return;
-    it=hashtable_iterator(from->ht);
-    do {
-        watcher_object_list_t *w = hashtable_iterator_value(it);
-        copy_watchers(w, to, 1);
-        hasMore=hashtable_iterator_advance(it);
-    } while(hasMore);
-    free(it);
+    uint32_t i;
+    int j;
+    for (i = 0; i <= from->mask; i++) {
+        zk_slot_t *s = &from->slots[i];
+        if (s->hash) {
+            watcher_object_t *items = list_items(&s->watchers);
+            for (j = 0; j < s->watchers.count; j++) {
+                add_to_list(to, items[j].watcher, items[j].context);
+            }
+        }
+    }
 }
 
 static void collect_session_watchers(zhandle_t *zh,
-                                     watcher_object_list_t **list)
+                                     watcher_object_list_t *list)
 {
-    copy_table(zh->active_node_watchers, *list);
-    copy_table(zh->active_exist_watchers, *list);
-    copy_table(zh->active_child_watchers, *list);
+    copy_table(zh->active_node_watchers, list);
+    copy_table(zh->active_exist_watchers, list);
+    copy_table(zh->active_child_watchers, list);
 }
 
-static void add_for_event(zk_hashtable *ht, char *path, watcher_object_list_t **list)
+static void add_for_event(zk_hashtable *ht, char *path, watcher_object_list_t *list)
 {
-    watcher_object_list_t* wl;
-    wl = (watcher_object_list_t*)hashtable_remove(ht->ht, path);
-    if (wl) {
-        copy_watchers(wl, *list, 0);
-        // Since we move, not clone the watch_objects, we just need to free the
-        // head pointer
-        free(wl);
+    zk_slot_t *s = find_slot(ht, path);
+    if (s) {
+        move_watchers(&s->watchers, list);
+        remove_slot(ht, s);
     }
 }
 
-static void do_foreach_watcher(watcher_object_t* wo,zhandle_t* zh,
+static void do_foreach_watcher(watcher_object_list_t *wl,zhandle_t* zh,
         const char* path,int type,int state)
 {
     // session event's don't have paths
     const char *client_path =
         (type != ZOO_SESSION_EVENT ? sub_string(zh, path) : path);
-    while(wo!=0){
-        wo->watcher(zh,type,state,client_path,wo->context);
-        wo=wo->next;
-    }    
+    watcher_object_t *items = list_items(wl);
+    int i;
+    for (i = 0; i < wl->count; i++) {
+        items[i].watcher(zh,type,state,client_path,items[i].context);
+    }
     free_duplicate_path(client_path, path);
 }
 
 watcher_object_list_t *collectWatchers(zhandle_t *zh,int type, char *path)
 {
-    struct watcher_object_list *list = create_watcher_object_list(0); 
+    struct watcher_object_list *list = create_watcher_object_list();
 
     if(type==ZOO_SESSION_EVENT){
-        watcher_object_t defWatcher;
-        defWatcher.watcher=zh->watcher;
-        defWatcher.context=zh->context;
-        add_to_list(&list, &defWatcher, 1);
-        collect_session_watchers(zh, &list);
+        add_to_list(list, zh->watcher, zh->context);
+        collect_session_watchers(zh, list);
         return list;
     }
     switch(type){
     case CREATED_EVENT_DEF:
     case CHANGED_EVENT_DEF:
         // look up the watchers for the path and move them to a delivery list
-        add_for_event(zh->active_node_watchers,path,&list);
-        add_for_event(zh->active_exist_watchers,path,&list);
+        add_for_event(zh->active_node_watchers,path,list);
+        add_for_event(zh->active_exist_watchers,path,list);
         break;
     case CHILD_EVENT_DEF:
         // look up the watchers for the path and move them to a delivery list
-        add_for_event(zh->active_child_watchers,path,&list);
+        add_for_event(zh->active_child_watchers,path,list);
         break;
     case DELETED_EVENT_DEF:
         // look up the watchers for the path and move them to a delivery list
-        add_for_event(zh->active_node_watchers,path,&list);
-        add_for_event(zh->active_exist_watchers,path,&list);
-        add_for_event(zh->active_child_watchers,path,&list);
+        add_for_event(zh->active_node_watchers,path,list);
+        add_for_event(zh->active_exist_watchers,path,list);
+        add_for_event(zh->active_child_watchers,path,list);
         break;
     }
     return list;
@@ -318,7 +439,9 @@ watcher_object_list_t *collectWatchers(zhandle_t *zh,int type, char *path)
 void deliverWatchers(zhandle_t *zh, int type,int state, char *path, watcher_object_list_t **list)
 {
     if (!list || !(*list)) return;
-    do_foreach_watcher((*list)->head, zh, path, type, state);
+    ZK_PROBE3(watch_fired, path, type, state);
+    do_foreach_watcher(*list, zh, path, type, state);
+    ZK_PROBE2(watch_delivered, path, type);
     destroy_watcher_object_list(*list);
     *list = 0;
 }
@@ -330,8 +453,8 @@ void activateWatcher(zhandle_t *zh, watcher_registration_t* reg, int rc)
          * by the IO thread */
         zk_hashtable *ht = reg->checker(zh, rc);
         if(ht){
-            insert_watcher_object(ht,reg->path,
-                    create_watcher_object(reg->watcher, reg->context));
+            zk_slot_t *s = insert_slot(ht, reg->path);
+            add_to_list(&s->watchers, reg->watcher, reg->context);
         }
     }    
 }
@@ -340,75 +463,35 @@ void activateWatcher(zhandle_t *zh, watcher_registration_t* reg, int rc)
 static int containsWatcher(zk_hashtable *watchers, const char *path,
         watcher_fn watcher, void *watcherCtx)
 {
-    watcher_object_list_t *wl;
-    watcher_object_t e;
+    zk_slot_t *s;
 
     if (!watcher)
         return 1;
 
-    wl = hashtable_search(watchers->ht, (void *)path);
-    if (!wl)
+    s = find_slot(watchers, path);
+    if (!s)
         return 0;
 
-    e.watcher = watcher;
-    e.context = watcherCtx;
-
-    return search_watcher(&wl, &e) ? 1 : 0;
-}
-
-/**
- * remove any watcher_object that has a matching (watcher, watcherCtx)
- */
-static void removeWatcherFromList(watcher_object_list_t *wl, watcher_fn watcher,
-        void *watcherCtx)
-{
-    watcher_object_t *e = NULL;
-
-    if (!wl || (wl && !wl->head))
-        return;
-
-    e = wl->head;
-    while (e){
-        if (e->next &&
-            e->next->watcher == watcher &&
-            e->next->context == watcherCtx) {
-            watcher_object_t *this = e->next;
-            e->next = e->next->next;
-            free(this);
-            break;
-        }
-        e = e->next;
-    }
-
-    if (wl->head &&
-        wl->head->watcher == watcher && wl->head->context == watcherCtx) {
-        watcher_object_t *this = wl->head;
-        wl->head = wl->head->next;
-        free(this);
-    }
+    return list_find(&s->watchers, watcher, watcherCtx) >= 0 ? 1 : 0;
 }
 
 static void removeWatcher(zk_hashtable *watchers, const char *path,
         watcher_fn watcher, void *watcherCtx)
 {
-    watcher_object_list_t *wl = hashtable_search(watchers->ht, (void *)path);
+    zk_slot_t *s = find_slot(watchers, path);
 
-    if (!wl)
+    if (!s)
         return;
 
-    if (!watcher) {
-        wl = (watcher_object_list_t *) hashtable_remove(watchers->ht,
-                                                        (void *)path);
-        destroy_watcher_object_list(wl);
-        return;
+    if (watcher) {
+        int pos = list_find(&s->watchers, watcher, watcherCtx);
+        if (pos >= 0)
+            list_remove_at(&s->watchers, pos);
     }
 
-    removeWatcherFromList(wl, watcher, watcherCtx);
-
-    if (!wl->head) {
-        wl = (watcher_object_list_t *) hashtable_remove(watchers->ht,
-                                                        (void *)path);
-        destroy_watcher_object_list(wl);
+    if (!watcher || !s->watchers.count) {
+        list_clear(&s->watchers);
+        remove_slot(watchers, s);
     }
 }
 
@@ -63,7 +63,13 @@ typedef struct _watcher_deregistration {
 zk_hashtable* create_zk_hashtable();
 void destroy_zk_hashtable(zk_hashtable* ht);
 
-char **collect_keys(zk_hashtable *ht, int *count);
+/**
+ * Walks the paths that have watchers without copying them: start with a zero
+ * cursor, NULL marks the end. The strings are owned by the table and are only
+ * valid while the watchers lock is held and the table is unchanged.
+ */
+const char *next_watched_path(zk_hashtable *ht, unsigned int *cursor, int *len);
+int zk_hashtable_count(zk_hashtable *ht);
 
 /**
  * check if the completion has a watcher object associated
@@ -0,0 +1,212 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "proto.h"
+#include "zk_latency.h"
+
+#ifdef WIN32
+#include "winport.h"
+#endif
+
+/* the single-threaded library has no other thread to race with */
+#if !defined(THREADED)
+#define add_int64(p, v) (*(p) += (v))
+#define swap_int64(p, v) swap_plain(p, v)
+#define load_int64(p) (*(p))
+#define cas_int64(p, expected, v) (*(p) == (expected) ? (*(p) = (v), 1) : 0)
+static int64_t swap_plain(int64_t *p, int64_t v)
+{
+    int64_t old = *p;
+    *p = v;
+    return old;
+}
+#elif !defined(WIN32)
+#define add_int64(p, v) __atomic_fetch_add(p, v, __ATOMIC_RELAXED)
+#define swap_int64(p, v) __atomic_exchange_n(p, v, __ATOMIC_RELAXED)
+#define load_int64(p) __atomic_load_n(p, __ATOMIC_RELAXED)
+#define cas_int64(p, expected, v) __atomic_compare_exchange_n(p, &(expected), v, 0, \
+        __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+#else
+#define add_int64(p, v) InterlockedExchangeAdd64((volatile LONG64*)(p), v)
+#define swap_int64(p, v) InterlockedExchange64((volatile LONG64*)(p), v)
+#define load_int64(p) InterlockedCompareExchange64((volatile LONG64*)(p), 0, 0)
+#define cas_int64(p, expected, v) \
+        (InterlockedCompareExchange64((volatile LONG64*)(p), v, expected) == (expected))
+#endif
+
+#define LINEAR_BUCKETS 32
+#define SUB_BUCKETS 16
+#define SUB_SHIFT 4
+
+int zk_latency_op(int type)
+{
+    switch (type) {
+    case ZOO_CREATE_OP:
+    case ZOO_CREATE2_OP:
+    case ZOO_CREATE_CONTAINER_OP:
+    case ZOO_CREATE_TTL_OP:
+        return ZOO_LATENCY_CREATE;
+    case ZOO_DELETE_OP:
+        return ZOO_LATENCY_DELETE;
+    case ZOO_EXISTS_OP:
+        return ZOO_LATENCY_EXISTS;
+    case ZOO_GETDATA_OP:
+        return ZOO_LATENCY_GET_DATA;
+    case ZOO_SETDATA_OP:
+        return ZOO_LATENCY_SET_DATA;
+    case ZOO_GETCHILDREN_OP:
+    case ZOO_GETCHILDREN2_OP:
+        return ZOO_LATENCY_GET_CHILDREN;
+    case ZOO_MULTI_OP:
+        return ZOO_LATENCY_MULTI;
+    default:
+        return ZOO_LATENCY_OTHER;
+    }
+}
+
+static int highest_bit(uint64_t v)
+{
+    int bit = 0;
+    while (v >>= 1) {
+        ++bit;
+    }
+    return bit;
+}
+
+int zk_latency_bucket(int64_t usec)
+{
+    int bit;
+    int bucket;
+    if (usec < LINEAR_BUCKETS) {
+        return usec < 0 ? 0 : (int)usec;
+    }
+    /* keep the top five bits, the leading one picks the power of two and the
+     * other four the sub-bucket */
+    bit = highest_bit((uint64_t)usec);
+    bucket = LINEAR_BUCKETS + (bit - 5) * SUB_BUCKETS
+            + (int)((usec >> (bit - SUB_SHIFT)) - SUB_BUCKETS);
+    return bucket < ZOO_LATENCY_BUCKETS ? bucket : ZOO_LATENCY_BUCKETS - 1;
+}
+
+int64_t zoo_latency_bucket_floor(int bucket)
+{
+    int bit;
+    if (bucket < LINEAR_BUCKETS) {
+        return bucket < 0 ? 0 : bucket;
+    }
+    if (bucket >= ZOO_LATENCY_BUCKETS) {
+        bucket = ZOO_LATENCY_BUCKETS - 1;
+    }
+    bit = 5 + (bucket - LINEAR_BUCKETS) / SUB_BUCKETS;
+    return (int64_t)(SUB_BUCKETS + (bucket - LINEAR_BUCKETS) % SUB_BUCKETS)
+            << (bit - SUB_SHIFT);
+}
+
+int64_t zoo_latency_percentile(const struct zoo_latency_histogram *hist,
+        double fraction)
+{
+    int64_t rank;
+    int64_t seen = 0;
+    int i;
+    if (!hist || hist->count <= 0) {
+        return 0;
+    }
+    if (fraction < 0) {
+        fraction = 0;
+    }
+    rank = (int64_t)(fraction * (double)hist->count);
+    if (rank >= hist->count) {
+        rank = hist->count - 1;
+    }
+    for (i = 0; i < ZOO_LATENCY_BUCKETS; ++i) {
+        seen += hist->buckets[i];
+        if (seen > rank) {
+            return zoo_latency_bucket_floor(i);
+        }
+    }
+    return zoo_latency_bucket_floor(ZOO_LATENCY_BUCKETS - 1);
+}
+
+void zk_latency_record(zk_latency_t *lat, int op, int phase, int64_t usec)
+{
+    struct zoo_latency_histogram *hist;
+    int64_t max;
+    if (!lat || op < 0 || op >= ZOO_LATENCY_OPS || phase < 0 || phase >= ZOO_LATENCY_PHASES) {
+        return;
+    }
+    if (usec < 0) {
+        usec = 0;
+    }
+    hist = &lat->hist[op][phase];
+    add_int64(&hist->buckets[zk_latency_bucket(usec)], 1);
+    add_int64(&hist->sum, usec);
+    add_int64(&hist->count, 1);
+    max = load_int64(&hist->max);
+    while (usec > max && !cas_int64(&hist->max, max, usec)) {
+        max = load_int64(&hist->max);
+    }
+}
+
+void zk_latency_sent(zk_latency_t *lat, int32_t xid, int type, int64_t now)
+{
+    zk_latency_sent_t *slot;
+    if (!lat || xid <= 0) {
+        return;
+    }
+    slot = &lat->sent[xid & (ZK_LATENCY_RING - 1)];
+    slot->xid = xid;
+    slot->op = zk_latency_op(type);
+    slot->time = now;
+}
+
+int64_t zk_latency_sent_time(zk_latency_t *lat, int32_t xid, int *op)
+{
+    zk_latency_sent_t *slot;
+    if (!lat || xid <= 0) {
+        return -1;
+    }
+    slot = &lat->sent[xid & (ZK_LATENCY_RING - 1)];
+    if (slot->xid != xid) {
+        return -1;
+    }
+    slot->xid = 0;
+    *op = slot->op;
+    return slot->time;
+}
+
+void zk_latency_snapshot(zk_latency_t *lat, int op, int phase,
+        struct zoo_latency_histogram *hist, int reset)
+{
+    struct zoo_latency_histogram *src = &lat->hist[op][phase];
+    int i;
+    if (reset) {
+        hist->count = swap_int64(&src->count, 0);
+        hist->sum = swap_int64(&src->sum, 0);
+        hist->max = swap_int64(&src->max, 0);
+        for (i = 0; i < ZOO_LATENCY_BUCKETS; ++i) {
+            hist->buckets[i] = swap_int64(&src->buckets[i], 0);
+        }
+    } else {
+        hist->count = load_int64(&src->count);
+        hist->sum = load_int64(&src->sum);
+        hist->max = load_int64(&src->max);
+        for (i = 0; i < ZOO_LATENCY_BUCKETS; ++i) {
+            hist->buckets[i] = load_int64(&src->buckets[i]);
+        }
+    }
+}
@@ -0,0 +1,78 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ZK_LATENCY_H_
+#define ZK_LATENCY_H_
+
+#include <stdint.h>
+
+#include "zookeeper.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* slots of the ring remembering when each request was written, a power of two */
+#define ZK_LATENCY_RING 4096
+
+typedef struct _zk_latency_sent {
+    int32_t xid;
+    int32_t op;                     // ZOO_LATENCY_ operation
+    int64_t time;                   // usec the last byte was written
+} zk_latency_sent_t;
+
+/**
+ * Latency histograms of one zhandle. The counters are only touched with
+ * atomic adds and swaps, so the IO thread, the completion lanes and readers
+ * never take a lock. The ring is indexed by xid and only used by the IO
+ * thread; a request whose slot was reused before its response arrived is
+ * simply not recorded.
+ */
+typedef struct _zk_latency {
+    struct zoo_latency_histogram hist[ZOO_LATENCY_OPS][ZOO_LATENCY_PHASES];
+    zk_latency_sent_t sent[ZK_LATENCY_RING];
+} zk_latency_t;
+
+/**
+ * Map a request type of proto.h to a ZOO_LATENCY_ operation.
+ */
+int zk_latency_op(int type);
+
+int zk_latency_bucket(int64_t usec);
+
+/**
+ * Count one duration, negative durations from a clock step count as 0.
+ */
+void zk_latency_record(zk_latency_t *lat, int op, int phase, int64_t usec);
+
+void zk_latency_sent(zk_latency_t *lat, int32_t xid, int type, int64_t now);
+
+/**
+ * Look up the write of xid, returns the time and sets op, or returns -1 if
+ * the slot has been reused since.
+ */
+int64_t zk_latency_sent_time(zk_latency_t *lat, int32_t xid, int *op);
+
+void zk_latency_snapshot(zk_latency_t *lat, int op, int phase,
+        struct zoo_latency_histogram *hist, int reset);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*ZK_LATENCY_H_*/
@@ -0,0 +1,198 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "zk_pool.h"
+
+#ifdef THREADED
+#define lock_class(c) pthread_mutex_lock(&(c)->lock)
+#define unlock_class(c) pthread_mutex_unlock(&(c)->lock)
+#else
+#define lock_class(c)
+#define unlock_class(c)
+#endif
+
+#define LARGE_CLASS ZK_POOL_CLASSES
+
+static int size_class_of(size_t size)
+{
+    int cls = 0;
+    size_t class_size = (size_t)1 << ZK_POOL_MIN_SHIFT;
+    while (class_size < size) {
+        if (++cls == ZK_POOL_CLASSES) {
+            return -1;
+        }
+        class_size <<= 1;
+    }
+    return cls;
+}
+
+static size_t class_size_of(int cls)
+{
+    return (size_t)1 << (cls + ZK_POOL_MIN_SHIFT);
+}
+
+static int max_free_of(int cls)
+{
+    size_t by_bytes = ZK_POOL_MAX_FREE_BYTES / class_size_of(cls);
+    return by_bytes < ZK_POOL_MAX_FREE ? (int)by_bytes : ZK_POOL_MAX_FREE;
+}
+
+void zk_pool_init(zk_pool_t *pool)
+{
+    int i;
+    memset(pool, 0, sizeof(*pool));
+    for (i = 0; i <= ZK_POOL_CLASSES; i++) {
+#ifdef THREADED
+        pthread_mutex_init(&pool->classes[i].lock, 0);
+#endif
+    }
+}
+
+void zk_pool_destroy(zk_pool_t *pool)
+{
+    int i;
+    for (i = 0; i <= ZK_POOL_CLASSES; i++) {
+        zk_pool_class_t *c = &pool->classes[i];
+        while (c->free_list) {
+            zk_pool_block_t *b = c->free_list;
+            c->free_list = b->h.next;
+            free(b);
+        }
+        c->free_count = 0;
+#ifdef THREADED
+        pthread_mutex_destroy(&c->lock);
+#endif
+    }
+}
+
+void *zk_pool_alloc(zk_pool_t *pool, size_t size)
+{
+    int cls = size_class_of(size);
+    zk_pool_class_t *c = &pool->classes[cls < 0 ? LARGE_CLASS : cls];
+    zk_pool_block_t *b = NULL;
+
+    lock_class(c);
+    if (c->free_list) {
+        b = c->free_list;
+        c->free_list = b->h.next;
+        c->free_count--;
+        c->hits++;
+    } else {
+        c->fallbacks++;
+    }
+    unlock_class(c);
+
+    if (!b) {
+        b = malloc(sizeof(*b) + (cls < 0 ? size : class_size_of(cls)));
+        if (!b) {
+            return NULL;
+        }
+        b->h.pool = pool;
+        b->h.size_class = cls;
+    }
+    b->h.next = NULL;
+    return b + 1;
+}
+
+void *zk_pool_calloc(zk_pool_t *pool, size_t size)
+{
+    void *ptr = zk_pool_alloc(pool, size);
+    if (ptr) {
+        memset(ptr, 0, size);
+    }
+    return ptr;
+}
+
+void zk_pool_free(void *ptr)
+{
+    zk_pool_block_t *b;
+    zk_pool_class_t *c;
+
+    if (!ptr) {
+        return;
+    }
+    b = (zk_pool_block_t *)ptr - 1;
+    if (b->h.size_class < 0) {
+        free(b);
+        return;
+    }
+    c = &b->h.pool->classes[b->h.size_class];
+    lock_class(c);
+    if (c->free_count < max_free_of((int)b->h.size_class)) {
+        b->h.next = c->free_list;
+        c->free_list = b;
+        c->free_count++;
+        b = NULL;
+    }
+    unlock_class(c);
+    free(b);
+}
+
+void *zk_pool_realloc(zk_pool_t *pool, void *ptr, size_t size)
+{
+    zk_pool_block_t *b;
+    size_t old_size;
+    void *new_ptr;
+
+    if (!ptr) {
+        return zk_pool_alloc(pool, size);
+    }
+    b = (zk_pool_block_t *)ptr - 1;
+    if (b->h.size_class >= 0 && size <= class_size_of((int)b->h.size_class)) {
+        return ptr;
+    }
+    if (b->h.size_class < 0) {
+        zk_pool_block_t *nb = realloc(b, sizeof(*b) + size);
+        return nb ? nb + 1 : NULL;
+    }
+
+    new_ptr = zk_pool_alloc(pool, size);
+    if (!new_ptr) {
+        return NULL;
+    }
+    old_size = class_size_of((int)b->h.size_class);
+    memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+    zk_pool_free(ptr);
+    return new_ptr;
+}
+
+void *zk_pool_archive_alloc(void *ctx, void *ptr, size_t size)
+{
+    if (size == 0) {
+        zk_pool_free(ptr);
+        return NULL;
+    }
+    return zk_pool_realloc((zk_pool_t *)ctx, ptr, size);
+}
+
+void zk_pool_stats(zk_pool_t *pool, int64_t *hits, int64_t *fallbacks, int64_t *cached)
+{
+    int i;
+    *hits = *fallbacks = *cached = 0;
+    for (i = 0; i <= ZK_POOL_CLASSES; i++) {
+        zk_pool_class_t *c = &pool->classes[i];
+        lock_class(c);
+        *hits += c->hits;
+        *fallbacks += c->fallbacks;
+        *cached += c->free_count;
+        unlock_class(c);
+    }
+}
@@ -0,0 +1,126 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ZK_POOL_H_
+#define ZK_POOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#ifdef THREADED
+#ifndef WIN32
+#include <pthread.h>
+#else
+#include "winport.h"
+#endif
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* size classes are the powers of two from 2^ZK_POOL_MIN_SHIFT to 2^ZK_POOL_MAX_SHIFT bytes */
+#define ZK_POOL_MIN_SHIFT 5
+#define ZK_POOL_MAX_SHIFT 16
+#define ZK_POOL_CLASSES (ZK_POOL_MAX_SHIFT - ZK_POOL_MIN_SHIFT + 1)
+/* free blocks cached per class, bounded by count and by bytes, any more go back to malloc */
+#define ZK_POOL_MAX_FREE 1024
+#define ZK_POOL_MAX_FREE_BYTES (1 << 20)
+
+struct _zk_pool;
+
+/* the strictest fundamental alignment, what malloc guarantees */
+#if (defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L) || defined(__cplusplus)
+typedef max_align_t zk_pool_align_t;
+#else
+typedef union {
+    long double ld;
+    int64_t i;
+    void *p;
+    void (*f)(void);
+} zk_pool_align_t;
+#endif
+
+/**
+ * Every block handed out by a pool starts with this header, so a block can be
+ * returned without knowing the pool or the size class it came from. The header
+ * is padded to zk_pool_align_t, so the memory after it is aligned as malloc's.
+ */
+typedef union _zk_pool_block {
+    struct {
+        struct _zk_pool *pool;
+        union _zk_pool_block *next; // next free block, only valid in a free list
+        int64_t size_class;         // -1 for blocks larger than the largest class
+    } h;
+    zk_pool_align_t align;
+} zk_pool_block_t;
+
+typedef struct _zk_pool_class {
+    zk_pool_block_t *free_list;
+    int free_count;
+    int64_t hits;                   // allocations served from the free list
+    int64_t fallbacks;              // allocations that had to call malloc
+#ifdef THREADED
+    pthread_mutex_t lock;
+#endif
+} zk_pool_class_t;
+
+/**
+ * Size-classed free lists for the buffers, completions and archives of one
+ * zhandle. Each class has its own lock, so the IO thread receiving responses
+ * and the completion thread freeing them rarely contend.
+ * The last class holds no blocks, it only counts oversized allocations.
+ */
+typedef struct _zk_pool {
+    zk_pool_class_t classes[ZK_POOL_CLASSES + 1];
+} zk_pool_t;
+
+void zk_pool_init(zk_pool_t *pool);
+
+/**
+ * Release the cached blocks. Blocks still in use must not be freed afterwards.
+ */
+void zk_pool_destroy(zk_pool_t *pool);
+
+void *zk_pool_alloc(zk_pool_t *pool, size_t size);
+void *zk_pool_calloc(zk_pool_t *pool, size_t size);
+
+/**
+ * Grow or shrink a block, a block that still fits its size class is returned as is.
+ */
+void *zk_pool_realloc(zk_pool_t *pool, void *ptr, size_t size);
+
+/**
+ * Return a block to the pool that allocated it, NULL is ignored.
+ */
+void zk_pool_free(void *ptr);
+
+/**
+ * Allocator for the buffer archives of recordio.h, ctx is the zk_pool_t.
+ */
+void *zk_pool_archive_alloc(void *ctx, void *ptr, size_t size);
+
+/**
+ * Sum the counters of all classes, cached is the number of free blocks held.
+ */
+void zk_pool_stats(zk_pool_t *pool, int64_t *hits, int64_t *fallbacks, int64_t *cached);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*ZK_POOL_H_*/
@@ -0,0 +1,85 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ZK_PROBES_H_
+#define ZK_PROBES_H_
+
+/**
+ * USDT probes of provider "zookeeper", for perf and bpftrace, e.g.
+ *
+ *   bpftrace -e 'usdt:./libzookeeper.so:zookeeper:watch_fired { printf("%s\n", str(arg0)); }'
+ *
+ * A probe site is a single nop while nothing is attached. Work that only
+ * feeds a probe's arguments is guarded by ZK_PROBE_ACTIVE, which reads the
+ * probe's semaphore, raised by the tracer while it is attached.
+ *
+ * Compiled in only when asked for with ZOO_WITH_PROBES (cmake -DWITH_USDT=ON,
+ * configure --enable-usdt) and <sys/sdt.h> is found (HAVE_SYS_SDT_H).
+ *
+ *   request_queued(xid, type, len)              a request was appended to to_send,
+ *                                               type is its ZOO_*_OP
+ *   completion_dequeued(xid, ctype, wait_usec)  a completion is being dispatched,
+ *                                               ctype is its COMPLETION_ kind and
+ *                                               wait_usec the time since its response
+ *                                               was read, -1 if that was not stamped
+ *   callback_start(xid, ctype)                  its callback starts
+ *   callback_done(xid, ctype, err)              and returned, err of the reply
+ *   watch_fired(path, type, state)              the watchers of an event are called
+ *   watch_delivered(path, type)                 and all returned
+ */
+#if defined(HAVE_SYS_SDT_H) && defined(ZOO_WITH_PROBES)
+
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define ZK_PROBES_ENABLED 1
+#define ZK_PROBE_SEMAPHORE(name) zookeeper_##name##_semaphore
+#define ZK_PROBE_DEFINE(name) \
+    unsigned short ZK_PROBE_SEMAPHORE(name) __attribute__((section(".probes"))) = 0;
+#define ZK_PROBE_ACTIVE(name) __builtin_expect(ZK_PROBE_SEMAPHORE(name) != 0, 0)
+
+#define ZK_PROBE2(name, a, b) DTRACE_PROBE2(zookeeper, name, a, b)
+#define ZK_PROBE3(name, a, b, c) DTRACE_PROBE3(zookeeper, name, a, b, c)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* defined in zookeeper.c */
+extern unsigned short ZK_PROBE_SEMAPHORE(request_queued);
+extern unsigned short ZK_PROBE_SEMAPHORE(completion_dequeued);
+extern unsigned short ZK_PROBE_SEMAPHORE(callback_start);
+extern unsigned short ZK_PROBE_SEMAPHORE(callback_done);
+extern unsigned short ZK_PROBE_SEMAPHORE(watch_fired);
+extern unsigned short ZK_PROBE_SEMAPHORE(watch_delivered);
+
+#ifdef __cplusplus
+}
+#endif
+
+#else
+
+#define ZK_PROBE_DEFINE(name)
+#define ZK_PROBE_ACTIVE(name) 0
+
+#define ZK_PROBE2(name, a, b) ((void)(a), (void)(b))
+#define ZK_PROBE3(name, a, b, c) ((void)(a), (void)(b), (void)(c))
+
+#endif
+
+#endif /*ZK_PROBES_H_*/
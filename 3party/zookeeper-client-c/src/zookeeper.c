@@ -31,6 +31,7 @@
 #include "zk_adaptor.h"
 #include "zookeeper_log.h"
 #include "zk_hashtable.h"
+#include "zk_probes.h"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -100,6 +101,13 @@
 
 #define IF_DEBUG(x) if(logLevel==ZOO_LOG_LEVEL_DEBUG) {x;}
 
+ZK_PROBE_DEFINE(request_queued)
+ZK_PROBE_DEFINE(completion_dequeued)
+ZK_PROBE_DEFINE(callback_start)
+ZK_PROBE_DEFINE(callback_done)
+ZK_PROBE_DEFINE(watch_fired)
+ZK_PROBE_DEFINE(watch_delivered)
+
 const int ZOOKEEPER_WRITE = 1 << 0;
 const int ZOOKEEPER_READ = 1 << 1;
 
@@ -206,6 +214,7 @@ struct ACL_vector ZOO_CREATOR_ALL_ACL = { 1, _CREATOR_ALL_ACL_ACL};
 #define COMPLETION_STRING 6
 #define COMPLETION_MULTI 7
 #define COMPLETION_STRING_STAT 8
+#define COMPLETION_DATA_VIEW 9
 
 typedef struct _auth_completion_list {
     void_completion_t completion;
@@ -219,6 +228,7 @@ typedef struct completion {
         void_completion_t void_result;
         stat_completion_t stat_result;
         data_completion_t data_result;
+        data_view_completion_t data_view_result;
         strings_completion_t strings_result;
         strings_stat_completion_t strings_stat_result;
         acl_completion_t acl_result;
@@ -229,14 +239,26 @@ typedef struct completion {
     completion_head_t clist; /* For multi-op */
 } completion_t;
 
+/* what a data_view_completion_t borrows, lives on the stack of the call */
+struct zoo_data_view {
+    const char *value;
+    int32_t len;
+    int taken;
+    buffer_list_t *frame; /* the response, if its plain body can be handed over */
+};
+
 typedef struct _completion_list {
     int xid;
     completion_t c;
     const void *data;
     buffer_list_t *buffer;
     struct _completion_list *next;
+    uint32_t key; /* hash of the path, 0 if ordered against every completion */
     watcher_registration_t* watcher;
     watcher_deregistration_t* watcher_deregistration;
+    int64_t submit; /* usec the request was queued */
+    int64_t recv;   /* usec its response was read, 0 until then */
+    int op;         /* ZOO_LATENCY_ operation, set with recv */
 } completion_list_t;
 
 const char*err2string(int err);
@@ -248,12 +270,13 @@ static void deserialize_response(zhandle_t *zh, int type, int xid, int failed, i
 static int deserialize_multi(zhandle_t *zh, int xid, completion_list_t *cptr, struct iarchive *ia);
 
 /* completion routine forward declarations */
-static int add_completion(zhandle_t *zh, int xid, int completion_type,
-        const void *dc, const void *data, int add_to_front,
+static uint32_t completion_key(const char *path);
+static int add_completion(zhandle_t *zh, int xid, const char *path,
+        int completion_type, const void *dc, const void *data, int add_to_front,
         watcher_registration_t* wo, completion_head_t *clist);
 static int add_completion_deregistration(zhandle_t *zh, int xid,
-        int completion_type, const void *dc, const void *data,
-        int add_to_front, watcher_deregistration_t* wo,
+        const char *path, int completion_type, const void *dc,
+        const void *data, int add_to_front, watcher_deregistration_t* wo,
         completion_head_t *clist);
 static int do_add_completion(zhandle_t *zh, const void *dc, completion_list_t *c,
         int add_to_front);
@@ -271,7 +294,7 @@ static completion_list_t* do_create_completion_entry(zhandle_t *zh,
 static void destroy_completion_entry(completion_list_t* c);
 static void queue_completion_nolock(completion_head_t *list, completion_list_t *c,
         int add_to_front);
-static void queue_completion(completion_head_t *list, completion_list_t *c,
+void queue_completion(completion_head_t *list, completion_list_t *c,
         int add_to_front);
 static int handle_socket_error_msg(zhandle_t *zh, int line, int rc,
     const char* format,...);
@@ -641,6 +664,9 @@ static void destroy(zhandle_t *zh)
     destroy_zk_hashtable(zh->active_child_watchers);
     addrvec_free(&zh->addrs_old);
     addrvec_free(&zh->addrs_new);
+    destroy_completion_queue(&zh->completions_to_process);
+    zk_pool_destroy(&zh->pool);
+    free(zh->latency);
 }
 
 static void setup_random()
@@ -1210,6 +1236,8 @@ static zhandle_t *zookeeper_init_internal(const char *host, watcher_fn watcher,
     if (!zh) {
         return 0;
     }
+    zk_pool_init(&zh->pool);
+    zh->latency = calloc(1, sizeof(*zh->latency));
 
     // Set log callback before calling into log_env
     zh->log_callback = log_callback;
@@ -1247,6 +1275,10 @@ static zhandle_t *zookeeper_init_internal(const char *host, watcher_fn watcher,
     zh->context = context;
     zh->recv_timeout = recv_timeout;
     zh->allow_read_only = flags & ZOO_READONLY;
+    zh->shared_io = flags & ZOO_SHARED_IO;
+    zh->completion_threads = (flags >> 8) & 0xff;
+    zh->rewatch_chunk_bytes = ZOO_REWATCH_CHUNK_BYTES;
+    zh->rewatch_window = ZOO_REWATCH_WINDOW;
     // non-zero clientid implies we've seen r/w server already
     zh->seen_rw_server_before = (clientid != 0 && clientid->client_id != 0);
     init_auth_info(&zh->auth_h);
@@ -1310,6 +1342,9 @@ static zhandle_t *zookeeper_init_internal(const char *host, watcher_fn watcher,
     zh->active_child_watchers=create_zk_hashtable();
     zh->disable_reconnection_attempt = 0;
 
+    if (init_completion_queue(&zh->completions_to_process) != 0) {
+        goto abort;
+    }
     if (adaptor_init(zh) == -1) {
         goto abort;
     }
@@ -1481,6 +1516,15 @@ const char* zoo_get_current_server(zhandle_t* zh)
     return endpoint_info;
 }
 
+int zoo_get_pool_stats(zhandle_t *zh, struct zoo_pool_stats *stats)
+{
+    if (zh == NULL || stats == NULL) {
+        return ZBADARGUMENTS;
+    }
+    zk_pool_stats(&zh->pool, &stats->hits, &stats->fallbacks, &stats->cached);
+    return ZOK;
+}
+
 /**
  * deallocated the free_path only its beeen allocated
  * and not equal to path
@@ -1530,28 +1574,55 @@ char* sub_string(zhandle_t *zh, const char* server_path) {
     return ret_str;
 }
 
-static buffer_list_t *allocate_buffer(char *buff, int len)
+static struct oarchive *create_pooled_oarchive(zhandle_t *zh)
+{
+    return create_buffer_oarchive_alloc(zk_pool_archive_alloc, &zh->pool);
+}
+
+static struct iarchive *create_pooled_iarchive(zhandle_t *zh, char *buffer, int len)
 {
-    buffer_list_t *buffer = calloc(1, sizeof(*buffer));
+    return create_buffer_iarchive_alloc(buffer, len, zk_pool_archive_alloc, &zh->pool);
+}
+
+/* buff must come from zh->pool, e.g. the buffer of a pooled oarchive */
+static buffer_list_t *allocate_buffer(zhandle_t *zh, char *buff, int len)
+{
+    buffer_list_t *buffer = zk_pool_alloc(&zh->pool, sizeof(*buffer));
     if (buffer == 0)
         return 0;
 
     buffer->len = len==0?sizeof(*buffer):len;
     buffer->curr_offset = 0;
     buffer->buffer = buff;
+    buffer->chunk = 0;
+    buffer->plain = 0;
     buffer->next = 0;
     return buffer;
 }
 
+static void release_recv_chunk(recv_chunk_t *c)
+{
+#ifdef THREADED
+    if (fetch_and_add(&c->refs, -1) == 1)
+#else
+    if (--c->refs == 0)
+#endif
+        zk_pool_free(c);
+}
+
 static void free_buffer(buffer_list_t *b)
 {
     if (!b) {
         return;
     }
-    if (b->buffer) {
+    if (b->chunk) {
+        release_recv_chunk(b->chunk);
+    } else if (b->plain) {
         free(b->buffer);
+    } else {
+        zk_pool_free(b->buffer);
     }
-    free(b);
+    zk_pool_free(b);
 }
 
 static buffer_list_t *dequeue_buffer(buffer_head_t *list)
@@ -1603,24 +1674,101 @@ static void queue_buffer(buffer_head_t *list, buffer_list_t *b, int add_to_front
     unlock_buffer_list(list);
 }
 
-static int queue_buffer_bytes(buffer_head_t *list, char *buff, int len)
+/* the packet of a request starts with its RequestHeader */
+static int read_request_header(buffer_list_t *b, int32_t *xid, int32_t *type)
+{
+    int32_t hdr[2];
+    if (b->len < (int)sizeof(hdr)) {
+        return 0;
+    }
+    memcpy(hdr, b->buffer, sizeof(hdr));
+    *xid = (int32_t)ntohl(hdr[0]);
+    *type = (int32_t)ntohl(hdr[1]);
+    return 1;
+}
+
+static void probe_request_queued(zhandle_t *zh, buffer_head_t *list, buffer_list_t *b)
+{
+    int32_t xid;
+    int32_t type;
+    if (list == &zh->to_send && read_request_header(b, &xid, &type)) {
+        ZK_PROBE3(request_queued, xid, type, b->len);
+    }
+}
+
+static int queue_buffer_bytes(zhandle_t *zh, buffer_head_t *list, char *buff, int len)
 {
-    buffer_list_t *b  = allocate_buffer(buff,len);
+    buffer_list_t *b  = allocate_buffer(zh,buff,len);
     if (!b)
         return ZSYSTEMERROR;
     queue_buffer(list, b, 0);
+    if (ZK_PROBE_ACTIVE(request_queued))
+        probe_request_queued(zh, list, b);
     return ZOK;
 }
 
-static int queue_front_buffer_bytes(buffer_head_t *list, char *buff, int len)
+static int queue_front_buffer_bytes(zhandle_t *zh, buffer_head_t *list, char *buff, int len)
 {
-    buffer_list_t *b  = allocate_buffer(buff,len);
+    buffer_list_t *b  = allocate_buffer(zh,buff,len);
     if (!b)
         return ZSYSTEMERROR;
     queue_buffer(list, b, 1);
+    if (ZK_PROBE_ACTIVE(request_queued))
+        probe_request_queued(zh, list, b);
     return ZOK;
 }
 
+static int64_t clock_usec(void)
+{
+    struct timeval now;
+    get_system_time(&now);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_usec;
+}
+
+/* remembers when a request was written */
+static void stamp_sent(zhandle_t *zh, buffer_list_t *buff, int64_t now)
+{
+    int32_t xid;
+    int32_t type;
+    if (read_request_header(buff, &xid, &type)) {
+        zk_latency_sent(zh->latency, xid, type, now);
+        /* a written SetWatches packet takes its place in the window */
+        if (xid == SET_WATCHES_XID) {
+            zh->rewatch_unsent--;
+            zh->rewatch_in_flight++;
+        }
+    }
+}
+
+static int is_set_watches(buffer_list_t *buff)
+{
+    int32_t xid;
+    int32_t type;
+    return read_request_header(buff, &xid, &type) && xid == SET_WATCHES_XID;
+}
+
+/* the next packet is a SetWatches and the window is full: it waits for a
+ * response, and so does every request queued behind it */
+static int rewatch_held(zhandle_t *zh)
+{
+    return zh->to_send.head && zh->rewatch_in_flight >= zh->rewatch_window
+        && is_set_watches(zh->to_send.head);
+}
+
+/* splits the time since the call into queue and round trip */
+static void stamp_received(zhandle_t *zh, completion_list_t *cptr)
+{
+    int op;
+    int64_t sent = zk_latency_sent_time(zh->latency, cptr->xid, &op);
+    if (sent < 0) {
+        return;
+    }
+    cptr->recv = clock_usec();
+    cptr->op = op;
+    zk_latency_record(zh->latency, op, ZOO_LATENCY_QUEUE, sent - cptr->submit);
+    zk_latency_record(zh->latency, op, ZOO_LATENCY_RTT, cptr->recv - sent);
+}
+
 static __attribute__ ((unused)) int get_queue_len(buffer_head_t *list)
 {
     int i;
@@ -1682,6 +1830,105 @@ static int send_buffer(zhandle_t *zh, buffer_list_t *buff)
     return buff->curr_offset == len + sizeof(buff->len);
 }
 
+#ifndef _WIN32
+/* queued buffers gathered into one sendmsg call, each takes two iovecs */
+#define SEND_GATHER_MAX 64
+
+/* sends the length prefixes and bodies of as many queued buffers as fit in
+ * one sendmsg call, a partial write resumes from curr_offset next time.
+ * Completely sent buffers are removed from zh->to_send.
+ * returns:
+ * -1 if send failed,
+ * 0 if send would block (or a send was incomplete),
+ * 1 if all the gathered buffers were sent
+ */
+static int gather_send_buffers(zhandle_t *zh)
+{
+    struct iovec iov[SEND_GATHER_MAX * 2];
+    int32_t prefix[SEND_GATHER_MAX];
+    struct msghdr msg;
+    buffer_list_t *buff;
+    int niov = 0;
+    int count = 0;
+    int held = zh->rewatch_in_flight;
+    int64_t now;
+    ssize_t rc;
+
+    for (buff = zh->to_send.head; buff && count < SEND_GATHER_MAX;
+            buff = buff->next, count++) {
+        int off = buff->curr_offset;
+        if (is_set_watches(buff)) {
+            if (held >= zh->rewatch_window) {
+                break;
+            }
+            held++;
+        }
+        if (off < 4) {
+            prefix[count] = htonl(buff->len);
+            iov[niov].iov_base = (char*)&prefix[count] + off;
+            iov[niov].iov_len = sizeof(prefix[count]) - off;
+            niov++;
+            off = 0;
+        } else {
+            off -= sizeof(buff->len);
+        }
+        if (off < buff->len) {
+            iov[niov].iov_base = buff->buffer + off;
+            iov[niov].iov_len = buff->len - off;
+            niov++;
+        }
+    }
+
+    if (count == 0) {
+        return 0;
+    }
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = niov;
+    rc = sendmsg(zh->fd->sock, &msg, SEND_FLAGS);
+    if (rc == -1) {
+        return errno == EAGAIN ? 0 : -1;
+    }
+    now = clock_usec();
+    while (count-- > 0) {
+        int remaining;
+        buff = zh->to_send.head;
+        remaining = buff->len + sizeof(buff->len) - buff->curr_offset;
+        if (rc < remaining) {
+            buff->curr_offset += rc;
+            return 0;
+        }
+        rc -= remaining;
+        stamp_sent(zh, buff, now);
+        remove_buffer(&zh->to_send);
+    }
+    return 1;
+}
+#endif
+
+/* sends from the head of zh->to_send, the caller holds its lock.
+ * Sent buffers are removed from the queue, returns as send_buffer */
+static int send_buffers(zhandle_t *zh)
+{
+    int rc;
+#ifndef _WIN32
+#ifdef HAVE_OPENSSL_H
+    if (!zh->fd->ssl_sock)
+#endif
+        return gather_send_buffers(zh);
+#endif
+    /* TLS records and winsock go one buffer at a time */
+    if (rewatch_held(zh)) {
+        return 0;
+    }
+    rc = send_buffer(zh, zh->to_send.head);
+    if (rc > 0) {
+        stamp_sent(zh, zh->to_send.head, clock_usec());
+        remove_buffer(&zh->to_send);
+    }
+    return rc;
+}
+
 /* returns:
  * -1 if recv call failed,
  * 0 if recv would block,
@@ -1714,7 +1961,7 @@ static int recv_buffer(zhandle_t *zh, buffer_list_t *buff)
         off = buff->curr_offset;
         if (buff->curr_offset == sizeof(buff->len)) {
             buff->len = ntohl(buff->len);
-            buff->buffer = calloc(1, buff->len);
+            buff->buffer = zk_pool_alloc(&zh->pool, buff->len);
         }
     }
     if (buff->buffer) {
@@ -1747,6 +1994,143 @@ static int recv_buffer(zhandle_t *zh, buffer_list_t *buff)
     return buff->curr_offset == buff->len + sizeof(buff->len);
 }
 
+/* the largest pool class, so a chunk never falls back to a plain malloc */
+#define RECV_CHUNK_ALLOC (1 << ZK_POOL_MAX_SHIFT)
+
+/* Start a new receive chunk, carrying over the unframed tail of the current one */
+static int rotate_recv_chunk(zhandle_t *zh)
+{
+    recv_chunk_t *old = zh->recv_chunk;
+    recv_chunk_t *c = zk_pool_alloc(&zh->pool, RECV_CHUNK_ALLOC);
+    if (!c) {
+        errno = ENOMEM;
+        return -1;
+    }
+    c->refs = 1;
+    c->size = RECV_CHUNK_ALLOC - offsetof(recv_chunk_t, data);
+    c->used = 0;
+    c->consumed = 0;
+    if (old) {
+        c->used = old->used - old->consumed;
+        memcpy(c->data, old->data + old->consumed, c->used);
+        release_recv_chunk(old);
+    }
+    zh->recv_chunk = c;
+    return 0;
+}
+
+/* Split the complete packets received into the current chunk and queue them
+ * for processing. A packet too large for a chunk continues in its own buffer.
+ * returns -1 on a malformed length, else the number of packets queued */
+static int frame_recv_chunk(zhandle_t *zh)
+{
+    recv_chunk_t *c = zh->recv_chunk;
+    int queued = 0;
+
+    while (c->used - c->consumed >= (int)sizeof(int32_t)) {
+        int32_t len;
+        int avail = c->used - c->consumed - sizeof(len);
+        char *frame = c->data + c->consumed;
+        buffer_list_t *b;
+
+        memcpy(&len, frame, sizeof(len));
+        len = ntohl(len);
+        if (len < 0) {
+            errno = EBADMSG;
+            return -1;
+        }
+        if (len > c->size - (int)sizeof(len)) {
+            /* too large to pool anyway, a plain body can be handed to
+             * zoo_data_view_take as it is */
+            char *body = malloc(len);
+            b = body ? allocate_buffer(zh, body, len) : 0;
+            if (!b) {
+                free(body);
+                errno = ENOMEM;
+                return -1;
+            }
+            b->plain = 1;
+            memcpy(body, frame + sizeof(len), avail);
+            b->curr_offset = sizeof(len) + avail;
+            c->consumed = c->used;
+            zh->input_buffer = b;
+            break;
+        }
+        if (avail < len) {
+            break;
+        }
+
+        b = allocate_buffer(zh, frame + sizeof(len), len);
+        if (!b) {
+            errno = ENOMEM;
+            return -1;
+        }
+        b->curr_offset = len + sizeof(len);
+        b->chunk = c;
+#ifdef THREADED
+        fetch_and_add(&c->refs, 1);
+#else
+        c->refs++;
+#endif
+        c->consumed += len + sizeof(len);
+        queue_buffer(&zh->to_process, b, 0);
+        queued++;
+    }
+    /* nothing references the received bytes, reuse the space from the start */
+#ifdef THREADED
+    if (c->consumed == c->used && load_int32(&c->refs) == 1) {
+#else
+    if (c->consumed == c->used && c->refs == 1) {
+#endif
+        c->consumed = c->used = 0;
+    }
+    return queued;
+}
+
+/* Receive as much as the current chunk can hold with a single recv and
+ * frame it in place, instead of a recv for each length and each body.
+ * returns -1 if recv failed, else the number of packets queued */
+static int recv_frames(zhandle_t *zh)
+{
+    recv_chunk_t *c;
+    int rc;
+
+    if (zh->input_buffer) {
+        /* finish the oversized packet first */
+        rc = recv_buffer(zh, zh->input_buffer);
+        if (rc <= 0) {
+            return rc;
+        }
+        queue_buffer(&zh->to_process, zh->input_buffer, 0);
+        zh->input_buffer = 0;
+        return 1;
+    }
+
+    if (!zh->recv_chunk || zh->recv_chunk->used == zh->recv_chunk->size) {
+        if (rotate_recv_chunk(zh) < 0) {
+            return -1;
+        }
+    }
+    c = zh->recv_chunk;
+    rc = zookeeper_recv(zh->fd, c->data + c->used, c->size - c->used, 0);
+    switch (rc) {
+    case 0:
+        errno = EHOSTDOWN;
+    case -1:
+#ifdef _WIN32
+        if (WSAGetLastError() == WSAEWOULDBLOCK) {
+#else
+        if (errno == EAGAIN) {
+#endif
+            return 0;
+        }
+        return -1;
+    default:
+        c->used += rc;
+    }
+    return frame_recv_chunk(zh);
+}
+
 void free_buffers(buffer_head_t *list)
 {
     while (remove_buffer(list))
@@ -1765,6 +2149,7 @@ void free_completions(zhandle_t *zh,int callCompletion,int reason)
         tmp_list = zh->sent_requests;
         zh->sent_requests.head = 0;
         zh->sent_requests.last = 0;
+        zh->sent_requests.count = 0;
         unlock_completion_list(&zh->sent_requests);
         while (tmp_list.head) {
             completion_list_t *cptr = tmp_list.head;
@@ -1787,15 +2172,13 @@ void free_completions(zhandle_t *zh,int callCompletion,int reason)
                 h.xid = cptr->xid;
                 h.zxid = -1;
                 h.err = reason;
-                oa = create_buffer_oarchive();
+                oa = create_pooled_oarchive(zh);
                 serialize_ReplyHeader(oa, "header", &h);
-                bptr = calloc(sizeof(*bptr), 1);
+                bptr = allocate_buffer(zh, get_buffer(oa), get_buffer_len(oa));
                 assert(bptr);
-                bptr->len = get_buffer_len(oa);
-                bptr->buffer = get_buffer(oa);
                 close_buffer_oarchive(&oa, 0);
                 cptr->buffer = bptr;
-                queue_completion(&zh->completions_to_process, cptr, 0);
+                push_completion(&zh->completions_to_process, cptr);
             }
         }
     }
@@ -1824,12 +2207,19 @@ static void cleanup_bufs(zhandle_t *zh,int callCompletion,int rc)
     enter_critical(zh);
     free_buffers(&zh->to_send);
     free_buffers(&zh->to_process);
+    free_buffers(&zh->rewatch_pending);
+    zh->rewatch_unsent = 0;
+    zh->rewatch_in_flight = 0;
     free_completions(zh,callCompletion,rc);
     leave_critical(zh);
     if (zh->input_buffer && zh->input_buffer != &zh->primer_buffer) {
         free_buffer(zh->input_buffer);
         zh->input_buffer = 0;
     }
+    if (zh->recv_chunk) {
+        release_recv_chunk(zh->recv_chunk);
+        zh->recv_chunk = 0;
+    }
 }
 
 /* return 1 if zh's state is ZOO_CONNECTED_STATE or ZOO_READONLY_STATE,
@@ -1934,14 +2324,14 @@ static int send_info_packet(zhandle_t *zh, auth_info* auth) {
     struct RequestHeader h = {AUTH_XID, ZOO_SETAUTH_OP};
     struct AuthPacket req;
     int rc;
-    oa = create_buffer_oarchive();
+    oa = create_pooled_oarchive(zh);
     rc = serialize_RequestHeader(oa, "header", &h);
     req.type=0;   // ignored by the server
     req.scheme = auth->scheme;
     req.auth = auth->auth;
     rc = rc < 0 ? rc : serialize_AuthPacket(oa, "req", &req);
     /* add this buffer to the head of the send queue */
-    rc = rc < 0 ? rc : queue_front_buffer_bytes(&zh->to_send, get_buffer(oa),
+    rc = rc < 0 ? rc : queue_front_buffer_bytes(zh, &zh->to_send, get_buffer(oa),
             get_buffer_len(oa));
     /* We queued the buffer, so don't free it */
     close_buffer_oarchive(&oa, 0);
@@ -1986,53 +2376,217 @@ static int send_last_auth_info(zhandle_t *zh)
     return (rc < 0)?ZMARSHALLINGERROR:ZOK;
 }
 
-static void free_key_list(char **list, int count)
+/* serializes one SetWatches packet to the back of rewatch_pending */
+static int queue_set_watches_chunk(zhandle_t *zh, struct SetWatches *req)
 {
-    int i;
+    struct oarchive *oa;
+    struct RequestHeader h = {SET_WATCHES_XID, ZOO_SETWATCHES_OP};
+    int rc;
 
-    for(i = 0; i < count; i++) {
-        free(list[i]);
+    oa = create_pooled_oarchive(zh);
+    rc = serialize_RequestHeader(oa, "header", &h);
+    rc = rc < 0 ? rc : serialize_SetWatches(oa, "req", req);
+    if (rc >= 0) {
+        zh->rewatch_stats.last_chunks++;
+        zh->rewatch_stats.last_bytes += get_buffer_len(oa);
+        rc = queue_buffer_bytes(zh, &zh->rewatch_pending, get_buffer(oa),
+                get_buffer_len(oa));
+    }
+    /* a queued buffer is owned by the pending list now */
+    close_buffer_oarchive(&oa, rc < 0);
+    return rc;
+}
+
+/*
+ * Moves every SetWatches packet from rewatch_pending to the front of the send
+ * queue in its original order, so no request queued meanwhile can reach the
+ * server before the watches of its paths. rewatch_window only bounds how many
+ * of them are written ahead of their responses, see rewatch_held.
+ */
+static void queue_set_watches(zhandle_t *zh)
+{
+    buffer_list_t *reversed = NULL;
+    buffer_list_t *b;
+
+    while ((b = dequeue_buffer(&zh->rewatch_pending))) {
+        zh->rewatch_unsent++;
+        b->next = reversed;
+        reversed = b;
+    }
+    while (reversed) {
+        b = reversed;
+        reversed = b->next;
+        queue_buffer(&zh->to_send, b, 1);
     }
-    free(list);
 }
 
+static void set_watches_acked(zhandle_t *zh)
+{
+    int64_t elapsed;
+
+    if (zh->rewatch_in_flight > 0) {
+        zh->rewatch_in_flight--;
+    }
+    if (zh->rewatch_in_flight || zh->rewatch_unsent) {
+        return;
+    }
+
+    elapsed = clock_usec() - zh->rewatch_start;
+    lock_watchers(zh);
+    if (zh->rewatch_stats.in_progress) {
+        zh->rewatch_stats.in_progress = 0;
+        zh->rewatch_stats.replays++;
+        zh->rewatch_stats.last_duration = elapsed;
+        zh->rewatch_stats.total_duration += elapsed;
+        if (elapsed > zh->rewatch_stats.max_duration) {
+            zh->rewatch_stats.max_duration = elapsed;
+        }
+    }
+    unlock_watchers(zh);
+    LOG_DEBUG(LOGCALLBACK(zh), "Watch replay took %lld us", (long long)elapsed);
+}
+
+/*
+ * Replays the active watches after a reconnect. The paths are read straight
+ * out of the watcher tables into packets of about rewatch_chunk_bytes each,
+ * which are all queued ahead of the user requests.
+ */
 static int send_set_watches(zhandle_t *zh)
 {
-    struct oarchive *oa;
-    struct RequestHeader h = {SET_WATCHES_XID, ZOO_SETWATCHES_OP};
+    zk_hashtable *tables[3];
+    struct String_vector *vectors[3];
+    int capacity[3] = {0, 0, 0};
     struct SetWatches req;
-    int rc;
+    const char *path;
+    unsigned int cursor;
+    int len, i;
+    int chunk_bytes = 0;
+    int rc = 0;
+
+    /* an interrupted replay is started over */
+    free_buffers(&zh->rewatch_pending);
+    zh->rewatch_unsent = 0;
+    zh->rewatch_in_flight = 0;
 
+    memset(&req, 0, sizeof(req));
     req.relativeZxid = zh->last_zxid;
+    tables[0] = zh->active_node_watchers;
+    tables[1] = zh->active_exist_watchers;
+    tables[2] = zh->active_child_watchers;
+    vectors[0] = &req.dataWatches;
+    vectors[1] = &req.existWatches;
+    vectors[2] = &req.childWatches;
+
+    /* the paths point into the watcher tables, keep them locked until serialized */
     lock_watchers(zh);
-    req.dataWatches.data = collect_keys(zh->active_node_watchers, (int*)&req.dataWatches.count);
-    req.existWatches.data = collect_keys(zh->active_exist_watchers, (int*)&req.existWatches.count);
-    req.childWatches.data = collect_keys(zh->active_child_watchers, (int*)&req.childWatches.count);
+    zh->rewatch_stats.last_paths = 0;
+    zh->rewatch_stats.last_chunks = 0;
+    zh->rewatch_stats.last_bytes = 0;
+    for (i = 0; i < 3 && rc >= 0; i++) {
+        cursor = 0;
+        while (rc >= 0 && (path = next_watched_path(tables[i], &cursor, &len))) {
+            /* every path costs its length prefix too */
+            if (chunk_bytes > 0 && chunk_bytes + len + 4 > zh->rewatch_chunk_bytes) {
+                rc = queue_set_watches_chunk(zh, &req);
+                req.dataWatches.count = 0;
+                req.existWatches.count = 0;
+                req.childWatches.count = 0;
+                chunk_bytes = 0;
+                if (rc < 0) {
+                    break;
+                }
+            }
+            if (vectors[i]->count == capacity[i]) {
+                char **data;
+                capacity[i] = capacity[i] ? capacity[i] * 2 : 64;
+                data = realloc(vectors[i]->data, capacity[i] * sizeof(char *));
+                if (!data) {
+                    rc = ZSYSTEMERROR;
+                    break;
+                }
+                vectors[i]->data = data;
+            }
+            vectors[i]->data[vectors[i]->count++] = (char *)path;
+            chunk_bytes += len + 4;
+            zh->rewatch_stats.last_paths++;
+        }
+    }
+    if (rc >= 0 && chunk_bytes > 0) {
+        rc = queue_set_watches_chunk(zh, &req);
+    }
+    zh->rewatch_stats.in_progress = rc >= 0 && zh->rewatch_pending.head;
     unlock_watchers(zh);
+    for (i = 0; i < 3; i++) {
+        free(vectors[i]->data);
+    }
 
+    if (rc < 0) {
+        free_buffers(&zh->rewatch_pending);
+        return ZMARSHALLINGERROR;
+    }
     // return if there are no pending watches
-    if (!req.dataWatches.count && !req.existWatches.count &&
-        !req.childWatches.count) {
-        free_key_list(req.dataWatches.data, req.dataWatches.count);
-        free_key_list(req.existWatches.data, req.existWatches.count);
-        free_key_list(req.childWatches.data, req.childWatches.count);
+    if (!zh->rewatch_pending.head) {
         return ZOK;
     }
 
-
-    oa = create_buffer_oarchive();
-    rc = serialize_RequestHeader(oa, "header", &h);
-    rc = rc < 0 ? rc : serialize_SetWatches(oa, "req", &req);
-    /* add this buffer to the head of the send queue */
-    rc = rc < 0 ? rc : queue_front_buffer_bytes(&zh->to_send, get_buffer(oa),
-            get_buffer_len(oa));
-    /* We queued the buffer, so don't free it */
-    close_buffer_oarchive(&oa, 0);
-    free_key_list(req.dataWatches.data, req.dataWatches.count);
-    free_key_list(req.existWatches.data, req.existWatches.count);
-    free_key_list(req.childWatches.data, req.childWatches.count);
+    zh->rewatch_start = clock_usec();
+    queue_set_watches(zh);
     LOG_DEBUG(LOGCALLBACK(zh), "Sending set watches request to %s",zoo_get_current_server(zh));
-    return (rc < 0)?ZMARSHALLINGERROR:ZOK;
+    return ZOK;
+}
+
+int zoo_get_rewatch_stats(zhandle_t *zh, struct zoo_rewatch_stats *stats)
+{
+    if (zh == NULL || stats == NULL) {
+        return ZBADARGUMENTS;
+    }
+    lock_watchers(zh);
+    *stats = zh->rewatch_stats;
+    unlock_watchers(zh);
+    return ZOK;
+}
+
+int zoo_get_queue_stats(zhandle_t *zh, struct zoo_queue_stats *stats)
+{
+    if (zh == NULL || stats == NULL) {
+        return ZBADARGUMENTS;
+    }
+    stats->outstanding = zh->sent_requests.count;
+    stats->completions = zh->completions_to_process.depth;
+    stats->io_iterations = zh->io_count;
+    lock_watchers(zh);
+    stats->data_watches = zk_hashtable_count(zh->active_node_watchers);
+    stats->exist_watches = zk_hashtable_count(zh->active_exist_watchers);
+    stats->child_watches = zk_hashtable_count(zh->active_child_watchers);
+    unlock_watchers(zh);
+    return ZOK;
+}
+
+int zoo_get_latency(zhandle_t *zh, int op, int phase,
+        struct zoo_latency_histogram *hist, int reset)
+{
+    if (zh == NULL || hist == NULL || op < 0 || op >= ZOO_LATENCY_OPS
+            || phase < 0 || phase >= ZOO_LATENCY_PHASES) {
+        return ZBADARGUMENTS;
+    }
+    if (zh->latency == NULL) {
+        memset(hist, 0, sizeof(*hist));
+        return ZOK;
+    }
+    zk_latency_snapshot(zh->latency, op, phase, hist, reset);
+    return ZOK;
+}
+
+int zoo_set_rewatch_limits(zhandle_t *zh, int chunk_bytes, int window)
+{
+    if (zh == NULL || chunk_bytes < 0 || window < 0) {
+        return ZBADARGUMENTS;
+    }
+    lock_watchers(zh);
+    zh->rewatch_chunk_bytes = chunk_bytes ? chunk_bytes : ZOO_REWATCH_CHUNK_BYTES;
+    zh->rewatch_window = window ? window : ZOO_REWATCH_WINDOW;
+    unlock_watchers(zh);
+    return ZOK;
 }
 
 static int serialize_prime_connect(struct connect_req *req, char* buffer){
@@ -2164,24 +2718,24 @@ static struct timeval get_timeval(int interval)
     return tv;
 }
 
- static int add_void_completion(zhandle_t *zh, int xid, void_completion_t dc,
-     const void *data);
- static int add_string_completion(zhandle_t *zh, int xid,
+ static int add_void_completion(zhandle_t *zh, int xid, const char *path,
+     void_completion_t dc, const void *data);
+ static int add_string_completion(zhandle_t *zh, int xid, const char *path,
      string_completion_t dc, const void *data);
- static int add_string_stat_completion(zhandle_t *zh, int xid,
+ static int add_string_stat_completion(zhandle_t *zh, int xid, const char *path,
      string_stat_completion_t dc, const void *data);
 
 
  int send_ping(zhandle_t* zh)
  {
     int rc;
-    struct oarchive *oa = create_buffer_oarchive();
+    struct oarchive *oa = create_pooled_oarchive(zh);
     struct RequestHeader h = {PING_XID, ZOO_PING_OP};
 
     rc = serialize_RequestHeader(oa, "header", &h);
     enter_critical(zh);
     get_system_time(&zh->last_ping);
-    rc = rc < 0 ? rc : queue_buffer_bytes(&zh->to_send, get_buffer(oa),
+    rc = rc < 0 ? rc : queue_buffer_bytes(zh, &zh->to_send, get_buffer(oa),
             get_buffer_len(oa));
     leave_critical(zh);
     close_buffer_oarchive(&oa, 0);
@@ -2544,7 +3098,7 @@ int zookeeper_interest(zhandle_t *zh, socket_t *fd, int *interest,
         *interest = ZOOKEEPER_READ;
         /* we are interested in a write if we are connected and have something
          * to send, or we are waiting for a connect to finish. */
-        if ((zh->to_send.head && is_connected(zh))
+        if ((zh->to_send.head && is_connected(zh) && !rewatch_held(zh))
             || zh->state == ZOO_CONNECTING_STATE
             || zh->state == ZOO_SSL_CONNECTING_STATE) {
             *interest |= ZOOKEEPER_WRITE;
@@ -2751,20 +3305,18 @@ static int check_events(zhandle_t *zh, int events)
     }
     if (events&ZOOKEEPER_READ) {
         int rc;
-        if (zh->input_buffer == 0) {
-            zh->input_buffer = allocate_buffer(0,0);
+        if (zh->input_buffer != &zh->primer_buffer) {
+            rc = recv_frames(zh);
+        } else {
+            rc = recv_buffer(zh, zh->input_buffer);
         }
-
-        rc = recv_buffer(zh, zh->input_buffer);
         if (rc < 0) {
             return handle_socket_error_msg(zh, __LINE__,ZCONNECTIONLOSS,
                 "failed while receiving a server response");
         }
         if (rc > 0) {
             get_system_time(&zh->last_recv);
-            if (zh->input_buffer != &zh->primer_buffer) {
-                queue_buffer(&zh->to_process, zh->input_buffer, 0);
-            } else  {
+            if (zh->input_buffer == &zh->primer_buffer) {
                 int64_t oldid, newid;
                 //deserialize
                 deserialize_prime_response(&zh->primer_storage, zh->primer_buffer.buffer);
@@ -2801,8 +3353,8 @@ static int check_events(zhandle_t *zh, int events)
                     zh->input_buffer = 0; // just in case the watcher calls zookeeper_process() again
                     PROCESS_SESSION_EVENT(zh, zh->state);
                 }
+                zh->input_buffer = 0;
             }
-            zh->input_buffer = 0;
         } else {
             // zookeeper_process was called but there was nothing to read
             // from the socket
@@ -2834,7 +3386,7 @@ static int queue_session_event(zhandle_t *zh, int state)
     struct oarchive *oa;
     completion_list_t *cptr;
 
-    if ((oa=create_buffer_oarchive())==NULL) {
+    if ((oa=create_pooled_oarchive(zh))==NULL) {
         LOG_ERROR(LOGCALLBACK(zh), "out of memory");
         goto error;
     }
@@ -2845,19 +3397,19 @@ static int queue_session_event(zhandle_t *zh, int state)
         goto error;
     }
     cptr = create_completion_entry(zh, WATCHER_EVENT_XID,-1,0,0,0,0);
-    cptr->buffer = allocate_buffer(get_buffer(oa), get_buffer_len(oa));
-    cptr->buffer->curr_offset = get_buffer_len(oa);
+    cptr->buffer = allocate_buffer(zh, get_buffer(oa), get_buffer_len(oa));
     if (!cptr->buffer) {
-        free(cptr);
+        zk_pool_free(cptr);
         close_buffer_oarchive(&oa, 1);
         goto error;
     }
+    cptr->buffer->curr_offset = get_buffer_len(oa);
     /* We queued the buffer, so don't free it */
     close_buffer_oarchive(&oa, 0);
     lock_watchers(zh);
     cptr->c.watcher_result = collectWatchers(zh, ZOO_SESSION_EVENT, "");
     unlock_watchers(zh);
-    queue_completion(&zh->completions_to_process, cptr, 0);
+    push_completion(&zh->completions_to_process, cptr);
     if (process_async(zh->outstanding_sync)) {
         process_completions(zh);
     }
@@ -2875,6 +3427,7 @@ completion_list_t *dequeue_completion(completion_head_t *list)
     cptr = list->head;
     if (cptr) {
         list->head = cptr->next;
+        list->count--;
         if (!list->head) {
             assert(list->last == cptr);
             list->last = 0;
@@ -2884,6 +3437,117 @@ completion_list_t *dequeue_completion(completion_head_t *list)
     return cptr;
 }
 
+#ifdef THREADED
+#define swap_completion(ptr, c) \
+    ((completion_list_t *)exchange_pointer((void *volatile *)(ptr), (c)))
+#define next_completion(c) \
+    ((completion_list_t *)load_pointer((void *volatile *)&(c)->next))
+#else
+static completion_list_t *swap_completion(completion_list_t *volatile *ptr,
+        completion_list_t *c)
+{
+    completion_list_t *old = *ptr;
+    *ptr = c;
+    return old;
+}
+#define next_completion(c) ((c)->next)
+#endif
+
+int init_completion_queue(completion_queue_t *q)
+{
+    q->stub = calloc(1, sizeof(completion_list_t));
+    if (!q->stub) {
+        return -1;
+    }
+    q->head = q->tail = q->stub;
+    return 0;
+}
+
+void destroy_completion_queue(completion_queue_t *q)
+{
+    completion_list_t *cptr;
+    if (!q->stub) {
+        return;
+    }
+    while ((cptr = pop_completion(q)) != 0) {
+        destroy_completion_entry(cptr);
+    }
+    free(q->stub);
+    q->stub = q->head = q->tail = 0;
+}
+
+static void link_completion(completion_queue_t *q, completion_list_t *c)
+{
+    completion_list_t *prev;
+    c->next = 0;
+    prev = swap_completion(&q->head, c);
+    /* the swap is a full barrier, so the consumer either sees the link or
+     * was already parked when we look at sleeping */
+    swap_completion(&prev->next, c);
+}
+
+void push_completion(completion_queue_t *q, completion_list_t *c)
+{
+    /* counted first, so the consumer never takes depth below zero */
+#ifdef THREADED
+    fetch_and_add(&q->depth, 1);
+    link_completion(q, c);
+    if (load_int32(&q->sleeping)) {
+        unpark_completion_consumer(q);
+    }
+#else
+    q->depth++;
+    link_completion(q, c);
+#endif
+}
+
+static completion_list_t *unlink_completion(completion_queue_t *q)
+{
+    completion_list_t *tail = q->tail;
+    completion_list_t *next = next_completion(tail);
+
+    if (tail == q->stub) {
+        if (!next) {
+            return 0;
+        }
+        q->tail = tail = next;
+        next = next_completion(next);
+    }
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
+    if (tail != q->head) {
+        /* a producer swapped the head but hasn't linked its entry yet */
+        return 0;
+    }
+    link_completion(q, q->stub);
+    next = next_completion(tail);
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
+    return 0;
+}
+
+completion_list_t *pop_completion(completion_queue_t *q)
+{
+    completion_list_t *c = unlink_completion(q);
+    if (c) {
+#ifdef THREADED
+        fetch_and_add(&q->depth, -1);
+#else
+        q->depth--;
+#endif
+    }
+    return c;
+}
+
+int has_completions(completion_queue_t *q)
+{
+    return q->tail != q->stub || next_completion(q->stub) != 0;
+}
+
 // cleanup completion list of a failed multi request
 static void cleanup_failed_multi(zhandle_t *zh, int xid, int rc, completion_list_t *cptr) {
     completion_list_t *entry;
@@ -2942,6 +3606,26 @@ static void deserialize_response(zhandle_t *zh, int type, int xid, int failed, i
             deallocate_GetDataResponse(&res);
         }
         break;
+    case COMPLETION_DATA_VIEW:
+        LOG_DEBUG(LOGCALLBACK(zh), "Calling COMPLETION_DATA_VIEW for xid=%#x failed=%d rc=%d",
+                    cptr->xid, failed, rc);
+        if (failed) {
+            cptr->c.data_view_result(rc, 0, 0, 0, 0, cptr->data);
+        } else {
+            const char *value;
+            int32_t value_len;
+            struct Stat stat;
+            struct zoo_data_view view;
+            ia_deserialize_buffer_view(ia, "data", &value, &value_len);
+            deserialize_Stat(ia, "stat", &stat);
+            view.value = value;
+            view.len = value_len;
+            view.taken = 0;
+            view.frame = cptr->buffer && cptr->buffer->plain ? cptr->buffer : NULL;
+            cptr->c.data_view_result(rc, value, value_len, &stat, &view,
+                    cptr->data);
+        }
+        break;
     case COMPLETION_STAT:
         LOG_DEBUG(LOGCALLBACK(zh), "Calling COMPLETION_STAT for xid=%#x failed=%d rc=%d",
                     cptr->xid, failed, rc);
@@ -3044,35 +3728,59 @@ static void deserialize_response(zhandle_t *zh, int type, int xid, int failed, i
 }
 
 
-/* handles async completion (both single- and multithreaded) */
-void process_completions(zhandle_t *zh)
+/* runs the callback of a single async completion or watcher event */
+void process_completion(zhandle_t *zh, completion_list_t *cptr)
 {
-    completion_list_t *cptr;
-    while ((cptr = dequeue_completion(&zh->completions_to_process)) != 0) {
-        struct ReplyHeader hdr;
-        buffer_list_t *bptr = cptr->buffer;
-        struct iarchive *ia = create_buffer_iarchive(bptr->buffer,
-                bptr->len);
-        deserialize_ReplyHeader(ia, "hdr", &hdr);
+    struct ReplyHeader hdr;
+    buffer_list_t *bptr = cptr->buffer;
+    struct iarchive *ia = create_pooled_iarchive(zh, bptr->buffer,
+            bptr->len);
+    deserialize_ReplyHeader(ia, "hdr", &hdr);
 
-        if (hdr.xid == WATCHER_EVENT_XID) {
-            int type, state;
-            struct WatcherEvent evt;
-            deserialize_WatcherEvent(ia, "event", &evt);
-            /* We are doing a notification, so there is no pending request */
-            type = evt.type;
-            state = evt.state;
-            /* This is a notification so there aren't any pending requests */
-            LOG_DEBUG(LOGCALLBACK(zh), "Calling a watcher for node [%s], type = %d event=%s",
-                       (evt.path==NULL?"NULL":evt.path), cptr->c.type,
-                       watcherEvent2String(type));
-            deliverWatchers(zh,type,state,evt.path, &cptr->c.watcher_result);
-            deallocate_WatcherEvent(&evt);
+    if (hdr.xid == WATCHER_EVENT_XID) {
+        int type, state;
+        struct WatcherEvent evt;
+        deserialize_WatcherEvent(ia, "event", &evt);
+        /* We are doing a notification, so there is no pending request */
+        type = evt.type;
+        state = evt.state;
+        /* This is a notification so there aren't any pending requests */
+        LOG_DEBUG(LOGCALLBACK(zh), "Calling a watcher for node [%s], type = %d event=%s",
+                   (evt.path==NULL?"NULL":evt.path), cptr->c.type,
+                   watcherEvent2String(type));
+        deliverWatchers(zh,type,state,evt.path, &cptr->c.watcher_result);
+        deallocate_WatcherEvent(&evt);
+    } else {
+        if (ZK_PROBE_ACTIVE(completion_dequeued)) {
+            ZK_PROBE3(completion_dequeued, hdr.xid, cptr->c.type,
+                    cptr->recv ? clock_usec() - cptr->recv : (int64_t)-1);
+        }
+        ZK_PROBE2(callback_start, hdr.xid, cptr->c.type);
+        if (cptr->recv) {
+            int64_t start = clock_usec();
+            zk_latency_record(zh->latency, cptr->op, ZOO_LATENCY_DISPATCH, start - cptr->recv);
+            deserialize_response(zh, cptr->c.type, hdr.xid, hdr.err != 0, hdr.err, cptr, ia);
+            zk_latency_record(zh->latency, cptr->op, ZOO_LATENCY_CALLBACK, clock_usec() - start);
         } else {
             deserialize_response(zh, cptr->c.type, hdr.xid, hdr.err != 0, hdr.err, cptr, ia);
         }
-        destroy_completion_entry(cptr);
-        close_buffer_iarchive(&ia);
+        ZK_PROBE3(callback_done, hdr.xid, cptr->c.type, hdr.err);
+    }
+    destroy_completion_entry(cptr);
+    close_buffer_iarchive(&ia);
+}
+
+uint32_t get_completion_key(completion_list_t *cptr)
+{
+    return cptr->key;
+}
+
+/* handles async completion (both single- and multithreaded) */
+void process_completions(zhandle_t *zh)
+{
+    completion_list_t *cptr;
+    while ((cptr = pop_completion(&zh->completions_to_process)) != 0) {
+        process_completion(zh, cptr);
     }
 }
 
@@ -3136,7 +3844,7 @@ int zookeeper_process(zhandle_t *zh, int events)
 
     while (rc >= 0 && (bptr=dequeue_buffer(&zh->to_process))) {
         struct ReplyHeader hdr;
-        struct iarchive *ia = create_buffer_iarchive(
+        struct iarchive *ia = create_pooled_iarchive(zh,
                                     bptr->buffer, bptr->curr_offset);
         deserialize_ReplyHeader(ia, "hdr", &hdr);
 
@@ -3165,13 +3873,18 @@ int zookeeper_process(zhandle_t *zh, int events)
             lock_watchers(zh);
             c->c.watcher_result = collectWatchers(zh, type, path);
             unlock_watchers(zh);
+            c->key = completion_key(path);
 
             // We cannot free until now, otherwise path will become invalid
             deallocate_WatcherEvent(&evt);
-            queue_completion(&zh->completions_to_process, c, 0);
+            push_completion(&zh->completions_to_process, c);
         } else if (hdr.xid == SET_WATCHES_XID) {
             LOG_DEBUG(LOGCALLBACK(zh), "Processing SET_WATCHES");
+            if (hdr.err != ZOK) {
+                LOG_WARN(LOGCALLBACK(zh), "SetWatches failed with %d", hdr.err);
+            }
             free_buffer(bptr);
+            set_watches_acked(zh);
         } else if (hdr.xid == AUTH_XID){
             LOG_DEBUG(LOGCALLBACK(zh), "Processing AUTH_XID");
 
@@ -3219,6 +3932,7 @@ int zookeeper_process(zhandle_t *zh, int events)
                 // Update last_zxid only when it is a request response
                 zh->last_zxid = hdr.zxid;
             }
+            stamp_received(zh, cptr);
             lock_watchers(zh);
             activateWatcher(zh, cptr->watcher, rc);
             deactivateWatcher(zh, cptr->watcher_deregistration, rc);
@@ -3227,7 +3941,7 @@ int zookeeper_process(zhandle_t *zh, int events)
             if (cptr->c.void_result != SYNCHRONOUS_MARKER) {
                 LOG_DEBUG(LOGCALLBACK(zh), "Queueing asynchronous response");
                 cptr->buffer = bptr;
-                queue_completion(&zh->completions_to_process, cptr, 0);
+                push_completion(&zh->completions_to_process, cptr);
             } else {
 #ifdef THREADED
                 struct sync_completion
@@ -3237,6 +3951,10 @@ int zookeeper_process(zhandle_t *zh, int events)
                 process_sync_completion(zh, cptr, sc, ia);
 
                 notify_sync_completion(sc);
+                if (cptr->recv) {
+                    zk_latency_record(zh->latency, cptr->op, ZOO_LATENCY_CALLBACK,
+                            clock_usec() - cptr->recv);
+                }
                 free_buffer(bptr);
                 zh->outstanding_sync--;
                 destroy_completion_entry(cptr);
@@ -3325,13 +4043,14 @@ static completion_list_t* do_create_completion_entry(zhandle_t *zh, int xid,
         watcher_registration_t* wo, completion_head_t *clist,
         watcher_deregistration_t* wdo)
 {
-    completion_list_t *c = calloc(1, sizeof(completion_list_t));
+    completion_list_t *c = zk_pool_calloc(&zh->pool, sizeof(completion_list_t));
     if (!c) {
         LOG_ERROR(LOGCALLBACK(zh), "out of memory");
         return 0;
     }
     c->c.type = completion_type;
     c->data = data;
+    c->submit = clock_usec();
     switch(c->c.type) {
     case COMPLETION_VOID:
         c->c.void_result = (void_completion_t)dc;
@@ -3342,6 +4061,9 @@ static completion_list_t* do_create_completion_entry(zhandle_t *zh, int xid,
     case COMPLETION_DATA:
         c->c.data_result = (data_completion_t)dc;
         break;
+    case COMPLETION_DATA_VIEW:
+        c->c.data_view_result = (data_view_completion_t)dc;
+        break;
     case COMPLETION_STAT:
         c->c.stat_result = (stat_completion_t)dc;
         break;
@@ -3375,7 +4097,7 @@ static void destroy_completion_entry(completion_list_t* c){
         destroy_watcher_deregistration(c->watcher_deregistration);
         if(c->buffer!=0)
             free_buffer(c->buffer);
-        free(c);
+        zk_pool_free(c);
     }
 }
 
@@ -3384,6 +4106,7 @@ static void queue_completion_nolock(completion_head_t *list,
                                     int add_to_front)
 {
     c->next = 0;
+    list->count++;
     /* appending a new entry to the back of the list */
     if (list->last) {
         assert(list->head);
@@ -3403,7 +4126,7 @@ static void queue_completion_nolock(completion_head_t *list,
     }
 }
 
-static void queue_completion(completion_head_t *list, completion_list_t *c,
+void queue_completion(completion_head_t *list, completion_list_t *c,
         int add_to_front)
 {
 
@@ -3412,21 +4135,40 @@ static void queue_completion(completion_head_t *list, completion_list_t *c,
     unlock_completion_list(list);
 }
 
-static int add_completion(zhandle_t *zh, int xid, int completion_type,
-        const void *dc, const void *data, int add_to_front,
+/* Completions on the same path are dispatched in order, the ones without a
+ * path (key 0) are ordered against everything, see process_completion(). */
+static uint32_t completion_key(const char *path)
+{
+    uint32_t hash = 2166136261u;
+    if (!path)
+        return 0;
+    while (*path) {
+        hash ^= (unsigned char)*path++;
+        hash *= 16777619u;
+    }
+    return hash ? hash : 1;
+}
+
+static int add_completion(zhandle_t *zh, int xid, const char *path,
+        int completion_type, const void *dc, const void *data, int add_to_front,
         watcher_registration_t* wo, completion_head_t *clist)
 {
     completion_list_t *c =create_completion_entry(zh, xid, completion_type, dc,
             data, wo, clist);
+    if (c)
+        c->key = completion_key(path);
     return do_add_completion(zh, dc, c, add_to_front);
 }
 
 static int add_completion_deregistration(zhandle_t *zh, int xid,
-        int completion_type, const void *dc, const void *data, int add_to_front,
-        watcher_deregistration_t* wdo, completion_head_t *clist)
+        const char *path, int completion_type, const void *dc,
+        const void *data, int add_to_front, watcher_deregistration_t* wdo,
+        completion_head_t *clist)
 {
     completion_list_t *c = create_completion_entry_deregistration(zh, xid,
            completion_type, dc, data, wdo, clist);
+    if (c)
+        c->key = completion_key(path);
     return do_add_completion(zh, dc, c, add_to_front);
 }
 
@@ -3444,65 +4186,66 @@ static int do_add_completion(zhandle_t *zh, const void *dc,
         }
         rc = ZOK;
     } else {
-        free(c);
+        zk_pool_free(c);
         rc = ZINVALIDSTATE;
     }
     unlock_completion_list(&zh->sent_requests);
     return rc;
 }
 
-static int add_data_completion(zhandle_t *zh, int xid, data_completion_t dc,
-        const void *data,watcher_registration_t* wo)
+static int add_data_completion(zhandle_t *zh, int xid, const char *path,
+        data_completion_t dc, const void *data,watcher_registration_t* wo)
 {
-    return add_completion(zh, xid, COMPLETION_DATA, dc, data, 0, wo, 0);
+    return add_completion(zh, xid, path, COMPLETION_DATA, dc, data, 0, wo, 0);
 }
 
-static int add_stat_completion(zhandle_t *zh, int xid, stat_completion_t dc,
-        const void *data,watcher_registration_t* wo)
+static int add_stat_completion(zhandle_t *zh, int xid, const char *path,
+        stat_completion_t dc, const void *data,watcher_registration_t* wo)
 {
-    return add_completion(zh, xid, COMPLETION_STAT, dc, data, 0, wo, 0);
+    return add_completion(zh, xid, path, COMPLETION_STAT, dc, data, 0, wo, 0);
 }
 
-static int add_strings_completion(zhandle_t *zh, int xid,
+static int add_strings_completion(zhandle_t *zh, int xid, const char *path,
         strings_completion_t dc, const void *data,watcher_registration_t* wo)
 {
-    return add_completion(zh, xid, COMPLETION_STRINGLIST, dc, data, 0, wo, 0);
+    return add_completion(zh, xid, path, COMPLETION_STRINGLIST, dc, data, 0, wo, 0);
 }
 
-static int add_strings_stat_completion(zhandle_t *zh, int xid,
+static int add_strings_stat_completion(zhandle_t *zh, int xid, const char *path,
         strings_stat_completion_t dc, const void *data,watcher_registration_t* wo)
 {
-    return add_completion(zh, xid, COMPLETION_STRINGLIST_STAT, dc, data, 0, wo, 0);
+    return add_completion(zh, xid, path, COMPLETION_STRINGLIST_STAT, dc, data, 0, wo, 0);
 }
 
-static int add_acl_completion(zhandle_t *zh, int xid, acl_completion_t dc,
-        const void *data)
+static int add_acl_completion(zhandle_t *zh, int xid, const char *path,
+        acl_completion_t dc, const void *data)
 {
-    return add_completion(zh, xid, COMPLETION_ACLLIST, dc, data, 0, 0, 0);
+    return add_completion(zh, xid, path, COMPLETION_ACLLIST, dc, data, 0, 0, 0);
 }
 
-static int add_void_completion(zhandle_t *zh, int xid, void_completion_t dc,
-        const void *data)
+static int add_void_completion(zhandle_t *zh, int xid, const char *path,
+        void_completion_t dc, const void *data)
 {
-    return add_completion(zh, xid, COMPLETION_VOID, dc, data, 0, 0, 0);
+    return add_completion(zh, xid, path, COMPLETION_VOID, dc, data, 0, 0, 0);
 }
 
-static int add_string_completion(zhandle_t *zh, int xid,
+static int add_string_completion(zhandle_t *zh, int xid, const char *path,
         string_completion_t dc, const void *data)
 {
-    return add_completion(zh, xid, COMPLETION_STRING, dc, data, 0, 0, 0);
+    return add_completion(zh, xid, path, COMPLETION_STRING, dc, data, 0, 0, 0);
 }
 
-static int add_string_stat_completion(zhandle_t *zh, int xid,
+static int add_string_stat_completion(zhandle_t *zh, int xid, const char *path,
         string_stat_completion_t dc, const void *data)
 {
-    return add_completion(zh, xid, COMPLETION_STRING_STAT, dc, data, 0, 0, 0);
+    return add_completion(zh, xid, path, COMPLETION_STRING_STAT, dc, data, 0, 0, 0);
 }
 
 static int add_multi_completion(zhandle_t *zh, int xid, void_completion_t dc,
         const void *data, completion_head_t *clist)
 {
-    return add_completion(zh, xid, COMPLETION_MULTI, dc, data, 0,0, clist);
+    /* a multi touches several paths, so it is ordered against everything */
+    return add_completion(zh, xid, NULL, COMPLETION_MULTI, dc, data, 0,0, clist);
 }
 
 /**
@@ -3578,9 +4321,9 @@ int zookeeper_close(zhandle_t *zh)
         struct RequestHeader h = {get_xid(), ZOO_CLOSE_OP};
         LOG_INFO(LOGCALLBACK(zh), "Closing zookeeper sessionId=%#llx to %s\n",
             zh->client_id.client_id, zoo_get_current_server(zh));
-        oa = create_buffer_oarchive();
+        oa = create_pooled_oarchive(zh);
         rc = serialize_RequestHeader(oa, "header", &h);
-        rc = rc < 0 ? rc : queue_buffer_bytes(&zh->to_send, get_buffer(oa), get_buffer_len(oa));
+        rc = rc < 0 ? rc : queue_buffer_bytes(zh, &zh->to_send, get_buffer(oa), get_buffer_len(oa));
         /* We queued the buffer, so don't free it */
         close_buffer_oarchive(&oa, 0);
         if (rc < 0) {
@@ -3697,9 +4440,9 @@ int zoo_aget(zhandle_t *zh, const char *path, int watch, data_completion_t dc,
     return zoo_awget(zh,path,watch?zh->watcher:0,zh->context,dc,data);
 }
 
-int zoo_awget(zhandle_t *zh, const char *path,
-        watcher_fn watcher, void* watcherCtx,
-        data_completion_t dc, const void *data)
+static int send_get_data(zhandle_t *zh, const char *path,
+        watcher_fn watcher, void* watcherCtx, int completion_type,
+        void *dc, const void *data)
 {
     struct oarchive *oa;
     char *server_path = prepend_string(zh, path);
@@ -3715,13 +4458,13 @@ int zoo_awget(zhandle_t *zh, const char *path,
         free_duplicate_path(server_path, path);
         return ZINVALIDSTATE;
     }
-    oa=create_buffer_oarchive();
+    oa=create_pooled_oarchive(zh);
     rc = serialize_RequestHeader(oa, "header", &h);
     rc = rc < 0 ? rc : serialize_GetDataRequest(oa, "req", &req);
     enter_critical(zh);
-    rc = rc < 0 ? rc : add_data_completion(zh, h.xid, dc, data,
-    create_watcher_registration(server_path,data_result_checker,watcher,watcherCtx));
-    rc = rc < 0 ? rc : queue_buffer_bytes(&zh->to_send, get_buffer(oa),
+    rc = rc < 0 ? rc : add_completion(zh, h.xid, server_path, completion_type, dc, data, 0,
+    create_watcher_registration(server_path,data_result_checker,watcher,watcherCtx), 0);
+    rc = rc < 0 ? rc : queue_buffer_bytes(zh, &zh->to_send, get_buffer(oa),
             get_buffer_len(oa));
     leave_critical(zh);
     free_duplicate_path(server_path, path);
@@ -3735,6 +4478,60 @@ int zoo_awget(zhandle_t *zh, const char *path,
     return (rc < 0)?ZMARSHALLINGERROR:ZOK;
 }
 
+int zoo_awget(zhandle_t *zh, const char *path,
+        watcher_fn watcher, void* watcherCtx,
+        data_completion_t dc, const void *data)
+{
+    return send_get_data(zh, path, watcher, watcherCtx, COMPLETION_DATA,
+            (void *)dc, data);
+}
+
+int zoo_aget_view(zhandle_t *zh, const char *path, int watch,
+        data_view_completion_t dc, const void *data)
+{
+    return zoo_awget_view(zh,path,watch?zh->watcher:0,zh->context,dc,data);
+}
+
+int zoo_awget_view(zhandle_t *zh, const char *path,
+        watcher_fn watcher, void* watcherCtx,
+        data_view_completion_t dc, const void *data)
+{
+    return send_get_data(zh, path, watcher, watcherCtx, COMPLETION_DATA_VIEW,
+            (void *)dc, data);
+}
+
+void *zoo_data_view_take(struct zoo_data_view *view, const char **value)
+{
+    char *owner;
+    size_t len;
+
+    if (!view || view->taken || !view->value || !value) {
+        return NULL;
+    }
+    if (view->frame) {
+        /* the response body is the owner, freed by the caller instead of the frame */
+        owner = view->frame->buffer;
+        view->frame->buffer = NULL;
+        *value = view->value;
+    } else {
+        /* plain malloc, a pooled block would point back into the handle */
+        len = view->len > 0 ? (size_t)view->len : 0;
+        owner = malloc(len ? len : 1);
+        if (!owner) {
+            return NULL;
+        }
+        memcpy(owner, view->value, len);
+        *value = owner;
+    }
+    view->taken = 1;
+    return owner;
+}
+
+void zoo_data_view_release(void *owner)
+{
+    free(owner);
+}
+
 int zoo_agetconfig(zhandle_t *zh, int watch, data_completion_t dc,
         const void *data)
 {
@@ -3759,13 +4556,13 @@ int zoo_awgetconfig(zhandle_t *zh, watcher_fn watcher, void* watcherCtx,
         free_duplicate_path(server_path, path);
         return ZINVALIDSTATE;
     }
-    oa=create_buffer_oarchive();
+    oa=create_pooled_oarchive(zh);
     rc = serialize_RequestHeader(oa, "header", &h);
     rc = rc < 0 ? rc : serialize_GetDataRequest(oa, "req", &req);
     enter_critical(zh);
-    rc = rc < 0 ? rc : add_data_completion(zh, h.xid, dc, data,
+    rc = rc < 0 ? rc : add_data_completion(zh, h.xid, server_path, dc, data,
                                            create_watcher_registration(server_path,data_result_checker,watcher,watcherCtx));
-    rc = rc < 0 ? rc : queue_buffer_bytes(&zh->to_send, get_buffer(oa),
+    rc = rc < 0 ? rc : queue_buffer_bytes(zh, &zh->to_send, get_buffer(oa),
                                           get_buffer_len(oa));
     leave_critical(zh);
     free_duplicate_path(server_path, path);
@@ -3794,7 +4591,7 @@ int zoo_areconfig(zhandle_t *zh, const char *joining, const char *leaving,
         return ZINVALIDSTATE;
     }
 
-   oa=create_buffer_oarchive();
+   oa=create_pooled_oarchive(zh);
    req.joiningServers = (char *)joining;
    req.leavingServers = (char *)leaving;
    req.newMembers = (char *)members;
@@ -3802,8 +4599,8 @@ int zoo_areconfig(zhandle_t *zh, const char *joining, const char *leaving,
     rc = serialize_RequestHeader(oa, "header", &h);
    rc = rc < 0 ? rc : serialize_ReconfigRequest(oa, "req", &req);
     enter_critical(zh);
-    rc = rc < 0 ? rc : add_data_completion(zh, h.xid, dc, data, NULL);
-    rc = rc < 0 ? rc : queue_buffer_bytes(&zh->to_send, get_buffer(oa),
+    rc = rc < 0 ? rc : add_data_completion(zh, h.xid, ZOO_CONFIG_NODE, dc, data, NULL);
+    rc = rc < 0 ? rc : queue_buffer_bytes(zh, &zh->to_send, get_buffer(oa),
             get_buffer_len(oa));
     leave_critical(zh);
     /* We queued the buffer, so don't free it */
@@ -3842,12 +4639,12 @@ int zoo_aset(zhandle_t *zh, const char *path, const char *buffer, int buflen,
     if (rc != ZOK) {
         return rc;
     }
-    oa = create_buffer_oarchive();
+    oa = create_pooled_oarchive(zh);
     rc = serialize_RequestHeader(oa, "header", &h);
     rc = rc < 0 ? rc : serialize_SetDataRequest(oa, "req", &req);
     enter_critical(zh);
-    rc = rc < 0 ? rc : add_stat_completion(zh, h.xid, dc, data,0);
-    rc = rc < 0 ? rc : queue_buffer_bytes(&zh->to_send, get_buffer(oa),
+    rc = rc < 0 ? rc : add_stat_completion(zh, h.xid, req.path, dc, data,0);
+    rc = rc < 0 ? rc : queue_buffer_bytes(zh, &zh->to_send, get_buffer(oa),
             get_buffer_len(oa));
     leave_critical(zh);
     free_duplicate_path(req.path, path);
@@ -3948,7 +4745,7 @@ int zoo_acreate_ttl(zhandle_t *zh, const char *path, const char *value,
         if (rc != ZOK) {
             return rc;
         }
-        oa = create_buffer_oarchive();
+        oa = create_pooled_oarchive(zh);
         rc = serialize_RequestHeader(oa, "header", &h);
         rc = rc < 0 ? rc : serialize_CreateTTLRequest(oa, "req", &req);
 
@@ -3965,7 +4762,7 @@ int zoo_acreate_ttl(zhandle_t *zh, const char *path, const char *value,
         if (rc != ZOK) {
             return rc;
         }
-        oa = create_buffer_oarchive();
+        oa = create_pooled_oarchive(zh);
         rc = serialize_RequestHeader(oa, "header", &h);
         rc = rc < 0 ? rc : serialize_CreateRequest(oa, "req", &req);
 
@@ -3973,8 +4770,8 @@ int zoo_acreate_ttl(zhandle_t *zh, const char *path, const char *value,
     }
 
     enter_critical(zh);
-    rc = rc < 0 ? rc : add_string_completion(zh, h.xid, completion, data);
-    rc = rc < 0 ? rc : queue_buffer_bytes(&zh->to_send, get_buffer(oa),
+    rc = rc < 0 ? rc : add_string_completion(zh, h.xid, req_path, completion, data);
+    rc = rc < 0 ? rc : queue_buffer_bytes(zh, &zh->to_send, get_buffer(oa),
             get_buffer_len(oa));
     leave_critical(zh);
     free_duplicate_path(req_path, path);
@@ -4016,7 +4813,7 @@ int zoo_acreate2_ttl(zhandle_t *zh, const char *path, const char *value,
         if (rc != ZOK) {
             return rc;
         }
-        oa = create_buffer_oarchive();
+        oa = create_pooled_oarchive(zh);
         rc = serialize_RequestHeader(oa, "header", &h);
         rc = rc < 0 ? rc : serialize_CreateTTLRequest(oa, "req", &req);
 
@@ -4032,7 +4829,7 @@ int zoo_acreate2_ttl(zhandle_t *zh, const char *path, const char *value,
         if (rc != ZOK) {
             return rc;
         }
-        oa = create_buffer_oarchive();
+        oa = create_pooled_oarchive(zh);
         rc = serialize_RequestHeader(oa, "header", &h);
         rc = rc < 0 ? rc : serialize_CreateRequest(oa, "req", &req);
 
@@ -4040,8 +4837,8 @@ int zoo_acreate2_ttl(zhandle_t *zh, const char *path, const char *value,
     }
 
     enter_critical(zh);
-    rc = rc < 0 ? rc : add_string_stat_completion(zh, h.xid, completion, data);
-    rc = rc < 0 ? rc : queue_buffer_bytes(&zh->to_send, get_buffer(oa),
+    rc = rc < 0 ? rc : add_string_stat_completion(zh, h.xid, req_path, completion, data);
+    rc = rc < 0 ? rc : queue_buffer_bytes(zh, &zh->to_send, get_buffer(oa),
             get_buffer_len(oa));
     leave_critical(zh);
     free_duplicate_path(req_path, path);
@@ -4076,12 +4873,12 @@ int zoo_adelete(zhandle_t *zh, const char *path, int version,
     if (rc != ZOK) {
         return rc;
     }
-    oa = create_buffer_oarchive();
+    oa = create_pooled_oarchive(zh);
     rc = serialize_RequestHeader(oa, "header", &h);
     rc = rc < 0 ? rc : serialize_DeleteRequest(oa, "req", &req);
     enter_critical(zh);
-    rc = rc < 0 ? rc : add_void_completion(zh, h.xid, completion, data);
-    rc = rc < 0 ? rc : queue_buffer_bytes(&zh->to_send, get_buffer(oa),
+    rc = rc < 0 ? rc : add_void_completion(zh, h.xid, req.path, completion, data);
+    rc = rc < 0 ? rc : queue_buffer_bytes(zh, &zh->to_send, get_buffer(oa),
             get_buffer_len(oa));
     leave_critical(zh);
     free_duplicate_path(req.path, path);
@@ -4113,14 +4910,14 @@ int zoo_awexists(zhandle_t *zh, const char *path,
     if (rc != ZOK) {
         return rc;
     }
-    oa = create_buffer_oarchive();
+    oa = create_pooled_oarchive(zh);
     rc = serialize_RequestHeader(oa, "header", &h);
     rc = rc < 0 ? rc : serialize_ExistsRequest(oa, "req", &req);
     enter_critical(zh);
-    rc = rc < 0 ? rc : add_stat_completion(zh, h.xid, completion, data,
+    rc = rc < 0 ? rc : add_stat_completion(zh, h.xid, req.path, completion, data,
         create_watcher_registration(req.path,exists_result_checker,
                 watcher,watcherCtx));
-    rc = rc < 0 ? rc : queue_buffer_bytes(&zh->to_send, get_buffer(oa),
+    rc = rc < 0 ? rc : queue_buffer_bytes(zh, &zh->to_send, get_buffer(oa),
             get_buffer_len(oa));
     leave_critical(zh);
     free_duplicate_path(req.path, path);
@@ -4147,13 +4944,13 @@ static int zoo_awget_children_(zhandle_t *zh, const char *path,
     if (rc != ZOK) {
         return rc;
     }
-    oa = create_buffer_oarchive();
+    oa = create_pooled_oarchive(zh);
     rc = serialize_RequestHeader(oa, "header", &h);
     rc = rc < 0 ? rc : serialize_GetChildrenRequest(oa, "req", &req);
     enter_critical(zh);
-    rc = rc < 0 ? rc : add_strings_completion(zh, h.xid, sc, data,
+    rc = rc < 0 ? rc : add_strings_completion(zh, h.xid, req.path, sc, data,
             create_watcher_registration(req.path,child_result_checker,watcher,watcherCtx));
-    rc = rc < 0 ? rc : queue_buffer_bytes(&zh->to_send, get_buffer(oa),
+    rc = rc < 0 ? rc : queue_buffer_bytes(zh, &zh->to_send, get_buffer(oa),
             get_buffer_len(oa));
     leave_critical(zh);
     free_duplicate_path(req.path, path);
@@ -4195,13 +4992,13 @@ static int zoo_awget_children2_(zhandle_t *zh, const char *path,
     if (rc != ZOK) {
         return rc;
     }
-    oa = create_buffer_oarchive();
+    oa = create_pooled_oarchive(zh);
     rc = serialize_RequestHeader(oa, "header", &h);
     rc = rc < 0 ? rc : serialize_GetChildren2Request(oa, "req", &req);
     enter_critical(zh);
-    rc = rc < 0 ? rc : add_strings_stat_completion(zh, h.xid, ssc, data,
+    rc = rc < 0 ? rc : add_strings_stat_completion(zh, h.xid, req.path, ssc, data,
             create_watcher_registration(req.path,child_result_checker,watcher,watcherCtx));
-    rc = rc < 0 ? rc : queue_buffer_bytes(&zh->to_send, get_buffer(oa),
+    rc = rc < 0 ? rc : queue_buffer_bytes(zh, &zh->to_send, get_buffer(oa),
             get_buffer_len(oa));
     leave_critical(zh);
     free_duplicate_path(req.path, path);
@@ -4239,12 +5036,12 @@ int zoo_async(zhandle_t *zh, const char *path,
     if (rc != ZOK) {
         return rc;
     }
-    oa = create_buffer_oarchive();
+    oa = create_pooled_oarchive(zh);
     rc = serialize_RequestHeader(oa, "header", &h);
     rc = rc < 0 ? rc : serialize_SyncRequest(oa, "req", &req);
     enter_critical(zh);
-    rc = rc < 0 ? rc : add_string_completion(zh, h.xid, completion, data);
-    rc = rc < 0 ? rc : queue_buffer_bytes(&zh->to_send, get_buffer(oa),
+    rc = rc < 0 ? rc : add_string_completion(zh, h.xid, req.path, completion, data);
+    rc = rc < 0 ? rc : queue_buffer_bytes(zh, &zh->to_send, get_buffer(oa),
             get_buffer_len(oa));
     leave_critical(zh);
     free_duplicate_path(req.path, path);
@@ -4269,12 +5066,12 @@ int zoo_aget_acl(zhandle_t *zh, const char *path, acl_completion_t completion,
     if (rc != ZOK) {
         return rc;
     }
-    oa = create_buffer_oarchive();
+    oa = create_pooled_oarchive(zh);
     rc = serialize_RequestHeader(oa, "header", &h);
     rc = rc < 0 ? rc : serialize_GetACLRequest(oa, "req", &req);
     enter_critical(zh);
-    rc = rc < 0 ? rc : add_acl_completion(zh, h.xid, completion, data);
-    rc = rc < 0 ? rc : queue_buffer_bytes(&zh->to_send, get_buffer(oa),
+    rc = rc < 0 ? rc : add_acl_completion(zh, h.xid, req.path, completion, data);
+    rc = rc < 0 ? rc : queue_buffer_bytes(zh, &zh->to_send, get_buffer(oa),
             get_buffer_len(oa));
     leave_critical(zh);
     free_duplicate_path(req.path, path);
@@ -4298,14 +5095,14 @@ int zoo_aset_acl(zhandle_t *zh, const char *path, int version,
     if (rc != ZOK) {
         return rc;
     }
-    oa = create_buffer_oarchive();
+    oa = create_pooled_oarchive(zh);
     req.acl = *acl;
     req.version = version;
     rc = serialize_RequestHeader(oa, "header", &h);
     rc = rc < 0 ? rc : serialize_SetACLRequest(oa, "req", &req);
     enter_critical(zh);
-    rc = rc < 0 ? rc : add_void_completion(zh, h.xid, completion, data);
-    rc = rc < 0 ? rc : queue_buffer_bytes(&zh->to_send, get_buffer(oa),
+    rc = rc < 0 ? rc : add_void_completion(zh, h.xid, req.path, completion, data);
+    rc = rc < 0 ? rc : queue_buffer_bytes(zh, &zh->to_send, get_buffer(oa),
             get_buffer_len(oa));
     leave_critical(zh);
     free_duplicate_path(req.path, path);
@@ -4379,7 +5176,7 @@ int zoo_amulti(zhandle_t *zh, int count, const zoo_op_t *ops,
 {
     struct RequestHeader h = {get_xid(), ZOO_MULTI_OP};
     struct MultiHeader mh = {-1, 1, -1};
-    struct oarchive *oa = create_buffer_oarchive();
+    struct oarchive *oa = create_pooled_oarchive(zh);
     completion_head_t clist = { 0 };
 
     int rc = serialize_RequestHeader(oa, "header", &h);
@@ -4466,7 +5263,7 @@ int zoo_amulti(zhandle_t *zh, int count, const zoo_op_t *ops,
     /* BEGIN: CRTICIAL SECTION */
     enter_critical(zh);
     rc = rc < 0 ? rc : add_multi_completion(zh, h.xid, completion, data, &clist);
-    rc = rc < 0 ? rc : queue_buffer_bytes(&zh->to_send, get_buffer(oa),
+    rc = rc < 0 ? rc : queue_buffer_bytes(zh, &zh->to_send, get_buffer(oa),
             get_buffer_len(oa));
     leave_critical(zh);
 
@@ -4531,7 +5328,7 @@ static int aremove_watches(
     }
     unlock_watchers(zh);
 
-    oa = create_buffer_oarchive();
+    oa = create_pooled_oarchive(zh);
     rc = serialize_RequestHeader(oa, "header", &h);
 
     if (all) {
@@ -4558,8 +5355,8 @@ static int aremove_watches(
 
     enter_critical(zh);
     rc = add_completion_deregistration(
-        zh, h.xid, COMPLETION_VOID, completion, data, 0, wdo, 0);
-    rc = rc < 0 ? rc : queue_buffer_bytes(&zh->to_send, get_buffer(oa),
+        zh, h.xid, server_path, COMPLETION_VOID, completion, data, 0, wdo, 0);
+    rc = rc < 0 ? rc : queue_buffer_bytes(zh, &zh->to_send, get_buffer(oa),
             get_buffer_len(oa));
     rc = rc < 0 ? ZMARSHALLINGERROR : ZOK;
     leave_critical(zh);
@@ -4646,12 +5443,16 @@ int flush_send_queue(zhandle_t*zh, int timeout)
     struct timeval wait;
 #endif
     get_system_time(&started);
-    // we can't use dequeue_buffer() here because if (non-blocking) send_buffer()
+    // we can't use dequeue_buffer() here because if (non-blocking) send_buffers()
     // returns EWOULDBLOCK we'd have to put the buffer back on the queue.
     // we use a recursive lock instead and only dequeue the buffer if a send was
     // successful
     lock_buffer_list(&zh->to_send);
     while (zh->to_send.head != 0 && is_connected(zh)) {
+        /* nothing can be written until a SetWatches response opens the window */
+        if (rewatch_held(zh)) {
+            break;
+        }
         if(timeout!=0){
 #ifndef _WIN32
             struct pollfd fds;
@@ -4684,9 +5485,10 @@ int flush_send_queue(zhandle_t*zh, int timeout)
             }
         }
 
-        rc = send_buffer(zh, zh->to_send.head);
+        // sent buffers are removed from the queue
+        rc = send_buffers(zh);
         if(rc==0 && timeout==0){
-            /* send_buffer would block while sending this buffer */
+            /* send_buffers would block while sending the buffers */
             rc = ZOK;
             break;
         }
@@ -4694,9 +5496,6 @@ int flush_send_queue(zhandle_t*zh, int timeout)
             rc = ZCONNECTIONLOSS;
             break;
         }
-        // if the buffer has been sent successfully, remove it from the queue
-        if (rc > 0)
-            remove_buffer(&zh->to_send);
         get_system_time(&zh->last_send);
         rc = ZOK;
     }
@@ -4767,6 +5566,8 @@ const char* zerror(int c)
       return "the watcher couldn't be found";
     case ZRECONFIGDISABLED:
       return "attempts to perform a reconfiguration operation when reconfiguration feature is disable";
+    case ZTHROTTLEDOP:
+      return "throttled operation";
     }
     if (c > 0) {
       return strerror(c);
@@ -4894,11 +5695,14 @@ static void process_sync_completion(zhandle_t *zh,
     switch(cptr->c.type) {
     case COMPLETION_DATA:
         if (sc->rc==0) {
-            struct GetDataResponse res;
+            const char *value;
+            int32_t value_len;
             int len;
-            deserialize_GetDataResponse(ia, "reply", &res);
-            if (res.data.len <= sc->u.data.buff_len) {
-                len = res.data.len;
+            /* copy straight from the response into the caller's buffer */
+            ia_deserialize_buffer_view(ia, "data", &value, &value_len);
+            deserialize_Stat(ia, "stat", &sc->u.data.stat);
+            if (value_len <= sc->u.data.buff_len) {
+                len = value_len;
             } else {
                 len = sc->u.data.buff_len;
             }
@@ -4908,10 +5712,8 @@ static void process_sync_completion(zhandle_t *zh,
             if (len == -1) {
                 sc->u.data.buffer = NULL;
             } else {
-                memcpy(sc->u.data.buffer, res.data.buff, len);
+                memcpy(sc->u.data.buffer, value, len);
             }
-            sc->u.data.stat = res.stat;
-            deallocate_GetDataResponse(&res);
         }
         break;
     case COMPLETION_STAT:
@@ -0,0 +1,604 @@
+// Microbenchmarks of the config_monitor backends, results are written as JSON
+// so runs can be compared across commits.
+//
+//   config_monitor_bench [--backend cppzk|loc_file|all] [--hosts ip:port] [--ops N]
+//                        [--fanout N] [--watches N] [--fleet N] [--window N] [--jitter ms]
+//                        [--allocs 0|1] [--filter substr] [--label text] [--json file]
+//
+// Without --hosts the cppzk benchmarks run against the in-process zk::fake_server.
+// expiry_storm always does, it needs the server to expire the sessions.
+//
+// Allocations and copies are counted per cm::alloc_op and reported per benchmark
+// operation, --allocs 0 turns the counting off. Those of the in-process server and
+// of the loc_file benchmarks, which bypass config_monitor, end up in "other".
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "alloc_stats.hpp"
+#include "config_monitor.hpp"
+#include "cppzk/cppzk.hpp"
+#include "fake_zk_server.hpp"
+#include "local_file/local_file.hpp"
+
+CM_ALLOC_STATS_REPLACE_NEW()
+
+namespace bench {
+
+using clock = std::chrono::steady_clock;
+
+struct options {
+	std::string backend = "all";
+	std::string hosts;
+	std::string filter;
+	std::string label;
+	std::string json;
+	size_t ops = 10000;
+	size_t fanout = 8;
+	size_t watches = 10000;  // expiry_storm, over the whole fleet
+	size_t fleet = 4;
+	size_t window = 256;  // rewatch_policy
+	int64_t jitter_ms = 0;
+	bool allocs = true;
+};
+
+struct result {
+	std::string backend;
+	std::string name;
+	std::map<std::string, int64_t> params;
+	size_t ops = 0;
+	double seconds = 0;
+	std::vector<double> latency_us;  // per operation, may be empty
+	cm::alloc_stats::snapshot allocs{};  // while it ran, in total
+};
+
+inline double micros(clock::duration d) {
+	return std::chrono::duration<double, std::micro>(d).count();
+}
+
+inline double percentile(const std::vector<double>& sorted, double p) {
+	if (sorted.empty()) {
+		return 0;
+	}
+	auto idx = (size_t)(p * (double)(sorted.size() - 1) + 0.5);
+	return sorted[std::min(idx, sorted.size() - 1)];
+}
+
+inline std::string escape(std::string_view s) {
+	std::string out;
+	for (auto c : s) {
+		if (c == '"' || c == '\\') {
+			out.push_back('\\');
+		}
+		out.push_back(c);
+	}
+	return out;
+}
+
+class report {
+	options opt_;
+	std::vector<result> results_;
+
+public:
+	explicit report(options opt) : opt_(std::move(opt)) {}
+
+	bool wanted(std::string_view backend, std::string_view name) const {
+		if (opt_.backend != "all" && opt_.backend != backend) {
+			return false;
+		}
+		auto full = std::string(backend) + "/" + std::string(name);
+		return opt_.filter.empty() || full.find(opt_.filter) != std::string::npos;
+	}
+
+	void add(result r) {
+		std::sort(r.latency_us.begin(), r.latency_us.end());
+		uint64_t allocs = 0;
+		uint64_t copied = 0;
+		for (size_t i = 1; i < r.allocs.size(); ++i) {  // without other
+			allocs += r.allocs[i].allocs;
+			copied += r.allocs[i].copied_bytes;
+		}
+		std::fprintf(stderr, "%-10s %-24s %10zu ops %12.0f ops/s  p50 %8.1f us  p99 %8.1f us"
+			"  allocs/op %6.1f  copied/op %8.1f B\n",
+			r.backend.c_str(), (r.name + suffix(r)).c_str(), r.ops, (double)r.ops / r.seconds,
+			percentile(r.latency_us, 0.5), percentile(r.latency_us, 0.99),
+			(double)allocs / (double)r.ops, (double)copied / (double)r.ops);
+		results_.push_back(std::move(r));
+	}
+
+	void write(std::ostream& os) const {
+		os << "{\n  \"label\": \"" << escape(opt_.label) << "\",\n";
+		os << "  \"timestamp\": " << std::chrono::duration_cast<std::chrono::seconds>(
+			std::chrono::system_clock::now().time_since_epoch()).count() << ",\n";
+		os << "  \"results\": [";
+		for (size_t i = 0; i < results_.size(); ++i) {
+			auto& r = results_[i];
+			os << (i ? ",\n" : "\n") << "    {\"backend\": \"" << r.backend << "\", \"name\": \""
+				<< r.name << "\", \"params\": {";
+			size_t n = 0;
+			for (auto& [k, v] : r.params) {
+				os << (n++ ? ", " : "") << "\"" << k << "\": " << v;
+			}
+			os << "}, \"ops\": " << r.ops << ", \"seconds\": " << r.seconds
+				<< ", \"ops_per_sec\": " << (double)r.ops / r.seconds;
+			if (!r.latency_us.empty()) {
+				os << ", \"latency_us\": {\"p50\": " << percentile(r.latency_us, 0.5)
+					<< ", \"p90\": " << percentile(r.latency_us, 0.9)
+					<< ", \"p99\": " << percentile(r.latency_us, 0.99)
+					<< ", \"max\": " << r.latency_us.back() << "}";
+			}
+			write_allocs(os, r);
+			os << "}";
+		}
+		os << "\n  ]\n}\n";
+	}
+
+private:
+	// per operation of the benchmark, the alloc_ops without any left out
+	static void write_allocs(std::ostream& os, const result& r) {
+		auto per_op = [&r](uint64_t n) { return (double)n / (double)r.ops; };
+		os << ", \"allocs_per_op\": {";
+		size_t n = 0;
+		for (size_t i = 0; i < r.allocs.size(); ++i) {
+			auto& c = r.allocs[i];
+			if (c.allocs == 0 && c.copies == 0) {
+				continue;
+			}
+			os << (n++ ? ", " : "") << "\"" << cm::to_string((cm::alloc_op)i) << "\": {\"allocs\": "
+				<< per_op(c.allocs) << ", \"alloc_bytes\": " << per_op(c.alloc_bytes)
+				<< ", \"copies\": " << per_op(c.copies) << ", \"copied_bytes\": " << per_op(c.copied_bytes) << "}";
+		}
+		os << "}";
+	}
+
+	static std::string suffix(const result& r) {
+		std::string s;
+		for (auto& [k, v] : r.params) {
+			s += " " + k + "=" + std::to_string(v);
+		}
+		return s;
+	}
+};
+
+// Runs op(i, done) for i in [0, ops) keeping depth of them in flight,
+// op calls done() from its completion.
+template <typename Op>
+result pipelined(std::string backend, std::string name, size_t ops, size_t depth, Op&& op) {
+	result r{ std::move(backend), std::move(name), { { "depth", (int64_t)depth } }, ops, 0, {} };
+	r.latency_us.resize(ops);
+	std::atomic<size_t> issued = 0;
+	std::atomic<size_t> finished = 0;
+	std::promise<void> all_done;
+	std::function<void()> next = [&]() {
+		auto i = issued++;
+		if (i >= ops) {
+			return;
+		}
+		auto start = clock::now();
+		op(i, [&, i, start]() {
+			r.latency_us[i] = micros(clock::now() - start);
+			if (++finished == ops) {
+				all_done.set_value();
+				return;
+			}
+			next();
+		});
+	};
+
+	auto allocs = cm::alloc_stats::instance().get();
+	auto start = clock::now();
+	for (size_t i = 0; i < std::min(depth, ops); ++i) {
+		next();
+	}
+	all_done.get_future().wait();
+	r.seconds = std::chrono::duration<double>(clock::now() - start).count();
+	r.allocs = cm::alloc_stats::diff(cm::alloc_stats::instance().get(), allocs);
+	return r;
+}
+
+template <typename Op>
+result timed(std::string backend, std::string name, size_t ops, Op&& op) {
+	result r{ std::move(backend), std::move(name), {}, ops, 0, {} };
+	r.latency_us.reserve(ops);
+	auto allocs = cm::alloc_stats::instance().get();
+	auto begin = clock::now();
+	for (size_t i = 0; i < ops; ++i) {
+		auto start = clock::now();
+		op(i);
+		r.latency_us.push_back(micros(clock::now() - start));
+	}
+	r.seconds = std::chrono::duration<double>(clock::now() - begin).count();
+	r.allocs = cm::alloc_stats::diff(cm::alloc_stats::instance().get(), allocs);
+	return r;
+}
+
+// Waits until count watchers saw the same round
+class fanout_barrier {
+	std::mutex mtx_;
+	std::condition_variable cv_;
+	std::string round_;
+	size_t seen_ = 0;
+
+public:
+	void arm(std::string round) {
+		std::lock_guard<std::mutex> lock(mtx_);
+		round_ = std::move(round);
+		seen_ = 0;
+	}
+
+	void saw(std::string_view value) {
+		std::lock_guard<std::mutex> lock(mtx_);
+		if (value == round_) {
+			++seen_;
+			cv_.notify_all();
+		}
+	}
+
+	bool wait(size_t count, std::chrono::milliseconds timeout) {
+		std::unique_lock<std::mutex> lock(mtx_);
+		return cv_.wait_for(lock, timeout, [&] { return seen_ >= count; });
+	}
+};
+
+inline void run_cppzk(const options& opt, report& rep) {
+	if (opt.backend != "all" && opt.backend != "cppzk") {
+		return;
+	}
+	std::unique_ptr<zk::fake_server> server;
+	auto hosts = opt.hosts;
+	if (hosts.empty()) {
+		server = std::make_unique<zk::fake_server>();
+		hosts = server->hosts();
+	}
+	const std::string be = "cppzk";
+	const std::string root = "/config_monitor_bench";
+	cm::config_monitor<zk::cppzk> m;
+	m.init(hosts, 30000);
+	m.del_path(root);
+	m.create_path(root + "/key", std::string(64, 'v'));
+	auto key = root + "/key";
+	auto ops = opt.ops;
+
+	if (rep.wanted(be, "sync_get")) {
+		rep.add(timed(be, "sync_get", ops, [&](size_t) { m.get_path_value(key); }));
+	}
+	if (rep.wanted(be, "sync_set")) {
+		rep.add(timed(be, "sync_set", ops, [&](size_t i) { m.set_path_value(key, std::to_string(i)); }));
+	}
+	if (rep.wanted(be, "sync_create")) {
+		m.create_path(root + "/c");
+		rep.add(timed(be, "sync_create", ops / 10, [&](size_t i) {
+			m.create_path(root + "/c/" + std::to_string(i), std::string("v"));
+		}));
+		if (rep.wanted(be, "sync_delete")) {
+			rep.add(timed(be, "sync_delete", ops / 10, [&](size_t i) {
+				m.del_path(root + "/c/" + std::to_string(i));
+			}));
+		}
+	}
+
+	for (size_t depth : { 1, 16, 256 }) {
+		if (rep.wanted(be, "async_get")) {
+			rep.add(pipelined(be, "async_get", ops, depth, [&](size_t, auto done) {
+				m.async_get_path_value(key, [done](const auto&, auto&&) { done(); });
+			}));
+		}
+		if (rep.wanted(be, "async_set")) {
+			rep.add(pipelined(be, "async_set", ops, depth, [&](size_t i, auto done) {
+				m.async_set_path_value(key, std::to_string(i), [done](const auto&) { done(); });
+			}));
+		}
+		if (rep.wanted(be, "async_create_delete")) {
+			rep.add(pipelined(be, "async_create_delete", ops / 10, depth, [&](size_t i, auto done) {
+				auto p = root + "/a" + std::to_string(i);
+				m.async_create_path(p, [&m, p, done](const auto&, auto&&) {
+					m.async_del_path(p, [done](const auto&) { done(); });
+				}, std::string("v"));
+			}));
+		}
+	}
+
+	if (rep.wanted(be, "pipeline_sweep")) {
+		for (size_t depth : { 1, 2, 4, 8, 16, 32, 64, 128, 256, 512 }) {
+			rep.add(pipelined(be, "pipeline_sweep", ops, depth, [&](size_t, auto done) {
+				m.async_get_path_value(key, [done](const auto&, auto&&) { done(); });
+			}));
+		}
+	}
+
+	if (rep.wanted(be, "watch_fanout")) {
+		auto fan = root + "/fan";
+		m.create_path(fan, std::string("init"));
+		fanout_barrier barrier;
+		std::vector<std::unique_ptr<cm::config_monitor<zk::cppzk>>> watchers;
+		for (size_t i = 0; i < opt.fanout; ++i) {
+			auto& w = watchers.emplace_back(std::make_unique<cm::config_monitor<zk::cppzk>>());
+			w->init(hosts, 30000);
+			w->watch_path(fan, [&barrier](auto, auto&& val) {
+				if (val) {
+					barrier.saw(*val);
+				}
+			});
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(200));
+		auto rounds = std::max<size_t>(ops / 100, 10);
+		auto r = timed(be, "watch_fanout", rounds, [&](size_t i) {
+			auto round = "round-" + std::to_string(i);
+			barrier.arm(round);
+			m.set_path_value(fan, round);
+			barrier.wait(opt.fanout, std::chrono::seconds(5));
+		});
+		r.params["watchers"] = (int64_t)opt.fanout;
+		rep.add(std::move(r));
+	}
+
+	if (rep.wanted(be, "recursive")) {
+		auto tree = root + "/tree";
+		constexpr size_t breadth = 10;
+		auto r = timed(be, "recursive_create", breadth * breadth, [&](size_t i) {
+			m.create_path(tree + "/n" + std::to_string(i / breadth) + "/n" + std::to_string(i % breadth),
+				std::string("v"));
+		});
+		rep.add(std::move(r));
+		rep.add(timed(be, "recursive_list", std::max<size_t>(ops / 100, 10), [&](size_t) {
+			std::deque<std::string> subs;
+			m.recursive_get_sub_path(tree, subs);
+		}));
+		rep.add(timed(be, "recursive_delete", 1, [&](size_t) { m.del_path(tree); }));
+	}
+	m.del_path(root);
+}
+
+// Expires the sessions of a fleet of monitors at once and times their rewatch: until
+// each monitor saw a fresh value of every watch again, and how hard that hit the server.
+inline void run_expiry_storm(const options& opt, report& rep) {
+	if (!rep.wanted("cppzk", "expiry_storm")) {
+		return;
+	}
+	zk::fake_server server;
+	const std::string root = "/expiry_storm";
+	auto per_client = std::max<size_t>(opt.watches / opt.fleet, 1);
+
+	struct client {
+		cm::config_monitor<zk::cppzk> monitor;
+		std::atomic<size_t> seen = 0;
+		size_t target = 0;
+		std::promise<clock::time_point> recovered;
+	};
+	std::vector<std::unique_ptr<client>> fleet;
+	{
+		cm::config_monitor<zk::cppzk> setup;
+		setup.init(server.hosts(), 30000);
+		for (size_t c = 0; c < opt.fleet; ++c) {
+			for (size_t i = 0; i < per_client; ++i) {
+				setup.create_path(root + "/c" + std::to_string(c) + "/n" + std::to_string(i), std::string("v"));
+			}
+		}
+	}
+
+	// every watch_path and every child of the watch_sub_path reports once per (re)watch
+	auto on_value = [](client& cl) {
+		if (++cl.seen == cl.target) {
+			cl.recovered.set_value(clock::now());
+		}
+	};
+	for (size_t c = 0; c < opt.fleet; ++c) {
+		auto& cl = *fleet.emplace_back(std::make_unique<client>());
+		cl.target = 2 * per_client;
+		cl.monitor.init(server.hosts(), 30000);
+		cl.monitor.set_rewatch_policy({ opt.window, std::chrono::milliseconds(opt.jitter_ms) });
+		auto dir = root + "/c" + std::to_string(c);
+		for (size_t i = 0; i < per_client; ++i) {
+			cl.monitor.watch_path(dir + "/n" + std::to_string(i), [&cl, on_value](auto, auto&&) { on_value(cl); });
+		}
+		cl.monitor.watch_sub_path(dir, [&cl, on_value](auto, auto, auto&&) { on_value(cl); });
+	}
+	for (auto& cl : fleet) {
+		cl->recovered.get_future().wait();
+		cl->seen = 0;
+		cl->recovered = {};
+	}
+
+	// server load in 10ms windows while the fleet recovers
+	std::atomic<bool> sampling = true;
+	uint64_t peak = 0;
+	std::thread sampler([&] {
+		auto last = server.request_count();
+		while (sampling) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			auto now = server.request_count();
+			peak = std::max(peak, now - last);
+			last = now;
+		}
+	});
+	auto requests = server.request_count();
+	auto allocs = cm::alloc_stats::instance().get();
+	auto start = clock::now();
+	server.expire_all_sessions();
+
+	result r{ "cppzk", "expiry_storm", {}, 0, 0, {} };
+	for (auto& cl : fleet) {
+		auto done = cl->recovered.get_future().get();
+		r.latency_us.push_back(micros(done - start));
+		r.ops += cl->target;
+	}
+	r.seconds = std::chrono::duration<double>(clock::now() - start).count();
+	r.allocs = cm::alloc_stats::diff(cm::alloc_stats::instance().get(), allocs);
+	sampling = false;
+	sampler.join();
+	r.params["watches"] = (int64_t)(per_client * opt.fleet);
+	r.params["fleet"] = (int64_t)opt.fleet;
+	r.params["window"] = (int64_t)opt.window;
+	r.params["jitter_ms"] = opt.jitter_ms;
+	r.params["requests"] = (int64_t)(server.request_count() - requests);
+	r.params["peak_requests_10ms"] = (int64_t)peak;
+	rep.add(std::move(r));
+	fleet.clear();
+}
+
+inline void run_loc_file(const options& opt, report& rep) {
+	if (opt.backend != "all" && opt.backend != "loc_file") {
+		return;
+	}
+	namespace fs = std::filesystem;
+	const std::string be = "loc_file";
+	auto root = (fs::temp_directory_path() / "config_monitor_bench").string();
+	auto session_dir = root + "_session";
+	fs::remove_all(root);
+	fs::create_directories(root);
+	auto key = root + "/key";
+	auto ops = opt.ops;
+	{
+		loc::loc_file f;
+		f.initialize(10, session_dir);
+		auto wait = [](auto&& issue) {
+			std::promise<void> pro;
+			issue([&pro](auto&&...) { pro.set_value(); });
+			pro.get_future().wait();
+		};
+		wait([&](auto done) { f.create_path(key, std::string(64, 'v'), loc::file_create_mode::persistent, done); });
+
+		if (rep.wanted(be, "sync_get")) {
+			rep.add(timed(be, "sync_get", ops, [&](size_t) {
+				wait([&](auto done) { f.get_path_value<false>(key, done); });
+			}));
+		}
+		if (rep.wanted(be, "sync_set")) {
+			rep.add(timed(be, "sync_set", ops, [&](size_t i) {
+				wait([&](auto done) { f.set_path_value(key, std::to_string(i), done); });
+			}));
+		}
+		if (rep.wanted(be, "sync_create")) {
+			rep.add(timed(be, "sync_create", ops / 10, [&](size_t i) {
+				wait([&](auto done) {
+					f.create_path(root + "/c/" + std::to_string(i), "v", loc::file_create_mode::persistent, done);
+				});
+			}));
+			if (rep.wanted(be, "sync_delete")) {
+				rep.add(timed(be, "sync_delete", ops / 10, [&](size_t i) {
+					wait([&](auto done) { f.delete_path(root + "/c/" + std::to_string(i), done); });
+				}));
+			}
+		}
+		for (size_t depth : { 1, 16, 256 }) {
+			if (rep.wanted(be, "async_set")) {
+				rep.add(pipelined(be, "async_set", ops, depth, [&](size_t i, auto done) {
+					f.set_path_value(key, std::to_string(i), [done](auto) { done(); });
+				}));
+			}
+		}
+
+		if (rep.wanted(be, "watch_fanout")) {
+			fanout_barrier barrier;
+			std::vector<std::unique_ptr<loc::loc_file>> watchers;
+			for (size_t i = 0; i < opt.fanout; ++i) {
+				auto& w = watchers.emplace_back(std::make_unique<loc::loc_file>());
+				w->initialize(1);
+				w->get_path_value(key, [&barrier](auto, auto&& val) {
+					if (val) {
+						barrier.saw(*val);
+					}
+				}, loc::poll_interval{ std::chrono::milliseconds(1), std::chrono::milliseconds(1) });
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(50));
+			auto r = timed(be, "watch_fanout", std::max<size_t>(ops / 100, 10), [&](size_t i) {
+				auto round = "round-" + std::to_string(i);
+				barrier.arm(round);
+				wait([&](auto done) { f.set_path_value(key, round, done); });
+				barrier.wait(opt.fanout, std::chrono::seconds(5));
+			});
+			r.params["watchers"] = (int64_t)opt.fanout;
+			rep.add(std::move(r));
+		}
+
+		if (rep.wanted(be, "recursive")) {
+			auto tree = root + "/tree";
+			constexpr size_t breadth = 10;
+			rep.add(timed(be, "recursive_create", breadth * breadth, [&](size_t i) {
+				wait([&](auto done) {
+					f.create_path(tree + "/n" + std::to_string(i / breadth) + "/n" + std::to_string(i % breadth),
+						"v", loc::file_create_mode::persistent, done);
+				});
+			}));
+			rep.add(timed(be, "recursive_delete", 1, [&](size_t) {
+				wait([&](auto done) { f.delete_path(tree, done); });
+			}));
+		}
+	}
+	fs::remove_all(root);
+	fs::remove_all(session_dir);
+}
+
+}  // namespace bench
+
+int main(int argc, char** argv) {
+	bench::options opt;
+	for (int i = 1; i + 1 < argc; i += 2) {
+		std::string_view arg = argv[i];
+		std::string val = argv[i + 1];
+		if (arg == "--backend") {
+			opt.backend = val;
+		}
+		else if (arg == "--hosts") {
+			opt.hosts = val;
+		}
+		else if (arg == "--ops") {
+			opt.ops = std::max<size_t>(std::stoul(val), 10);
+		}
+		else if (arg == "--fanout") {
+			opt.fanout = std::max<size_t>(std::stoul(val), 1);
+		}
+		else if (arg == "--watches") {
+			opt.watches = std::max<size_t>(std::stoul(val), 1);
+		}
+		else if (arg == "--fleet") {
+			opt.fleet = std::max<size_t>(std::stoul(val), 1);
+		}
+		else if (arg == "--window") {
+			opt.window = std::stoul(val);
+		}
+		else if (arg == "--jitter") {
+			opt.jitter_ms = std::max<int64_t>(std::stoll(val), 0);
+		}
+		else if (arg == "--allocs") {
+			opt.allocs = val != "0";
+		}
+		else if (arg == "--filter") {
+			opt.filter = val;
+		}
+		else if (arg == "--label") {
+			opt.label = val;
+		}
+		else if (arg == "--json") {
+			opt.json = val;
+		}
+		else {
+			std::fprintf(stderr, "unknown option %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	zoo_set_debug_level(ZOO_LOG_LEVEL_ERROR);
+	cm::alloc_stats::enable(opt.allocs);
+	bench::report rep(opt);
+	bench::run_cppzk(opt, rep);
+	bench::run_expiry_storm(opt, rep);
+	bench::run_loc_file(opt, rep);
+
+	if (opt.json.empty()) {
+		rep.write(std::cout);
+		return 0;
+	}
+	std::ofstream out(opt.json);
+	rep.write(out);
+	return out ? 0 : 1;
+}
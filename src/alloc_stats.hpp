@@ -0,0 +1,170 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+namespace cm {
+
+// What the allocations and copies of a thread are charged to, see alloc_scope
+enum class alloc_op {
+	other,        // outside any scope: the application, the server of a test...
+	create,
+	del,
+	set,
+	get,
+	children,
+	watch,        // registering a watch
+	watch_event,  // from a fired watch to its callback returning, the reads it starts included
+	count
+};
+
+inline const char* to_string(alloc_op op) {
+	static constexpr const char* names[] = {
+		"other", "create", "del", "set", "get", "children", "watch", "watch_event" };
+	return names[static_cast<size_t>(op)];
+}
+
+/**
+ * @brief Allocations and bytes copied, per alloc_op.
+ * Nothing is counted until enable(true). Allocations reach it through an allocator hook:
+ * CM_ALLOC_STATS_REPLACE_NEW replaces the global operator new with one that calls on_alloc(),
+ * a program with its own allocator calls on_alloc() from that instead. Copies of paths and
+ * values are counted where the code makes them.
+ */
+class alloc_stats {
+public:
+	struct counts {
+		uint64_t allocs = 0;
+		uint64_t alloc_bytes = 0;
+		uint64_t copies = 0;
+		uint64_t copied_bytes = 0;
+	};
+	using snapshot = std::array<counts, static_cast<size_t>(alloc_op::count)>;
+
+	static alloc_stats& instance() {
+		static alloc_stats stats;
+		return stats;
+	}
+
+	static void enable(bool on) {
+		enabled_.store(on, std::memory_order_relaxed);
+	}
+
+	static bool enabled() {
+		return enabled_.load(std::memory_order_relaxed);
+	}
+
+	static alloc_op current() {
+		return current_;
+	}
+
+	// For a completion to be charged to what issued its request
+	static alloc_op current_or(alloc_op fallback) {
+		return current_ == alloc_op::other ? fallback : current_;
+	}
+
+	// From the allocator hook, must not allocate
+	static void on_alloc(size_t bytes) {
+		if (enabled()) {
+			auto& c = instance().slots_[static_cast<size_t>(current_)];
+			c.allocs.fetch_add(1, std::memory_order_relaxed);
+			c.alloc_bytes.fetch_add(bytes, std::memory_order_relaxed);
+		}
+	}
+
+	static void on_copy(size_t bytes) {
+		if (enabled()) {
+			auto& c = instance().slots_[static_cast<size_t>(current_)];
+			c.copies.fetch_add(1, std::memory_order_relaxed);
+			c.copied_bytes.fetch_add(bytes, std::memory_order_relaxed);
+		}
+	}
+
+	snapshot get() const {
+		snapshot snap;
+		for (size_t i = 0; i < snap.size(); ++i) {
+			snap[i].allocs = slots_[i].allocs.load(std::memory_order_relaxed);
+			snap[i].alloc_bytes = slots_[i].alloc_bytes.load(std::memory_order_relaxed);
+			snap[i].copies = slots_[i].copies.load(std::memory_order_relaxed);
+			snap[i].copied_bytes = slots_[i].copied_bytes.load(std::memory_order_relaxed);
+		}
+		return snap;
+	}
+
+	// The counts of after less those of before
+	static snapshot diff(const snapshot& after, const snapshot& before) {
+		snapshot d;
+		for (size_t i = 0; i < d.size(); ++i) {
+			d[i].allocs = after[i].allocs - before[i].allocs;
+			d[i].alloc_bytes = after[i].alloc_bytes - before[i].alloc_bytes;
+			d[i].copies = after[i].copies - before[i].copies;
+			d[i].copied_bytes = after[i].copied_bytes - before[i].copied_bytes;
+		}
+		return d;
+	}
+
+private:
+	friend class alloc_scope;
+
+	struct alignas(64) slot {
+		std::atomic<uint64_t> allocs = 0;
+		std::atomic<uint64_t> alloc_bytes = 0;
+		std::atomic<uint64_t> copies = 0;
+		std::atomic<uint64_t> copied_bytes = 0;
+	};
+
+	std::array<slot, static_cast<size_t>(alloc_op::count)> slots_;
+	static inline std::atomic<bool> enabled_ = false;
+	static inline thread_local alloc_op current_ = alloc_op::other;
+};
+
+/**
+ * @brief Charges what the thread does in its lifetime to op, the innermost scope wins
+ */
+class alloc_scope {
+public:
+	explicit alloc_scope(alloc_op op) : prev_(alloc_stats::current_) {
+		alloc_stats::current_ = op;
+	}
+
+	~alloc_scope() {
+		alloc_stats::current_ = prev_;
+	}
+
+	alloc_scope(const alloc_scope&) = delete;
+	alloc_scope& operator=(const alloc_scope&) = delete;
+
+private:
+	alloc_op prev_;
+};
+
+}  // namespace cm
+
+// Expand once, at namespace scope of one translation unit of the program. Aligned and
+// nothrow news are left to the library, its nothrow versions call these. All are kept out
+// of line, inlined into their callers gcc takes the free for a mismatched delete.
+#define CM_ALLOC_STATS_REPLACE_NEW()                                       \
+	[[gnu::noinline]] void* operator new(std::size_t size) {               \
+		cm::alloc_stats::on_alloc(size);                                   \
+		if (auto p = std::malloc(size ? size : 1)) {                       \
+			return p;                                                      \
+		}                                                                  \
+		throw std::bad_alloc();                                            \
+	}                                                                      \
+	[[gnu::noinline]] void* operator new[](std::size_t size) {             \
+		return ::operator new(size);                                       \
+	}                                                                      \
+	[[gnu::noinline]] void operator delete(void* p) noexcept {             \
+		std::free(p);                                                      \
+	}                                                                      \
+	[[gnu::noinline]] void operator delete[](void* p) noexcept {           \
+		std::free(p);                                                      \
+	}                                                                      \
+	[[gnu::noinline]] void operator delete(void* p, std::size_t) noexcept { \
+		std::free(p);                                                      \
+	}                                                                      \
+	[[gnu::noinline]] void operator delete[](void* p, std::size_t) noexcept { \
+		std::free(p);                                                      \
+	}
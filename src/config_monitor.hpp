@@ -1,21 +1,31 @@
 #pragma once
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <deque>
 #include <functional>
 #include <mutex>
+#include <ostream>
 #include <string>
+#include <vector>
 #include <type_traits>
 #include <optional>
 #include <unordered_map>
 #include <unordered_set>
+#include <utility>
 #include <optional>
 #include <future>
+#include <random>
+#include <thread>
+#include "alloc_stats.hpp"
+#include "event_log.hpp"
 
 namespace zk {
 class cppzk;
 }
 namespace loc {
 class config_file;
+class packed_file;
 }
 namespace etcd {
 class etcd_v3;
@@ -34,6 +44,8 @@ constexpr bool has_##FUN##_v = has_##FUN<T>::value;
 
 HAS_MEMBER(set_expired_cb);
 HAS_MEMBER(get_client_ip);
+HAS_MEMBER(watch_path_event_timed);
+HAS_MEMBER(async_get_path_stat);
 
 enum class path_event {
 	changed = 1,  // create, update
@@ -54,6 +66,123 @@ enum class create_mode {
 	persistent_sequential_with_ttl = 6
 };
 
+/**
+ * @brief How the watches are registered again after the session expired
+ */
+struct rewatch_policy {
+	size_t window = 256;                   // registrations in flight at once, 0 for no limit
+	std::chrono::milliseconds jitter{ 0 };  // reconnect after a random delay below this, spreads a fleet
+};
+
+/**
+ * @brief The metadata of a node, as far as the backend has it.
+ * Times are milliseconds since the epoch, by the clock of the server (cppzk).
+ */
+struct node_stat {
+	int64_t czxid = 0;
+	int64_t mzxid = 0;
+	int64_t ctime = 0;
+	int64_t mtime = 0;
+	int32_t version = 0;
+	int32_t cversion = 0;
+	int32_t aversion = 0;
+	int64_t ephemeral_owner = 0;
+	int32_t data_length = 0;
+	int32_t num_children = 0;
+	int64_t pzxid = 0;
+};
+
+/**
+ * @brief One watch notification traced from the write to the end of the callback.
+ * Times are microseconds since the epoch; written comes from the server's clock,
+ * so the first hop includes the clock offset between server and client.
+ */
+struct watch_sample {
+	std::string path;
+	int64_t mzxid = 0;
+	int64_t written = 0;
+	int64_t received = 0;
+	int64_t callback_start = 0;
+	int64_t callback_end = 0;
+};
+
+/**
+ * @brief Keeps the most recent watch samples of a config_monitor, disabled by default.
+ */
+class watch_tracer {
+public:
+	/**
+	 * @brief Start tracing
+	 * @param capacity The oldest samples are dropped beyond this
+	 */
+	void enable(size_t capacity = 4096) {
+		std::lock_guard<std::mutex> lock(mtx_);
+		capacity_ = capacity;
+		enabled_ = capacity > 0;
+	}
+
+	void disable() {
+		enabled_ = false;
+	}
+
+	bool enabled() const {
+		return enabled_;
+	}
+
+	void record(watch_sample&& sample) {
+		std::lock_guard<std::mutex> lock(mtx_);
+		if (!enabled_) {
+			return;
+		}
+		samples_.push_back(std::move(sample));
+		while (samples_.size() > capacity_) {
+			samples_.pop_front();
+		}
+	}
+
+	/**
+	 * @brief Copy the samples in the order they were recorded
+	 * @param reset Also clear them
+	 */
+	std::vector<watch_sample> samples(bool reset = false) {
+		std::lock_guard<std::mutex> lock(mtx_);
+		std::vector<watch_sample> out(samples_.begin(), samples_.end());
+		if (reset) {
+			samples_.clear();
+		}
+		return out;
+	}
+
+	/**
+	 * @brief Write samples as JSON lines, with the hop durations precomputed
+	 */
+	static void write_json(std::ostream& os, const std::vector<watch_sample>& samples) {
+		for (auto& s : samples) {
+			os << "{\"path\":\"";
+			for (auto c : s.path) {
+				if (c == '"' || c == '\\') {
+					os << '\\';
+				}
+				os << c;
+			}
+			os << "\",\"mzxid\":" << s.mzxid
+				<< ",\"written\":" << s.written
+				<< ",\"received\":" << s.received
+				<< ",\"callback_start\":" << s.callback_start
+				<< ",\"callback_end\":" << s.callback_end
+				<< ",\"propagation_us\":" << s.received - s.written
+				<< ",\"dispatch_us\":" << s.callback_start - s.received
+				<< ",\"callback_us\":" << s.callback_end - s.callback_start << "}\n";
+		}
+	}
+
+private:
+	std::mutex mtx_;
+	std::deque<watch_sample> samples_;
+	size_t capacity_ = 0;
+	std::atomic<bool> enabled_ = false;
+};
+
 template <typename>
 inline constexpr bool always_false_v = false;
 
@@ -62,17 +191,37 @@ class config_monitor : public ConfigType {
 public:
 	using watch_sub_cb = std::function<void(path_event, std::string_view, std::optional<std::string>&&)>;
 	using watch_cb = std::function<void(path_event, std::optional<std::string>&&)>;
+	using watch_stat_cb = std::function<void(path_event, std::optional<std::string>&&, const node_stat&)>;
 	using operate_cb = std::function<void(const std::error_code&)>;
 	using create_cb = std::function<void(const std::error_code&, std::string&&)>;
 	using get_callback = std::function<void(const std::error_code&, std::optional<std::string>&&)>;
 
 private:
-	// key is main path
+	// key is main path, the children callbacks of different paths may run on different
+	// completion threads, see ZOO_COMPLETION_THREADS
 	std::unordered_map<std::string, std::unordered_set<std::string>> last_sub_path_;
+	std::mutex sub_path_mtx_;
 	//std::unordered_map<std::string, std::unordered_map<std::string, std::string>> sub_path_value_;
-	std::unordered_map<std::string, watch_cb> watch_record_;
+	std::unordered_map<std::string, watch_stat_cb> watch_record_;
 	std::unordered_map<std::string, watch_sub_cb> watch_sub_record_;
+	// recorded watches an expired session has not registered again yet, guarded by record_mtx_
+	std::unordered_set<std::string> rewatch_pending_;
+	std::unordered_set<std::string> rewatch_sub_pending_;
+	uint64_t rewatch_generation_ = 0;
 	std::mutex record_mtx_;
+	watch_tracer tracer_;
+	event_recorder recorder_;
+	rewatch_policy rewatch_policy_;
+
+	// the paths of an expired session to register again, their callbacks stay in the records
+	struct rewatch_batch {
+		std::mutex mtx;
+		std::deque<std::string> paths;
+		std::deque<std::string> sub_paths;
+		uint64_t generation = 0;
+		size_t credits = 0;
+		bool pumping = false;
+	};
 
 public:
 	config_monitor(const config_monitor&) = delete;
@@ -94,29 +243,53 @@ public:
 		if constexpr (has_set_expired_cb_v<ConfigType>) {
 			ConfigType::set_expired_cb([this, arg = std::make_tuple(args...)]() {
 				ConfigType::clear_resource();
-				last_sub_path_.clear();
+				{
+					std::lock_guard<std::mutex> lock(sub_path_mtx_);
+					last_sub_path_.clear();
+				}
+				auto jitter = rewatch_policy_.jitter.count();
+				if (jitter > 0) {
+					thread_local std::mt19937_64 rng{ std::random_device{}() };
+					std::this_thread::sleep_for(std::chrono::milliseconds(
+						std::uniform_int_distribution<int64_t>(0, jitter - 1)(rng)));
+				}
 				this->callable([this](auto&&... args) {
 					ConfigType::initialize(std::forward<decltype(args)>(args)...);
 				}, std::move(arg), std::make_index_sequence<std::tuple_size_v<decltype(arg)>>());
 
 				// auto rewatch
 				if constexpr (std::is_same_v<ConfigType, zk::cppzk>) {
+					auto batch = std::make_shared<rewatch_batch>();
 					std::unique_lock<std::mutex> lock(record_mtx_);
-					auto watch_record = std::move(watch_record_);
-					auto watch_sub_record = std::move(watch_sub_record_);
-					lock.unlock();
-					for (auto&& [path, cb] : watch_record) {
-						watch_path(path, std::move(cb));
+					batch->generation = ++rewatch_generation_;
+					rewatch_pending_.clear();
+					rewatch_sub_pending_.clear();
+					for (auto&& record : watch_record_) {
+						batch->paths.emplace_back(record.first);
+						rewatch_pending_.insert(record.first);
 					}
-					for (auto&& [path, cb] : watch_sub_record) {
-						watch_sub_path(path, std::move(cb));
+					for (auto&& record : watch_sub_record_) {
+						batch->sub_paths.emplace_back(record.first);
+						rewatch_sub_pending_.insert(record.first);
 					}
+					lock.unlock();
+					auto window = rewatch_policy_.window;
+					rewatch_pump(batch, window ? window : batch->paths.size() + batch->sub_paths.size());
 				}
 			});
 		}
 		ConfigType::initialize(std::forward<Args>(args)...);
 	}
 
+	/**
+	 * @brief Set how the watches are registered again after the session expired.
+	 * A window keeps the new session from flooding the server with its whole watch
+	 * list at once, a jitter keeps a fleet expired together from reconnecting together.
+	 */
+	void set_rewatch_policy(rewatch_policy policy) {
+		rewatch_policy_ = policy;
+	}
+
 	/**
 	 * @brief Sync create full path.
 	 * If the path depth more than 1, the prefix path will be created automatically.
@@ -129,6 +302,7 @@ public:
 	 */
 	auto create_path(std::string_view path, const std::optional<std::string>& value = std::nullopt,
 		create_mode mode = create_mode::persistent, int64_t ttl = -1) {
+		alloc_scope scope(alloc_op::create);
 		auto create_mode = ConfigType::get_create_mode(static_cast<int>(mode));
 		return ConfigType::create_path(path, value, create_mode, ttl);
 	}
@@ -146,6 +320,7 @@ public:
 	void async_create_path(std::string path, create_cb cb,
 		const std::optional<std::string>& value = std::nullopt,
 		create_mode mode = create_mode::persistent, int64_t ttl = -1) {
+		alloc_scope scope(alloc_op::create);
 		auto create_mode = ConfigType::get_create_mode(static_cast<int>(mode));
 		ConfigType::async_create_path(path, value, create_mode,
 			[cb = std::move(cb)](const auto& ec, std::string&& new_path) {
@@ -162,6 +337,7 @@ public:
 	 * @return std::error_code
 	 */
 	auto del_path(std::string_view path) {
+		alloc_scope scope(alloc_op::del);
 		return ConfigType::delete_path(path);
 	}
 
@@ -172,6 +348,7 @@ public:
 	 * @param callback
 	 */
 	void async_del_path(std::string_view path, operate_cb callback) {
+		alloc_scope scope(alloc_op::del);
 		ConfigType::async_delete_path(path, [this, cb = std::move(callback)](const auto& ec) {
 			if (cb) {
 				cb(ec);
@@ -186,6 +363,7 @@ public:
 	 * @return std::error_code
      */
 	auto set_path_value(std::string_view path, std::string_view value) {
+		alloc_scope scope(alloc_op::set);
 		return ConfigType::set_path_value(path, value);
 	}
 
@@ -196,6 +374,7 @@ public:
 	 * @param callback
      */
 	void async_set_path_value(std::string_view path, std::string_view value, operate_cb callback) {
+		alloc_scope scope(alloc_op::set);
 		ConfigType::async_set_path_value(path, value, [cb = std::move(callback)](const auto& ec) {
 			if (cb) {
 				cb(ec);
@@ -209,6 +388,7 @@ public:
 	 * @return [std::error_code, std::vector<std::string>]
 	 */
 	auto get_sub_path(std::string_view path) {
+		alloc_scope scope(alloc_op::children);
 		return ConfigType::get_sub_path(path);
 	}
 
@@ -218,6 +398,7 @@ public:
 	 * @return [std::error_code, std::optional<std::string>]
 	 */
 	auto get_path_value(std::string_view path) {
+		alloc_scope scope(alloc_op::get);
 		return ConfigType::get_path_value(path);
 	}
 
@@ -227,6 +408,7 @@ public:
 	 * @param callback
 	 */
 	void async_get_path_value(std::string_view path, get_callback callback) {
+		alloc_scope scope(alloc_op::get);
 		ConfigType::async_get_path_value(path,
 			[cb = std::move(callback)](const auto& ec, auto, auto, auto&& val) {
 			if (cb) {
@@ -235,6 +417,17 @@ public:
 		});
 	}
 
+	/**
+	 * @brief Async get a path value without copying it, for backends that lend
+	 * their receive buffers (cppzk)
+	 * @param path The target path
+	 * @param callback Receives the backend's buffer type, e.g. zk::data_buffer
+	 */
+	template <typename Callback>
+	void async_get_path_view(std::string_view path, Callback&& callback) {
+		ConfigType::async_get_path_view(path, std::forward<Callback>(callback));
+	}
+
 	/**
 	 * @brief Async monitor path changed. It will set the next watch point automatically.
 	 * Also valid for a non existed path, monitor will start after the target path is created.
@@ -244,28 +437,86 @@ public:
 	 * If the event is del, then the 2th arg value will be empty.
      */
 	void watch_path(std::string_view path, watch_cb callback) {
-		if constexpr (std::is_same_v<ConfigType, zk::cppzk>) {
-			std::unique_lock<std::mutex> lock(record_mtx_);
-			watch_record_[std::string(path)] = callback;
-			lock.unlock();
-		}
+		watch_path(path, [cb = std::move(callback)](path_event eve, auto&& val, const node_stat&) {
+			cb(eve, std::move(val));
+		});
+	}
 
-		ConfigType::watch_path_event(path,
-			[this, cb = std::move(callback), p = std::string(path)](const auto& ec, auto eve) {
-			if (ec && ConfigType::is_delete_event(eve)) {
-				cb(path_event::del, {});
-				return;
+	/**
+	 * @brief Same as watch_path, the callback also gets the stat of the node the value was read
+	 * with (mzxid, mtime...), left zero if the backend has none or the event is del.
+	 * Changes are recorded to tracer() while it is enabled.
+	 *
+	 * @param path The target path
+	 * @param cb Callback, 3th arg is the stat of the changed value
+	 */
+	void watch_path(std::string_view path, watch_stat_cb callback) {
+		add_watch(path, std::move(callback), nullptr);
+	}
+
+	/**
+	 * @brief The propagation samples of watch_path callbacks
+	 */
+	watch_tracer& tracer() {
+		return tracer_;
+	}
+
+	/**
+	 * @brief Records every event delivered to a watch_path or watch_sub_path callback once opened,
+	 * see replay()
+	 */
+	event_recorder& recorder() {
+		return recorder_;
+	}
+
+	/**
+	 * @brief Feed a log written by recorder() to the callbacks registered now, in its order,
+	 * on the calling thread. A callback is found by the path it was registered with, events
+	 * of paths not watched now are skipped. A value recorded only as hash is given as empty.
+	 *
+	 * @param file The log
+	 * @param speed 1 keeps the original gaps between events, 2 halves them, 0 does not wait
+	 * @return The number of events delivered
+	 */
+	size_t replay(const std::string& file, double speed = 1.0) {
+		event_log::reader log;
+		if (!log.open(file)) {
+			return 0;
+		}
+		size_t delivered = 0;
+		event_record r;
+		int64_t first = 0;
+		auto start = std::chrono::steady_clock::now();
+		while (log.next(r)) {
+			if (delivered == 0) {
+				first = r.time_us;
 			}
-			auto changed = ConfigType::is_dummy_event(eve) ||
-				ConfigType::is_create_event(eve) || ConfigType::is_changed_event(eve);
-			if (changed) {
-				ConfigType::async_get_path_value(p, [&cb](const auto& ec, auto, auto, auto&& val) {
-					if (!ec) {
-						cb(path_event::changed, std::move(val));
-					}
-				});
+			if (speed > 0) {
+				std::this_thread::sleep_until(start + std::chrono::microseconds(
+					(int64_t)((double)(r.time_us - first) / speed)));
 			}
-		});
+			std::unique_lock<std::mutex> lock(record_mtx_);
+			if (r.sub_path) {
+				auto it = watch_sub_record_.find(r.watch);
+				if (it == watch_sub_record_.end()) {
+					continue;
+				}
+				auto cb = it->second;
+				lock.unlock();
+				cb(r.event, r.path, std::move(r.value));
+			}
+			else {
+				auto it = watch_record_.find(r.watch);
+				if (it == watch_record_.end()) {
+					continue;
+				}
+				auto cb = it->second;
+				lock.unlock();
+				cb(r.event, std::move(r.value), node_stat{});
+			}
+			++delivered;
+		}
+		return delivered;
 	}
 
 	/**
@@ -279,29 +530,137 @@ public:
 	 * If the event is del, then the changed value must be empty.
 	 */
 	void watch_sub_path(std::string_view path, watch_sub_cb callback) {
-		if constexpr (std::is_same_v<ConfigType, zk::cppzk>) {
-			std::unique_lock<std::mutex> lock(record_mtx_);
-			watch_sub_record_[std::string(path)] = callback;
-			lock.unlock();
+		add_sub_watch(path, std::move(callback), nullptr);
+	}
+
+	/**
+     * @brief Sync remove the watch, the path event will not be triggered.
+     * @param path The target path
+     * @param type Watch type, path or sub-path
+     */
+	auto remove_watches(std::string_view path, watch_type type) {
+		std::promise<std::error_code> pro;
+		async_remove_watches(path, type, [&pro](const std::error_code& ec) {
+			pro.set_value(ec);
+		});
+		return pro.get_future().get();
+	}
+
+	/**
+	 * @brief Async remove the watch, the path event will not be triggered.
+	 * @param path The target path
+	 * @param type Watch type, path or sub-path
+	 * @param callback
+	 */
+	void async_remove_watches(std::string_view path, watch_type type, operate_cb callback) {
+		// forgotten before the request is sent, so a rewatch in progress cannot register it again
+		std::unique_lock<std::mutex> lock(record_mtx_);
+		if (type == watch_type::watch_path) {
+			watch_record_.erase(std::string(path));
+			rewatch_pending_.erase(std::string(path));
+		}
+		else {
+			watch_sub_record_.erase(std::string(path));
+			rewatch_sub_pending_.erase(std::string(path));
 		}
+		lock.unlock();
+
+		ConfigType::async_remove_watches(path, static_cast<int>(type),
+			[this, type, p = std::string(path), cb = std::move(callback)](auto ec) {		
+			if (type == watch_type::watch_sub_path) {
+				std::lock_guard<std::mutex> lock(sub_path_mtx_);
+				last_sub_path_.erase(p);
+			}
+			if (cb) {
+				cb(ec);
+			}
+		});
+	}
 
+	/**
+	 * @brief Get self ip with the session
+	 * @return Self ip
+	 */
+	auto client_ip() {
+		if constexpr (has_get_client_ip_v<ConfigType>) {
+			return ConfigType::get_client_ip();
+		}
+	}
+
+private:
+	// settled is called once the watch is registered, before its first event is handled
+	void add_watch(std::string_view path, watch_stat_cb callback, std::function<void()> settled) {
+		alloc_scope scope(alloc_op::watch);
+		std::unique_lock<std::mutex> lock(record_mtx_);
+		watch_record_[std::string(path)] = callback;
+		rewatch_pending_.erase(std::string(path));
+		lock.unlock();
+		register_watch(path, std::move(callback), std::move(settled));
+	}
+
+	void register_watch(std::string_view path, watch_stat_cb callback, std::function<void()> settled) {
+		alloc_scope scope(alloc_op::watch);
+		auto on_event = [this, cb = std::move(callback), p = std::string(path), settled = std::move(settled)](
+			const auto& ec, auto eve, std::chrono::system_clock::time_point received) mutable {
+			if (settled) {
+				std::exchange(settled, nullptr)();
+			}
+			if (ec && ConfigType::is_delete_event(eve)) {
+				record_event(path_event::del, false, p, p, std::nullopt);
+				cb(path_event::del, {}, node_stat{});
+				return;
+			}
+			auto changed = ConfigType::is_dummy_event(eve) ||
+				ConfigType::is_create_event(eve) || ConfigType::is_changed_event(eve);
+			if (changed) {
+				read_changed(p, cb, received);
+			}
+		};
+		if constexpr (has_watch_path_event_timed_v<ConfigType>) {
+			ConfigType::watch_path_event_timed(path, std::move(on_event));
+		}
+		else {
+			ConfigType::watch_path_event(path, [on_event = std::move(on_event)](const auto& ec, auto eve) mutable {
+				on_event(ec, eve, std::chrono::system_clock::time_point{});
+			});
+		}
+	}
+
+	void add_sub_watch(std::string_view path, watch_sub_cb callback, std::function<void()> settled) {
+		alloc_scope scope(alloc_op::watch);
+		std::unique_lock<std::mutex> lock(record_mtx_);
+		watch_sub_record_[std::string(path)] = callback;
+		rewatch_sub_pending_.erase(std::string(path));
+		lock.unlock();
+		register_sub_watch(path, std::move(callback), std::move(settled));
+	}
+
+	void register_sub_watch(std::string_view path, watch_sub_cb callback, std::function<void()> settled) {
+		alloc_scope scope(alloc_op::watch);
 		auto prefix = std::string(path);
 		auto monitor = [this, cb = std::move(callback), prefix](const std::string& sub_path) {
+			alloc_stats::on_copy(sub_path.size());
 			ConfigType::template async_get_path_value<true>(sub_path, 
 				[this, cb = std::move(cb), prefix = std::move(prefix)](
 					const auto& ec, auto eve, std::string_view path, auto&& val) {
 				if (ec && ConfigType::is_delete_event(eve)) {
+					record_event(path_event::del, true, prefix, path, std::nullopt);
 					cb(path_event::del, path, {});
 					return;
 				}
 				if (!ec) {
+					record_event(path_event::changed, true, prefix, path, val);
 					cb(path_event::changed, path, std::move(val));
 				}	
 			});
 		};
 
 		ConfigType::watch_path_event(path, 
-		[this, prefix = std::move(prefix), monitor = std::move(monitor)](const auto& ec, auto eve) {
+		[this, prefix = std::move(prefix), monitor = std::move(monitor), settled = std::move(settled)](
+			const auto& ec, auto eve) mutable {
+			if (settled) {
+				std::exchange(settled, nullptr)();
+			}
 			if (ec) {
 				return;
 			}
@@ -315,81 +674,128 @@ public:
 					return;
 				}
 
-				std::unordered_set<std::string> sub_paths_set;
+				std::vector<std::string> new_paths;
+				std::unique_lock<std::mutex> lock(sub_path_mtx_);
 				auto it = last_sub_path_.find(prefix);
-				// all is new paths, monitor all
-				if (it == last_sub_path_.end()) {
-					for (auto&& sub_path : sub_paths) {
-						monitor(prefix + "/" + sub_path);
-						sub_paths_set.emplace(std::move(sub_path));
-					}
-					last_sub_path_.emplace(prefix, std::move(sub_paths_set));
-					return;
-				}
-				// monitor new paths
+				// all is new paths if not seen, otherwise ignore the existed ones
 				for (auto&& sub_path : sub_paths) {
-					if (it->second.find(sub_path) != it->second.end()) { //ignore existed path
-						continue;
+					if (it == last_sub_path_.end() || it->second.find(sub_path) == it->second.end()) {
+						new_paths.emplace_back(prefix + "/" + sub_path);
 					}
-					monitor(prefix + "/" + sub_path);
 				}
 				//Replace the old sub_paths_set
+				std::unordered_set<std::string> sub_paths_set;
 				for (auto&& sub_path : sub_paths) {
 					sub_paths_set.emplace(std::move(sub_path));
 				}
 				last_sub_path_[prefix] = std::move(sub_paths_set);
+				lock.unlock();
+
+				// monitor new paths, outside the lock as the read may complete inline
+				for (auto&& sub_path : new_paths) {
+					monitor(sub_path);
+				}
 			});
 		});
 	}
 
-	/**
-     * @brief Sync remove the watch, the path event will not be triggered.
-     * @param path The target path
-     * @param type Watch type, path or sub-path
-     */
-	auto remove_watches(std::string_view path, watch_type type) {
-		std::promise<std::error_code> pro;
-		async_remove_watches(path, type, [&pro](const std::error_code& ec) {
-			pro.set_value(ec);
-		});
-		return pro.get_future().get();
+	// Registers pending watches of the batch while it has credits, each registration
+	// that settles returns its credit. Called again from inside a registration it only
+	// adds the credit, the running pump picks it up.
+	void rewatch_pump(const std::shared_ptr<rewatch_batch>& batch, size_t credits) {
+		std::unique_lock<std::mutex> lock(batch->mtx);
+		batch->credits += credits;
+		if (batch->pumping) {
+			return;
+		}
+		batch->pumping = true;
+		while (batch->credits > 0 && (!batch->paths.empty() || !batch->sub_paths.empty())) {
+			auto sub = batch->paths.empty();
+			auto& queue = sub ? batch->sub_paths : batch->paths;
+			auto path = std::move(queue.front());
+			queue.pop_front();
+			lock.unlock();
+			auto settled = [this, batch]() { rewatch_pump(batch, 1); };
+			auto registered = sub ?
+				rewatch(batch->generation, path, rewatch_sub_pending_, watch_sub_record_, watch_type::watch_sub_path,
+					[&](watch_sub_cb&& cb) { register_sub_watch(path, std::move(cb), std::move(settled)); }) :
+				rewatch(batch->generation, path, rewatch_pending_, watch_record_, watch_type::watch_path,
+					[&](watch_stat_cb&& cb) { register_watch(path, std::move(cb), std::move(settled)); });
+			lock.lock();
+			if (registered) {
+				batch->credits--;
+			}
+		}
+		batch->pumping = false;
 	}
 
-	/**
-	 * @brief Async remove the watch, the path event will not be triggered.
-	 * @param path The target path
-	 * @param type Watch type, path or sub-path
-	 * @param callback
-	 */
-	void async_remove_watches(std::string_view path, watch_type type, operate_cb callback) {
-		ConfigType::async_remove_watches(path, static_cast<int>(type),
-			[this, type, p = std::string(path), cb = std::move(callback)](auto ec) {		
-			if (type == watch_type::watch_path) {
-				std::unique_lock<std::mutex> lock(record_mtx_);
-				watch_record_.erase(p);
-			}
-			else { //sub-path
-				last_sub_path_.erase(p);
-				std::unique_lock<std::mutex> lock(record_mtx_);
-				watch_sub_record_.erase(p);
-			}
-			if (cb) {
-				cb(ec);
-			}
-		});
+	// Registers the current callback of path if its watch is still pending for this
+	// generation. A path removed or watched again meanwhile is skipped and costs no credit.
+	template <typename Callback, typename Register>
+	bool rewatch(uint64_t generation, const std::string& path, std::unordered_set<std::string>& pending,
+		const std::unordered_map<std::string, Callback>& records, watch_type type, Register&& reg) {
+		std::unique_lock<std::mutex> lock(record_mtx_);
+		auto it = records.find(path);
+		if (generation != rewatch_generation_ || !pending.erase(path) || it == records.end()) {
+			return false;
+		}
+		auto cb = it->second;
+		lock.unlock();
+		reg(std::move(cb));
+
+		// removed while being registered: the removal may have reached the server first
+		lock.lock();
+		auto removed = records.find(path) == records.end();
+		lock.unlock();
+		if (removed) {
+			ConfigType::async_remove_watches(path, static_cast<int>(type), [](auto) {});
+		}
+		return true;
 	}
 
-	/**
-	 * @brief Get self ip with the session
-	 * @return Self ip
-	 */
-	auto client_ip() {
-		if constexpr (has_get_client_ip_v<ConfigType>) {
-			return ConfigType::get_client_ip();
+	static int64_t epoch_us(std::chrono::system_clock::time_point t) {
+		return std::chrono::duration_cast<std::chrono::microseconds>(t.time_since_epoch()).count();
+	}
+
+	// cb lives in the watch, which outlives every read it starts
+	void read_changed(const std::string& path, const watch_stat_cb& cb,
+		std::chrono::system_clock::time_point received) {
+		if constexpr (has_async_get_path_stat_v<ConfigType>) {
+			ConfigType::async_get_path_stat(path, [this, &cb, path, received](
+				const auto& ec, auto&& val, const auto& st) {
+				if (ec) {
+					return;
+				}
+				node_stat stat{ st.czxid, st.mzxid, st.ctime, st.mtime, st.version, st.cversion,
+					st.aversion, st.ephemeralOwner, st.dataLength, st.numChildren, st.pzxid };
+				record_event(path_event::changed, false, path, path, val);
+				if (!tracer_.enabled() || received == std::chrono::system_clock::time_point{}) {
+					cb(path_event::changed, std::move(val), stat);
+					return;
+				}
+				auto start = std::chrono::system_clock::now();
+				cb(path_event::changed, std::move(val), stat);
+				tracer_.record({ path, stat.mzxid, stat.mtime * 1000, epoch_us(received),
+					epoch_us(start), epoch_us(std::chrono::system_clock::now()) });
+			});
+		}
+		else {
+			ConfigType::async_get_path_value(path, [this, &cb, path](const auto& ec, auto, auto, auto&& val) {
+				if (!ec) {
+					record_event(path_event::changed, false, path, path, val);
+					cb(path_event::changed, std::move(val), node_stat{});
+				}
+			});
+		}
+	}
+
+	void record_event(path_event eve, bool sub_path, std::string_view watch, std::string_view path,
+		const std::optional<std::string>& value) {
+		if (recorder_.enabled()) {
+			recorder_.record(eve, sub_path, watch, path, value);
 		}
 	}
 
-private:
 	template <typename F, typename Tuple, std::size_t... I>
 	constexpr void callable(F&& f, Tuple&& tuple, std::index_sequence<I...>) {
 		f(std::get<I>(std::forward<Tuple>(tuple))...);
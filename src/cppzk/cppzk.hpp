@@ -9,6 +9,7 @@
 #include "netinet/in.h"
 #endif
 
+#include <array>
 #include <atomic>
 #include <chrono>
 #include <condition_variable>
@@ -19,14 +20,21 @@
 #include <thread>
 #include <type_traits>
 #include <unordered_map>
+#include <utility>
 #include "cppzk_redeclare.h"
+#include "alloc_stats.hpp"
+#include "metrics.hpp"
+#include "probes.hpp"
 
 namespace zk {
 class cppzk {
 private:
 	zhandle_t* zh_{};
+	// Held to swap zh_ and by the stats readers, which may run on a scrape thread
+	// while an expired session is replaced. They see a live handle or none.
+	mutable std::mutex handle_mtx_;
 	std::string hosts_;
-	int unused_flags_ = 0;
+	int flags_ = 0;
 	std::string schema_;
 	std::string credential_;
 	std::string cert_;
@@ -40,17 +48,63 @@ private:
 	std::chrono::time_point<std::chrono::system_clock>
 		session_begin_timepoint_{ std::chrono::system_clock::now() };
 	std::atomic<bool> need_detect_ = false;
+	std::mutex detect_mtx_;
+	std::condition_variable detect_cv_;
+	bool wake_detect_ = false;  // the session expired, check now rather than at the next tick
 	expired_callback expired_cb_ = []() { exit(0); };
 	std::once_flag of_;
 	std::atomic<bool> is_conntected_ = false;
 
+	// single-flight reads: callers of a path whose read is in flight wait for its result
+	using read_waiter = std::function<void(const std::error_code&, std::optional<std::string>&&)>;
+	struct inflight_read {
+		uint64_t write_seq = 0;  // write_seq_ when the read was sent
+		std::vector<read_waiter> waiters;
+	};
+	using inflight_map = std::unordered_map<std::string, inflight_read>;
+	enum class read_role { leader, joined, alone };
+	std::mutex inflight_mtx_;
+	inflight_map inflight_async_;
+	inflight_map inflight_sync_;
+	std::atomic<uint64_t> write_seq_ = 0;
+	std::atomic<uint64_t> coalesced_reads_ = 0;
+	std::atomic<size_t> sync_reads_ = 0;  // get_path_value calls in flight
+
+	// in-flight limit of the async calls, see set_inflight_limit
+	enum class slot { owned, shared, rejected };
+	std::mutex limit_mtx_;
+	std::condition_variable limit_cv_;
+	std::atomic<size_t> inflight_limit_ = 0;
+	zk_backpressure backpressure_ = zk_backpressure::block;
+	ready_callback ready_cb_;
+	bool ready_pending_ = false;
+	std::atomic<int64_t> inflight_ops_ = 0;
+	std::atomic<int64_t> waiting_ops_ = 0;
+	std::atomic<uint64_t> throttled_ops_ = 0;
+	static inline thread_local int nested_ops_ = 0;  // public async calls running on this thread
+
+	// session metrics, see register_metrics
+	static constexpr std::array<const char*, 7> session_state_names_{
+		"connecting", "associating", "connected", "readonly", "expired", "auth_failed", "not_connected" };
+	std::array<std::atomic<uint64_t>, 7> session_transitions_{};
+	std::atomic<uint64_t> reconnects_ = 0;
+	std::atomic<uint64_t> expirations_ = 0;
+	std::atomic<bool> connected_once_ = false;  // by the current handle
+	int rewatch_chunk_bytes_ = 0;  // see set_rewatch_limits
+	int rewatch_window_ = 0;
+	cm::metrics_registry* metrics_ = nullptr;
+
 public:
 	cppzk(const cppzk&) = delete;
 	cppzk& operator=(const cppzk&) = delete;
 	cppzk() = default;
 
 	~cppzk() {
+		if (metrics_) {
+			metrics_->remove(this);
+		}
 		run_ = false;
+		wake_detect();
 		if (detect_expired_thread_.joinable()) {
 			detect_expired_thread_.join();
 		}
@@ -65,24 +119,28 @@ public:
 
 	// If enable ssl, param cert like this "server.crt,client.crt,client.pem,passwd"
 	// Or defualt value disbale ssl
+	// flags go to zookeeper_init, e.g. ZOO_SHARED_IO | ZOO_COMPLETION_THREADS(4)
 	void initialize(std::string_view hosts, int session_timeout_ms, std::string_view schema = "",
-		std::string_view credential = "", const char* cert = "", int unused_flags = 0) {
+		std::string_view credential = "", const char* cert = "", int flags = 0) {
 		hosts_ = hosts;
 		session_timeout_ms_ = session_timeout_ms;
 		schema_ = schema;
 		credential_ = credential;
 		cert_ = cert;
-		unused_flags_ = unused_flags;
+		flags_ = flags;
 		connect_server();
 		std::call_once(of_, [this]() { detect_expired_session(); });
 	}
 
 	std::error_code clear_resource() {
-		return make_ec(zookeeper_close(zh_));
+		std::unique_lock<std::mutex> lock(handle_mtx_);
+		auto zh = std::exchange(zh_, nullptr);
+		lock.unlock();
+		return make_ec(zookeeper_close(zh));
 	}
 
 	std::error_code handle_state() {
-		return make_ec(zoo_state(zh_));
+		return make_ec(with_handle(zoo_state));
 	}
 
 	void set_log_level(zk_loglevel level) {
@@ -106,6 +164,7 @@ public:
 
 	auto create_path(std::string_view path, const std::optional<std::string>& value,
 		zk_create_mode mode, int64_t ttl = -1, zk_acl acl = zk_acl::zk_open_acl_unsafe) {
+		write_done done{ write_seq_ };
 		bool enable_ttl = false;
 		if (mode == zk_create_mode::zk_persistent_sequential_with_ttl ||
 			mode == zk_create_mode::zk_persistent_with_ttl) {
@@ -135,6 +194,7 @@ public:
 	void async_create_path(std::string_view path, std::optional<std::string> value,
 		zk_create_mode mode, create_callback ccb, int64_t ttl = -1,
 		zk_acl acl = zk_acl::zk_open_acl_unsafe) {
+		ccb = after_write(std::move(ccb));
 		bool enable_ttl = false;
 		if (mode == zk_create_mode::zk_persistent_sequential_with_ttl ||
 			mode == zk_create_mode::zk_persistent_with_ttl) {
@@ -143,20 +203,29 @@ public:
 		if (enable_ttl && ttl < 0) {
 			throw std::runtime_error("enable_ttl, ttl must > 0");
 		}
+		if (!admit(ccb)) {
+			return;
+		}
 
 		auto sp_path = split_path(path);
 		if (sp_path.size() == 1) { //just 1 depth
 			auto val_ptr = !value.has_value() ? nullptr : value.value().data();
 			auto val_len = !value.has_value() ? -1 : (int)value.value().length();
 			auto ud = new create_callback{ std::move(ccb) };
-			zoo_acreate2_ttl(zh_, path.data(), val_ptr, val_len, &acl_mapping[acl], (int)mode, ttl,
-				[](int rc, const char* str, const struct Stat*, const void* data) {
+			string_stat_completion_t completion = [](int rc, const char* str, const struct Stat*,
+				const void* data) {
+				cm::alloc_scope scope(cm::alloc_op::create);
 				auto cb = (create_callback*)data;
 				if ((*cb)) {
 					(*cb)(make_ec(rc), str == nullptr ? std::string{} : std::string(str));
 				}
 				delete cb;
-			}, ud);
+			};
+			auto rc = zoo_acreate2_ttl(zh_, path.data(), val_ptr, val_len, &acl_mapping[acl],
+				(int)mode, ttl, completion, ud);
+			if (rc != ZOO_ERRORS::ZOK) {
+				completion(rc, nullptr, nullptr, ud);
+			}
 			return;
 		}
 
@@ -170,7 +239,9 @@ public:
 			cppzk* self;
 			string_stat_completion_t completion;
 		};
-		auto completion = [](int rc, const char* str, const struct Stat*, const void* data) {
+		string_stat_completion_t completion = [](int rc, const char* str, const struct Stat*,
+			const void* data) {
+			cm::alloc_scope scope(cm::alloc_op::create);
 			auto cud = (create_userdata*)data;
 			auto& cb = cud->callback;
 			auto& sp_path = cud->split_paths;
@@ -198,11 +269,15 @@ public:
 		std::string first_layer = sp_path[0];
 		auto cud = new create_userdata{ split_path(path),
 			std::move(value), mode, std::move(ccb), ttl, acl, this, completion };
-		zoo_acreate2_ttl(zh_, first_layer.data(), nullptr, -1, &acl_mapping[acl], ZOO_PERSISTENT, -1,
-			completion, cud);
+		auto rc = zoo_acreate2_ttl(zh_, first_layer.data(), nullptr, -1, &acl_mapping[acl],
+			ZOO_PERSISTENT, -1, completion, cud);
+		if (rc != ZOO_ERRORS::ZOK) {
+			completion(rc, nullptr, nullptr, cud);
+		}
 	}
 
 	auto delete_path(std::string_view path) {
+		write_done done{ write_seq_ };
 		std::deque<std::string> sub_paths;
 		auto ec = recursive_get_sub_path(path, sub_paths);
 		if (ec) {
@@ -219,13 +294,19 @@ public:
 	}
 
 	void async_delete_path(std::string_view path, operate_cb cb) {
+		cb = after_write(std::move(cb));
+		if (!admit(cb)) {
+			return;
+		}
+		op_scope scope;
 		struct usrdata {
 			operate_cb callback;
 			std::deque<std::string> subs;
 			cppzk* self;
 			void_completion_t completion;
 		};
-		auto completion = [](int rc, const void* data) {
+		void_completion_t completion = [](int rc, const void* data) {
+			cm::alloc_scope scope(cm::alloc_op::del);
 			auto ud = (usrdata*)data;
 			ud->subs.pop_front();
 			if (rc || ud->subs.empty()) {
@@ -247,28 +328,304 @@ public:
 			subs.emplace_back(std::move(prefix));
 			std::string first_path = subs[0];
 			auto data = new usrdata{ std::move(cb), std::move(subs), this, completion };
-			zoo_adelete(zh_, first_path.data(), -1, completion, data);
+			auto rc = zoo_adelete(zh_, first_path.data(), -1, completion, data);
+			if (rc != ZOO_ERRORS::ZOK) {
+				completion(rc, data);
+			}
 		});
 	}
 
 	auto set_path_value(std::string_view path, std::string_view value) {
+		write_done done{ write_seq_ };
 		auto rc = zoo_set2(zh_, path.data(), value.data(), (int)value.length(), -1, nullptr);
 		return make_ec(rc);
 	}
 
 	void async_set_path_value(std::string_view path, std::string_view value, operate_cb cb) {
+		cb = after_write(std::move(cb));
+		if (!admit(cb)) {
+			return;
+		}
 		auto data = new operate_cb{ std::move(cb) };
-		zoo_aset(zh_, path.data(), value.data(), (int)value.length(), -1,
-			[](int rc, const struct Stat*, const void* data) {
+		stat_completion_t completion = [](int rc, const struct Stat*, const void* data) {
+			cm::alloc_scope scope(cm::alloc_op::set);
 			auto cb = (operate_cb*)data;
 			if ((*cb)) {
 				(*cb)(make_ec(rc));
 			}
 			delete cb;
-		}, data);
+		};
+		auto rc = zoo_aset(zh_, path.data(), value.data(), (int)value.length(), -1,
+			completion, data);
+		if (rc != ZOO_ERRORS::ZOK) {
+			completion(rc, nullptr, data);
+		}
 	}
 
+	// Concurrent calls for the same path share one read. A call while no other is
+	// in flight has nobody to share with and reads without registering.
 	auto get_path_value(std::string_view path) {
+		struct sync_read_guard {
+			std::atomic<size_t>& reads;
+			~sync_read_guard() { reads--; }
+		} guard{ sync_reads_ };
+		if (sync_reads_++ == 0) {
+			return read_path_value(path);
+		}
+
+		using result = std::tuple<std::error_code, std::optional<std::string>>;
+		std::promise<result> pro;
+		read_waiter waiter = [&pro](const std::error_code& ec, std::optional<std::string>&& val) {
+			pro.set_value(result(ec, std::move(val)));
+		};
+		auto role = join_read(inflight_sync_, path, waiter);
+		if (role == read_role::alone) {
+			return read_path_value(path);
+		}
+		if (role == read_role::leader) {
+			auto [ec, val] = read_path_value(path);
+			finish_read(inflight_sync_, std::string(path), ec, std::move(val));
+		}
+		return pro.get_future().get();
+	}
+
+	uint64_t coalesced_reads() const {
+		return coalesced_reads_;
+	}
+
+	// Caps the async calls waiting for a response, 0 means no limit.
+	// Calls made on the completion thread are counted but never held back.
+	void set_inflight_limit(size_t limit, zk_backpressure policy = zk_backpressure::block,
+		ready_callback ready_cb = {}) {
+		std::unique_lock<std::mutex> lock(limit_mtx_);
+		inflight_limit_ = limit;
+		backpressure_ = policy;
+		ready_cb_ = std::move(ready_cb);
+		auto ready = take_ready();
+		lock.unlock();
+		limit_cv_.notify_all();
+		if (ready) {
+			ready();
+		}
+	}
+
+	int64_t inflight_ops() const {
+		return inflight_ops_;
+	}
+
+	int64_t waiting_ops() const {
+		return waiting_ops_;
+	}
+
+	uint64_t throttled_ops() const {
+		return throttled_ops_;
+	}
+
+	// Packet size and window of the SetWatches replayed after a reconnect, 0 keeps
+	// the C client's default. Kept for the handles of later sessions too.
+	void set_rewatch_limits(int chunk_bytes, int window) {
+		rewatch_chunk_bytes_ = chunk_bytes;
+		rewatch_window_ = window;
+		with_handle([=](zhandle_t* zh) { return zoo_set_rewatch_limits(zh, chunk_bytes, window); });
+	}
+
+	// Watch replay timings of the current session, durations in microseconds
+	zoo_rewatch_stats rewatch_stats() const {
+		zoo_rewatch_stats stats{};
+		with_handle([&stats](zhandle_t* zh) { return zoo_get_rewatch_stats(zh, &stats); });
+		return stats;
+	}
+
+	// Recorded by the C client without locks, a new session starts from zero
+	latency_histogram latency(zk_op op, zk_latency_phase phase, bool reset = false) const {
+		latency_histogram hist{};
+		with_handle([&](zhandle_t* zh) {
+			return zoo_get_latency(zh, static_cast<int>(op), static_cast<int>(phase), &hist, reset);
+		});
+		return hist;
+	}
+
+	// Adds the session, watch and queue metrics of this handle to a registry, labels like
+	// `instance="a"` tell handles apart. The series are removed with the cppzk, so the
+	// registry must outlive it.
+	void register_metrics(cm::metrics_registry& registry, std::string_view labels = "") {
+		if (metrics_) {
+			metrics_->remove(this);
+		}
+		metrics_ = &registry;
+		auto with = [labels = std::string(labels)](const std::string& label) {
+			return labels.empty() ? label : labels + "," + label;
+		};
+		auto counter = [](const std::atomic<uint64_t>& v) {
+			return [&v] { return (double)v.load(std::memory_order_relaxed); };
+		};
+		auto queue = [this](int32_t zoo_queue_stats::*field) {
+			return [this, field] {
+				zoo_queue_stats stats{};
+				with_handle([&stats](zhandle_t* zh) { return zoo_get_queue_stats(zh, &stats); });
+				return (double)(stats.*field);
+			};
+		};
+		auto rewatch = [this](int64_t zoo_rewatch_stats::*field, double scale) {
+			return [this, field, scale] { return (double)(rewatch_stats().*field) * scale; };
+		};
+		using cm::metric_type;
+
+		for (size_t i = 0; i < session_state_names_.size(); ++i) {
+			registry.add("zk_session_transitions_total", "Session events by the state entered",
+				metric_type::counter, with(std::string("state=\"") + session_state_names_[i] + "\""),
+				counter(session_transitions_[i]), this);
+		}
+		registry.add("zk_reconnects_total", "Connections re-established within a session",
+			metric_type::counter, labels, counter(reconnects_), this);
+		registry.add("zk_session_expirations_total", "Sessions expired by the server",
+			metric_type::counter, labels, counter(expirations_), this);
+		registry.add("zk_session_state", "zoo_state of the current handle",
+			metric_type::gauge, labels, [this] { return (double)with_handle(zoo_state); }, this);
+
+		registry.add("zk_watches", "Watched paths by watch type", metric_type::gauge,
+			with("type=\"data\""), queue(&zoo_queue_stats::data_watches), this);
+		registry.add("zk_watches", "Watched paths by watch type", metric_type::gauge,
+			with("type=\"exist\""), queue(&zoo_queue_stats::exist_watches), this);
+		registry.add("zk_watches", "Watched paths by watch type", metric_type::gauge,
+			with("type=\"child\""), queue(&zoo_queue_stats::child_watches), this);
+		registry.add("zk_watch_callbacks", "Persistent watch callbacks held by cppzk",
+			metric_type::gauge, labels, [this] {
+				std::lock_guard<std::mutex> lock(mtx_);
+				return (double)releaser_.size();
+			}, this);
+
+		registry.add("zk_rewatch_replays_total", "Watch replays completed after reconnects",
+			metric_type::counter, labels, rewatch(&zoo_rewatch_stats::replays, 1), this);
+		registry.add("zk_rewatch_duration_seconds_total", "Time spent replaying watches",
+			metric_type::counter, labels, rewatch(&zoo_rewatch_stats::total_duration, 1e-6), this);
+		registry.add("zk_rewatch_last_duration_seconds", "Duration of the last watch replay",
+			metric_type::gauge, labels, rewatch(&zoo_rewatch_stats::last_duration, 1e-6), this);
+		registry.add("zk_rewatch_max_duration_seconds", "Longest watch replay of the session",
+			metric_type::gauge, labels, rewatch(&zoo_rewatch_stats::max_duration, 1e-6), this);
+
+		registry.add("zk_outstanding_requests", "Requests waiting for a response",
+			metric_type::gauge, labels, queue(&zoo_queue_stats::outstanding), this);
+		registry.add("zk_completion_queue_depth", "Responses and events waiting for the completion thread",
+			metric_type::gauge, labels, queue(&zoo_queue_stats::completions), this);
+		registry.add("zk_inflight_ops", "Async calls holding an in-flight slot",
+			metric_type::gauge, labels, [this] { return (double)inflight_ops_.load(); }, this);
+		registry.add("zk_waiting_ops", "Async calls blocked by the in-flight limit",
+			metric_type::gauge, labels, [this] { return (double)waiting_ops_.load(); }, this);
+		registry.add("zk_throttled_ops_total", "Async calls rejected by the in-flight limit",
+			metric_type::counter, labels, counter(throttled_ops_), this);
+		registry.add("zk_coalesced_reads_total", "Reads served by another caller's request",
+			metric_type::counter, labels, counter(coalesced_reads_), this);
+	}
+
+private:
+	void count_session_state(int state) {
+		static const std::array<int, 7> states{ ZOO_CONNECTING_STATE, ZOO_ASSOCIATING_STATE,
+			ZOO_CONNECTED_STATE, ZOO_READONLY_STATE, ZOO_EXPIRED_SESSION_STATE, ZOO_AUTH_FAILED_STATE,
+			ZOO_NOTCONNECTED_STATE };
+		auto it = std::find(states.begin(), states.end(), state);
+		if (it != states.end()) {
+			session_transitions_[(size_t)(it - states.begin())].fetch_add(1, std::memory_order_relaxed);
+		}
+		if (state == ZOO_CONNECTED_STATE && connected_once_.exchange(true)) {
+			reconnects_.fetch_add(1, std::memory_order_relaxed);
+		}
+		if (state == ZOO_EXPIRED_SESSION_STATE) {
+			expirations_.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+
+	// Without a live handle the C calls see NULL, the stats read as zero
+	template <typename Fn>
+	int with_handle(Fn&& fn) const {
+		std::lock_guard<std::mutex> lock(handle_mtx_);
+		return fn(zh_);
+	}
+
+	bool below_limit() const {
+		auto limit = inflight_limit_.load();
+		return limit == 0 || (size_t)inflight_ops_.load() < limit;
+	}
+
+	// call with limit_mtx_ held
+	ready_callback take_ready() {
+		if (!ready_pending_ || !below_limit()) {
+			return {};
+		}
+		ready_pending_ = false;
+		return ready_cb_;
+	}
+
+	slot acquire_slot() {
+		if (nested_ops_ > 0) {
+			return slot::shared;
+		}
+		if (inflight_limit_ == 0 || zoo_is_completion_thread(zh_)) {
+			inflight_ops_++;
+			return slot::owned;
+		}
+
+		std::unique_lock<std::mutex> lock(limit_mtx_);
+		if (!below_limit()) {
+			if (backpressure_ != zk_backpressure::block) {
+				ready_pending_ = backpressure_ == zk_backpressure::notify;
+				throttled_ops_++;
+				return slot::rejected;
+			}
+			waiting_ops_++;
+			limit_cv_.wait(lock, [this] { return below_limit(); });
+			waiting_ops_--;
+		}
+		inflight_ops_++;
+		return slot::owned;
+	}
+
+	void release_slot() {
+		inflight_ops_--;
+		if (inflight_limit_ == 0 && waiting_ops_ == 0) {
+			return;
+		}
+		std::unique_lock<std::mutex> lock(limit_mtx_);
+		auto ready = take_ready();
+		lock.unlock();
+		limit_cv_.notify_one();
+		if (ready) {
+			ready();
+		}
+	}
+
+	// Takes a slot for a public async call. A rejected call is completed here,
+	// otherwise cb gives the slot back the first time it is called.
+	template<typename... Args>
+	bool admit(std::function<void(const std::error_code&, Args...)>& cb) {
+		auto s = acquire_slot();
+		if (s == slot::rejected) {
+			if (cb) {
+				cb(make_ec(ZOO_ERRORS::ZTHROTTLEDOP), std::decay_t<Args>{}...);
+			}
+			return false;
+		}
+		if (s == slot::owned) {
+			cb = [cb = std::move(cb), this, released = std::make_shared<std::atomic<bool>>(false)](
+				const std::error_code& ec, Args... args) {
+				if (!released->exchange(true)) {
+					release_slot();
+				}
+				if (cb) {
+					cb(ec, std::forward<Args>(args)...);
+				}
+			};
+		}
+		return true;
+	}
+
+	// Public async calls made inside another one share its slot
+	struct op_scope {
+		op_scope() { nested_ops_++; }
+		~op_scope() { nested_ops_--; }
+	};
+
+	std::tuple<std::error_code, std::optional<std::string>> read_path_value(std::string_view path) {
 		constexpr int size = 1024;
 		char buf[size]{};
 		int len = size;
@@ -279,6 +636,7 @@ public:
 		}
 
 		auto real_len = stat.dataLength;
+		cm::alloc_stats::on_copy((size_t)real_len);
 		if (real_len <= size) {
 			auto val = std::string{ buf, (size_t)real_len };
 			return std::make_tuple(make_ec(rc), std::optional<std::string>(std::move(val)));
@@ -294,13 +652,76 @@ public:
 		return std::make_tuple(make_ec(rc), std::optional<std::string>(std::move(value)));
 	}
 
+	// write_seq_ moves once a write has completed, so a read sent while it was in flight,
+	// which may have missed it, is not joined by anyone who saw it complete
+	struct write_done {
+		std::atomic<uint64_t>& seq;
+		~write_done() { seq++; }
+	};
+
+	template <typename Callback>
+	Callback after_write(Callback cb) {
+		return [this, cb = std::move(cb)](auto&&... args) {
+			write_seq_++;
+			if (cb) {
+				cb(std::forward<decltype(args)>(args)...);
+			}
+		};
+	}
+
+	// Attaches waiter to the read of path in flight, or makes the caller the
+	// leader that sends it. A read sent before the latest write completed is not joined,
+	// so a caller always sees its own writes.
+	read_role join_read(inflight_map& reads, std::string_view path, read_waiter& waiter) {
+		std::lock_guard<std::mutex> lock(inflight_mtx_);
+		auto seq = write_seq_.load();
+		auto [it, inserted] = reads.try_emplace(std::string(path));
+		if (inserted) {
+			it->second.write_seq = seq;
+		}
+		else if (it->second.write_seq != seq) {
+			return read_role::alone;
+		}
+		else {
+			coalesced_reads_++;
+		}
+		it->second.waiters.push_back(std::move(waiter));
+		return inserted ? read_role::leader : read_role::joined;
+	}
+
+	void finish_read(inflight_map& reads, const std::string& path,
+		const std::error_code& ec, std::optional<std::string>&& val) {
+		std::unique_lock<std::mutex> lock(inflight_mtx_);
+		auto node = reads.extract(path);
+		lock.unlock();
+		if (node.empty()) {
+			return;
+		}
+		auto& waiters = node.mapped().waiters;
+		for (size_t i = 0; i + 1 < waiters.size(); ++i) {
+			cm::alloc_stats::on_copy(val ? val->size() : 0);
+			auto copy = val;
+			waiters[i](ec, std::move(copy));
+		}
+		if (!waiters.empty()) {
+			waiters.back()(ec, std::move(val));
+		}
+	}
+
+public:
+
 	template<bool Advanced = false>
 	void async_get_path_value(std::string_view path, get_callback cb) {
+		if (!admit(cb)) {
+			return;
+		}
 		auto wfn = [](zhandle_t*, int eve, int, const char* path, void* watcherCtx) {
 			auto d = static_cast<wget_userdata*>(watcherCtx);
 			if (eve == ZOO_SESSION_EVENT) {
 				return;  // deal in zookeeper_init watcher
 			}
+			cm::alloc_scope scope(cm::alloc_op::watch_event);
+			CM_PROBE3(cppzk, watch_fired, watcherCtx, path, eve);
 			if (eve == ZOO_DELETED_EVENT) {
 				d->cb(make_ec(ZOO_ERRORS::ZNONODE),
 					(zk_event)ZOO_DELETED_EVENT, path, std::optional<std::string>{});
@@ -309,13 +730,21 @@ public:
 				return;
 			}
 			d->path = path;
+			cm::alloc_stats::on_copy(d->path.size());
 			d->eve = (zk_event)eve;
-			zoo_awget(d->self->zh_, path, d->wfn, watcherCtx, d->completion, watcherCtx);
+			zoo_awget_view(d->self->zh_, path, d->wfn, watcherCtx, d->completion, watcherCtx);
 		};
-		auto gcb = [](int rc, const char* val, int len, const struct Stat*, const void* data) {
+		// val points into the receive buffer, this is the only copy of the value
+		auto gcb = [](int rc, const char* val, int len, const struct Stat*, zoo_data_view*,
+			const void* data) {
 			auto d = (wget_userdata*)data;
+			cm::alloc_scope scope(cm::alloc_op::watch_event);
+			cm::alloc_stats::on_copy(val ? (size_t)len : 0);
+			CM_PROBE3(cppzk, value_read, data, d->path.c_str(), val ? len : -1);
+			CM_PROBE3(cppzk, watch_callback_start, data, (int)d->eve, rc);
 			d->cb(make_ec(rc), d->eve, d->path,
 				val ? std::string(val, len) : std::optional<std::string>{});
+			CM_PROBE3(cppzk, watch_callback_done, data, (int)d->eve, rc);
 			if constexpr (!Advanced) {
 				delete d;
 			}
@@ -323,33 +752,147 @@ public:
 
 		if constexpr (Advanced) {
 			auto data = std::make_shared<wget_userdata>(wfn, gcb, std::move(cb), this, path);
-			zoo_awget(zh_, path.data(), wfn, data.get(), gcb, data.get());
+			cm::alloc_stats::on_copy(path.size());
+			auto rc = zoo_awget_view(zh_, path.data(), wfn, data.get(), gcb, data.get());
+			if (rc != ZOO_ERRORS::ZOK) {
+				gcb(rc, nullptr, -1, nullptr, nullptr, data.get());
+				return;
+			}
 			std::lock_guard<std::mutex> lock(mtx_);
 			releaser_.emplace((uint64_t)data.get(), std::move(data));
 		}
 		else {
-			auto data = new wget_userdata(wfn, gcb, std::move(cb), this, path);
-			zoo_awget(zh_, path.data(), nullptr, nullptr, gcb, data);
+			async_read_path_value(path, std::move(cb));
+		}
+	}
+
+	// Concurrent calls for the same path share one read
+	void async_read_path_value(std::string_view path, get_callback cb) {
+		struct read_userdata {
+			cppzk* self;
+			std::string path;
+			read_waiter waiter;  // empty for a leader, its waiter is in inflight_async_
+			cm::alloc_op op;     // the completion is charged to what issued the read
+		};
+		read_waiter waiter = [cb = std::move(cb), p = std::string(path)](
+			const std::error_code& ec, std::optional<std::string>&& val) {
+			cb(ec, zk_event::zk_dummy_event, p, std::move(val));
+		};
+		auto role = join_read(inflight_async_, path, waiter);
+		if (role == read_role::joined) {
+			return;
+		}
+
+		// val points into the receive buffer, this is the only copy of the value
+		auto completion = [](int rc, const char* val, int len, const struct Stat*, zoo_data_view*,
+			const void* data) {
+			auto ud = (read_userdata*)data;
+			cm::alloc_scope scope(ud->op);
+			cm::alloc_stats::on_copy(val ? (size_t)len : 0);
+			auto value = val ? std::optional<std::string>(std::string(val, len)) : std::nullopt;
+			if (ud->waiter) {
+				ud->waiter(make_ec(rc), std::move(value));
+			}
+			else {
+				ud->self->finish_read(ud->self->inflight_async_, ud->path, make_ec(rc), std::move(value));
+			}
+			delete ud;
+		};
+		auto ud = new read_userdata{ this, std::string(path),
+			role == read_role::alone ? std::move(waiter) : read_waiter{},
+			cm::alloc_stats::current_or(cm::alloc_op::get) };
+		auto rc = zoo_aget_view(zh_, path.data(), 0, completion, ud);
+		if (rc != ZOO_ERRORS::ZOK) {
+			completion(rc, nullptr, -1, nullptr, nullptr, ud);
+		}
+	}
+
+	// The value is lent from the receive buffer, see data_buffer
+	void async_get_path_view(std::string_view path, get_view_callback cb) {
+		if (!admit(cb)) {
+			return;
+		}
+		auto data = new get_view_callback{ std::move(cb) };
+		data_view_completion_t completion = [](int rc, const char* val, int len,
+			const struct Stat*, zoo_data_view* view, const void* data) {
+			auto cb = (get_view_callback*)data;
+			if ((*cb)) {
+				(*cb)(make_ec(rc), data_buffer(val, len, view));
+			}
+			delete cb;
+		};
+		auto rc = zoo_awget_view(zh_, path.data(), nullptr, nullptr, completion, data);
+		if (rc != ZOO_ERRORS::ZOK) {
+			completion(rc, nullptr, -1, nullptr, nullptr, data);
+		}
+	}
+
+	// The value and the Stat it was read with, e.g. to find the write behind a watch event
+	void async_get_path_stat(std::string_view path, get_stat_callback cb) {
+		if (!admit(cb)) {
+			return;
+		}
+		struct stat_userdata {
+			get_stat_callback cb;
+			cm::alloc_op op;
+		};
+		auto data = new stat_userdata{ std::move(cb), cm::alloc_stats::current_or(cm::alloc_op::get) };
+		data_view_completion_t completion = [](int rc, const char* val, int len,
+			const struct Stat* stat, zoo_data_view*, const void* data) {
+			auto ud = (stat_userdata*)data;
+			cm::alloc_scope scope(ud->op);
+			cm::alloc_stats::on_copy(val ? (size_t)len : 0);
+			if (ud->cb) {
+				ud->cb(make_ec(rc), val ? std::string(val, len) : std::optional<std::string>{},
+					stat ? *stat : Stat{});
+			}
+			delete ud;
+		};
+		auto rc = zoo_aget_view(zh_, path.data(), 0, completion, data);
+		if (rc != ZOO_ERRORS::ZOK) {
+			completion(rc, nullptr, -1, nullptr, nullptr, data);
 		}
 	}
 
 	// [create/delete/changed] event just for current path
 	void watch_path_event(std::string_view path, exists_callback cb) {
+		watch_path_event_timed(path, [cb = std::move(cb)](const std::error_code& ec, zk_event eve,
+			std::chrono::system_clock::time_point) {
+			if (cb) {
+				cb(ec, eve);
+			}
+		});
+	}
+
+	void watch_path_event_timed(std::string_view path, exists_timed_callback cb) {
+		if (!admit(cb)) {
+			return;
+		}
 		auto wfn = [](zhandle_t*, int eve, int, const char* path, void* watcherCtx) {
 			auto eud = (exists_userdata*)watcherCtx;
 			if (eve == ZOO_SESSION_EVENT) {
 				return;  // deal in zookeeper_init watcher
 			}
+			cm::alloc_scope scope(cm::alloc_op::watch_event);
+			CM_PROBE3(cppzk, watch_fired, watcherCtx, path, eve);
 			eud->eve = (zk_event)eve;
+			eud->received = std::chrono::system_clock::now();
 			zoo_awexists(eud->self->zh_, path, eud->wfn, watcherCtx, eud->completion, watcherCtx);
 		};
 		auto exists_completion = [](int rc, const struct Stat*, const void* data) {
 			auto d = (exists_userdata*)data;
-			d->cb(make_ec(rc), d->eve);
+			cm::alloc_scope scope(cm::alloc_op::watch_event);
+			CM_PROBE3(cppzk, watch_callback_start, data, (int)d->eve, rc);
+			d->cb(make_ec(rc), d->eve, d->received);
+			CM_PROBE3(cppzk, watch_callback_done, data, (int)d->eve, rc);
 		};
 
 		auto data = std::make_shared<exists_userdata>(wfn, exists_completion, std::move(cb), this);
-		zoo_awexists(zh_, path.data(), wfn, data.get(), exists_completion, data.get());
+		auto rc = zoo_awexists(zh_, path.data(), wfn, data.get(), exists_completion, data.get());
+		if (rc != ZOO_ERRORS::ZOK) {
+			exists_completion(rc, nullptr, data.get());
+			return;
+		}
 		std::lock_guard lock(mtx_);
 		releaser_.emplace((uint64_t)data.get(), std::move(data));
 	}
@@ -367,17 +910,23 @@ public:
 		sub_paths.reserve(count);
 		for (size_t i = 0; i < count; ++i) {
 			sub_paths.emplace_back(std::string(path) + "/" + std::string(strings.data[i]));
+			cm::alloc_stats::on_copy(sub_paths.back().size());
 		}
 		return std::make_tuple(make_ec(rc), std::move(sub_paths));
 	}
 
 	template<bool Advanced = false>
 	void async_get_sub_path(std::string_view path, get_children_callback cb) {
+		if (!admit(cb)) {
+			return;
+		}
 		auto wfn = [](zhandle_t*, int eve, int, const char* path, void* watcherCtx) {
 			auto d = static_cast<get_children_userdata*>(watcherCtx);
 			if (eve == ZOO_SESSION_EVENT) {
 				return;  // deal in zookeeper_init watcher
 			}
+			cm::alloc_scope scope(cm::alloc_op::watch_event);
+			CM_PROBE3(cppzk, watch_fired, watcherCtx, path, eve);
 			if (eve == ZOO_DELETED_EVENT) {
 				std::lock_guard<std::mutex> lock(d->self->mtx_);
 				d->self->releaser_.erase((uint64_t)watcherCtx);
@@ -387,12 +936,14 @@ public:
 		};
 		auto completion = [](int rc, const String_vector* strings, const Stat*, const void* data) {
 			auto d = (get_children_userdata*)data;
+			cm::alloc_scope scope(Advanced ? cm::alloc_op::watch_event : cm::alloc_op::children);
 			std::vector<std::string> children_path;
 			if (strings) {
 				size_t count = strings->count;
 				children_path.reserve(count);
 				for (size_t i = 0; i < count; ++i) {
 					children_path.emplace_back(std::string(strings->data[i]));
+					cm::alloc_stats::on_copy(children_path.back().size());
 				}
 			}
 			d->cb(make_ec(rc), std::move(children_path));
@@ -404,13 +955,20 @@ public:
 		if constexpr (Advanced) {
 			auto data = std::make_shared<get_children_userdata>(
 				wfn, completion, std::move(cb), this, path);
-			zoo_awget_children2(zh_, path.data(), wfn, data.get(), completion, data.get());
+			auto rc = zoo_awget_children2(zh_, path.data(), wfn, data.get(), completion, data.get());
+			if (rc != ZOO_ERRORS::ZOK) {
+				completion(rc, nullptr, nullptr, data.get());
+				return;
+			}
 			std::lock_guard<std::mutex> lock(mtx_);
 			releaser_.emplace((uint64_t)data.get(), std::move(data));
 		}
 		else {
 			auto data = new get_children_userdata(wfn, completion, std::move(cb), this, path);
-			zoo_awget_children2(zh_, path.data(), nullptr, nullptr, completion, data);
+			auto rc = zoo_awget_children2(zh_, path.data(), nullptr, nullptr, completion, data);
+			if (rc != ZOO_ERRORS::ZOK) {
+				completion(rc, nullptr, nullptr, data);
+			}
 		}
 	}
 
@@ -434,14 +992,17 @@ public:
 	// Be careful, maybe block the completion thread.
 	// Not the real async recursive, it is too difficult
 	void async_recursive_get_sub_path(std::string_view path, recursive_get_children_callback cb) {
+		if (!admit(cb)) {
+			return;
+		}
 		struct usrdata {
 			recursive_get_children_callback callback;
 			std::string prefix_path;
 			cppzk* self;
 		};
 		auto data = new usrdata{ std::move(cb), std::string(path), this };
-		zoo_awget_children2(zh_, path.data(), nullptr, nullptr,
-			[](int rc, const struct String_vector* strings, const struct Stat*, const void* data) {
+		strings_stat_completion_t completion = [](int rc, const struct String_vector* strings,
+			const struct Stat*, const void* data) {
 			auto ud = (usrdata*)data;
 			std::shared_ptr<void> guard(nullptr, [ud](auto) {delete ud; });
 			if (rc != ZOO_ERRORS::ZOK) {
@@ -469,7 +1030,11 @@ public:
 				subs.emplace_back(std::move(full));
 			}
 			ud->callback(make_ec(rc), std::move(subs));
-		}, data);
+		};
+		auto rc = zoo_awget_children2(zh_, path.data(), nullptr, nullptr, completion, data);
+		if (rc != ZOO_ERRORS::ZOK) {
+			completion(rc, nullptr, nullptr, data);
+		}
 	}
 
 	//TODO remove watch, should delete releaser_
@@ -496,6 +1061,10 @@ public:
 	}
 
 	void async_remove_watches(std::string_view path, int watch_type, operate_cb cb) {
+		if (!admit(cb)) {
+			return;
+		}
+		op_scope scope;
 		void_completion_t callback = [](int rc, const void* data) {
 			auto cb = (operate_cb*)data;
 			if ((*cb)) {
@@ -505,8 +1074,11 @@ public:
 		};
 		if (watch_type == 0) { //path
 			auto data = new operate_cb(std::move(cb));
-			zoo_aremove_all_watches(zh_, path.data(), ZWATCHTYPE_DATA, 0,
+			auto rc = zoo_aremove_all_watches(zh_, path.data(), ZWATCHTYPE_DATA, 0,
 				(void_completion_t*)callback, data);
+			if (rc != ZOO_ERRORS::ZOK) {
+				callback(rc, data);
+			}
 			return;
 		}
 
@@ -569,8 +1141,14 @@ private:
 		detect_expired_thread_ = std::thread([this]() {
 			while (run_) {
 				auto interval = session_timeout_ms_ / 5;
-				std::this_thread::sleep_for(std::chrono::milliseconds(
-					interval < 3000 ? interval : 3000));
+				std::unique_lock<std::mutex> wait_lock(detect_mtx_);
+				detect_cv_.wait_for(wait_lock, std::chrono::milliseconds(interval < 3000 ? interval : 3000),
+					[this] { return wake_detect_ || !run_; });
+				wake_detect_ = false;
+				wait_lock.unlock();
+				if (!run_) {
+					break;
+				}
 				if (need_detect_) {
 					// make network interaction
 					get_path_value("/zookeeper");
@@ -585,9 +1163,18 @@ private:
 		});
 	}
 
+	void wake_detect() {
+		std::lock_guard<std::mutex> lock(detect_mtx_);
+		wake_detect_ = true;
+		detect_cv_.notify_one();
+	}
+
 	void connect_server(const char* cert = "") {
 		auto watcher = [](zhandle_t*, int type, int state, const char*, void* watcherCtx) {
 			auto self = (cppzk*)(watcherCtx);
+			if (type == ZOO_SESSION_EVENT) {
+				self->count_session_state(state);
+			}
 			if (state == ZOO_CONNECTED_STATE && type == ZOO_SESSION_EVENT) {
 				self->is_conntected_ = true;
 				return;
@@ -595,18 +1182,25 @@ private:
 			if (state == ZOO_EXPIRED_SESSION_STATE && type == ZOO_SESSION_EVENT) {
 				self->need_detect_ = false;
 				self->is_conntected_ = false;
+				self->wake_detect();
 			}
 		};
+		connected_once_ = false;
 #ifdef HAVE_OPENSSL_H
-		zh_ = zookeeper_init_ssl(hosts_.c_str(), cert_.data(),
-			watcher, session_timeout_ms_, nullptr, this, 0);
+		auto zh = zookeeper_init_ssl(hosts_.c_str(), cert_.data(),
+			watcher, session_timeout_ms_, nullptr, this, flags_);
 #else
-		zh_ = zookeeper_init(hosts_.c_str(), watcher, session_timeout_ms_, nullptr, this, 0);
+		auto zh = zookeeper_init(hosts_.c_str(), watcher, session_timeout_ms_, nullptr, this, flags_);
 		(void)cert;
 #endif
+		{
+			std::lock_guard<std::mutex> lock(handle_mtx_);
+			zh_ = zh;
+		}
 		if (!zh_) {
 			throw std::runtime_error("zookeeper_init error");
 		}
+		zoo_set_rewatch_limits(zh_, rewatch_chunk_bytes_, rewatch_window_);
 
 		while (!is_conntected_ && run_) {
 			std::this_thread::sleep_for(std::chrono::milliseconds(10));
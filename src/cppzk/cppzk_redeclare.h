@@ -1,6 +1,8 @@
 #pragma once
+#include <chrono>
 #include <system_error>
 #include <optional>
+#include <string_view>
 #include "zookeeper.h"
 
 // redefine according to zookeeper origin define
@@ -64,34 +66,126 @@ using expired_callback = std::function<void()>;
 using create_callback = std::function<void(const std::error_code&, std::string&&)>;
 using operate_cb = std::function<void(const std::error_code&)>;
 using exists_callback = std::function<void(const std::error_code&, zk_event)>;
+// The time point is when the client got the event, zero for the first call
+using exists_timed_callback = std::function<void(
+    const std::error_code&, zk_event, std::chrono::system_clock::time_point)>;
 using get_callback = std::function<void(
     const std::error_code&, zk_event, std::string_view, std::optional<std::string>&&)>;
+using get_stat_callback = std::function<void(
+    const std::error_code&, std::optional<std::string>&&, const Stat&)>;
 using get_children_callback = std::function<void(
     const std::error_code&, std::vector<std::string>&&)>;
 using recursive_get_children_callback = std::function<void(
     const std::error_code&, std::deque<std::string>&&)>;
+using ready_callback = std::function<void()>;
+
+// What an async call does when the in-flight limit is reached
+enum class zk_backpressure {
+    block,      // wait for a free slot
+    fail_fast,  // complete the callback with ZTHROTTLEDOP
+    notify,     // like fail_fast, then call the ready callback once a slot is free
+};
+
+enum class zk_op {
+    create = ZOO_LATENCY_CREATE,
+    del = ZOO_LATENCY_DELETE,
+    exists = ZOO_LATENCY_EXISTS,
+    get_data = ZOO_LATENCY_GET_DATA,
+    set_data = ZOO_LATENCY_SET_DATA,
+    get_children = ZOO_LATENCY_GET_CHILDREN,
+    multi = ZOO_LATENCY_MULTI,
+    other = ZOO_LATENCY_OTHER,
+};
+
+enum class zk_latency_phase {
+    queue = ZOO_LATENCY_QUEUE,        // waiting to be written to the socket
+    rtt = ZOO_LATENCY_RTT,            // on the wire and in the server
+    dispatch = ZOO_LATENCY_DISPATCH,  // response waiting for the completion thread
+    callback = ZOO_LATENCY_CALLBACK,  // deserializing and running the callback
+};
+
+// Latencies in microseconds, bucketed with about 6% precision
+struct latency_histogram : zoo_latency_histogram {
+    int64_t percentile(double fraction) const {
+        return zoo_latency_percentile(this, fraction);
+    }
+    double mean() const {
+        return count ? (double)sum / (double)count : 0.0;
+    }
+};
+
+// A GetData value lent from the C client's receive buffer. It is only valid
+// inside the callback unless take() is called. A taken buffer may outlive the
+// session and the cppzk that produced it: it owns the response body of a value
+// larger than a receive chunk (64KB), and a copy of a smaller one.
+class data_buffer {
+public:
+    data_buffer() = default;
+    data_buffer(const char* value, int len, zoo_data_view* view)
+        : value_(value), len_(len < 0 ? 0 : (size_t)len), view_(view) {}
+    data_buffer(const data_buffer&) = delete;
+    data_buffer& operator=(const data_buffer&) = delete;
+    data_buffer(data_buffer&& other) noexcept { swap(other); }
+    data_buffer& operator=(data_buffer&& other) noexcept {
+        data_buffer(std::move(other)).swap(*this);
+        return *this;
+    }
+    ~data_buffer() { zoo_data_view_release(owner_); }
+
+    bool has_value() const { return value_ != nullptr; }
+    std::string_view view() const { return { value_, len_ }; }
+    std::string to_string() const { return std::string(view()); }
+
+    // Keep the bytes after the callback returns, in one block of their own
+    bool take() {
+        bool kept = true;
+        if (view_ && value_) {
+            owner_ = zoo_data_view_take(view_, &value_);
+            kept = owner_ != nullptr;
+            value_ = kept ? value_ : nullptr;
+            len_ = kept ? len_ : 0;
+        }
+        view_ = nullptr;
+        return kept;
+    }
+
+private:
+    void swap(data_buffer& other) noexcept {
+        std::swap(value_, other.value_);
+        std::swap(len_, other.len_);
+        std::swap(view_, other.view_);
+        std::swap(owner_, other.owner_);
+    }
+
+    const char* value_ = nullptr;
+    size_t len_ = 0;
+    zoo_data_view* view_ = nullptr;
+    void* owner_ = nullptr;
+};
+using get_view_callback = std::function<void(const std::error_code&, data_buffer&&)>;
 
 class cppzk;
 struct user_data {};
 struct exists_userdata : user_data {
     watcher_fn wfn;
     stat_completion_t completion;
-    exists_callback cb;
+    exists_timed_callback cb;
     cppzk* self;
     zk_event eve = zk_event::zk_dummy_event;
+    std::chrono::system_clock::time_point received{};
 
-    exists_userdata(watcher_fn f, stat_completion_t c, exists_callback callbback, cppzk* ptr)
+    exists_userdata(watcher_fn f, stat_completion_t c, exists_timed_callback callbback, cppzk* ptr)
         : wfn(f), completion(c), cb(std::move(callbback)), self(ptr) {}
 };
 struct wget_userdata : user_data {
     watcher_fn wfn;
-    data_completion_t completion;
+    data_view_completion_t completion;
     get_callback cb;
     cppzk* self;
     zk_event eve = zk_event::zk_dummy_event;
     std::string path;
 
-    wget_userdata(watcher_fn f, data_completion_t c,
+    wget_userdata(watcher_fn f, data_view_completion_t c,
                   get_callback callbback, cppzk* ptr, std::string_view p)
         : wfn(f), completion(c), cb(std::move(callbback)), self(ptr), path(p) {}
 };
@@ -0,0 +1,384 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+
+namespace cm {
+
+enum class path_event;
+
+/**
+ * @brief One event as config_monitor delivered it to a watch callback
+ */
+struct event_record {
+	int64_t time_us = 0;               // since the epoch
+	path_event event{};
+	bool sub_path = false;             // delivered to a watch_sub_path callback
+	std::string watch;                 // the path the callback was registered with
+	std::string path;                  // the path of the event, a child of watch for sub paths
+	std::optional<std::string> value;  // if recorded in full
+	uint64_t value_hash = 0;           // fnv-1a 64 of the value, 0 without one
+};
+
+inline uint64_t fnv1a(std::string_view data) {
+	uint64_t hash = 14695981039346656037ull;
+	for (auto c : data) {
+		hash = (hash ^ (uint8_t)c) * 1099511628211ull;
+	}
+	return hash;
+}
+
+/**
+ * @brief Bounded multi producer, single consumer queue, push never blocks
+ */
+template <typename T>
+class mpsc_ring {
+	struct cell {
+		std::atomic<size_t> seq;
+		T value;
+	};
+
+public:
+	/**
+	 * @param capacity Rounded up to a power of two
+	 */
+	explicit mpsc_ring(size_t capacity) {
+		size_t size = 2;
+		while (size < capacity) {
+			size <<= 1;
+		}
+		cells_.reset(new cell[size]);
+		mask_ = size - 1;
+		for (size_t i = 0; i < size; ++i) {
+			cells_[i].seq.store(i, std::memory_order_relaxed);
+		}
+	}
+
+	// false if full
+	bool push(T&& value) {
+		auto pos = head_.load(std::memory_order_relaxed);
+		for (;;) {
+			auto& c = cells_[pos & mask_];
+			auto diff = (intptr_t)c.seq.load(std::memory_order_acquire) - (intptr_t)pos;
+			if (diff == 0) {
+				if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					c.value = std::move(value);
+					c.seq.store(pos + 1, std::memory_order_release);
+					return true;
+				}
+			}
+			else if (diff < 0) {
+				return false;
+			}
+			else {
+				pos = head_.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	// only one thread may pop
+	bool pop(T& value) {
+		auto& c = cells_[tail_ & mask_];
+		if ((intptr_t)c.seq.load(std::memory_order_acquire) - (intptr_t)(tail_ + 1) < 0) {
+			return false;
+		}
+		value = std::move(c.value);
+		c.seq.store(tail_ + mask_ + 1, std::memory_order_release);
+		++tail_;
+		return true;
+	}
+
+private:
+	std::unique_ptr<cell[]> cells_;
+	size_t mask_ = 0;
+	alignas(64) std::atomic<size_t> head_ = 0;
+	alignas(64) size_t tail_ = 0;
+};
+
+/**
+ * @brief The binary event log, a magic followed by records of
+ *   u8      flags: event (bits 0-1), sub path (2), value (3), value hash (4), path is watch (5)
+ *   varint  zigzag time delta to the previous record, microseconds
+ *   varint  length, watch
+ *   varint  length, path       unless it is the watch
+ *   varint  length, value      if recorded in full
+ *   u64 le  value hash         if recorded as hash
+ */
+namespace event_log {
+
+inline constexpr char magic[8] = { 'C', 'M', 'E', 'V', 'L', 'O', 'G', '1' };
+
+enum flag : uint8_t {
+	event_mask = 0x03,
+	sub_path = 0x04,
+	has_value = 0x08,
+	has_hash = 0x10,
+	path_is_watch = 0x20
+};
+
+inline void put_varint(std::string& out, uint64_t v) {
+	while (v >= 0x80) {
+		out.push_back((char)(v | 0x80));
+		v >>= 7;
+	}
+	out.push_back((char)v);
+}
+
+inline void put_bytes(std::string& out, std::string_view bytes) {
+	put_varint(out, bytes.size());
+	out.append(bytes);
+}
+
+inline void encode(std::string& out, const event_record& r, int64_t& last_time) {
+	int flags = (int)r.event & event_mask;
+	flags |= r.sub_path ? sub_path : 0;
+	flags |= r.value ? has_value : 0;
+	flags |= !r.value && r.value_hash ? has_hash : 0;
+	flags |= r.path == r.watch ? path_is_watch : 0;
+	out.push_back((char)flags);
+	auto delta = r.time_us - last_time;
+	last_time = r.time_us;
+	put_varint(out, ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+	put_bytes(out, r.watch);
+	if (!(flags & path_is_watch)) {
+		put_bytes(out, r.path);
+	}
+	if (flags & has_value) {
+		put_bytes(out, *r.value);
+	}
+	if (flags & has_hash) {
+		for (int i = 0; i < 8; ++i) {
+			out.push_back((char)(r.value_hash >> (8 * i)));
+		}
+	}
+}
+
+/**
+ * @brief Reads a log back record by record
+ */
+class reader {
+public:
+	~reader() {
+		if (file_) {
+			std::fclose(file_);
+		}
+	}
+
+	bool open(const std::string& path) {
+		file_ = std::fopen(path.c_str(), "rb");
+		char head[sizeof(magic)];
+		return file_ && std::fread(head, 1, sizeof(head), file_) == sizeof(head) &&
+			std::equal(head, head + sizeof(head), magic);
+	}
+
+	// false at the end of the log, or at a record cut short
+	bool next(event_record& r) {
+		auto flags = std::fgetc(file_);
+		uint64_t delta = 0;
+		if (flags == EOF || !get_varint(delta) || !get_bytes(r.watch)) {
+			return false;
+		}
+		last_time_ += (int64_t)(delta >> 1) ^ -(int64_t)(delta & 1);
+		r.time_us = last_time_;
+		r.event = (path_event)(flags & event_mask);
+		r.sub_path = flags & sub_path;
+		if (flags & path_is_watch) {
+			r.path = r.watch;
+		}
+		else if (!get_bytes(r.path)) {
+			return false;
+		}
+		r.value.reset();
+		r.value_hash = 0;
+		if (flags & has_value) {
+			if (!get_bytes(r.value.emplace())) {
+				return false;
+			}
+			r.value_hash = fnv1a(*r.value);
+		}
+		if (flags & has_hash) {
+			uint8_t bytes[8];
+			if (std::fread(bytes, 1, 8, file_) != 8) {
+				return false;
+			}
+			for (int i = 0; i < 8; ++i) {
+				r.value_hash |= (uint64_t)bytes[i] << (8 * i);
+			}
+		}
+		return true;
+	}
+
+private:
+	bool get_varint(uint64_t& v) {
+		v = 0;
+		for (int shift = 0; shift < 64; shift += 7) {
+			auto c = std::fgetc(file_);
+			if (c == EOF) {
+				return false;
+			}
+			v |= (uint64_t)(c & 0x7f) << shift;
+			if (!(c & 0x80)) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	bool get_bytes(std::string& out) {
+		uint64_t len = 0;
+		if (!get_varint(len)) {
+			return false;
+		}
+		out.resize(len);
+		return std::fread(out.data(), 1, len, file_) == len;
+	}
+
+	std::FILE* file_ = nullptr;
+	int64_t last_time_ = 0;
+};
+
+}  // namespace event_log
+
+/**
+ * @brief Writes the events config_monitor delivers to a binary log.
+ * record() only pushes to a lock-free ring, a background thread encodes and writes.
+ * When the ring is full the event is dropped and counted, a callback never waits.
+ */
+class event_recorder {
+public:
+	struct options {
+		size_t capacity = 8192;                       // events buffered before dropping
+		bool full_values = true;                      // else only a hash of each value
+		std::chrono::milliseconds flush_interval{ 10 };
+	};
+
+	~event_recorder() {
+		close();
+	}
+
+	bool open(const std::string& file) {
+		return open(file, options{});
+	}
+
+	/**
+	 * @brief Start recording to file, replacing it, a recording in progress is closed first
+	 */
+	bool open(const std::string& file, options opt) {
+		close();
+		file_ = std::fopen(file.c_str(), "wb");
+		if (!file_ || std::fwrite(event_log::magic, 1, sizeof(event_log::magic), file_) != sizeof(event_log::magic)) {
+			close_file();
+			return false;
+		}
+		opt_ = opt;
+		ring_ = std::make_unique<mpsc_ring<event_record>>(opt.capacity);
+		recorded_ = 0;
+		dropped_ = 0;
+		stop_ = false;
+		flusher_ = std::thread([this] { flush_loop(); });
+		enabled_ = true;
+		return true;
+	}
+
+	/**
+	 * @brief Stop recording, the buffered events are written first
+	 */
+	void close() {
+		if (!flusher_.joinable()) {
+			return;
+		}
+		enabled_ = false;
+		while (writers_ > 0) {
+			std::this_thread::yield();
+		}
+		stop_ = true;
+		flusher_.join();
+		close_file();
+	}
+
+	bool enabled() const {
+		return enabled_.load(std::memory_order_relaxed);
+	}
+
+	void record(path_event eve, bool sub_path, std::string_view watch, std::string_view path,
+		const std::optional<std::string>& value) {
+		writers_++;  // seq_cst, pairs with close() clearing enabled_ before reading writers_
+		if (enabled_) {
+			event_record r;
+			r.time_us = std::chrono::duration_cast<std::chrono::microseconds>(
+				std::chrono::system_clock::now().time_since_epoch()).count();
+			r.event = eve;
+			r.sub_path = sub_path;
+			r.watch = watch;
+			r.path = path;
+			if (value) {
+				r.value_hash = fnv1a(*value);
+				if (opt_.full_values) {
+					r.value = value;
+				}
+			}
+			if (ring_->push(std::move(r))) {
+				recorded_.fetch_add(1, std::memory_order_relaxed);
+			}
+			else {
+				dropped_.fetch_add(1, std::memory_order_relaxed);
+			}
+		}
+		writers_--;
+	}
+
+	uint64_t recorded() const {
+		return recorded_;
+	}
+
+	uint64_t dropped() const {
+		return dropped_;
+	}
+
+private:
+	void flush_loop() {
+		std::string buf;
+		event_record r;
+		int64_t last_time = 0;
+		for (;;) {
+			auto stopping = stop_.load();
+			while (ring_->pop(r)) {
+				event_log::encode(buf, r, last_time);
+			}
+			if (!buf.empty()) {
+				std::fwrite(buf.data(), 1, buf.size(), file_);
+				buf.clear();
+			}
+			if (stopping) {
+				break;
+			}
+			std::this_thread::sleep_for(opt_.flush_interval);
+		}
+	}
+
+	void close_file() {
+		if (file_) {
+			std::fclose(file_);
+			file_ = nullptr;
+		}
+	}
+
+	options opt_;
+	std::FILE* file_ = nullptr;
+	std::unique_ptr<mpsc_ring<event_record>> ring_;
+	std::thread flusher_;
+	std::atomic<bool> enabled_ = false;
+	std::atomic<bool> stop_ = false;
+	std::atomic<int> writers_ = 0;
+	std::atomic<uint64_t> recorded_ = 0;
+	std::atomic<uint64_t> dropped_ = 0;
+};
+
+}  // namespace cm
@@ -1,15 +1,28 @@
 #pragma once
+#include <algorithm>
+#include <array>
 #include <atomic>
 #include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
 #include <deque>
 #include <filesystem>
+#include <fstream>
 #include <functional>
 #include <mutex>
 #include <string>
 #include <thread>
 #include <optional>
 #include <chrono>
+#include <queue>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 #include "local_file_declare.hpp"
+#include "metrics.hpp"
+#include "probes.hpp"
+#include "process.hpp"
+#include "timer_wheel.hpp"
 
 namespace loc {
 
@@ -21,6 +34,7 @@ public:
     using exists_callback = std::function<void(file_error, file_event)>;
     using get_callback = std::function<void(file_error, std::optional<std::string>&&)>;
     using get_children_callback = std::function<void(file_error, file_event, std::deque<std::string>&&)>;
+    using watch_tree_callback = std::function<void(file_error, file_event, std::string_view)>;
 
     using last_existed_status_type = std::unordered_map<std::string, bool>;
     using monitor_exist_path_type = std::unordered_map<std::string, exists_callback>;
@@ -29,6 +43,37 @@ public:
     using last_path_children_type = std::unordered_map<std::string, std::deque<std::string>>;
     using monitor_sub_path_type = std::unordered_map<std::string, get_children_callback>;
 
+    struct tree_entry {
+        bool is_dir = false;
+        size_t mtime = 0;
+    };
+    struct tree_watch {
+        watch_tree_callback callback;
+        std::unordered_map<std::string, tree_entry> entries;  // every file and directory indexed
+        std::unordered_map<std::string, std::unordered_set<std::string>> dir_children;
+    };
+    using monitor_tree_type = std::unordered_map<std::string, tree_watch>;
+
+    using poll_clock = std::chrono::steady_clock;
+    enum class monitor_kind { exist = 0, get = 1, sub = 2, tree = 3 };
+    struct poll_state {
+        std::chrono::milliseconds interval;
+        std::chrono::milliseconds min_interval;
+        std::chrono::milliseconds max_interval;
+        uint64_t generation;
+    };
+    struct poll_item {
+        poll_clock::time_point due;
+        monitor_kind kind;
+        std::string path;
+        uint64_t generation;
+
+        bool operator>(const poll_item& other) const {
+            return due > other.due;
+        }
+    };
+    using poll_queue_type = std::priority_queue<poll_item, std::vector<poll_item>, std::greater<>>;
+
 private:
     last_existed_status_type last_existed_status_;
     monitor_exist_path_type monitor_exist_path_;
@@ -45,43 +90,117 @@ private:
     std::deque<std::function<void()>> task_queue_;
     std::atomic<bool> run_ = true;
 
+    // Every watched path is polled on its own interval: doubled while the path stays quiet,
+    // back to the minimum once it changed. A stale item (re-registered or removed path) is
+    // recognized by its generation and dropped when popped.
+    std::chrono::milliseconds min_interval_{ 1000 };
+    std::chrono::milliseconds max_interval_{ 8000 };
+    poll_queue_type poll_queue_;
+    std::array<std::unordered_map<std::string, poll_state>, 4> poll_states_;
+    uint64_t poll_generation_ = 0;
+    bool poll_changed_ = false;
+
+    // Below only touched by the task thread (or after it is joined).
+    // Key of the node registries is the absolute path.
+    static constexpr int64_t ttl_tick_ms = 10;
+    timer_wheel<std::string> ttl_wheel_{ steady_tick() };
+    std::unordered_map<std::string, int64_t> ttl_paths_;
+    std::unordered_set<std::string> ephemeral_paths_;
+    std::unordered_map<std::string, int32_t> sequence_;  // next sequence number of each directory
+    std::filesystem::path session_file_;
+    monitor_tree_type monitor_tree_;
+
+    std::array<cm::duration_histogram, 4> scan_durations_;  // by monitor_kind
+    cm::metrics_registry* metrics_ = nullptr;
+
 public:
-    void initialize(int frequency_ms = 1000) {
-        task_thread_ = std::thread([this, frequency_ms]() {
+    /**
+     * @param frequency_ms Shortest poll interval of a watched path, ttl expiry is checked
+     * at this frequency too
+     * @param session_dir Where the ephemeral/ttl journal lives. Journals left by dead processes
+     * in the same directory are recovered: their ephemeral nodes are removed and their ttl nodes
+     * are adopted. Default is "<temp_directory>/loc_file"
+     * @param max_frequency_ms Longest poll interval a quiet path backs off to,
+     * default is 8 * frequency_ms
+     */
+    void initialize(int frequency_ms = 1000, std::string_view session_dir = "",
+                    int max_frequency_ms = -1) {
+        open_session(session_dir);
+        min_interval_ = std::chrono::milliseconds(frequency_ms);
+        max_interval_ = std::chrono::milliseconds(
+            max_frequency_ms < 0 ? frequency_ms * 8 : std::max(max_frequency_ms, frequency_ms));
+        task_thread_ = std::thread([this]() {
             while (run_) {
                 std::unique_lock lock(task_mtx_);
-                task_cv_.wait_for(lock, std::chrono::milliseconds(frequency_ms), [this]() {
-                    return !run_ || !task_queue_.empty();
-                });
+                auto wakeup = [this]() { return !run_ || !task_queue_.empty() || poll_changed_; };
+                auto wake_time = poll_queue_.empty() ? poll_clock::time_point::max() : poll_queue_.top().due;
+                if (!ttl_wheel_.empty()) {
+                    wake_time = std::min(wake_time, poll_clock::now() + min_interval_);
+                }
+                if (wake_time == poll_clock::time_point::max()) {
+                    task_cv_.wait(lock, wakeup);
+                }
+                else {
+                    task_cv_.wait_until(lock, wake_time, wakeup);
+                }
+                poll_changed_ = false;
                 auto task_queue = std::move(task_queue_);
-                auto last_existed_status = last_existed_status_;
-                auto monitor_exist_path = monitor_exist_path_;
-
-                auto last_changed_time = last_changed_time_;
-                auto monitor_get_path = monitor_get_path_;
-
-                auto last_path_children = last_path_children_;
-                auto monitor_sub_path = monitor_sub_path_;
+                auto due_polls = take_due_polls();
                 lock.unlock();
+                CM_PROBE2(loc_file, loop_wakeup, task_queue.size(), due_polls.size());
 
                 // deal task
                 for (auto& task : task_queue) {
                     task();
                 }
-
-                handle_monitor_exist(std::move(last_existed_status), std::move(monitor_exist_path));
-                handle_monitor_get(std::move(last_changed_time), std::move(monitor_get_path));
-                handle_monitor_sub(std::move(last_path_children), std::move(monitor_sub_path));
+                expire_ttl_paths();
+
+                for (auto& item : due_polls) {
+                    auto changed = false;
+                    auto start = poll_clock::now();
+                    CM_PROBE2(loc_file, scan_start, item.path.c_str(), (int)item.kind);
+                    switch (item.kind) {
+                    case monitor_kind::exist: changed = handle_monitor_exist(item.path); break;
+                    case monitor_kind::get: changed = handle_monitor_get(item.path); break;
+                    case monitor_kind::sub: changed = handle_monitor_sub(item.path); break;
+                    case monitor_kind::tree: changed = handle_monitor_tree(item.path); break;
+                    }
+                    scan_durations_[static_cast<size_t>(item.kind)].observe(poll_clock::now() - start);
+                    CM_PROBE3(loc_file, scan_done, item.path.c_str(), (int)item.kind, changed);
+                    reschedule_poll(std::move(item), changed);
+                }
             }
         });
     }
 
     ~loc_file() {
+        if (metrics_) {
+            metrics_->remove(this);
+        }
         run_ = false;
         task_cv_.notify_one();
         if (task_thread_.joinable()) {
             task_thread_.join();
         }
+        close_session();
+    }
+
+    /**
+     * @brief Add the poll scan durations to a registry, the series are removed with the loc_file
+     * so the registry must outlive it
+     * @param labels Like `instance="a"`, to tell instances apart
+     */
+    void register_metrics(cm::metrics_registry& registry, std::string_view labels = "") {
+        if (metrics_) {
+            metrics_->remove(this);
+        }
+        metrics_ = &registry;
+        static const std::array<const char*, 4> kinds{ "exist", "get", "sub", "tree" };
+        for (size_t i = 0; i < kinds.size(); ++i) {
+            auto kind = std::string("kind=\"") + kinds[i] + "\"";
+            registry.add("loc_file_scan_duration_seconds", "Time to poll one watched path",
+                labels.empty() ? kind : std::string(labels) + "," + kind, scan_durations_[i], this);
+        }
     }
 
     void create_path(std::string_view path, std::string_view value, file_create_mode mode,
@@ -94,24 +213,44 @@ public:
         if (enable_ttl && ttl < 0) {
             throw std::runtime_error("enable_ttl, ttl must > 0");
         }
-        add_task([this, p = std::string(path), v = std::string(value), cb = std::move(ccb)]() mutable {
+        add_task([this, p = std::string(path), v = std::string(value), mode, enable_ttl, ttl,
+                  cb = std::move(ccb)]() mutable {
             std::filesystem::path path(p);
-            auto exist = std::filesystem::exists(path);
-            if (exist) {
+            auto sequential = mode == file_create_mode::persistent_sequential ||
+                mode == file_create_mode::ephemeral_sequential ||
+                mode == file_create_mode::persistent_sequential_with_ttl;
+            if (!sequential && std::filesystem::exists(path)) {
                 cb(file_error::already_exist, {});
                 return;
             }
 
             auto parent_path = path.parent_path();
-            auto file_name = path.filename();
-            std::filesystem::create_directories(parent_path);
-            auto err = set_file_value(p, v);
+            std::error_code ec;
+            if (!parent_path.empty()) {
+                std::filesystem::create_directories(parent_path, ec);
+            }
+            auto err = sequential ? create_sequential_file(p, v) : set_file_value(p, v);
+            if (err != file_error::ok) {
+                cb(err, {});
+                return;
+            }
+
+            auto abs_path = std::filesystem::absolute(p).lexically_normal().string();
+            if (mode == file_create_mode::ephemeral || mode == file_create_mode::ephemeral_sequential) {
+                ephemeral_paths_.emplace(abs_path);
+                flush_session();
+            }
+            else if (enable_ttl) {
+                ttl_paths_[abs_path] = ttl;
+                ttl_wheel_.add(steady_tick() + to_ticks(ttl), abs_path);
+                flush_session();
+            }
             cb(err, std::move(p));
         });
     }
 
     void delete_path(std::string_view path, delete_callback dcb) {
-        add_task([p = std::string(path), callback = std::move(dcb)]() {
+        add_task([this, p = std::string(path), callback = std::move(dcb)]() {
             std::error_code ec;
             auto exist = std::filesystem::exists(p);
             if (!exist) {
@@ -120,6 +259,7 @@ public:
             }
 
             std::filesystem::remove_all(p, ec);
+            forget_nodes(p);
             if (ec) {         
                 return callback(file_error::already_used);
             }
@@ -142,7 +282,7 @@ public:
 
     // [create/delete/changed] event just for current path
     template <bool Advanced = true>
-    void exists_path(std::string_view path, exists_callback ecb) {
+    void exists_path(std::string_view path, exists_callback ecb, poll_interval interval = {}) {
         auto existed = std::filesystem::exists(path);
         if (!existed) {
             add_task([ecb]() { ecb(file_error::not_exist, file_event::dummy_event); });
@@ -155,13 +295,14 @@ public:
             auto p = std::string(path);
             std::unique_lock lock(task_mtx_);
             monitor_exist_path_.emplace(p, std::move(ecb));
-            last_existed_status_.emplace(std::move(p), existed);
+            last_existed_status_.emplace(p, existed);
+            schedule_poll(monitor_kind::exist, p, interval);
         }
     }
 
     // [changed] event just for current path, if the path exists all the time
     template <bool Advanced = true>
-    void get_path_value(std::string_view path, get_callback gcb) {
+    void get_path_value(std::string_view path, get_callback gcb, poll_interval interval = {}) {
         auto [err, value] = get_file_value(path);
         if (err != file_error::ok) {
             return add_task([gcb]() { gcb(file_error::not_exist, {}); });
@@ -173,13 +314,14 @@ public:
             auto p = std::string(path);
             std::unique_lock lock(task_mtx_);
             monitor_get_path_.emplace(p, std::move(gcb));
-            last_changed_time_.emplace(std::move(p), timestamp);
+            last_changed_time_.emplace(p, timestamp);
+            schedule_poll(monitor_kind::get, p, interval);
         }
     }
 
     // [create/delete] sub path event just for current path, if the path exists all the time
     template <bool Advanced = true>
-    void get_sub_path(std::string_view path, get_children_callback gccb) {
+    void get_sub_path(std::string_view path, get_children_callback gccb, poll_interval interval = {}) {
         auto existed = std::filesystem::exists(path);
         if (!existed) {
             return add_task([gccb]() { gccb(file_error::not_exist, file_event::dummy_event, {}); });
@@ -193,7 +335,8 @@ public:
             auto p = std::string(path);
             std::unique_lock lock(task_mtx_);
             monitor_sub_path_.emplace(p, std::move(gccb));
-            last_path_children_.emplace(std::move(p), std::move(children));
+            last_path_children_.emplace(p, std::move(children));
+            schedule_poll(monitor_kind::sub, p, interval);
         }
         else {
             add_task([gccb, ch = std::move(children)]() mutable {
@@ -202,12 +345,35 @@ public:
         }
     }
 
+    // [create/delete/changed] event for the path and every file or directory below it,
+    // a dummy_event is reported first. One registration covers the whole tree, each round
+    // only re-lists the directories whose mtime moved.
+    void watch_tree(std::string_view path, watch_tree_callback wtcb, poll_interval interval = {}) {
+        add_task([this, p = std::string(path), cb = std::move(wtcb), interval]() mutable {
+            auto& watch = monitor_tree_[p];
+            watch = tree_watch{};
+            watch.callback = std::move(cb);
+            index_tree(watch, p, false);
+            std::unique_lock lock(task_mtx_);
+            schedule_poll(monitor_kind::tree, p, interval);
+            lock.unlock();
+            auto existed = watch.entries.find(p) != watch.entries.end();
+            watch.callback(existed ? file_error::ok : file_error::not_exist, file_event::dummy_event, p);
+        });
+    }
+
+    // watch_type 0: path, 1: sub-path, 2: tree
     void remove_watches(std::string_view path, int watch_type, delete_callback cb) {
         add_task([cb, watch_type, this, p = std::string(path)]() {
             if (watch_type == 0) {
                 remove_monitor_exist_path(p);
                 remove_monitor_get_path(p);
             }
+            else if (watch_type == 2) {
+                monitor_tree_.erase(p);
+                std::unique_lock lock(task_mtx_);
+                poll_states_[static_cast<size_t>(monitor_kind::tree)].erase(p);
+            }
             else { //sub-path
                 remove_monitor_exist_path(p);
                 remove_monitor_sub_path(p);
@@ -286,6 +452,187 @@ private:
         return file_error::ok;
     }
 
+    // Create "<path><10 digits sequence>" exclusively, the per-directory counter only moves forward
+    // and a name taken by another process is skipped, so two creators never share a node
+    file_error create_sequential_file(std::string& path, std::string_view value) {
+        auto dir = std::filesystem::absolute(path).parent_path().lexically_normal().string();
+        auto it = sequence_.find(dir);
+        if (it == sequence_.end()) {
+            it = sequence_.emplace(dir, max_sequence(dir) + 1).first;
+        }
+
+        constexpr int max_retry = 1024;
+        for (int i = 0; i < max_retry; ++i) {
+            char suffix[16]{};
+            snprintf(suffix, sizeof(suffix), "%010d", it->second++);
+            auto seq_path = path + suffix;
+            auto file = fopen(seq_path.data(), "wbx");
+            if (file == nullptr) {
+                if (std::filesystem::exists(seq_path)) {
+                    continue;
+                }
+                return file_error::not_exist;
+            }
+            fwrite(value.data(), value.length(), 1, file);
+            fclose(file);
+            path = std::move(seq_path);
+            return file_error::ok;
+        }
+        return file_error::already_exist;
+    }
+
+    int32_t max_sequence(const std::string& dir) {
+        int32_t max_seq = -1;
+        std::error_code ec;
+        for (auto& entry : std::filesystem::directory_iterator(dir, ec)) {
+            auto name = entry.path().filename().string();
+            if (name.size() < 10) {
+                continue;
+            }
+            auto seq = std::string_view(name).substr(name.size() - 10);
+            if (std::all_of(seq.begin(), seq.end(), [](char c) { return c >= '0' && c <= '9'; })) {
+                max_seq = std::max(max_seq, static_cast<int32_t>(std::strtol(seq.data(), nullptr, 10)));
+            }
+        }
+        return max_seq;
+    }
+
+    static uint64_t steady_tick() {
+        namespace sc = std::chrono;
+        auto ms = sc::duration_cast<sc::milliseconds>(sc::steady_clock::now().time_since_epoch());
+        return static_cast<uint64_t>(ms.count() / ttl_tick_ms);
+    }
+
+    static uint64_t to_ticks(int64_t ms) {
+        return static_cast<uint64_t>((std::max<int64_t>(ms, 0) + ttl_tick_ms - 1) / ttl_tick_ms);
+    }
+
+    // Like zookeeper, a ttl node expires once it has not been modified for ttl ms
+    void expire_ttl_paths() {
+        bool changed = false;
+        ttl_wheel_.advance(steady_tick(), [this, &changed](std::string&& path) {
+            auto it = ttl_paths_.find(path);
+            if (it == ttl_paths_.end()) {
+                return;  // deleted before expired
+            }
+            std::error_code ec;
+            auto mtime = std::filesystem::last_write_time(path, ec);
+            if (ec) {  // removed by others
+                ttl_paths_.erase(it);
+                changed = true;
+                return;
+            }
+            auto idle = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::filesystem::file_time_type::clock::now() - mtime).count();
+            if (idle < it->second) {
+                ttl_wheel_.add(steady_tick() + to_ticks(it->second - idle), std::move(path));
+                return;
+            }
+            std::filesystem::remove(path, ec);
+            ttl_paths_.erase(it);
+            changed = true;
+        });
+        if (changed) {
+            flush_session();
+        }
+    }
+
+    void forget_nodes(const std::string& path) {
+        auto prefix = std::filesystem::absolute(path).lexically_normal().string();
+        auto under = [&prefix](const std::string& p) {
+            return p.compare(0, prefix.size(), prefix) == 0 &&
+                (p.size() == prefix.size() || p[prefix.size()] == '/' || p[prefix.size()] == '\\');
+        };
+        bool erased = false;
+        for (auto it = ephemeral_paths_.begin(); it != ephemeral_paths_.end();) {
+            it = under(*it) ? (erased = true, ephemeral_paths_.erase(it)) : std::next(it);
+        }
+        for (auto it = ttl_paths_.begin(); it != ttl_paths_.end();) {
+            it = under(it->first) ? (erased = true, ttl_paths_.erase(it)) : std::next(it);
+        }
+        if (erased) {
+            flush_session();
+        }
+    }
+
+    // Journal file name is "<pid>_<instance>.session", each line is "e <path>" or "t <ttl> <path>"
+    void open_session(std::string_view session_dir) {
+        namespace fs = std::filesystem;
+        static std::atomic<uint32_t> instance_count = 0;
+        std::error_code ec;
+        auto dir = session_dir.empty() ? fs::temp_directory_path(ec) / "loc_file" : fs::path(session_dir);
+        fs::create_directories(dir, ec);
+        session_file_ = dir / (std::to_string(current_pid()) + "_" +
+            std::to_string(instance_count++) + ".session");
+
+        for (auto& entry : fs::directory_iterator(dir, ec)) {
+            auto name = entry.path().filename().string();
+            if (entry.path().extension() != ".session" || entry.path() == session_file_) {
+                continue;
+            }
+            auto pid = std::strtoll(name.data(), nullptr, 10);
+            if (pid == current_pid() || process_alive(pid)) {
+                continue;
+            }
+            recover_session(entry.path());
+        }
+    }
+
+    void recover_session(const std::filesystem::path& journal) {
+        std::ifstream in(journal);
+        std::string line;
+        std::error_code ec;
+        while (std::getline(in, line)) {
+            if (line.size() > 2 && line[0] == 'e') {
+                std::filesystem::remove(line.substr(2), ec);
+            }
+            else if (line.size() > 2 && line[0] == 't') {
+                char* end = nullptr;
+                auto ttl = std::strtoll(line.data() + 2, &end, 10);
+                auto path = std::string(end + 1);
+                if (std::filesystem::exists(path, ec)) {
+                    ttl_paths_[path] = ttl;
+                    ttl_wheel_.add(steady_tick(), std::move(path));  // recheck idle time at once
+                }
+            }
+        }
+        in.close();
+        std::filesystem::remove(journal, ec);
+        flush_session();
+    }
+
+    void flush_session() {
+        std::error_code ec;
+        if (ephemeral_paths_.empty() && ttl_paths_.empty()) {
+            std::filesystem::remove(session_file_, ec);
+            return;
+        }
+        auto tmp = session_file_;
+        tmp += ".tmp";
+        std::ofstream out(tmp, std::ios::trunc);
+        for (const auto& path : ephemeral_paths_) {
+            out << "e " << path << '\n';
+        }
+        for (const auto& [path, ttl] : ttl_paths_) {
+            out << "t " << ttl << ' ' << path << '\n';
+        }
+        out.close();
+        std::filesystem::rename(tmp, session_file_, ec);
+    }
+
+    // Ephemeral nodes die with the instance, ttl nodes stay in the journal to be adopted
+    void close_session() {
+        if (session_file_.empty()) {
+            return;
+        }
+        std::error_code ec;
+        for (const auto& path : ephemeral_paths_) {
+            std::filesystem::remove(path, ec);
+        }
+        ephemeral_paths_.clear();
+        flush_session();
+    }
+
     std::pair<file_error, size_t> file_modify_time(std::string_view path) {
         namespace sc = std::chrono;
         std::error_code ec;
@@ -301,18 +648,62 @@ private:
         std::unique_lock lock(task_mtx_);
         last_changed_time_.erase(path);
         monitor_get_path_.erase(path);
+        poll_states_[static_cast<size_t>(monitor_kind::get)].erase(path);
     }
 
     void remove_monitor_exist_path(const std::string& path) {
         std::unique_lock lock(task_mtx_);
         last_existed_status_.erase(path);
         monitor_exist_path_.erase(path);
+        poll_states_[static_cast<size_t>(monitor_kind::exist)].erase(path);
     }
 
     void remove_monitor_sub_path(const std::string& path) {
         std::unique_lock lock(task_mtx_);
         last_path_children_.erase(path);
         monitor_sub_path_.erase(path);
+        poll_states_[static_cast<size_t>(monitor_kind::sub)].erase(path);
+    }
+
+    // Must hold task_mtx_
+    void schedule_poll(monitor_kind kind, const std::string& path, poll_interval interval) {
+        auto min_interval = interval.min.count() > 0 ? interval.min : min_interval_;
+        auto max_interval = std::max(min_interval, interval.max.count() > 0 ? interval.max : max_interval_);
+        auto generation = ++poll_generation_;
+        poll_states_[static_cast<size_t>(kind)][path] =
+            poll_state{ min_interval, min_interval, max_interval, generation };
+        poll_queue_.push(poll_item{ poll_clock::now() + min_interval, kind, path, generation });
+        poll_changed_ = true;
+        task_cv_.notify_one();
+    }
+
+    // Must hold task_mtx_
+    std::vector<poll_item> take_due_polls() {
+        std::vector<poll_item> due_polls;
+        auto now = poll_clock::now();
+        while (!poll_queue_.empty() && poll_queue_.top().due <= now) {
+            auto item = std::move(const_cast<poll_item&>(poll_queue_.top()));
+            poll_queue_.pop();
+            auto& states = poll_states_[static_cast<size_t>(item.kind)];
+            auto it = states.find(item.path);
+            if (it != states.end() && it->second.generation == item.generation) {
+                due_polls.emplace_back(std::move(item));
+            }
+        }
+        return due_polls;
+    }
+
+    void reschedule_poll(poll_item&& item, bool changed) {
+        std::unique_lock lock(task_mtx_);
+        auto& states = poll_states_[static_cast<size_t>(item.kind)];
+        auto it = states.find(item.path);
+        if (it == states.end() || it->second.generation != item.generation) {
+            return;  // removed or re-registered while polling
+        }
+        auto& state = it->second;
+        state.interval = changed ? state.min_interval : std::min(state.interval * 2, state.max_interval);
+        item.due = poll_clock::now() + state.interval;
+        poll_queue_.push(std::move(item));
     }
 
     void update_last_existed_status(const std::string& path, bool status) {
@@ -348,61 +739,210 @@ private:
         last_path_children_[path] = std::move(children);
     }
 
-    void handle_monitor_exist(last_existed_status_type&& last_existed_status,
-                              monitor_exist_path_type&& monitor_exist_path) {
-        for (auto& [path, last_status] : last_existed_status) {
-            auto this_status = std::filesystem::exists(path);
-            if (last_status == this_status) {
-                //Todo: here can check changed or not.  changed_event or dummy_event
-                continue;
+    template <typename Monitor>
+    typename Monitor::mapped_type monitor_callback(const Monitor& monitor, const std::string& path) {
+        std::unique_lock lock(task_mtx_);
+        auto it = monitor.find(path);
+        return it == monitor.end() ? typename Monitor::mapped_type{} : it->second;
+    }
+
+    bool handle_monitor_exist(const std::string& path) {
+        std::unique_lock lock(task_mtx_);
+        auto it = last_existed_status_.find(path);
+        if (it == last_existed_status_.end()) {
+            return false;
+        }
+        auto last_status = it->second;
+        lock.unlock();
+
+        auto this_status = std::filesystem::exists(path);
+        if (last_status == this_status) {
+            //Todo: here can check changed or not.  changed_event or dummy_event
+            return false;
+        }
+        update_last_existed_status(path, this_status);
+        auto cb = monitor_callback(monitor_exist_path_, path);
+        if (!cb) {
+            return false;
+        }
+
+        //last status is existed, this time not existed.
+        if (last_status == true) {
+            cb(file_error::not_exist, file_event::deleted_event);
+            return true;
+        }
+        //last status is not existed, this time existed.
+        cb(file_error::ok, file_event::created_event);
+        return true;
+    }
+
+    bool handle_monitor_get(const std::string& path) {
+        std::unique_lock lock(task_mtx_);
+        auto it = last_changed_time_.find(path);
+        if (it == last_changed_time_.end()) {
+            return false;
+        }
+        auto last_timestamp = it->second;
+        lock.unlock();
+
+        auto [_, this_timestamp] = file_modify_time(path);
+        //nothing changed
+        if (last_timestamp == this_timestamp) {
+            return false;
+        }
+
+        //value changed
+        auto cb = monitor_callback(monitor_get_path_, path);
+        if (!cb) {
+            return false;
+        }
+        auto [err, value] = get_file_value(path);
+        if (err != file_error::ok) {
+            //file removed
+            remove_monitor_get_path(path);
+            cb(file_error::not_exist, {});
+            return true;
+        }
+        update_last_changed_time(path, this_timestamp);
+        cb(file_error::ok, std::move(value));
+        return true;
+    }
+
+    bool handle_monitor_sub(const std::string& path) {
+        std::unique_lock lock(task_mtx_);
+        auto it = last_path_children_.find(path);
+        if (it == last_path_children_.end()) {
+            return false;
+        }
+        auto last_sub_children = it->second;
+        lock.unlock();
+
+        auto this_sub_children = get_path_children(path);
+        if (last_sub_children == this_sub_children) {
+            return false;
+        }
+        updata_path_children(path, this_sub_children);
+        auto cb = monitor_callback(monitor_sub_path_, path);
+        if (!cb) {
+            return false;
+        }
+        cb(file_error::ok, file_event::child_event, std::move(this_sub_children));
+        return true;
+    }
+
+    void index_tree(tree_watch& watch, const std::string& path, bool report) {
+        namespace fs = std::filesystem;
+        std::error_code ec;
+        // Only the root is followed if it is a link, a link below it is an entry of its own
+        // and never descended into, so a link back up the tree does not loop
+        auto status = watch.entries.empty() ? fs::status(path, ec) : fs::symlink_status(path, ec);
+        if (ec || !fs::exists(status)) {
+            return;
+        }
+        // mtime before listing, a child added in between just causes one more re-list
+        auto [_, mtime] = file_modify_time(path);
+        auto is_dir = fs::is_directory(status);
+        watch.entries[path] = { is_dir, mtime };
+        if (report) {
+            watch.callback(file_error::ok, file_event::created_event, path);
+        }
+        if (!is_dir) {
+            return;
+        }
+
+        std::unordered_set<std::string> children;
+        for (auto& entry : fs::directory_iterator(path, ec)) {
+            children.emplace(entry.path().filename().string());
+        }
+        for (const auto& name : children) {
+            index_tree(watch, path + "/" + name, report);
+        }
+        watch.dir_children[path] = std::move(children);
+    }
+
+    void unindex_tree(tree_watch& watch, const std::string& path) {
+        auto it = watch.entries.find(path);
+        if (it == watch.entries.end()) {
+            return;
+        }
+        if (it->second.is_dir) {
+            auto children = std::move(watch.dir_children[path]);
+            watch.dir_children.erase(path);
+            for (const auto& name : children) {
+                unindex_tree(watch, path + "/" + name);
             }
-            update_last_existed_status(path, this_status);
+        }
+        watch.entries.erase(path);
+        watch.callback(file_error::not_exist, file_event::deleted_event, path);
+    }
 
-            //last status is existed, this time not existed.
-            if (last_status == true) {
-                monitor_exist_path[path](file_error::not_exist, file_event::deleted_event);
-                continue;
+    void relist_dir(tree_watch& watch, const std::string& dir) {
+        namespace fs = std::filesystem;
+        std::error_code ec;
+        std::unordered_set<std::string> children;
+        for (auto& entry : fs::directory_iterator(dir, ec)) {
+            children.emplace(entry.path().filename().string());
+        }
+
+        auto old_children = std::move(watch.dir_children[dir]);
+        for (const auto& name : old_children) {
+            auto child = dir + "/" + name;
+            auto it = watch.entries.find(child);
+            auto replaced = it != watch.entries.end() &&
+                it->second.is_dir != fs::is_directory(fs::symlink_status(child, ec));
+            if (children.find(name) == children.end() || replaced) {
+                unindex_tree(watch, child);
             }
-            //last status is not existed, this time existed.
-            if (last_status == false) {
-                monitor_exist_path[path](file_error::ok, file_event::created_event);
+        }
+        for (const auto& name : children) {
+            auto child = dir + "/" + name;
+            if (watch.entries.find(child) == watch.entries.end()) {
+                index_tree(watch, child, true);
             }
         }
+        watch.dir_children[dir] = std::move(children);
     }
 
-    void handle_monitor_get(last_changed_time_type&& last_changed_time,
-                            monitor_get_path_type&& monitor_get_path) {
-        for (auto& [path, last_timestamp] : last_changed_time) {
-            auto [_, this_timestamp] = file_modify_time(path);
-            //nothing changed
-            if (last_timestamp == this_timestamp) {
-                continue;
-            }
+    bool handle_monitor_tree(const std::string& root) {
+        auto tree = monitor_tree_.find(root);
+        if (tree == monitor_tree_.end()) {
+            return false;
+        }
+        auto& watch = tree->second;
+        if (watch.entries.find(root) == watch.entries.end()) {
+            index_tree(watch, root, true);
+            return watch.entries.find(root) != watch.entries.end();
+        }
+        if (!std::filesystem::exists(root)) {
+            unindex_tree(watch, root);
+            return true;
+        }
 
-            //value changed
-            auto [err, value] = get_file_value(path);
-            if (err != file_error::ok) {
-                //file removed
-                monitor_get_path[path](file_error::not_exist, {});
-                remove_monitor_get_path(path);
+        // A removed entry shows up as a mtime change of its parent directory
+        std::vector<std::string> changed_dirs;
+        std::vector<std::string> changed_files;
+        for (auto& [path, entry] : watch.entries) {
+            auto [err, mtime] = file_modify_time(path);
+            if (err != file_error::ok || mtime == entry.mtime) {
                 continue;
             }
-            monitor_get_path[path](file_error::ok, std::move(value));
-            update_last_changed_time(path, this_timestamp);
+            entry.mtime = mtime;
+            (entry.is_dir ? changed_dirs : changed_files).emplace_back(path);
         }
-    }
 
-    void handle_monitor_sub(last_path_children_type last_sub_path,
-                            monitor_sub_path_type monitor_sub_path) {
-        for (auto& [path, last_sub_children] : last_sub_path) {
-            auto this_sub_children = get_path_children(path);
-            if (last_sub_children == this_sub_children) {
-                continue;
+        std::sort(changed_dirs.begin(), changed_dirs.end());  // parent first
+        for (const auto& dir : changed_dirs) {
+            auto it = watch.entries.find(dir);
+            if (it != watch.entries.end() && it->second.is_dir) {
+                relist_dir(watch, dir);
+            }
+        }
+        for (const auto& file : changed_files) {
+            if (watch.entries.find(file) != watch.entries.end()) {
+                watch.callback(file_error::ok, file_event::changed_event, file);
             }
-            updata_path_children(path, this_sub_children);
-            monitor_sub_path[path](file_error::ok,
-                                   file_event::child_event, std::move(this_sub_children));
         }
+        return !changed_dirs.empty() || !changed_files.empty();
     }
 };
 
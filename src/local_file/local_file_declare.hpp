@@ -1,4 +1,5 @@
 #pragma once
+#include <chrono>
 #include <system_error>
 
 namespace loc {
@@ -7,7 +8,8 @@ enum class file_error {
     ok,
     not_exist,
     already_exist,
-    already_used
+    already_used,
+    io_error
 };
 
 enum class file_event {
@@ -27,6 +29,13 @@ enum class file_create_mode {
     persistent_sequential_with_ttl = 6
 };
 
+// Per watch poll interval, 0 means the value given to loc_file::initialize.
+// A quiet path backs off from min to max, a changed path goes back to min.
+struct poll_interval {
+    std::chrono::milliseconds min{ 0 };
+    std::chrono::milliseconds max{ 0 };
+};
+
 class file_error_category : public std::error_category {
 public:
     virtual const char* name() const noexcept override {
@@ -41,6 +50,10 @@ public:
             return "file not exist";
         case file_error::already_exist:
             return "file already_exist";
+        case file_error::already_used:
+            return "file already_used";
+        case file_error::io_error:
+            return "file io_error";
         default:
             return "unrecognized error";
         }
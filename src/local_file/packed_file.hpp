@@ -0,0 +1,955 @@
+#pragma once
+#ifdef _WIN32
+#error "packed_file needs POSIX mmap and flock"
+#endif
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "local_file_declare.hpp"
+#include "process.hpp"
+#include "timer_wheel.hpp"
+
+namespace loc {
+
+// The whole hierarchical namespace lives in one append-only log: [file header][record]...
+// A record is the put (create/set) or del of one path. The in-memory index points into the
+// mmap'd log, so reads never touch the filesystem, and startup is one sequential pass.
+// Processes sharing the log follow its tail for change notification; superseded records are
+// dropped by compaction, which rewrites the live nodes into a new log and renames it in place.
+class packed_file {
+public:
+    using create_callback = std::function<void(const std::error_code&, std::string&&)>;
+    using operate_cb = std::function<void(const std::error_code&)>;
+    using exists_callback = std::function<void(const std::error_code&, file_event)>;
+    using get_callback = std::function<void(
+        const std::error_code&, file_event, std::string_view, std::optional<std::string>&&)>;
+    using get_children_callback = std::function<void(const std::error_code&, std::vector<std::string>&&)>;
+
+private:
+    static constexpr uint32_t file_magic = 0x4b504d43;  // "CMPK"
+    static constexpr uint32_t file_version = 1;
+    static constexpr uint64_t file_header_size = 8;
+    static constexpr int64_t ttl_tick_ms = 10;
+
+    enum record_op : uint8_t {
+        op_put = 1,
+        op_del = 2
+    };
+
+    enum record_flag : uint8_t {
+        flag_value = 1,
+        flag_ephemeral = 2,
+        flag_ttl = 4,
+        flag_snapshot = 8   // written by compact(), its cversion is final, children do not count again
+    };
+
+    struct record_header {
+        uint32_t checksum;  // fnv-1a of everything behind it, a torn tail never validates
+        uint8_t op;
+        uint8_t flags;
+        uint16_t reserved;
+        uint32_t key_len;
+        uint32_t value_len;
+        int32_t cversion;   // children created/deleted, the base of sequential names
+        uint32_t reserved2;
+        int64_t ttl_ms;
+        int64_t owner;      // pid of the ephemeral node creator
+        int64_t mtime_ms;
+    };
+    static_assert(sizeof(record_header) == 48, "record_header is a file format");
+
+    struct node {
+        uint64_t value_offset = 0;
+        uint32_t value_len = 0;
+        uint64_t record_size = 0;
+        uint8_t flags = 0;
+        int32_t cversion = 0;
+        int64_t ttl_ms = -1;
+        int64_t owner = 0;
+        int64_t mtime_ms = 0;
+        std::set<std::string> children;
+    };
+    using index_type = std::unordered_map<std::string, node>;
+
+    struct change {
+        file_event event;
+        std::string path;
+    };
+
+    std::string file_path_;
+    int fd_ = -1;
+    ino_t inode_ = 0;
+    dev_t dev_ = 0;
+    const char* map_ = nullptr;
+    size_t map_size_ = 0;
+    uint64_t end_ = 0;  // end of the last record applied
+    uint64_t live_bytes_ = 0;
+    uint64_t dead_bytes_ = 0;
+    uint64_t compact_bytes_ = 1 << 20;
+    index_type index_;
+    std::unordered_set<std::string> own_ephemerals_;
+    timer_wheel<std::string> ttl_wheel_{ steady_tick() };
+
+    // config_monitor keeps a reference to the exist callback in the reads it issues from it
+    std::unordered_map<std::string, std::vector<std::shared_ptr<exists_callback>>> exist_watches_;
+    std::unordered_map<std::string, std::vector<get_callback>> data_watches_;
+    std::unordered_map<std::string, std::vector<get_children_callback>> child_watches_;
+    std::mutex mtx_;  // guards everything above
+
+    std::thread task_thread_;
+    std::mutex task_mtx_;
+    std::condition_variable task_cv_;
+    std::deque<std::function<void()>> task_queue_;
+    std::atomic<bool> run_ = true;
+
+public:
+    packed_file(const packed_file&) = delete;
+    packed_file& operator=(const packed_file&) = delete;
+    packed_file() = default;
+
+    ~packed_file() {
+        run_ = false;
+        task_cv_.notify_one();
+        if (task_thread_.joinable()) {
+            task_thread_.join();
+        }
+
+        std::unique_lock lock(mtx_);
+        if (fd_ < 0) {
+            return;
+        }
+        if (!own_ephemerals_.empty()) {
+            std::vector<change> changes;
+            begin_write(changes);
+            auto ephemerals = own_ephemerals_;
+            for (const auto& path : ephemerals) {
+                auto it = index_.find(path);
+                if (it != index_.end() && it->second.owner == current_pid()) {
+                    remove_subtree(path, changes);
+                }
+            }
+            end_write();
+        }
+        close_log();
+    }
+
+    /**
+     * @param file_path The log file, created if not exist
+     * @param frequency_ms How often the log tail is checked for changes made by other processes
+     * @param compact_bytes Compact once superseded records exceed both this and the live records
+     */
+    void initialize(std::string_view file_path, int frequency_ms = 1000, uint64_t compact_bytes = 1 << 20) {
+        std::unique_lock lock(mtx_);
+        file_path_ = file_path;
+        compact_bytes_ = compact_bytes;
+        open_log();
+
+        // ephemeral nodes of crashed processes, ttl nodes need a timer in this process
+        std::vector<std::string> orphans;
+        for (const auto& [path, n] : index_) {
+            if ((n.flags & flag_ephemeral) && n.owner != current_pid() && !process_alive(n.owner)) {
+                orphans.emplace_back(path);
+            }
+            if (n.flags & flag_ttl) {
+                ttl_wheel_.add(steady_tick(), path);
+            }
+        }
+        if (!orphans.empty()) {
+            std::vector<change> changes;
+            begin_write(changes);
+            for (const auto& path : orphans) {
+                if (index_.find(path) != index_.end()) {
+                    remove_subtree(path, changes);
+                }
+            }
+            end_write();
+        }
+        lock.unlock();
+
+        task_thread_ = std::thread([this, frequency_ms]() {
+            while (run_) {
+                std::unique_lock lock(task_mtx_);
+                task_cv_.wait_for(lock, std::chrono::milliseconds(frequency_ms), [this]() {
+                    return !run_ || !task_queue_.empty();
+                });
+                auto task_queue = std::move(task_queue_);
+                lock.unlock();
+
+                for (auto& task : task_queue) {
+                    task();
+                }
+                follow_tail();
+                expire_ttl_paths();
+                compact_if_needed();
+            }
+        });
+    }
+
+    auto create_path(std::string_view path, const std::optional<std::string>& value,
+                     file_create_mode mode, int64_t ttl = -1) {
+        auto enable_ttl = mode == file_create_mode::persistent_sequential_with_ttl ||
+            mode == file_create_mode::persistent_with_ttl;
+        if (enable_ttl && ttl < 0) {
+            throw std::runtime_error("enable_ttl, ttl must > 0");
+        }
+        check_path(path);
+
+        std::unique_lock lock(mtx_);
+        std::vector<change> changes;
+        begin_write(changes);
+        auto [err, new_path] = create_node(path, value, mode, enable_ttl ? ttl : -1, changes);
+        end_write();
+        notify(changes);
+        return std::make_tuple(make_ec(err), std::move(new_path));
+    }
+
+    void async_create_path(std::string_view path, std::optional<std::string> value,
+                           file_create_mode mode, create_callback ccb, int64_t ttl = -1) {
+        add_task([this, p = std::string(path), v = std::move(value), mode, cb = std::move(ccb), ttl]() {
+            auto [ec, new_path] = create_path(p, v, mode, ttl);
+            if (cb) {
+                cb(ec, std::move(new_path));
+            }
+        });
+    }
+
+    // Delete the path and all of its sub path
+    std::error_code delete_path(std::string_view path) {
+        std::unique_lock lock(mtx_);
+        std::vector<change> changes;
+        begin_write(changes);
+        auto p = std::string(path);
+        auto err = file_error::not_exist;
+        if (p != "/" && index_.find(p) != index_.end()) {
+            err = remove_subtree(p, changes);
+        }
+        end_write();
+        notify(changes);
+        return make_ec(err);
+    }
+
+    void async_delete_path(std::string_view path, operate_cb cb) {
+        add_task([this, p = std::string(path), cb = std::move(cb)]() {
+            auto ec = delete_path(p);
+            if (cb) {
+                cb(ec);
+            }
+        });
+    }
+
+    std::error_code set_path_value(std::string_view path, std::string_view value) {
+        std::unique_lock lock(mtx_);
+        std::vector<change> changes;
+        begin_write(changes);
+        auto p = std::string(path);
+        auto it = index_.find(p);
+        auto err = file_error::not_exist;
+        if (it != index_.end() && p != "/") {
+            auto n = it->second;
+            err = append(op_put, static_cast<uint8_t>(n.flags | flag_value), p, value,
+                         n.cversion, n.ttl_ms, n.owner, now_ms(), changes);
+        }
+        end_write();
+        notify(changes);
+        return make_ec(err);
+    }
+
+    void async_set_path_value(std::string_view path, std::string_view value, operate_cb cb) {
+        add_task([this, p = std::string(path), v = std::string(value), cb = std::move(cb)]() {
+            auto ec = set_path_value(p, v);
+            if (cb) {
+                cb(ec);
+            }
+        });
+    }
+
+    auto get_path_value(std::string_view path) {
+        std::unique_lock lock(mtx_);
+        auto it = index_.find(std::string(path));
+        if (it == index_.end()) {
+            return std::make_tuple(make_ec(file_error::not_exist), std::optional<std::string>{});
+        }
+        return std::make_tuple(make_ec(file_error::ok), node_value(it->second));
+    }
+
+    // [changed/deleted] event of the path if Advanced, the watch ends with the path deleted
+    template <bool Advanced = false>
+    void async_get_path_value(std::string_view path, get_callback cb) {
+        std::unique_lock lock(mtx_);
+        auto p = std::string(path);
+        auto it = index_.find(p);
+        if (it == index_.end()) {
+            add_task([cb = std::move(cb), p = std::move(p)]() {
+                cb(make_ec(file_error::not_exist), file_event::dummy_event, p, {});
+            });
+            return;
+        }
+        auto value = node_value(it->second);
+        if constexpr (Advanced) {
+            data_watches_[p].emplace_back(cb);
+        }
+        add_task([cb = std::move(cb), p = std::move(p), v = std::move(value)]() mutable {
+            cb(make_ec(file_error::ok), file_event::dummy_event, p, std::move(v));
+        });
+    }
+
+    // [create/delete/changed] event just for current path, the watch lasts until removed
+    void watch_path_event(std::string_view path, exists_callback cb) {
+        std::unique_lock lock(mtx_);
+        auto p = std::string(path);
+        auto err = index_.find(p) == index_.end() ? file_error::not_exist : file_error::ok;
+        auto watch = std::make_shared<exists_callback>(std::move(cb));
+        exist_watches_[p].emplace_back(watch);
+        add_task([watch, err]() { (*watch)(make_ec(err), file_event::dummy_event); });
+    }
+
+    auto get_sub_path(std::string_view path) {
+        std::unique_lock lock(mtx_);
+        auto it = index_.find(std::string(path));
+        if (it == index_.end()) {
+            return std::make_tuple(make_ec(file_error::not_exist), std::vector<std::string>{});
+        }
+        std::vector<std::string> sub_paths;
+        sub_paths.reserve(it->second.children.size());
+        for (const auto& child : it->second.children) {
+            sub_paths.emplace_back(join_path(it->first, child));
+        }
+        return std::make_tuple(make_ec(file_error::ok), std::move(sub_paths));
+    }
+
+    // Children name changed event of the path if Advanced, the watch ends with the path deleted
+    template <bool Advanced = false>
+    void async_get_sub_path(std::string_view path, get_children_callback cb) {
+        std::unique_lock lock(mtx_);
+        auto p = std::string(path);
+        auto it = index_.find(p);
+        if (it == index_.end()) {
+            add_task([cb = std::move(cb)]() { cb(make_ec(file_error::not_exist), {}); });
+            return;
+        }
+        std::vector<std::string> children(it->second.children.begin(), it->second.children.end());
+        if constexpr (Advanced) {
+            child_watches_[p].emplace_back(cb);
+        }
+        add_task([cb = std::move(cb), ch = std::move(children)]() mutable {
+            cb(make_ec(file_error::ok), std::move(ch));
+        });
+    }
+
+    // watch_type 0: path, 1: sub-path
+    void async_remove_watches(std::string_view path, int watch_type, operate_cb cb) {
+        add_task([this, p = std::string(path), watch_type, cb = std::move(cb)]() {
+            std::unique_lock lock(mtx_);
+            std::vector<std::shared_ptr<exists_callback>> removed;
+            auto remove = [this, &removed](const std::string& path) {
+                if (auto it = exist_watches_.find(path); it != exist_watches_.end()) {
+                    removed.insert(removed.end(), it->second.begin(), it->second.end());
+                    exist_watches_.erase(it);
+                }
+                data_watches_.erase(path);
+            };
+            if (watch_type != 0) {
+                auto it = index_.find(p);
+                if (it != index_.end()) {
+                    for (const auto& child : it->second.children) {
+                        remove(join_path(p, child));
+                    }
+                }
+                child_watches_.erase(p);
+            }
+            remove(p);
+            // released behind the reads already queued from them
+            add_task([removed = std::move(removed)]() {});
+            lock.unlock();
+            if (cb) {
+                cb(make_ec(file_error::ok));
+            }
+        });
+    }
+
+protected:
+    static std::error_code make_ec(file_error err) {
+        return { static_cast<int>(err), loc::category() };
+    }
+
+    bool is_no_node(const std::error_code& err) {
+        return err.value() == static_cast<int>(file_error::not_exist);
+    }
+
+    bool is_node_exist(const std::error_code& err) {
+        return err.value() == static_cast<int>(file_error::already_exist);
+    }
+
+    bool is_dummy_event(file_event eve) {
+        return eve == file_event::dummy_event;
+    }
+
+    bool is_create_event(file_event eve) {
+        return eve == file_event::created_event;
+    }
+
+    bool is_delete_event(file_event eve) {
+        return eve == file_event::deleted_event;
+    }
+
+    bool is_changed_event(file_event eve) {
+        return eve == file_event::changed_event;
+    }
+
+    auto get_persistent_mode() {
+        return file_create_mode::persistent;
+    }
+
+    auto get_create_mode(int mode) {
+        return static_cast<file_create_mode>(mode);
+    }
+
+private:
+    template <typename Task>
+    void add_task(Task&& task) {
+        std::unique_lock lock(task_mtx_);
+        task_queue_.emplace_back(std::forward<Task>(task));
+        lock.unlock();
+        task_cv_.notify_one();
+    }
+
+    static void check_path(std::string_view path) {
+        if (path.size() < 2 || path.front() != '/' || path.back() == '/' ||
+            path.find("//") != std::string_view::npos) {
+            throw std::invalid_argument("invalid path");
+        }
+    }
+
+    static std::string join_path(const std::string& parent, const std::string& name) {
+        return parent == "/" ? parent + name : parent + "/" + name;
+    }
+
+    static std::pair<std::string, std::string> split_parent(const std::string& path) {
+        auto pos = path.find_last_of('/');
+        return { pos == 0 ? std::string("/") : path.substr(0, pos), path.substr(pos + 1) };
+    }
+
+    static int64_t now_ms() {
+        namespace sc = std::chrono;
+        return sc::duration_cast<sc::milliseconds>(sc::system_clock::now().time_since_epoch()).count();
+    }
+
+    static uint64_t steady_tick() {
+        namespace sc = std::chrono;
+        auto ms = sc::duration_cast<sc::milliseconds>(sc::steady_clock::now().time_since_epoch());
+        return static_cast<uint64_t>(ms.count() / ttl_tick_ms);
+    }
+
+    static uint32_t checksum(const char* data, size_t len, uint32_t hash = 2166136261u) {
+        for (size_t i = 0; i < len; ++i) {
+            hash ^= static_cast<uint8_t>(data[i]);
+            hash *= 16777619u;
+        }
+        return hash;
+    }
+
+    std::optional<std::string> node_value(const node& n) const {
+        if (!(n.flags & flag_value)) {
+            return std::nullopt;
+        }
+        return std::string(map_ + n.value_offset, n.value_len);
+    }
+
+    // Must hold mtx_
+    std::pair<file_error, std::string> create_node(std::string_view path, const std::optional<std::string>& value,
+                                                   file_create_mode mode, int64_t ttl, std::vector<change>& changes) {
+        auto full = std::string(path);
+        for (auto pos = full.find('/', 1); pos != std::string::npos; pos = full.find('/', pos + 1)) {
+            auto prefix = full.substr(0, pos);
+            if (index_.find(prefix) == index_.end()) {
+                auto err = append(op_put, 0, prefix, {}, 0, -1, 0, now_ms(), changes);
+                if (err != file_error::ok) {
+                    return { err, {} };
+                }
+            }
+        }
+
+        auto sequential = mode == file_create_mode::persistent_sequential ||
+            mode == file_create_mode::ephemeral_sequential ||
+            mode == file_create_mode::persistent_sequential_with_ttl;
+        auto ephemeral = mode == file_create_mode::ephemeral || mode == file_create_mode::ephemeral_sequential;
+        if (sequential) {
+            char suffix[16]{};
+            snprintf(suffix, sizeof(suffix), "%010d", index_[split_parent(full).first].cversion);
+            full += suffix;
+        }
+        if (index_.find(full) != index_.end()) {
+            return { file_error::already_exist, {} };
+        }
+
+        uint8_t flags = value.has_value() ? flag_value : 0;
+        flags = static_cast<uint8_t>(flags | (ephemeral ? flag_ephemeral : 0) | (ttl >= 0 ? flag_ttl : 0));
+        auto err = append(op_put, flags, full, value.has_value() ? std::string_view(*value) : std::string_view{},
+                          0, ttl, ephemeral ? current_pid() : 0, now_ms(), changes);
+        if (err != file_error::ok) {
+            return { err, {} };
+        }
+        if (ephemeral) {
+            own_ephemerals_.emplace(full);
+        }
+        if (ttl >= 0) {
+            ttl_wheel_.add(steady_tick() + static_cast<uint64_t>(ttl / ttl_tick_ms + 1), full);
+        }
+        return { file_error::ok, std::move(full) };
+    }
+
+    // Must hold mtx_ and the write lock, children first
+    file_error remove_subtree(const std::string& path, std::vector<change>& changes) {
+        auto children = index_[path].children;
+        for (const auto& child : children) {
+            auto err = remove_subtree(join_path(path, child), changes);
+            if (err != file_error::ok) {
+                return err;
+            }
+        }
+        own_ephemerals_.erase(path);
+        return append(op_del, 0, path, {}, 0, -1, 0, now_ms(), changes);
+    }
+
+    std::string make_record(uint8_t op, uint8_t flags, std::string_view key, std::string_view value,
+                            int32_t cversion, int64_t ttl, int64_t owner, int64_t mtime) {
+        record_header h{};
+        h.op = op;
+        h.flags = flags;
+        h.key_len = static_cast<uint32_t>(key.size());
+        h.value_len = static_cast<uint32_t>(value.size());
+        h.cversion = cversion;
+        h.ttl_ms = ttl;
+        h.owner = owner;
+        h.mtime_ms = mtime;
+
+        std::string record(sizeof(h) + key.size() + value.size(), '\0');
+        std::memcpy(record.data(), &h, sizeof(h));
+        std::memcpy(record.data() + sizeof(h), key.data(), key.size());
+        std::memcpy(record.data() + sizeof(h) + key.size(), value.data(), value.size());
+        h.checksum = checksum(record.data() + sizeof(h.checksum), record.size() - sizeof(h.checksum));
+        std::memcpy(record.data(), &h.checksum, sizeof(h.checksum));
+        return record;
+    }
+
+    static bool write_all(int fd, const char* data, size_t len, uint64_t offset) {
+        while (len > 0) {
+            auto n = pwrite(fd, data, len, static_cast<off_t>(offset));
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                return false;
+            }
+            data += n;
+            len -= static_cast<size_t>(n);
+            offset += static_cast<uint64_t>(n);
+        }
+        return true;
+    }
+
+    // Must hold mtx_ and the write lock
+    file_error append(uint8_t op, uint8_t flags, const std::string& key, std::string_view value,
+                      int32_t cversion, int64_t ttl, int64_t owner, int64_t mtime, std::vector<change>& changes) {
+        auto record = make_record(op, flags, key, value, cversion, ttl, owner, mtime);
+        if (!write_all(fd_, record.data(), record.size(), end_)) {
+            [[maybe_unused]] auto r = ftruncate(fd_, static_cast<off_t>(end_));
+            return file_error::io_error;
+        }
+        map_log(end_ + record.size());
+        apply_record(end_, &changes);
+        return file_error::ok;
+    }
+
+    // Validate the record at offset against the log size, a partly written record is not valid
+    bool read_record(uint64_t offset, uint64_t size, record_header& h) const {
+        if (offset + sizeof(h) > size) {
+            return false;
+        }
+        std::memcpy(&h, map_ + offset, sizeof(h));
+        auto record_size = sizeof(h) + uint64_t(h.key_len) + h.value_len;
+        if (offset + record_size > size || (h.op != op_put && h.op != op_del)) {
+            return false;
+        }
+        return checksum(map_ + offset + sizeof(h.checksum), record_size - sizeof(h.checksum)) == h.checksum;
+    }
+
+    // Must hold mtx_, the record at end_ is valid
+    void apply_record(uint64_t offset, std::vector<change>* changes) {
+        record_header h{};
+        std::memcpy(&h, map_ + offset, sizeof(h));
+        auto key = std::string(map_ + offset + sizeof(h), h.key_len);
+        auto record_size = sizeof(h) + uint64_t(h.key_len) + h.value_len;
+        end_ = offset + record_size;
+
+        auto [parent_path, name] = split_parent(key);
+        auto it = index_.find(key);
+        if (h.op == op_del) {
+            dead_bytes_ += record_size;
+            if (it == index_.end()) {
+                return;
+            }
+            dead_bytes_ += it->second.record_size;
+            live_bytes_ -= it->second.record_size;
+            index_.erase(it);
+            auto& parent = index_[parent_path];
+            parent.children.erase(name);
+            parent.cversion++;
+            if (changes) {
+                changes->push_back({ file_event::deleted_event, key });
+                changes->push_back({ file_event::child_event, parent_path });
+            }
+            return;
+        }
+
+        auto created = it == index_.end();
+        if (created) {
+            it = index_.emplace(key, node{}).first;
+            it->second.cversion = h.cversion;
+            auto& parent = index_[parent_path];
+            parent.children.emplace(name);
+            if (!(h.flags & flag_snapshot)) {
+                parent.cversion++;
+            }
+        }
+        else {
+            dead_bytes_ += it->second.record_size;
+            live_bytes_ -= it->second.record_size;
+            it->second.cversion = std::max(it->second.cversion, h.cversion);
+        }
+        auto& n = it->second;
+        n.value_offset = offset + sizeof(h) + h.key_len;
+        n.value_len = h.value_len;
+        n.record_size = record_size;
+        n.flags = static_cast<uint8_t>(h.flags & ~flag_snapshot);
+        n.ttl_ms = h.ttl_ms;
+        n.owner = h.owner;
+        n.mtime_ms = h.mtime_ms;
+        live_bytes_ += record_size;
+        if (changes) {
+            changes->push_back({ created ? file_event::created_event : file_event::changed_event, key });
+            if (created) {
+                changes->push_back({ file_event::child_event, parent_path });
+            }
+        }
+    }
+
+    void map_log(uint64_t size) {
+        if (size <= map_size_) {
+            return;
+        }
+        constexpr uint64_t chunk = 1 << 20;  // pages past the end of file are never touched
+        auto new_size = static_cast<size_t>((size + chunk - 1) / chunk * chunk);
+        if (map_) {
+            munmap(const_cast<char*>(map_), map_size_);
+        }
+        auto ptr = mmap(nullptr, new_size, PROT_READ, MAP_SHARED, fd_, 0);
+        if (ptr == MAP_FAILED) {
+            throw std::runtime_error("packed_file mmap error");
+        }
+        map_ = static_cast<const char*>(ptr);
+        map_size_ = new_size;
+    }
+
+    // Must hold mtx_. Apply the complete records others appended behind end_
+    void catch_up(std::vector<change>* changes) {
+        struct stat st {};
+        if (fstat(fd_, &st) != 0 || static_cast<uint64_t>(st.st_size) <= end_) {
+            return;
+        }
+        auto size = static_cast<uint64_t>(st.st_size);
+        map_log(size);
+        record_header h{};
+        while (read_record(end_, size, h)) {
+            apply_record(end_, changes);
+        }
+    }
+
+    void open_log() {
+        fd_ = ::open(file_path_.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd_ < 0) {
+            throw std::runtime_error("packed_file open error: " + file_path_);
+        }
+        flock(fd_, LOCK_EX);
+        struct stat st {};
+        fstat(fd_, &st);
+        inode_ = st.st_ino;
+        dev_ = st.st_dev;
+        if (st.st_size == 0) {
+            uint32_t header[2] = { file_magic, file_version };
+            write_all(fd_, reinterpret_cast<const char*>(header), sizeof(header), 0);
+        }
+
+        map_log(file_header_size);
+        uint32_t header[2]{};
+        std::memcpy(header, map_, sizeof(header));
+        if (header[0] != file_magic || header[1] != file_version) {
+            close_log();
+            throw std::runtime_error("packed_file bad log header: " + file_path_);
+        }
+        end_ = file_header_size;
+        live_bytes_ = dead_bytes_ = 0;
+        index_.clear();
+        index_["/"];
+        catch_up(nullptr);
+        flock(fd_, LOCK_UN);
+    }
+
+    void close_log() {
+        if (map_) {
+            munmap(const_cast<char*>(map_), map_size_);
+        }
+        if (fd_ >= 0) {
+            ::close(fd_);
+        }
+        map_ = nullptr;
+        map_size_ = 0;
+        fd_ = -1;
+    }
+
+    // The log was compacted by someone else when the path no longer names our file
+    bool log_replaced() const {
+        struct stat st {};
+        if (stat(file_path_.c_str(), &st) != 0) {
+            return false;
+        }
+        return st.st_ino != inode_ || st.st_dev != dev_;
+    }
+
+    // Must hold mtx_. Reopen a replaced log and report the difference as changes
+    void reload(std::vector<change>* changes) {
+        auto old_index = std::move(index_);
+        auto old_map = map_;
+        auto old_map_size = map_size_;
+        auto old_fd = fd_;
+        map_ = nullptr;
+        map_size_ = 0;
+        open_log();
+
+        if (changes) {
+            for (const auto& [path, n] : index_) {
+                auto it = old_index.find(path);
+                if (it == old_index.end()) {
+                    changes->push_back({ file_event::created_event, path });
+                    changes->push_back({ file_event::child_event, split_parent(path).first });
+                    continue;
+                }
+                auto same = it->second.flags == n.flags && it->second.value_len == n.value_len &&
+                    std::memcmp(old_map + it->second.value_offset, map_ + n.value_offset, n.value_len) == 0;
+                if (!same) {
+                    changes->push_back({ file_event::changed_event, path });
+                }
+            }
+            for (const auto& [path, n] : old_index) {
+                if (index_.find(path) == index_.end()) {
+                    changes->push_back({ file_event::deleted_event, path });
+                    changes->push_back({ file_event::child_event, split_parent(path).first });
+                }
+            }
+        }
+        munmap(const_cast<char*>(old_map), old_map_size);
+        ::close(old_fd);
+    }
+
+    // Must hold mtx_. Lock the log across processes and catch up with it before appending
+    void begin_write(std::vector<change>& changes) {
+        for (;;) {
+            flock(fd_, LOCK_EX);
+            if (!log_replaced()) {
+                break;
+            }
+            flock(fd_, LOCK_UN);
+            reload(&changes);
+        }
+        catch_up(&changes);
+        struct stat st {};
+        if (fstat(fd_, &st) == 0 && static_cast<uint64_t>(st.st_size) > end_) {
+            // torn tail of a crashed writer
+            [[maybe_unused]] auto r = ftruncate(fd_, static_cast<off_t>(end_));
+        }
+    }
+
+    void end_write() {
+        flock(fd_, LOCK_UN);
+    }
+
+    // Must hold mtx_. Callbacks are resolved now and run in order on the task thread
+    void notify(const std::vector<change>& changes) {
+        std::vector<std::function<void()>> calls;
+        for (const auto& c : changes) {
+            if (c.event == file_event::child_event) {
+                auto it = child_watches_.find(c.path);
+                auto parent = index_.find(c.path);
+                if (it == child_watches_.end() || parent == index_.end()) {
+                    continue;
+                }
+                std::vector<std::string> children(parent->second.children.begin(), parent->second.children.end());
+                for (const auto& cb : it->second) {
+                    calls.emplace_back([cb, children]() mutable { cb(make_ec(file_error::ok), std::move(children)); });
+                }
+                continue;
+            }
+
+            auto deleted = c.event == file_event::deleted_event;
+            auto err = deleted ? file_error::not_exist : file_error::ok;
+            if (auto it = exist_watches_.find(c.path); it != exist_watches_.end()) {
+                for (const auto& watch : it->second) {
+                    calls.emplace_back([watch, err, eve = c.event]() { (*watch)(make_ec(err), eve); });
+                }
+            }
+            if (auto it = data_watches_.find(c.path); it != data_watches_.end() &&
+                c.event != file_event::created_event) {
+                std::optional<std::string> value;
+                auto n = index_.find(c.path);
+                if (!deleted && n != index_.end()) {
+                    value = node_value(n->second);
+                }
+                for (const auto& cb : it->second) {
+                    calls.emplace_back([cb, err, eve = c.event, p = c.path, value]() mutable {
+                        cb(make_ec(err), eve, p, std::move(value));
+                    });
+                }
+            }
+            if (deleted) {
+                data_watches_.erase(c.path);
+                child_watches_.erase(c.path);
+            }
+        }
+        if (!calls.empty()) {
+            add_task([calls = std::move(calls)]() {
+                for (const auto& call : calls) {
+                    call();
+                }
+            });
+        }
+    }
+
+    // Writers append under LOCK_EX, so a shared lock never sees a record being written
+    void follow_tail() {
+        std::unique_lock lock(mtx_);
+        std::vector<change> changes;
+        flock(fd_, LOCK_SH);
+        if (log_replaced()) {
+            flock(fd_, LOCK_UN);
+            reload(&changes);
+        }
+        else {
+            catch_up(&changes);
+            flock(fd_, LOCK_UN);
+        }
+        notify(changes);
+    }
+
+    // Like zookeeper, a ttl node without children expires once it has not been modified for ttl ms
+    void expire_ttl_paths() {
+        std::unique_lock lock(mtx_);
+        std::vector<std::string> expired;
+        ttl_wheel_.advance(steady_tick(), [&](std::string&& path) {
+            auto it = index_.find(path);
+            if (it == index_.end() || !(it->second.flags & flag_ttl)) {
+                return;
+            }
+            auto idle = now_ms() - it->second.mtime_ms;
+            if (idle < it->second.ttl_ms || !it->second.children.empty()) {
+                auto wait = std::max<int64_t>(it->second.ttl_ms - idle, ttl_tick_ms);
+                ttl_wheel_.add(steady_tick() + static_cast<uint64_t>(wait / ttl_tick_ms + 1), std::move(path));
+                return;
+            }
+            expired.emplace_back(std::move(path));
+        });
+        if (expired.empty()) {
+            return;
+        }
+
+        std::vector<change> changes;
+        begin_write(changes);
+        for (const auto& path : expired) {
+            auto it = index_.find(path);
+            if (it != index_.end() && it->second.children.empty()) {
+                append(op_del, 0, path, {}, 0, -1, 0, now_ms(), changes);
+            }
+        }
+        end_write();
+        notify(changes);
+    }
+
+    void compact_if_needed() {
+        std::unique_lock lock(mtx_);
+        if (dead_bytes_ < compact_bytes_ || dead_bytes_ < live_bytes_) {
+            return;
+        }
+        std::vector<change> changes;
+        begin_write(changes);
+        notify(changes);
+        compact();
+        end_write();
+    }
+
+    // Must hold mtx_ and the write lock. Parent sorts before its children, so replay stays valid.
+    // The root is written too, for its cversion, the base of the sequential names under it.
+    void compact() {
+        std::vector<const std::pair<const std::string, node>*> nodes;
+        nodes.reserve(index_.size());
+        for (const auto& kv : index_) {
+            nodes.emplace_back(&kv);
+        }
+        std::sort(nodes.begin(), nodes.end(), [](auto a, auto b) { return a->first < b->first; });
+
+        auto tmp_path = file_path_ + ".compact";
+        auto tmp_fd = ::open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (tmp_fd < 0) {
+            return;
+        }
+        std::string buffer;
+        uint32_t header[2] = { file_magic, file_version };
+        buffer.append(reinterpret_cast<const char*>(header), sizeof(header));
+        for (auto kv : nodes) {
+            const auto& n = kv->second;
+            auto value = std::string_view(map_ + n.value_offset, n.value_len);
+            buffer += make_record(op_put, static_cast<uint8_t>(n.flags | flag_snapshot), kv->first, value,
+                                  n.cversion, n.ttl_ms, n.owner, n.mtime_ms);
+        }
+        auto ok = write_all(tmp_fd, buffer.data(), buffer.size(), 0) && fsync(tmp_fd) == 0;
+        ::close(tmp_fd);
+        if (!ok || rename(tmp_path.c_str(), file_path_.c_str()) != 0) {
+            unlink(tmp_path.c_str());
+            return;
+        }
+        auto old_fd = fd_;
+        close_log_keep_fd();
+        open_log();
+        ::close(old_fd);  // releases the write lock of the old log
+        flock(fd_, LOCK_EX);  // end_write() unlocks the new one
+    }
+
+    void close_log_keep_fd() {
+        if (map_) {
+            munmap(const_cast<char*>(map_), map_size_);
+        }
+        map_ = nullptr;
+        map_size_ = 0;
+    }
+};
+
+}  // namespace loc
@@ -0,0 +1,41 @@
+#pragma once
+#include <cerrno>
+#include <cstdint>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <process.h>
+#include <windows.h>
+#else
+#include <signal.h>
+#include <unistd.h>
+#endif
+
+namespace loc {
+
+inline int64_t current_pid() {
+#ifdef _WIN32
+    return static_cast<int64_t>(_getpid());
+#else
+    return static_cast<int64_t>(getpid());
+#endif
+}
+
+// Used to recognize nodes left behind by a crashed process
+inline bool process_alive(int64_t pid) {
+#ifdef _WIN32
+    auto handle = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, static_cast<DWORD>(pid));
+    if (handle == nullptr) {
+        return false;
+    }
+    DWORD code = 0;
+    auto ok = GetExitCodeProcess(handle, &code);
+    CloseHandle(handle);
+    return ok && code == STILL_ACTIVE;
+#else
+    return kill(static_cast<pid_t>(pid), 0) == 0 || errno == EPERM;
+#endif
+}
+
+}  // namespace loc
@@ -0,0 +1,115 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace loc {
+
+// Hierarchical timing wheel: level n has 64 slots, each slot spans 64^n ticks.
+// add() and advancing one tick are O(1); an entry only moves when the level below wraps
+// and its slot is cascaded down, so the cost never depends on how many timers are pending.
+template <typename T>
+class timer_wheel {
+public:
+    static constexpr size_t slot_bits = 6;
+    static constexpr size_t slot_count = size_t(1) << slot_bits;
+    static constexpr size_t level_count = 4;
+    static constexpr uint64_t max_span = uint64_t(1) << (slot_bits * level_count);
+
+private:
+    static constexpr uint64_t slot_mask = slot_count - 1;
+
+    struct entry {
+        uint64_t deadline;
+        T value;
+    };
+    using slot_type = std::vector<entry>;
+
+    std::array<std::array<slot_type, slot_count>, level_count> levels_;
+    uint64_t now_ = 0;  // next tick to be processed
+    size_t size_ = 0;
+
+public:
+    explicit timer_wheel(uint64_t now = 0) : now_(now) {}
+
+    uint64_t now() const {
+        return now_;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    bool empty() const {
+        return size_ == 0;
+    }
+
+    // A deadline in the past fires on the next advance()
+    void add(uint64_t deadline, T value) {
+        place(entry{ deadline, std::move(value) });
+        ++size_;
+    }
+
+    // Process every tick up to and including `to`, cb(T&&) is called for each expired entry
+    template <typename Callback>
+    void advance(uint64_t to, Callback&& cb) {
+        while (now_ <= to) {
+            if (size_ == 0) {  // nothing pending, skip the idle ticks
+                now_ = to + 1;
+                return;
+            }
+
+            auto index = now_ & slot_mask;
+            if (index == 0) {
+                cascade(1);
+            }
+
+            auto expired = std::move(levels_[0][index]);
+            levels_[0][index].clear();
+            ++now_;
+            for (auto& e : expired) {
+                if (e.deadline >= now_) {  // clamped far deadline, not due yet
+                    place(std::move(e));
+                    continue;
+                }
+                --size_;
+                cb(std::move(e.value));
+            }
+        }
+    }
+
+private:
+    void place(entry&& e) {
+        auto delta = e.deadline < now_ ? 0 : e.deadline - now_;
+        if (delta >= max_span) {
+            delta = max_span - 1;
+        }
+        auto tick = now_ + delta;
+
+        size_t level = 0;
+        while (level + 1 < level_count && delta >= (uint64_t(1) << (slot_bits * (level + 1)))) {
+            ++level;
+        }
+        auto index = (tick >> (slot_bits * level)) & slot_mask;
+        levels_[level][index].emplace_back(std::move(e));
+    }
+
+    void cascade(size_t level) {
+        if (level >= level_count) {
+            return;
+        }
+        auto index = (now_ >> (slot_bits * level)) & slot_mask;
+        if (index == 0) {
+            cascade(level + 1);
+        }
+        auto entries = std::move(levels_[level][index]);
+        levels_[level][index].clear();
+        for (auto& e : entries) {
+            place(std::move(e));
+        }
+    }
+};
+
+}  // namespace loc
@@ -0,0 +1,245 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace cm {
+
+enum class metric_type {
+	counter,
+	gauge,
+	histogram
+};
+
+/**
+ * @brief Durations counted in fixed buckets, observe() is a few relaxed atomic adds.
+ */
+class duration_histogram {
+public:
+	struct snapshot {
+		std::vector<double> bounds;    // upper bounds in seconds
+		std::vector<uint64_t> counts;  // per bucket, the last one is +Inf
+		double sum = 0;                // seconds
+	};
+
+	/**
+	 * @param bounds Ascending upper bucket bounds in seconds, +Inf is implied
+	 */
+	explicit duration_histogram(std::vector<double> bounds = default_bounds())
+		: bounds_(std::move(bounds)), counts_(new std::atomic<uint64_t>[bounds_.size() + 1]) {
+		for (size_t i = 0; i <= bounds_.size(); ++i) {
+			counts_[i] = 0;
+		}
+	}
+
+	static std::vector<double> default_bounds() {
+		return { 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01,
+			0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5 };
+	}
+
+	void observe(std::chrono::nanoseconds elapsed) {
+		auto seconds = std::chrono::duration<double>(elapsed).count();
+		size_t i = 0;
+		while (i < bounds_.size() && seconds > bounds_[i]) {
+			++i;
+		}
+		counts_[i].fetch_add(1, std::memory_order_relaxed);
+		sum_ns_.fetch_add((uint64_t)elapsed.count(), std::memory_order_relaxed);
+	}
+
+	snapshot get() const {
+		snapshot snap;
+		snap.bounds = bounds_;
+		for (size_t i = 0; i <= bounds_.size(); ++i) {
+			snap.counts.push_back(counts_[i].load(std::memory_order_relaxed));
+		}
+		snap.sum = (double)sum_ns_.load(std::memory_order_relaxed) / 1e9;
+		return snap;
+	}
+
+private:
+	std::vector<double> bounds_;
+	std::unique_ptr<std::atomic<uint64_t>[]> counts_;
+	std::atomic<uint64_t> sum_ns_ = 0;
+};
+
+/**
+ * @brief Renders registered metrics in the Prometheus text exposition format.
+ * Nothing is sampled until a render: a series is a function reading a value its owner
+ * keeps up to date, so the owner's hot paths never touch the registry.
+ */
+class metrics_registry {
+public:
+	using value_fn = std::function<double()>;
+
+	static auto& instance() {
+		static metrics_registry registry;
+		return registry;
+	}
+
+	/**
+	 * @brief Add a counter or gauge series
+	 * @param labels Inside the braces, e.g. `state="connected"`, may be empty
+	 * @param owner Series added with the same owner are dropped together by remove()
+	 */
+	void add(std::string_view name, std::string_view help, metric_type type,
+		std::string_view labels, value_fn value, const void* owner = nullptr) {
+		std::lock_guard<std::mutex> lock(mtx_);
+		auto& fam = family_of(name, help, type);
+		fam.entries.push_back(series{ std::string(labels), std::move(value), nullptr, owner });
+	}
+
+	/**
+	 * @brief Add a histogram series, hist must outlive it
+	 */
+	void add(std::string_view name, std::string_view help, std::string_view labels,
+		const duration_histogram& hist, const void* owner = nullptr) {
+		std::lock_guard<std::mutex> lock(mtx_);
+		auto& fam = family_of(name, help, metric_type::histogram);
+		fam.entries.push_back(series{ std::string(labels), {}, &hist, owner });
+	}
+
+	void remove(const void* owner) {
+		std::lock_guard<std::mutex> lock(mtx_);
+		for (auto it = families_.begin(); it != families_.end();) {
+			auto& s = it->second.entries;
+			s.erase(std::remove_if(s.begin(), s.end(),
+				[owner](const series& one) { return one.owner == owner; }), s.end());
+			it = s.empty() ? families_.erase(it) : std::next(it);
+		}
+	}
+
+	void render(std::string& out) const {
+		std::lock_guard<std::mutex> lock(mtx_);
+		for (auto& [name, fam] : families_) {
+			out += "# HELP " + name + " " + fam.help + "\n";
+			out += "# TYPE " + name + " " + type_name(fam.type) + "\n";
+			for (auto& s : fam.entries) {
+				if (s.hist) {
+					render_histogram(out, name, s.labels, s.hist->get());
+				}
+				else {
+					render_sample(out, name, s.labels, s.value());
+				}
+			}
+		}
+	}
+
+	std::string render() const {
+		std::string out;
+		render(out);
+		return out;
+	}
+
+	/**
+	 * @brief Render into a caller's buffer, like snprintf
+	 * @return The full length of the text, it was truncated if this is not below size
+	 */
+	size_t render(char* buf, size_t size) const {
+		auto out = render();
+		if (size > 0) {
+			auto n = std::min(out.size(), size - 1);
+			std::memcpy(buf, out.data(), n);
+			buf[n] = '\0';
+		}
+		return out.size();
+	}
+
+	/**
+	 * @brief Replace a file with the rendered text, readers never see it half written
+	 */
+	bool write_file(const std::string& path) const {
+		auto out = render();
+		auto tmp = path + ".tmp";
+		auto f = std::fopen(tmp.c_str(), "wb");
+		if (!f) {
+			return false;
+		}
+		auto ok = std::fwrite(out.data(), 1, out.size(), f) == out.size();
+		ok = std::fclose(f) == 0 && ok;
+		if (!ok) {
+			std::remove(tmp.c_str());
+			return false;
+		}
+		std::remove(path.c_str());  // rename does not replace on windows
+		return std::rename(tmp.c_str(), path.c_str()) == 0;
+	}
+
+private:
+	struct series {
+		std::string labels;
+		value_fn value;
+		const duration_histogram* hist;
+		const void* owner;
+	};
+	struct family {
+		std::string help;
+		metric_type type;
+		std::vector<series> entries;
+	};
+
+	family& family_of(std::string_view name, std::string_view help, metric_type type) {
+		auto [it, added] = families_.try_emplace(std::string(name));
+		if (added) {
+			it->second.help = help;
+			it->second.type = type;
+		}
+		return it->second;
+	}
+
+	static const char* type_name(metric_type type) {
+		switch (type) {
+		case metric_type::counter: return "counter";
+		case metric_type::gauge: return "gauge";
+		default: return "histogram";
+		}
+	}
+
+	static void render_sample(std::string& out, std::string_view name, std::string_view labels,
+		double value) {
+		char num[32];
+		std::snprintf(num, sizeof(num), "%.15g", value);
+		out += name;
+		if (!labels.empty()) {
+			out += "{";
+			out += labels;
+			out += "}";
+		}
+		out += " ";
+		out += num;
+		out += "\n";
+	}
+
+	static void render_histogram(std::string& out, const std::string& name, const std::string& labels,
+		const duration_histogram::snapshot& snap) {
+		auto prefix = labels.empty() ? std::string() : labels + ",";
+		uint64_t cumulative = 0;
+		for (size_t i = 0; i < snap.counts.size(); ++i) {
+			cumulative += snap.counts[i];
+			char le[32];
+			if (i < snap.bounds.size()) {
+				std::snprintf(le, sizeof(le), "%g", snap.bounds[i]);
+			}
+			else {
+				std::snprintf(le, sizeof(le), "+Inf");
+			}
+			render_sample(out, name + "_bucket", prefix + "le=\"" + le + "\"", (double)cumulative);
+		}
+		render_sample(out, name + "_sum", labels, snap.sum);
+		render_sample(out, name + "_count", labels, (double)cumulative);
+	}
+
+	mutable std::mutex mtx_;
+	std::map<std::string, family> families_;
+};
+}  // namespace cm
@@ -0,0 +1,30 @@
+#pragma once
+
+// USDT probes of the C++ layer, for perf and bpftrace. A probe site is a single nop
+// while nothing is attached, so the arguments are only values already at hand;
+// durations are left to the tracer, between the start and done probes of a thread.
+//
+//   cppzk:watch_fired(ctx, path, event)          a watch went off, ctx identifies the watch
+//   cppzk:watch_callback_start(ctx, event, rc)   the callback of its read starts
+//   cppzk:watch_callback_done(ctx, event, rc)
+//   cppzk:value_read(ctx, path, len)             a watched value arrived, -1 if none
+//   loc_file:loop_wakeup(tasks, polls)           the monitor loop woke up with this much work
+//   loc_file:scan_start(path, kind)              it polls a watched path
+//   loc_file:scan_done(path, kind, changed)
+//
+// Compiled in when ZOO_WITH_PROBES is defined and <sys/sdt.h> is found, as the probes
+// of the C client; -DWITH_USDT=ON defines it for whatever links the zookeeper target.
+#if defined(ZOO_WITH_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define CM_PROBES_ENABLED 1
+#endif
+#endif
+
+#ifdef CM_PROBES_ENABLED
+#define CM_PROBE2(provider, name, a, b) DTRACE_PROBE2(provider, name, a, b)
+#define CM_PROBE3(provider, name, a, b, c) DTRACE_PROBE3(provider, name, a, b, c)
+#else
+#define CM_PROBE2(provider, name, a, b) ((void)(a), (void)(b))
+#define CM_PROBE3(provider, name, a, b, c) ((void)(a), (void)(b), (void)(c))
+#endif
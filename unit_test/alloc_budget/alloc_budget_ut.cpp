@@ -0,0 +1,101 @@
+// Allocation budgets of the hot paths. CM_ALLOC_STATS_REPLACE_NEW replaces the global
+// operator new of the whole program, so these live in a test binary of their own.
+//
+// What an event allocates depends on the standard library (small buffer sizes of
+// std::function and std::string...). A budget is therefore checked against a baseline
+// measured in the same binary, the bare cppzk read a watch event needs in any case;
+// CM_WATCH_EVENT_ALLOC_OVERHEAD sets the allocations per event allowed above it.
+#include <condition_variable>
+#include <cstdlib>
+#include <mutex>
+
+#include "alloc_stats.hpp"
+#include "config_monitor.hpp"
+#include "cppzk/cppzk.hpp"
+#include "fake_zk_server.hpp"
+#include "gtest/gtest.h"
+
+using namespace std::chrono_literals;
+
+CM_ALLOC_STATS_REPLACE_NEW()
+
+namespace {
+
+size_t env_or(const char* name, size_t fallback) {
+	auto value = std::getenv(name);
+	return value && *value ? std::strtoull(value, nullptr, 10) : fallback;
+}
+
+// Counts watch events, set() waits for the one its write causes
+class event_counter {
+public:
+	void fired() {
+		std::lock_guard<std::mutex> lock(mtx_);
+		++events_;
+		cv_.notify_all();
+	}
+
+	bool wait_for(size_t count) {
+		std::unique_lock<std::mutex> lock(mtx_);
+		return cv_.wait_for(lock, 3s, [&] { return events_ >= count; });
+	}
+
+private:
+	std::mutex mtx_;
+	std::condition_variable cv_;
+	size_t events_ = 0;
+};
+
+// The counts of rounds writes of path, each waited for as a watch event
+template <typename Monitor>
+cm::alloc_stats::snapshot measure(Monitor& writer, event_counter& counter, const std::string& path,
+	size_t rounds) {
+	auto& stats = cm::alloc_stats::instance();
+	cm::alloc_stats::enable(true);
+	auto before = stats.get();
+	for (size_t i = 0; i < rounds; ++i) {
+		writer.set_path_value(path, std::string(100, (char)('a' + i % 26)));
+		EXPECT_TRUE(counter.wait_for(i + 2));
+	}
+	auto used = cm::alloc_stats::diff(stats.get(), before);
+	cm::alloc_stats::enable(false);
+	return used;
+}
+
+}  // namespace
+
+// Guards the allocations of the watch hot path, lower the overhead when they go down
+TEST(alloc_budget, watch_event) {
+	constexpr size_t rounds = 50;
+	zk::fake_server server;
+	cm::config_monitor<zk::cppzk> monitor;
+	monitor.init(server.hosts(), 30000);
+	monitor.create_path("/baseline", std::string(100, 'v'));
+	monitor.create_path("/budget", std::string(100, 'v'));
+
+	// baseline: a persistent watch of the bare backend, which reads the value on each event
+	zk::cppzk bare;
+	bare.initialize(server.hosts(), 30000);
+	event_counter base_events;
+	bare.async_get_path_value<true>("/baseline", [&](const auto&, auto, auto, auto&&) {
+		base_events.fired();
+	});
+	ASSERT_TRUE(base_events.wait_for(1));
+	auto base = measure(monitor, base_events, "/baseline", rounds)[(size_t)cm::alloc_op::watch_event];
+
+	event_counter events;
+	monitor.watch_path("/budget", [&](auto, auto&&) {
+		events.fired();
+	});
+	ASSERT_TRUE(events.wait_for(1));
+	auto used = measure(monitor, events, "/budget", rounds);
+
+	auto& eve = used[(size_t)cm::alloc_op::watch_event];
+	EXPECT_EQ(eve.copies, rounds);  // the value, once
+	EXPECT_EQ(eve.copied_bytes, rounds * 100);
+	EXPECT_LE(eve.allocs, base.allocs + rounds * env_or("CM_WATCH_EVENT_ALLOC_OVERHEAD", 4));
+	EXPECT_EQ(used[(size_t)cm::alloc_op::set].allocs, 0u);
+	testing::Test::RecordProperty("baseline_allocs_per_event", std::to_string(base.allocs / rounds));
+	testing::Test::RecordProperty("watch_event_allocs_per_event", std::to_string(eve.allocs / rounds));
+	testing::Test::RecordProperty("watch_event_bytes_per_event", std::to_string(eve.alloc_bytes / rounds));
+}
@@ -0,0 +1,332 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <future>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include "config_monitor.hpp"
+#include "cppzk/cppzk.hpp"
+#include "fake_zk_server.hpp"
+#include "local_file/packed_file.hpp"
+#include "gtest/gtest.h"
+
+using namespace std::chrono_literals;
+
+// What a backend has to provide to run the conformance suite: a name for the report,
+// how to bring up a config_monitor on it, and how its error codes map to the few
+// conditions the suite checks. A new backend specializes this and joins backend_types.
+template <typename ConfigType>
+struct backend;
+
+template <>
+struct backend<zk::cppzk> {
+	static constexpr const char* name = "cppzk";
+	zk::fake_server server;
+
+	void init(cm::config_monitor<zk::cppzk>& monitor) {
+		monitor.init(server.hosts(), 30000);
+	}
+
+	static bool no_node(const std::error_code& ec) {
+		return ec.value() == ZOO_ERRORS::ZNONODE;
+	}
+
+	static bool node_exists(const std::error_code& ec) {
+		return ec.value() == ZOO_ERRORS::ZNODEEXISTS;
+	}
+};
+
+template <>
+struct backend<loc::packed_file> {
+	static constexpr const char* name = "packed_file";
+	std::string file = "./conformance_packed_file.log";
+
+	backend() {
+		std::remove(file.c_str());
+	}
+
+	~backend() {
+		std::remove(file.c_str());
+		std::remove((file + ".compact").c_str());
+	}
+
+	void init(cm::config_monitor<loc::packed_file>& monitor) {
+		monitor.init(file, 10);
+	}
+
+	static bool no_node(const std::error_code& ec) {
+		return ec.value() == static_cast<int>(loc::file_error::not_exist);
+	}
+
+	static bool node_exists(const std::error_code& ec) {
+		return ec.value() == static_cast<int>(loc::file_error::already_exist);
+	}
+};
+
+// Numbers of every backend, printed side by side once all tests are done
+class perf_report : public testing::Environment {
+public:
+	static void add(const std::string& metric, const std::string& name, double value) {
+		std::lock_guard<std::mutex> lock(mtx());
+		auto& rows = table();
+		auto it = std::find_if(rows.begin(), rows.end(), [&](auto& row) { return row.first == metric; });
+		if (it == rows.end()) {
+			it = rows.insert(rows.end(), { metric, {} });
+		}
+		it->second[name] = value;
+		if (std::find(columns().begin(), columns().end(), name) == columns().end()) {
+			columns().push_back(name);
+		}
+	}
+
+	void TearDown() override {
+		std::lock_guard<std::mutex> lock(mtx());
+		if (table().empty()) {
+			return;
+		}
+		std::ostringstream out;
+		out << std::left << std::setw(28) << "metric";
+		for (auto& col : columns()) {
+			out << std::right << std::setw(14) << col;
+		}
+		out << "\n";
+		for (auto& [metric, values] : table()) {
+			out << std::left << std::setw(28) << metric;
+			for (auto& col : columns()) {
+				auto it = values.find(col);
+				if (it == values.end()) {
+					out << std::right << std::setw(14) << "-";
+				}
+				else {
+					out << std::right << std::setw(14) << std::fixed << std::setprecision(1) << it->second;
+				}
+			}
+			out << "\n";
+		}
+		std::cout << out.str();
+	}
+
+private:
+	static std::mutex& mtx() {
+		static std::mutex m;
+		return m;
+	}
+
+	static std::vector<std::pair<std::string, std::map<std::string, double>>>& table() {
+		static std::vector<std::pair<std::string, std::map<std::string, double>>> rows;
+		return rows;
+	}
+
+	static std::vector<std::string>& columns() {
+		static std::vector<std::string> cols;
+		return cols;
+	}
+};
+
+static auto* const perf_env = testing::AddGlobalTestEnvironment(new perf_report);
+
+template <typename ConfigType>
+class conformance_test : public testing::Test {
+protected:
+	using traits = backend<ConfigType>;
+
+	traits backend_;  // before monitor_, a server or file must outlive its client
+	cm::config_monitor<ConfigType> monitor_;
+	std::string root_ = "/conformance";
+
+	void SetUp() override {
+		backend_.init(monitor_);
+	}
+
+	void report(const std::string& metric, double value) {
+		perf_report::add(metric, traits::name, value);
+	}
+};
+
+using backend_types = testing::Types<zk::cppzk, loc::packed_file>;
+TYPED_TEST_SUITE(conformance_test, backend_types);
+
+TYPED_TEST(conformance_test, crud_error_codes) {
+	using traits = typename TestFixture::traits;
+	auto& m = this->monitor_;
+	auto node = this->root_ + "/node";
+
+	auto [ec, path] = m.create_path(node, std::string("v1"));
+	EXPECT_EQ(ec.value(), 0);
+	EXPECT_EQ(path, node);
+	EXPECT_TRUE(traits::node_exists(std::get<0>(m.create_path(node, std::string("v1")))));
+
+	EXPECT_EQ(m.set_path_value(node, "v2").value(), 0);
+	auto [gec, value] = m.get_path_value(node);
+	EXPECT_EQ(gec.value(), 0);
+	EXPECT_EQ(value, "v2");
+
+	auto [sec, subs] = m.get_sub_path(this->root_);
+	EXPECT_EQ(sec.value(), 0);
+	ASSERT_EQ(subs.size(), 1u);
+	EXPECT_NE(subs[0].find("node"), std::string::npos);
+
+	EXPECT_EQ(m.del_path(this->root_).value(), 0);
+	EXPECT_TRUE(traits::no_node(std::get<0>(m.get_path_value(node))));
+	EXPECT_TRUE(traits::no_node(m.set_path_value(node, "v3")));
+	EXPECT_TRUE(traits::no_node(std::get<0>(m.get_sub_path(this->root_))));
+};
+
+TYPED_TEST(conformance_test, async_matches_sync) {
+	using traits = typename TestFixture::traits;
+	auto& m = this->monitor_;
+	auto node = this->root_ + "/async";
+
+	std::promise<std::pair<std::error_code, std::string>> created;
+	m.async_create_path(node, [&created](const std::error_code& ec, std::string&& path) {
+		created.set_value({ ec, std::move(path) });
+	}, std::string("v1"));
+	auto [cec, path] = created.get_future().get();
+	EXPECT_EQ(cec.value(), 0);
+	EXPECT_EQ(path, node);
+
+	std::promise<std::pair<std::error_code, std::optional<std::string>>> got;
+	m.async_get_path_value(node, [&got](const std::error_code& ec, std::optional<std::string>&& value) {
+		got.set_value({ ec, std::move(value) });
+	});
+	auto [gec, value] = got.get_future().get();
+	EXPECT_EQ(gec.value(), 0);
+	EXPECT_EQ(value, "v1");
+
+	std::promise<std::error_code> missing;
+	m.async_get_path_value(node + "/missing", [&missing](const std::error_code& ec, std::optional<std::string>&&) {
+		missing.set_value(ec);
+	});
+	EXPECT_TRUE(traits::no_node(missing.get_future().get()));
+};
+
+TYPED_TEST(conformance_test, sequential_names) {
+	auto& m = this->monitor_;
+	auto prefix = this->root_ + "/seq-";
+	std::vector<std::string> paths;
+	for (int i = 0; i < 3; ++i) {
+		auto [ec, path] = m.create_path(prefix, std::to_string(i), cm::create_mode::persistent_sequential);
+		EXPECT_EQ(ec.value(), 0);
+		paths.push_back(path);
+	}
+	for (size_t i = 0; i < paths.size(); ++i) {
+		ASSERT_EQ(paths[i].size(), prefix.size() + 10);
+		EXPECT_EQ(paths[i].compare(0, prefix.size(), prefix), 0);
+		EXPECT_TRUE(i == 0 || paths[i - 1] < paths[i]);
+	}
+};
+
+TYPED_TEST(conformance_test, watch_path_event_order) {
+	auto& m = this->monitor_;
+	auto node = this->root_ + "/watched";
+	m.create_path(node, std::string("v1"));
+
+	std::mutex mtx;
+	std::vector<std::pair<cm::path_event, std::optional<std::string>>> events;
+	auto done = std::make_shared<std::promise<void>>();
+	m.watch_path(node, [&](cm::path_event eve, std::optional<std::string>&& value) {
+		std::lock_guard<std::mutex> lock(mtx);
+		events.emplace_back(eve, std::move(value));
+		if (eve == cm::path_event::del) {
+			done->set_value();
+		}
+	});
+	std::this_thread::sleep_for(50ms);
+	m.set_path_value(node, "v2");
+	std::this_thread::sleep_for(50ms);
+	m.del_path(node);
+	ASSERT_EQ(done->get_future().wait_for(5s), std::future_status::ready);
+
+	std::lock_guard<std::mutex> lock(mtx);
+	ASSERT_EQ(events.size(), 3u);
+	EXPECT_EQ(events[0].first, cm::path_event::changed);
+	EXPECT_EQ(events[0].second, "v1");
+	EXPECT_EQ(events[1].first, cm::path_event::changed);
+	EXPECT_EQ(events[1].second, "v2");
+	EXPECT_EQ(events[2].first, cm::path_event::del);
+};
+
+TYPED_TEST(conformance_test, watch_sub_path_events) {
+	auto& m = this->monitor_;
+	m.create_path(this->root_ + "/a", std::string("1"));
+
+	std::mutex mtx;
+	std::set<std::string> values;
+	std::promise<void> done;
+	m.watch_sub_path(this->root_, [&](cm::path_event, std::string_view, std::optional<std::string>&& value) {
+		std::lock_guard<std::mutex> lock(mtx);
+		if (values.emplace(value.value_or("")).second && values.size() == 2) {
+			done.set_value();
+		}
+	});
+	std::this_thread::sleep_for(50ms);
+	m.create_path(this->root_ + "/b", std::string("2"));
+	ASSERT_EQ(done.get_future().wait_for(5s), std::future_status::ready);
+
+	std::lock_guard<std::mutex> lock(mtx);
+	EXPECT_EQ(values, (std::set<std::string>{ "1", "2" }));
+};
+
+// Not a pass/fail gate, the numbers only feed the side by side report
+TYPED_TEST(conformance_test, throughput_and_latency) {
+	using clock = std::chrono::steady_clock;
+	auto& m = this->monitor_;
+	auto node = this->root_ + "/perf";
+	m.create_path(node, std::string("0"));
+
+	constexpr int sync_ops = 200;
+	auto start = clock::now();
+	for (int i = 0; i < sync_ops; ++i) {
+		ASSERT_EQ(m.set_path_value(node, std::to_string(i)).value(), 0);
+		ASSERT_EQ(std::get<0>(m.get_path_value(node)).value(), 0);
+	}
+	std::chrono::duration<double> sync_time = clock::now() - start;
+	this->report("sync set+get ops/s", 2 * sync_ops / sync_time.count());
+
+	constexpr int async_ops = 1000;
+	std::atomic<int> pending = async_ops;
+	std::promise<void> drained;
+	start = clock::now();
+	for (int i = 0; i < async_ops; ++i) {
+		m.async_get_path_value(node, [&](const std::error_code&, std::optional<std::string>&&) {
+			if (--pending == 0) {
+				drained.set_value();
+			}
+		});
+	}
+	ASSERT_EQ(drained.get_future().wait_for(10s), std::future_status::ready);
+	std::chrono::duration<double> async_time = clock::now() - start;
+	this->report("async get ops/s", async_ops / async_time.count());
+
+	// set -> watch callback, one change in flight at a time
+	std::mutex mtx;
+	std::condition_variable cv;
+	std::string seen;
+	m.watch_path(node, [&](cm::path_event, std::optional<std::string>&& value) {
+		std::lock_guard<std::mutex> lock(mtx);
+		seen = value.value_or("");
+		cv.notify_one();
+	});
+	std::this_thread::sleep_for(50ms);
+	std::vector<double> latencies;
+	for (int i = 0; i < 20; ++i) {
+		auto expect = "w" + std::to_string(i);
+		auto sent = clock::now();
+		m.set_path_value(node, expect);
+		std::unique_lock<std::mutex> lock(mtx);
+		ASSERT_TRUE(cv.wait_for(lock, 5s, [&] { return seen == expect; }));
+		latencies.push_back(std::chrono::duration<double, std::micro>(clock::now() - sent).count());
+	}
+	std::sort(latencies.begin(), latencies.end());
+	this->report("watch latency p50 us", latencies[latencies.size() / 2]);
+	this->report("watch latency max us", latencies.back());
+};
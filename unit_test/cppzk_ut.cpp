@@ -261,6 +261,44 @@ TEST_P(cppzk_test, async_get_not_exist_path_value) {
 	pro.get_future().get();
 };
 
+TEST_P(cppzk_test, async_get_path_value_coalesced) {
+	std::string path = prefix + "/1";
+	std::string value = "5201314";
+	cm::config_monitor<>::instance().create_path(path, value);
+
+	constexpr int count = 64;
+	std::atomic<int> done = 0;
+	std::promise<void> pro;
+	for (int i = 0; i < count; ++i) {
+		cm::config_monitor<>::instance().async_get_path_value(path,
+			[&pro, &done, value](const std::error_code& ec, std::optional<std::string>&& val) {
+			EXPECT_EQ(ec.value(), 0);
+			EXPECT_EQ(val.value(), value);
+			if (++done == count) {
+				pro.set_value();
+			}
+		});
+	}
+	pro.get_future().get();
+};
+
+TEST_P(cppzk_test, async_get_path_view) {
+	std::string path = prefix + "/1";
+	std::string value = "5201314";
+	cm::config_monitor<>::instance().create_path(path, value);
+
+	std::promise<zk::data_buffer> pro;
+	cm::config_monitor<>::instance().async_get_path_view(path,
+		[&pro, value](const std::error_code& ec, zk::data_buffer&& buf) {
+		EXPECT_EQ(ec.value(), 0);
+		EXPECT_EQ(buf.view(), value);
+		EXPECT_TRUE(buf.take());
+		pro.set_value(std::move(buf));
+	});
+	auto buf = pro.get_future().get();
+	EXPECT_EQ(buf.view(), value);
+};
+
 TEST_P(cppzk_test, get_sub_path_value) {
 	std::string path1 = prefix + "/1";
 	std::string value1 = "5201314";
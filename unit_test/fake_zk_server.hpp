@@ -0,0 +1,1034 @@
+#pragma once
+#ifdef _WIN32
+#error "fake_zk_server needs POSIX sockets"
+#endif
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "proto.h"
+#include "zookeeper.h"
+
+// An in-process ZooKeeper stand-in speaking the jute wire protocol over loopback,
+// so the whole config_monitor<zk::cppzk> stack can run without an ensemble.
+// It is a single node with no persistence, ACLs are stored but not checked.
+namespace zk {
+
+// What happens to one request, see fake_server::set_fault_hook
+struct fake_fault {
+	std::chrono::milliseconds delay{ 0 };  // stall the connection before the request is applied
+	int error = 0;                         // answer with this error, the request is not applied
+	bool drop_reply = false;               // apply the request, never answer it
+	bool disconnect = false;               // close the connection, the session survives
+};
+
+struct fake_request {
+	int64_t session_id;
+	int32_t xid;
+	int32_t op;
+	std::string_view path;  // empty for requests without a path
+};
+
+using fake_fault_hook = std::function<fake_fault(const fake_request&)>;
+
+class fake_server {
+	class jute_in {
+	public:
+		jute_in(const char* data, size_t len) : p_(data), end_(data + len) {}
+
+		int32_t i32() {
+			uint32_t v = 0;
+			if (take(4)) {
+				std::memcpy(&v, p_ - 4, 4);
+			}
+			return (int32_t)ntohl(v);
+		}
+
+		int64_t i64() {
+			auto hi = (uint64_t)(uint32_t)i32();
+			auto lo = (uint64_t)(uint32_t)i32();
+			return (int64_t)(hi << 32 | lo);
+		}
+
+		bool boolean() {
+			return take(1) && p_[-1] != 0;
+		}
+
+		std::optional<std::string> buffer() {
+			auto len = i32();
+			if (len < 0 || !take((size_t)len)) {
+				return std::nullopt;
+			}
+			return std::string(p_ - len, (size_t)len);
+		}
+
+		std::string str() {
+			return buffer().value_or(std::string{});
+		}
+
+		bool ok() const {
+			return ok_;
+		}
+
+	private:
+		bool take(size_t n) {
+			if (!ok_ || (size_t)(end_ - p_) < n) {
+				ok_ = false;
+				return false;
+			}
+			p_ += n;
+			return true;
+		}
+
+		const char* p_;
+		const char* end_;
+		bool ok_ = true;
+	};
+
+	class jute_out {
+	public:
+		void i32(int32_t v) {
+			auto n = htonl((uint32_t)v);
+			buf_.append((const char*)&n, 4);
+		}
+
+		void i64(int64_t v) {
+			i32((int32_t)((uint64_t)v >> 32));
+			i32((int32_t)(uint64_t)v);
+		}
+
+		void boolean(bool v) {
+			buf_.push_back(v ? 1 : 0);
+		}
+
+		void buffer(const std::optional<std::string>& v) {
+			if (!v) {
+				i32(-1);
+				return;
+			}
+			i32((int32_t)v->size());
+			buf_.append(*v);
+		}
+
+		void str(std::string_view v) {
+			i32((int32_t)v.size());
+			buf_.append(v);
+		}
+
+		void append(const jute_out& other) {
+			buf_.append(other.buf_);
+		}
+
+		// length prefixed, ready for the socket
+		std::string frame() const {
+			jute_out len;
+			len.i32((int32_t)buf_.size());
+			return len.buf_ + buf_;
+		}
+
+	private:
+		std::string buf_;
+	};
+
+	struct acl_entry {
+		int32_t perms;
+		std::string scheme;
+		std::string id;
+	};
+
+	struct node {
+		std::optional<std::string> data;
+		std::vector<acl_entry> acl;
+		std::set<std::string> children;
+		int64_t czxid = 0;
+		int64_t mzxid = 0;
+		int64_t pzxid = 0;
+		int64_t ctime = 0;
+		int64_t mtime = 0;
+		int32_t version = 0;
+		int32_t cversion = 0;
+		int32_t aversion = 0;
+		int64_t ephemeral_owner = 0;
+		int64_t ttl = -1;
+		bool container = false;
+	};
+
+	struct connection {
+		int fd = -1;
+		int64_t session_id = 0;
+		std::thread worker;
+	};
+
+	struct session {
+		std::string passwd;
+		int timeout_ms = 0;
+		std::chrono::steady_clock::time_point last_seen;
+		connection* conn = nullptr;
+	};
+
+	// watches belong to a connection, a reconnecting client sends SetWatches
+	using watch_table = std::unordered_map<std::string, std::unordered_set<connection*>>;
+
+	struct pending_event {
+		watch_table* table;
+		std::string path;
+		int type;
+	};
+
+	static constexpr int min_session_timeout_ms = 4000;
+	static constexpr int max_session_timeout_ms = 40000;
+
+	int listen_fd_ = -1;
+	uint16_t port_ = 0;
+	std::atomic<bool> stop_ = false;
+	std::thread acceptor_;
+	std::thread reaper_;
+	std::condition_variable reaper_cv_;
+
+	std::mutex mtx_;  // everything below, replies are sent while holding it
+	std::map<std::string, node> nodes_;
+	std::set<std::string> expiring_nodes_;  // ttl and container nodes
+	std::unordered_map<int64_t, session> sessions_;
+	std::list<std::unique_ptr<connection>> conns_;
+	watch_table data_watches_;
+	watch_table child_watches_;
+	std::vector<std::pair<std::string, std::optional<node>>>* undo_ = nullptr;  // set inside multi
+	std::vector<pending_event> events_;
+	int64_t zxid_ = 0;
+	int64_t next_session_id_ = 0x100000000;
+
+	std::mutex hook_mtx_;
+	fake_fault_hook hook_;
+	std::atomic<uint64_t> requests_ = 0;
+
+public:
+	fake_server(const fake_server&) = delete;
+	fake_server& operator=(const fake_server&) = delete;
+
+	// port 0 picks a free one, see hosts()
+	explicit fake_server(uint16_t port = 0) {
+		nodes_["/"] = node{};
+		nodes_["/zookeeper"] = node{};
+		nodes_["/"].children.insert("zookeeper");
+
+		listen_fd_ = ::socket(AF_INET, SOCK_STREAM, 0);
+		int on = 1;
+		setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		sockaddr_in addr{};
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		addr.sin_port = htons(port);
+		socklen_t addr_len = sizeof(addr);
+		if (listen_fd_ < 0 || ::bind(listen_fd_, (sockaddr*)&addr, sizeof(addr)) != 0 ||
+			::listen(listen_fd_, 64) != 0 || getsockname(listen_fd_, (sockaddr*)&addr, &addr_len) != 0) {
+			if (listen_fd_ >= 0) {
+				::close(listen_fd_);
+			}
+			throw std::runtime_error("fake_server: can not listen on loopback");
+		}
+		port_ = ntohs(addr.sin_port);
+		acceptor_ = std::thread([this] { accept_loop(); });
+		reaper_ = std::thread([this] { reap_loop(); });
+	}
+
+	~fake_server() {
+		stop_ = true;
+		::shutdown(listen_fd_, SHUT_RDWR);
+		acceptor_.join();
+		::close(listen_fd_);
+		std::unique_lock<std::mutex> lock(mtx_);
+		for (auto& c : conns_) {
+			if (c->fd >= 0) {
+				::shutdown(c->fd, SHUT_RDWR);
+			}
+		}
+		lock.unlock();
+		reaper_cv_.notify_all();
+		reaper_.join();
+		for (auto& c : conns_) {
+			c->worker.join();
+		}
+	}
+
+	std::string hosts() const {
+		return "127.0.0.1:" + std::to_string(port_);
+	}
+
+	uint16_t port() const {
+		return port_;
+	}
+
+	// Called on the connection's thread before every request after the handshake
+	void set_fault_hook(fake_fault_hook hook) {
+		std::lock_guard<std::mutex> lock(hook_mtx_);
+		hook_ = std::move(hook);
+	}
+
+	// The client sees ZOO_EXPIRED_SESSION_STATE when it reconnects
+	void expire_session(int64_t session_id) {
+		std::lock_guard<std::mutex> lock(mtx_);
+		expire(session_id);
+		fire_events();
+	}
+
+	void expire_all_sessions() {
+		std::lock_guard<std::mutex> lock(mtx_);
+		std::vector<int64_t> ids;
+		for (auto& [id, _] : sessions_) {
+			ids.push_back(id);
+		}
+		for (auto id : ids) {
+			expire(id);
+		}
+		fire_events();
+	}
+
+	// Closes every connection, the sessions survive until their timeout
+	void drop_connections() {
+		std::lock_guard<std::mutex> lock(mtx_);
+		for (auto& c : conns_) {
+			if (c->fd >= 0) {
+				::shutdown(c->fd, SHUT_RDWR);
+			}
+		}
+	}
+
+	std::vector<int64_t> session_ids() {
+		std::lock_guard<std::mutex> lock(mtx_);
+		std::vector<int64_t> ids;
+		for (auto& [id, _] : sessions_) {
+			ids.push_back(id);
+		}
+		return ids;
+	}
+
+	size_t node_count() {
+		std::lock_guard<std::mutex> lock(mtx_);
+		return nodes_.size();
+	}
+
+	uint64_t request_count() const {
+		return requests_;
+	}
+
+private:
+	static int64_t now_ms() {
+		return std::chrono::duration_cast<std::chrono::milliseconds>(
+			std::chrono::system_clock::now().time_since_epoch()).count();
+	}
+
+	static bool send_all(int fd, const std::string& data) {
+		size_t sent = 0;
+		while (sent < data.size()) {
+			auto n = ::send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+			if (n <= 0) {
+				return false;
+			}
+			sent += (size_t)n;
+		}
+		return true;
+	}
+
+	static bool recv_all(int fd, char* buf, size_t len) {
+		size_t got = 0;
+		while (got < len) {
+			auto n = ::recv(fd, buf + got, len - got, 0);
+			if (n <= 0) {
+				return false;
+			}
+			got += (size_t)n;
+		}
+		return true;
+	}
+
+	static bool read_frame(int fd, std::string& frame) {
+		uint32_t len = 0;
+		if (!recv_all(fd, (char*)&len, 4)) {
+			return false;
+		}
+		len = ntohl(len);
+		if (len > 64 * 1024 * 1024) {
+			return false;
+		}
+		frame.resize(len);
+		return recv_all(fd, frame.data(), len);
+	}
+
+	static bool valid_path(const std::string& path) {
+		if (path.empty() || path[0] != '/' || path.find('\0') != std::string::npos) {
+			return false;
+		}
+		if (path.size() > 1 && path.back() == '/') {
+			return false;
+		}
+		return path.find("//") == std::string::npos;
+	}
+
+	static std::string parent_of(const std::string& path) {
+		auto pos = path.rfind('/');
+		return pos == 0 ? "/" : path.substr(0, pos);
+	}
+
+	static void write_stat(jute_out& out, const node& n) {
+		out.i64(n.czxid);
+		out.i64(n.mzxid);
+		out.i64(n.ctime);
+		out.i64(n.mtime);
+		out.i32(n.version);
+		out.i32(n.cversion);
+		out.i32(n.aversion);
+		out.i64(n.ephemeral_owner);
+		out.i32(n.data ? (int32_t)n.data->size() : 0);
+		out.i32((int32_t)n.children.size());
+		out.i64(n.pzxid);
+	}
+
+	static std::vector<acl_entry> read_acl(jute_in& in) {
+		std::vector<acl_entry> acl;
+		auto count = in.i32();
+		for (int32_t i = 0; i < count && in.ok(); ++i) {
+			acl_entry e;
+			e.perms = in.i32();
+			e.scheme = in.str();
+			e.id = in.str();
+			acl.push_back(std::move(e));
+		}
+		return acl;
+	}
+
+	static bool has_path(int32_t op) {
+		return op != ZOO_PING_OP && op != ZOO_MULTI_OP && op != ZOO_CLOSE_OP &&
+			op != ZOO_SETAUTH_OP && op != ZOO_SETWATCHES_OP;
+	}
+
+	void accept_loop() {
+		while (!stop_) {
+			auto fd = ::accept(listen_fd_, nullptr, nullptr);
+			if (fd < 0) {
+				continue;
+			}
+			int on = 1;
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+			std::lock_guard<std::mutex> lock(mtx_);
+			if (stop_) {
+				::close(fd);
+				break;
+			}
+			auto c = conns_.emplace_back(std::make_unique<connection>()).get();
+			c->fd = fd;
+			c->worker = std::thread([this, c] { serve(c); });
+		}
+	}
+
+	void reap_loop() {
+		std::unique_lock<std::mutex> lock(mtx_);
+		while (!stop_) {
+			reaper_cv_.wait_for(lock, std::chrono::milliseconds(20));
+			auto now = std::chrono::steady_clock::now();
+			std::vector<int64_t> expired;
+			for (auto& [id, s] : sessions_) {
+				if (now - s.last_seen > std::chrono::milliseconds(s.timeout_ms)) {
+					expired.push_back(id);
+				}
+			}
+			for (auto id : expired) {
+				expire(id);
+			}
+
+			auto ms = now_ms();
+			for (auto it = expiring_nodes_.begin(); it != expiring_nodes_.end();) {
+				auto n = nodes_.find(*it);
+				if (n == nodes_.end()) {
+					it = expiring_nodes_.erase(it);
+					continue;
+				}
+				auto& nd = n->second;
+				bool gone = nd.children.empty() &&
+					((nd.ttl > 0 && ms - nd.mtime > nd.ttl) || (nd.container && nd.cversion > 0));
+				if (gone) {
+					remove_node(n->first);
+					it = expiring_nodes_.erase(it);
+					continue;
+				}
+				++it;
+			}
+			fire_events();
+		}
+	}
+
+	void serve(connection* c) {
+		std::string frame;
+		bool alive = read_frame(c->fd, frame) && handshake(c, frame);
+		while (alive && read_frame(c->fd, frame)) {
+			requests_++;
+			jute_in in(frame.data(), frame.size());
+			auto xid = in.i32();
+			auto op = in.i32();
+			std::string path;
+			if (has_path(op)) {
+				auto peek = in;
+				path = peek.str();
+			}
+
+			fake_fault fault;
+			{
+				std::lock_guard<std::mutex> lock(hook_mtx_);
+				if (hook_) {
+					fault = hook_(fake_request{ c->session_id, xid, op, path });
+				}
+			}
+			if (fault.delay.count() > 0) {
+				std::this_thread::sleep_for(fault.delay);
+			}
+			if (fault.disconnect) {
+				break;
+			}
+
+			std::lock_guard<std::mutex> lock(mtx_);
+			auto s = sessions_.find(c->session_id);
+			if (s == sessions_.end() || s->second.conn != c) {
+				break;  // expired, the client learns it on reconnect
+			}
+			s->second.last_seen = std::chrono::steady_clock::now();
+
+			jute_out body;
+			int32_t err = fault.error;
+			if (err == 0) {
+				err = dispatch(c, op, in, body);
+			}
+			fire_events();
+
+			if (!fault.drop_reply) {
+				jute_out reply;
+				reply.i32(xid);
+				reply.i64(zxid_);
+				reply.i32(err);
+				if (err == 0 || (op == ZOO_MULTI_OP && fault.error == 0)) {
+					reply.append(body);
+				}
+				send_all(c->fd, reply.frame());
+			}
+			if (op == ZOO_CLOSE_OP) {
+				break;
+			}
+		}
+
+		std::lock_guard<std::mutex> lock(mtx_);
+		auto s = sessions_.find(c->session_id);
+		if (s != sessions_.end() && s->second.conn == c) {
+			s->second.conn = nullptr;
+			s->second.last_seen = std::chrono::steady_clock::now();
+		}
+		drop_watches(c);
+		::close(c->fd);
+		c->fd = -1;
+	}
+
+	bool handshake(connection* c, const std::string& frame) {
+		jute_in in(frame.data(), frame.size());
+		in.i32();  // protocol version
+		in.i64();  // last zxid seen
+		auto timeout = in.i32();
+		auto session_id = in.i64();
+		auto passwd = in.str();
+
+		std::lock_guard<std::mutex> lock(mtx_);
+		jute_out out;
+		out.i32(0);
+		if (session_id != 0) {
+			auto s = sessions_.find(session_id);
+			if (s == sessions_.end() || s->second.passwd != passwd) {
+				out.i32(0);
+				out.i64(0);
+				out.str(std::string(16, '\0'));
+				out.boolean(false);
+				send_all(c->fd, out.frame());
+				return false;
+			}
+			if (s->second.conn && s->second.conn->fd >= 0) {
+				::shutdown(s->second.conn->fd, SHUT_RDWR);
+			}
+		}
+		else {
+			session_id = next_session_id_++;
+			auto& s = sessions_[session_id];
+			s.passwd = std::string(16, '\0');
+			std::memcpy(s.passwd.data(), &session_id, sizeof(session_id));
+			s.timeout_ms = std::clamp(timeout, min_session_timeout_ms, max_session_timeout_ms);
+		}
+
+		auto& s = sessions_[session_id];
+		s.conn = c;
+		s.last_seen = std::chrono::steady_clock::now();
+		c->session_id = session_id;
+		out.i32(s.timeout_ms);
+		out.i64(session_id);
+		out.str(s.passwd);
+		out.boolean(false);
+		return send_all(c->fd, out.frame());
+	}
+
+	int32_t dispatch(connection* c, int32_t op, jute_in& in, jute_out& out) {
+		switch (op) {
+		case ZOO_PING_OP:
+		case ZOO_SETAUTH_OP:
+			return ZOO_ERRORS::ZOK;
+		case ZOO_CLOSE_OP:
+			expire(c->session_id, false);
+			return ZOO_ERRORS::ZOK;
+		case ZOO_SETWATCHES_OP:
+			return set_watches(c, in);
+		case ZOO_MULTI_OP:
+			return multi(c, in, out);
+		case ZOO_EXISTS_OP:
+		case ZOO_GETDATA_OP:
+		case ZOO_GETCHILDREN_OP:
+		case ZOO_GETCHILDREN2_OP:
+			return read(c, op, in, out);
+		case ZOO_GETACL_OP: {
+			auto n = nodes_.find(in.str());
+			if (n == nodes_.end()) {
+				return ZOO_ERRORS::ZNONODE;
+			}
+			out.i32((int32_t)n->second.acl.size());
+			for (auto& e : n->second.acl) {
+				out.i32(e.perms);
+				out.str(e.scheme);
+				out.str(e.id);
+			}
+			write_stat(out, n->second);
+			return ZOO_ERRORS::ZOK;
+		}
+		case ZOO_SYNC_OP:
+			out.str(in.str());
+			return ZOO_ERRORS::ZOK;
+		case ZOO_CHECK_WATCHES:
+		case ZOO_REMOVE_WATCHES:
+			return remove_watches(c, op == ZOO_REMOVE_WATCHES, in);
+		default:
+			return write_op(c, op, in, out);
+		}
+	}
+
+	// The requests that may also appear inside a multi
+	int32_t write_op(connection* c, int32_t op, jute_in& in, jute_out& out) {
+		switch (op) {
+		case ZOO_CREATE_OP:
+		case ZOO_CREATE2_OP:
+		case ZOO_CREATE_CONTAINER_OP:
+		case ZOO_CREATE_TTL_OP:
+			return create(c, op, in, out);
+		case ZOO_DELETE_OP:
+		case ZOO_DELETE_CONTAINER_OP: {
+			auto path = in.str();
+			auto version = op == ZOO_DELETE_OP ? in.i32() : -1;
+			auto n = nodes_.find(path);
+			if (path == "/" || !valid_path(path)) {
+				return ZOO_ERRORS::ZBADARGUMENTS;
+			}
+			if (n == nodes_.end()) {
+				return ZOO_ERRORS::ZNONODE;
+			}
+			if (version != -1 && version != n->second.version) {
+				return ZOO_ERRORS::ZBADVERSION;
+			}
+			if (!n->second.children.empty()) {
+				return ZOO_ERRORS::ZNOTEMPTY;
+			}
+			remove_node(path);
+			return ZOO_ERRORS::ZOK;
+		}
+		case ZOO_SETDATA_OP: {
+			auto path = in.str();
+			auto data = in.buffer();
+			auto version = in.i32();
+			auto n = nodes_.find(path);
+			if (n == nodes_.end()) {
+				return ZOO_ERRORS::ZNONODE;
+			}
+			if (version != -1 && version != n->second.version) {
+				return ZOO_ERRORS::ZBADVERSION;
+			}
+			save(path);
+			auto& nd = n->second;
+			nd.data = std::move(data);
+			nd.mzxid = ++zxid_;
+			nd.mtime = now_ms();
+			nd.version++;
+			events_.push_back({ &data_watches_, path, ZOO_CHANGED_EVENT });
+			write_stat(out, nd);
+			return ZOO_ERRORS::ZOK;
+		}
+		case ZOO_SETACL_OP: {
+			auto path = in.str();
+			auto acl = read_acl(in);
+			auto version = in.i32();
+			auto n = nodes_.find(path);
+			if (n == nodes_.end()) {
+				return ZOO_ERRORS::ZNONODE;
+			}
+			if (version != -1 && version != n->second.aversion) {
+				return ZOO_ERRORS::ZBADVERSION;
+			}
+			save(path);
+			n->second.acl = std::move(acl);
+			n->second.aversion++;
+			write_stat(out, n->second);
+			return ZOO_ERRORS::ZOK;
+		}
+		case ZOO_CHECK_OP: {
+			auto path = in.str();
+			auto version = in.i32();
+			auto n = nodes_.find(path);
+			if (n == nodes_.end()) {
+				return ZOO_ERRORS::ZNONODE;
+			}
+			if (version != -1 && version != n->second.version) {
+				return ZOO_ERRORS::ZBADVERSION;
+			}
+			return ZOO_ERRORS::ZOK;
+		}
+		default:
+			return ZOO_ERRORS::ZUNIMPLEMENTED;
+		}
+	}
+
+	int32_t create(connection* c, int32_t op, jute_in& in, jute_out& out) {
+		auto path = in.str();
+		auto data = in.buffer();
+		auto acl = read_acl(in);
+		auto flags = in.i32();
+		int64_t ttl = op == ZOO_CREATE_TTL_OP ? in.i64() : -1;
+
+		bool ttl_mode = flags == 5 || flags == 6;
+		if (!valid_path(path) || path == "/" || ttl_mode != (op == ZOO_CREATE_TTL_OP) ||
+			(ttl_mode && ttl <= 0)) {
+			return ZOO_ERRORS::ZBADARGUMENTS;
+		}
+		auto parent_path = parent_of(path);
+		auto parent = nodes_.find(parent_path);
+		if (parent == nodes_.end()) {
+			return ZOO_ERRORS::ZNONODE;
+		}
+		if (parent->second.ephemeral_owner != 0) {
+			return ZOO_ERRORS::ZNOCHILDRENFOREPHEMERALS;
+		}
+		if (flags == 2 || flags == 3 || flags == 6) {
+			char seq[16];
+			std::snprintf(seq, sizeof(seq), "%010d", parent->second.cversion);
+			path += seq;
+		}
+		if (nodes_.count(path)) {
+			return ZOO_ERRORS::ZNODEEXISTS;
+		}
+
+		save(parent_path);
+		save(path);
+		auto zxid = ++zxid_;
+		auto& n = nodes_[path];
+		n.data = std::move(data);
+		n.acl = std::move(acl);
+		n.czxid = n.mzxid = n.pzxid = zxid;
+		n.ctime = n.mtime = now_ms();
+		n.ephemeral_owner = (flags == 1 || flags == 3) ? c->session_id : 0;
+		n.ttl = ttl;
+		n.container = flags == 4;
+		if (n.ttl > 0 || n.container) {
+			expiring_nodes_.insert(path);
+		}
+		auto& pn = parent->second;
+		pn.children.insert(path.substr(path.rfind('/') + 1));
+		pn.cversion++;
+		pn.pzxid = zxid;
+
+		events_.push_back({ &data_watches_, path, ZOO_CREATED_EVENT });
+		events_.push_back({ &child_watches_, parent_path, ZOO_CHILD_EVENT });
+		out.str(path);
+		if (op != ZOO_CREATE_OP) {
+			write_stat(out, n);
+		}
+		return ZOO_ERRORS::ZOK;
+	}
+
+	void remove_node(std::string path) {  // by value, callers pass map keys
+		auto parent_path = parent_of(path);
+		save(parent_path);
+		save(path);
+		nodes_.erase(path);
+		auto& pn = nodes_[parent_path];
+		pn.children.erase(path.substr(path.rfind('/') + 1));
+		pn.cversion++;
+		pn.pzxid = ++zxid_;
+
+		events_.push_back({ &data_watches_, path, ZOO_DELETED_EVENT });
+		events_.push_back({ &child_watches_, path, ZOO_DELETED_EVENT });
+		events_.push_back({ &child_watches_, parent_path, ZOO_CHILD_EVENT });
+	}
+
+	int32_t read(connection* c, int32_t op, jute_in& in, jute_out& out) {
+		auto path = in.str();
+		auto watch = in.boolean();
+		auto n = nodes_.find(path);
+		if (op == ZOO_EXISTS_OP && watch) {
+			data_watches_[path].insert(c);
+		}
+		if (n == nodes_.end()) {
+			return ZOO_ERRORS::ZNONODE;
+		}
+
+		switch (op) {
+		case ZOO_EXISTS_OP:
+			write_stat(out, n->second);
+			break;
+		case ZOO_GETDATA_OP:
+			if (watch) {
+				data_watches_[path].insert(c);
+			}
+			out.buffer(n->second.data);
+			write_stat(out, n->second);
+			break;
+		default:
+			if (watch) {
+				child_watches_[path].insert(c);
+			}
+			out.i32((int32_t)n->second.children.size());
+			for (auto& child : n->second.children) {
+				out.str(child);
+			}
+			if (op == ZOO_GETCHILDREN2_OP) {
+				write_stat(out, n->second);
+			}
+			break;
+		}
+		return ZOO_ERRORS::ZOK;
+	}
+
+	// Ops are applied in order and rolled back from the undo log if one fails
+	int32_t multi(connection* c, jute_in& in, jute_out& out) {
+		std::vector<std::pair<std::string, std::optional<node>>> undo;
+		std::vector<std::pair<int32_t, jute_out>> results;
+		undo_ = &undo;
+		auto first_event = events_.size();
+		int32_t failed = ZOO_ERRORS::ZOK;
+		size_t failed_at = 0;
+		while (in.ok()) {
+			auto type = in.i32();
+			auto done = in.boolean();
+			in.i32();
+			if (done || type == -1) {
+				break;
+			}
+			jute_out result;
+			auto err = write_op(c, type, in, result);  // still parsed after a failure, then rolled back
+			if (err != ZOO_ERRORS::ZOK && !failed) {
+				failed = err;
+				failed_at = results.size();
+			}
+			results.emplace_back(type, std::move(result));
+		}
+		undo_ = nullptr;
+
+		if (failed) {
+			for (auto it = undo.rbegin(); it != undo.rend(); ++it) {
+				if (it->second) {
+					nodes_[it->first] = std::move(*it->second);
+				}
+				else {
+					nodes_.erase(it->first);
+				}
+			}
+			events_.resize(first_event);
+		}
+		for (size_t i = 0; i < results.size(); ++i) {
+			if (failed) {
+				auto err = i < failed_at ? ZOO_ERRORS::ZOK :
+					i == failed_at ? failed : ZOO_ERRORS::ZRUNTIMEINCONSISTENCY;
+				out.i32(-1);
+				out.boolean(false);
+				out.i32(err);
+				out.i32(err);
+				continue;
+			}
+			out.i32(results[i].first);
+			out.boolean(false);
+			out.i32(0);
+			out.append(results[i].second);
+		}
+		out.i32(-1);
+		out.boolean(true);
+		out.i32(-1);
+		return failed;
+	}
+
+	// Registers the watches of a reconnected client, firing the ones it missed
+	int32_t set_watches(connection* c, jute_in& in) {
+		auto relative_zxid = in.i64();
+		auto read_paths = [&in]() {
+			std::vector<std::string> paths(in.ok() ? (size_t)std::max(in.i32(), 0) : 0);
+			for (auto& p : paths) {
+				p = in.str();
+			}
+			return paths;
+		};
+		auto data = read_paths();
+		auto exist = read_paths();
+		auto child = read_paths();
+
+		std::vector<std::pair<std::string, int>> missed;
+		for (auto& p : data) {
+			auto n = nodes_.find(p);
+			if (n == nodes_.end()) {
+				missed.emplace_back(p, ZOO_DELETED_EVENT);
+			}
+			else if (n->second.mzxid > relative_zxid) {
+				missed.emplace_back(p, ZOO_CHANGED_EVENT);
+			}
+			else {
+				data_watches_[p].insert(c);
+			}
+		}
+		for (auto& p : exist) {
+			if (nodes_.count(p)) {
+				missed.emplace_back(p, ZOO_CREATED_EVENT);
+			}
+			else {
+				data_watches_[p].insert(c);
+			}
+		}
+		for (auto& p : child) {
+			auto n = nodes_.find(p);
+			if (n == nodes_.end()) {
+				missed.emplace_back(p, ZOO_DELETED_EVENT);
+			}
+			else if (n->second.pzxid > relative_zxid) {
+				missed.emplace_back(p, ZOO_CHILD_EVENT);
+			}
+			else {
+				child_watches_[p].insert(c);
+			}
+		}
+		for (auto& [p, type] : missed) {
+			send_event(c, p, type);
+		}
+		return ZOO_ERRORS::ZOK;
+	}
+
+	int32_t remove_watches(connection* c, bool remove, jute_in& in) {
+		auto path = in.str();
+		auto type = in.i32();
+		bool found = false;
+		auto check = [&](watch_table& table) {
+			auto w = table.find(path);
+			if (w == table.end() || !w->second.count(c)) {
+				return;
+			}
+			found = true;
+			if (remove) {
+				w->second.erase(c);
+				if (w->second.empty()) {
+					table.erase(w);
+				}
+			}
+		};
+		if (type == ZWATCHTYPE_CHILD || type == ZWATCHTYPE_ANY) {
+			check(child_watches_);
+		}
+		if (type == ZWATCHTYPE_DATA || type == ZWATCHTYPE_ANY) {
+			check(data_watches_);
+		}
+		return found ? ZOO_ERRORS::ZOK : ZOO_ERRORS::ZNOWATCHER;
+	}
+
+	void save(const std::string& path) {
+		if (!undo_) {
+			return;
+		}
+		auto n = nodes_.find(path);
+		undo_->emplace_back(path, n == nodes_.end() ? std::nullopt : std::optional<node>(n->second));
+	}
+
+	void send_event(connection* c, const std::string& path, int type) {
+		jute_out out;
+		out.i32(-1);
+		out.i64(-1);
+		out.i32(0);
+		out.i32(type);
+		out.i32(ZOO_CONNECTED_STATE);
+		out.str(path);
+		if (c->fd >= 0) {
+			send_all(c->fd, out.frame());
+		}
+	}
+
+	void fire_events() {
+		for (auto& e : events_) {
+			auto w = e.table->find(e.path);
+			if (w == e.table->end()) {
+				continue;
+			}
+			auto conns = std::move(w->second);
+			e.table->erase(w);
+			for (auto c : conns) {
+				send_event(c, e.path, e.type);
+			}
+		}
+		events_.clear();
+	}
+
+	void drop_watches(connection* c) {
+		for (auto table : { &data_watches_, &child_watches_ }) {
+			for (auto it = table->begin(); it != table->end();) {
+				it->second.erase(c);
+				it = it->second.empty() ? table->erase(it) : std::next(it);
+			}
+		}
+	}
+
+	// call with mtx_ held, fire_events() afterwards
+	void expire(int64_t session_id, bool close_connection = true) {
+		auto s = sessions_.find(session_id);
+		if (s == sessions_.end()) {
+			return;
+		}
+		std::vector<std::string> ephemerals;
+		for (auto& [path, n] : nodes_) {
+			if (n.ephemeral_owner == session_id) {
+				ephemerals.push_back(path);
+			}
+		}
+		for (auto& path : ephemerals) {
+			remove_node(path);
+		}
+		if (s->second.conn) {
+			drop_watches(s->second.conn);
+			if (close_connection && s->second.conn->fd >= 0) {
+				::shutdown(s->second.conn->fd, SHUT_RDWR);
+			}
+		}
+		sessions_.erase(s);
+	}
+};
+
+}  // namespace zk
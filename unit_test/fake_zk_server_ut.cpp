@@ -0,0 +1,839 @@
+#include <fstream>
+#include <future>
+#include <map>
+#include <set>
+#include <sstream>
+#include <utility>
+
+#include "config_monitor.hpp"
+#include "cppzk/cppzk.hpp"
+#include "fake_zk_server.hpp"
+#include "gtest/gtest.h"
+
+using namespace std::chrono_literals;
+
+class fake_zk_test : public testing::Test {
+protected:
+	zk::fake_server server_;
+	cm::config_monitor<zk::cppzk> monitor_;
+
+	void SetUp() override {
+		monitor_.init(server_.hosts(), 30000);
+	}
+
+	// A bare C handle, for the calls cppzk does not wrap
+	zhandle_t* connect(int flags = 0) {
+		auto zh = zookeeper_init(server_.hosts().data(), nullptr, 30000, nullptr, nullptr, flags);
+		for (int i = 0; i < 200 && zoo_state(zh) != ZOO_CONNECTED_STATE; ++i) {
+			std::this_thread::sleep_for(10ms);
+		}
+		return zh;
+	}
+};
+
+TEST_F(fake_zk_test, crud) {
+	auto [ec, path] = monitor_.create_path("/a/b", std::string("v1"));
+	EXPECT_EQ(ec.value(), 0);
+	EXPECT_EQ(path, "/a/b");
+	EXPECT_EQ(monitor_.set_path_value("/a/b", "v2").value(), 0);
+	auto [gec, val] = monitor_.get_path_value("/a/b");
+	EXPECT_EQ(gec.value(), 0);
+	EXPECT_EQ(val.value(), "v2");
+
+	auto [sec, seq] = monitor_.create_path("/a/s-", std::string("x"),
+		cm::create_mode::persistent_sequential);
+	EXPECT_EQ(sec.value(), 0);
+	EXPECT_EQ(seq, "/a/s-0000000001");
+	auto [cec, subs] = monitor_.get_sub_path("/a");
+	EXPECT_EQ(cec.value(), 0);
+	EXPECT_EQ(subs.size(), 2u);
+
+	EXPECT_EQ(monitor_.del_path("/a").value(), 0);
+	auto [nec, _] = monitor_.get_path_value("/a/b");
+	EXPECT_EQ(nec.value(), ZOO_ERRORS::ZNONODE);
+};
+
+TEST_F(fake_zk_test, watch_survives_reconnect) {
+	std::promise<std::string> changed;
+	monitor_.create_path("/w", std::string("v1"));
+	monitor_.watch_path("/w", [&changed, fired = false](auto eve, auto&& val) mutable {
+		if (eve == cm::path_event::changed && val == "v2" && !fired) {
+			fired = true;
+			changed.set_value(val.value());
+		}
+	});
+	std::this_thread::sleep_for(100ms);
+
+	server_.drop_connections();
+	std::this_thread::sleep_for(1500ms);
+	monitor_.set_path_value("/w", "v2");
+	auto f = changed.get_future();
+	ASSERT_EQ(f.wait_for(3s), std::future_status::ready);
+	EXPECT_EQ(f.get(), "v2");
+	EXPECT_EQ(server_.session_ids().size(), 1u);
+};
+
+TEST_F(fake_zk_test, rewatch_after_expiry) {
+	constexpr int paths = 20;
+	std::mutex mtx;
+	std::condition_variable cv;
+	std::map<std::string, std::string> seen;
+	monitor_.set_rewatch_policy({ 3, 0ms });
+	for (int i = 0; i < paths; ++i) {
+		auto path = "/r/" + std::to_string(i);
+		monitor_.create_path(path, std::string("v1"));
+		monitor_.watch_path(path, [&, path](auto, auto&& val) {
+			std::lock_guard<std::mutex> lock(mtx);
+			seen[path] = val.value_or("");
+			cv.notify_all();
+		});
+	}
+	auto all_are = [&](const std::string& value) {
+		std::unique_lock<std::mutex> lock(mtx);
+		return cv.wait_for(lock, 3s, [&] {
+			return seen.size() == paths && std::all_of(seen.begin(), seen.end(),
+				[&](auto& kv) { return kv.second == value; });
+		});
+	};
+	ASSERT_TRUE(all_are("v1"));
+
+	// detected as soon as the client learns it, not at the next check of the session
+	auto start = std::chrono::steady_clock::now();
+	server_.expire_all_sessions();
+	for (int i = 0; i < 300 && server_.session_ids().empty(); ++i) {
+		std::this_thread::sleep_for(10ms);
+	}
+	ASSERT_EQ(server_.session_ids().size(), 1u);
+	EXPECT_LT(std::chrono::steady_clock::now() - start, 2s);
+
+	for (int i = 0; i < paths; ++i) {
+		EXPECT_EQ(monitor_.set_path_value("/r/" + std::to_string(i), "v2").value(), 0);
+	}
+	EXPECT_TRUE(all_are("v2"));
+};
+
+// A watch removed or replaced while the expired session re-registers is not registered again
+TEST_F(fake_zk_test, remove_during_rewatch) {
+	constexpr int paths = 20;
+	std::mutex mtx;
+	std::condition_variable cv;
+	std::map<std::string, int> fired;  // v2 events per callback
+	auto count_as = [&](const std::string& name) {
+		return [&, name](auto, auto&& val) {
+			if (val.value_or("") == "v2") {
+				std::lock_guard<std::mutex> lock(mtx);
+				fired[name]++;
+				cv.notify_all();
+			}
+		};
+	};
+	monitor_.set_rewatch_policy({ 1, 0ms });
+	for (int i = 0; i < paths; ++i) {
+		auto path = "/rr/" + std::to_string(i);
+		monitor_.create_path(path, std::string("v1"));
+		monitor_.watch_path(path, count_as(path));
+	}
+	std::this_thread::sleep_for(100ms);
+
+	// with a window of one and slow registrations, a path not seen by the server yet is still pending
+	std::mutex seen_mtx;
+	std::set<std::string> seen;
+	server_.set_fault_hook([&](const zk::fake_request& req) {
+		zk::fake_fault fault;
+		if (req.op == ZOO_EXISTS_OP) {
+			std::lock_guard<std::mutex> lock(seen_mtx);
+			seen.emplace(req.path);
+			fault.delay = 50ms;
+		}
+		return fault;
+	});
+	server_.expire_all_sessions();
+	std::vector<std::string> pending;
+	for (int i = 0; i < 300 && pending.empty(); ++i) {
+		std::this_thread::sleep_for(5ms);
+		std::lock_guard<std::mutex> lock(seen_mtx);
+		for (int j = 0; !seen.empty() && j < paths && pending.size() < 2; ++j) {
+			auto path = "/rr/" + std::to_string(j);
+			if (!seen.count(path)) {
+				pending.push_back(path);
+			}
+		}
+	}
+	ASSERT_EQ(pending.size(), 2u);
+	monitor_.remove_watches(pending[0], cm::watch_type::watch_path);
+	monitor_.watch_path(pending[1], count_as("again"));
+	std::this_thread::sleep_for(paths * 50ms + 200ms);
+	server_.set_fault_hook({});
+	ASSERT_EQ(server_.session_ids().size(), 1u);
+
+	for (int i = 0; i < paths; ++i) {
+		EXPECT_EQ(monitor_.set_path_value("/rr/" + std::to_string(i), "v2").value(), 0);
+	}
+	std::unique_lock<std::mutex> lock(mtx);
+	EXPECT_TRUE(cv.wait_for(lock, 3s, [&] { return fired.size() == paths - 1; }));
+	lock.unlock();
+	std::this_thread::sleep_for(200ms);
+	lock.lock();
+	for (int i = 0; i < paths; ++i) {
+		auto path = "/rr/" + std::to_string(i);
+		EXPECT_EQ(fired.count(path), path == pending[0] || path == pending[1] ? 0u : 1u) << path;
+		EXPECT_LE(fired[path], 1) << path;
+	}
+	EXPECT_EQ(fired["again"], 1);
+};
+
+// Every SetWatches packet reaches the server before a request sent during the replay,
+// however small the window
+TEST_F(fake_zk_test, rewatch_limits) {
+	constexpr int paths = 40;
+	std::atomic<int> fired = 0;
+	monitor_.set_rewatch_limits(64, 2);
+	for (int i = 0; i < paths; ++i) {
+		auto path = "/rl/" + std::to_string(i);
+		monitor_.create_path(path, std::string("v1"));
+		monitor_.watch_path(path, [&fired](auto, auto&& val) {
+			if (val.value_or("") == "v2") {
+				fired++;
+			}
+		});
+	}
+	std::this_thread::sleep_for(100ms);
+
+	std::mutex ops_mtx;
+	std::vector<int32_t> ops;
+	server_.set_fault_hook([&](const zk::fake_request& req) {
+		zk::fake_fault fault;
+		if (req.op != ZOO_PING_OP) {
+			std::lock_guard<std::mutex> lock(ops_mtx);
+			ops.push_back(req.op);
+		}
+		if (req.op == ZOO_SETWATCHES_OP) {
+			fault.delay = 20ms;
+		}
+		return fault;
+	});
+	server_.drop_connections();
+	for (int i = 0; i < 300 && !monitor_.rewatch_stats().in_progress; ++i) {
+		std::this_thread::sleep_for(1ms);
+	}
+	ASSERT_TRUE(monitor_.rewatch_stats().in_progress);
+	std::atomic<int> set = 0;
+	for (int i = 0; i < paths; ++i) {
+		monitor_.async_set_path_value("/rl/" + std::to_string(i), "v2", [&set](const std::error_code& ec) {
+			if (!ec) {
+				set++;
+			}
+		});
+	}
+	for (int i = 0; i < 300 && fired < paths; ++i) {
+		std::this_thread::sleep_for(10ms);
+	}
+	server_.set_fault_hook({});
+	EXPECT_EQ(set.load(), paths);
+	EXPECT_EQ(fired.load(), paths);
+
+	auto stats = monitor_.rewatch_stats();
+	EXPECT_EQ(stats.replays, 1);
+	EXPECT_EQ(stats.in_progress, 0);
+	EXPECT_EQ(stats.last_paths, paths);
+	EXPECT_GT(stats.last_chunks, 2);
+	EXPECT_GE(stats.last_duration, stats.last_chunks * 20000);
+	std::lock_guard<std::mutex> lock(ops_mtx);
+	auto first_set = std::find(ops.begin(), ops.end(), ZOO_SETDATA_OP);
+	EXPECT_EQ(std::count(ops.begin(), first_set, ZOO_SETWATCHES_OP), stats.last_chunks);
+	EXPECT_EQ(std::count(first_set, ops.end(), ZOO_SETWATCHES_OP), 0);
+};
+
+TEST_F(fake_zk_test, ephemeral_removed_on_expire) {
+	auto zh = connect();
+	ASSERT_EQ(zoo_state(zh), ZOO_CONNECTED_STATE);
+	EXPECT_EQ(zoo_create(zh, "/e", "x", 1, &ZOO_OPEN_ACL_UNSAFE, ZOO_EPHEMERAL, nullptr, 0), ZOK);
+	auto id = zoo_client_id(zh)->client_id;
+
+	server_.expire_session(id);
+	auto [ec, _] = monitor_.get_path_value("/e");
+	EXPECT_EQ(ec.value(), ZOO_ERRORS::ZNONODE);
+	for (int i = 0; i < 200 && zoo_state(zh) != ZOO_EXPIRED_SESSION_STATE; ++i) {
+		std::this_thread::sleep_for(10ms);
+	}
+	EXPECT_EQ(zoo_state(zh), ZOO_EXPIRED_SESSION_STATE);
+	zookeeper_close(zh);
+};
+
+// A taken value does not depend on the session or the handle it was read with
+TEST_F(fake_zk_test, taken_view_outlives_handle) {
+	auto take = [](cm::config_monitor<zk::cppzk>& monitor) {
+		std::promise<zk::data_buffer> pro;
+		monitor.async_get_path_view("/t", [&pro](const std::error_code& ec, zk::data_buffer&& buf) {
+			EXPECT_FALSE(ec);
+			EXPECT_TRUE(buf.take());
+			pro.set_value(std::move(buf));
+		});
+		return pro.get_future().get();
+	};
+	monitor_.create_path("/t", std::string("value"));
+	auto expired = take(monitor_);
+	server_.expire_all_sessions();
+	for (int i = 0; i < 300 && server_.session_ids().empty(); ++i) {
+		std::this_thread::sleep_for(10ms);
+	}
+	ASSERT_EQ(server_.session_ids().size(), 1u);
+	EXPECT_EQ(std::get<1>(monitor_.get_path_value("/t")).value_or(""), "value");
+
+	std::optional<zk::data_buffer> closed;
+	{
+		cm::config_monitor<zk::cppzk> monitor;
+		monitor.init(server_.hosts(), 30000);
+		closed = take(monitor);
+	}
+	EXPECT_EQ(expired.view(), "value");
+	EXPECT_EQ(closed->view(), "value");
+	expired = zk::data_buffer{};
+	closed.reset();
+};
+
+// A value larger than a receive chunk is kept in the body it was received in
+TEST_F(fake_zk_test, large_view_taken_in_place) {
+	for (size_t size : { size_t(100), size_t(200 * 1024) }) {
+		std::string value(size, 'x');
+		monitor_.create_path("/big", value);
+		monitor_.set_path_value("/big", value);
+		std::promise<std::pair<zk::data_buffer, bool>> pro;
+		monitor_.async_get_path_view("/big", [&pro](const std::error_code& ec, zk::data_buffer&& buf) {
+			EXPECT_FALSE(ec);
+			auto lent = buf.view().data();
+			EXPECT_TRUE(buf.take());
+			bool in_place = buf.view().data() == lent;
+			pro.set_value({ std::move(buf), in_place });
+		});
+		auto [buf, in_place] = pro.get_future().get();
+		EXPECT_EQ(buf.view(), value);
+		EXPECT_EQ(in_place, size > 64 * 1024) << size;
+	}
+};
+
+TEST_F(fake_zk_test, ttl_node_expires) {
+	auto [ec, _] = monitor_.create_path("/ttl", std::string("x"),
+		cm::create_mode::persistent_with_ttl, 100);
+	EXPECT_EQ(ec.value(), 0);
+	std::this_thread::sleep_for(300ms);
+	auto [gec, val] = monitor_.get_path_value("/ttl");
+	EXPECT_EQ(gec.value(), ZOO_ERRORS::ZNONODE);
+};
+
+TEST_F(fake_zk_test, multi_is_atomic) {
+	auto zh = connect();
+	char buf[64];
+	zoo_op_t ops[2];
+	zoo_op_result_t results[2];
+	zoo_create_op_init(&ops[0], "/m", "x", 1, &ZOO_OPEN_ACL_UNSAFE, 0, buf, sizeof(buf));
+	zoo_delete_op_init(&ops[1], "/missing", -1);
+	EXPECT_EQ(zoo_multi(zh, 2, ops, results), ZNONODE);
+	EXPECT_EQ(zoo_exists(zh, "/m", 0, nullptr), ZNONODE);
+
+	zoo_create_op_init(&ops[1], "/m/n", "y", 1, &ZOO_OPEN_ACL_UNSAFE, 0, nullptr, 0);
+	EXPECT_EQ(zoo_multi(zh, 2, ops, results), ZOK);
+	EXPECT_EQ(std::string(buf), "/m");
+	EXPECT_EQ(zoo_exists(zh, "/m/n", 0, nullptr), ZOK);
+	zookeeper_close(zh);
+};
+
+// One shared IO thread, a request on one handle must not make it serve the others
+TEST_F(fake_zk_test, shared_io_serves_ready_handles) {
+	std::vector<zhandle_t*> handles;
+	for (int i = 0; i < 16; ++i) {
+		handles.push_back(connect(ZOO_SHARED_IO));
+		ASSERT_EQ(zoo_state(handles.back()), ZOO_CONNECTED_STATE);
+	}
+	auto iterations = [&](zhandle_t* zh) {
+		zoo_queue_stats stats{};
+		zoo_get_queue_stats(zh, &stats);
+		return stats.io_iterations;
+	};
+	std::vector<int32_t> before;
+	for (auto zh : handles) {
+		before.push_back(iterations(zh));
+	}
+
+	constexpr int ops = 200;
+	ASSERT_EQ(zoo_create(handles[0], "/shared", "0", 1, &ZOO_OPEN_ACL_UNSAFE, 0, nullptr, 0), ZOK);
+	for (int i = 0; i < ops; ++i) {
+		auto val = std::to_string(i);
+		ASSERT_EQ(zoo_set(handles[0], "/shared", val.data(), (int)val.size(), -1), ZOK);
+	}
+	EXPECT_GE(iterations(handles[0]) - before[0], ops);
+	for (size_t i = 1; i < handles.size(); ++i) {
+		EXPECT_LE(iterations(handles[i]) - before[i], 2) << "handle " << i;
+	}
+
+	// and every handle still works
+	for (auto zh : handles) {
+		char buf[16];
+		int len = sizeof(buf);
+		EXPECT_EQ(zoo_get(zh, "/shared", 0, buf, &len, nullptr), ZOK);
+		EXPECT_EQ(std::string(buf, (size_t)len), std::to_string(ops - 1));
+	}
+	for (auto zh : handles) {
+		zookeeper_close(zh);
+	}
+};
+
+// Completions of one path keep their order when spread over completion threads
+TEST_F(fake_zk_test, completion_threads_keep_path_order) {
+	constexpr int paths = 8;
+	constexpr int rounds = 100;
+	cm::config_monitor<zk::cppzk> monitor;
+	monitor.init(server_.hosts(), 30000, "", "", "", ZOO_COMPLETION_THREADS(4));
+	for (int i = 0; i < paths; ++i) {
+		monitor.create_path("/o/" + std::to_string(i), std::string("0"));
+	}
+
+	std::mutex mtx;
+	std::condition_variable cv;
+	std::vector<std::vector<int>> order(paths);
+	std::set<std::thread::id> threads;
+	int done = 0;
+	for (int r = 0; r < rounds; ++r) {
+		for (int i = 0; i < paths; ++i) {
+			monitor.async_set_path_value("/o/" + std::to_string(i), std::to_string(r),
+				[&, i, r](const std::error_code& ec) {
+				EXPECT_FALSE(ec);
+				std::lock_guard<std::mutex> lock(mtx);
+				order[i].push_back(r);
+				threads.insert(std::this_thread::get_id());
+				++done;
+				cv.notify_all();
+			});
+		}
+	}
+	std::unique_lock<std::mutex> lock(mtx);
+	ASSERT_TRUE(cv.wait_for(lock, 5s, [&] { return done == paths * rounds; }));
+	for (auto& seq : order) {
+		EXPECT_TRUE(std::is_sorted(seq.begin(), seq.end()));
+	}
+	EXPECT_GT(threads.size(), 1u);
+};
+
+// A session event waits for every completion queued before it
+TEST_F(fake_zk_test, completion_threads_session_event_barrier) {
+	constexpr int reads = 64;
+	struct context {
+		std::atomic<int> completed{ 0 };
+		std::promise<int> at_event;
+		bool fired = false;
+	} ctx;
+	auto watcher = [](zhandle_t*, int type, int state, const char*, void* data) {
+		auto ctx = static_cast<context*>(data);
+		if (type == ZOO_SESSION_EVENT && state == ZOO_CONNECTING_STATE && !ctx->fired) {
+			ctx->fired = true;
+			ctx->at_event.set_value(ctx->completed.load());
+		}
+	};
+	auto zh = zookeeper_init(server_.hosts().data(), watcher, 30000, nullptr, &ctx,
+		ZOO_COMPLETION_THREADS(4));
+	for (int i = 0; i < 200 && zoo_state(zh) != ZOO_CONNECTED_STATE; ++i) {
+		std::this_thread::sleep_for(10ms);
+	}
+	ASSERT_EQ(zoo_state(zh), ZOO_CONNECTED_STATE);
+
+	// slow completions still running on their lanes when the connection drops
+	auto completion = [](int, const char*, int, const Stat*, const void* data) {
+		std::this_thread::sleep_for(5ms);
+		static_cast<context*>(const_cast<void*>(data))->completed++;
+	};
+	for (int i = 0; i < reads; ++i) {
+		auto path = "/b/" + std::to_string(i % 8);
+		EXPECT_EQ(zoo_aget(zh, path.data(), 0, completion, &ctx), ZOK);
+	}
+	std::this_thread::sleep_for(20ms);
+	server_.drop_connections();
+
+	auto f = ctx.at_event.get_future();
+	ASSERT_EQ(f.wait_for(3s), std::future_status::ready);
+	EXPECT_EQ(f.get(), reads);
+	zookeeper_close(zh);
+};
+
+// Reads of a path issued while one is in flight share its request
+TEST_F(fake_zk_test, get_path_value_coalesced) {
+	monitor_.create_path("/c", std::string("v"));
+	std::atomic<int> gets = 0;
+	server_.set_fault_hook([&gets](const zk::fake_request& req) {
+		zk::fake_fault fault;
+		if (req.op == ZOO_GETDATA_OP && req.path == "/c") {
+			gets++;
+			fault.delay = 100ms;
+		}
+		return fault;
+	});
+
+	// a lone sync read goes straight to the server
+	EXPECT_EQ(std::get<1>(monitor_.get_path_value("/c")).value_or(""), "v");
+	EXPECT_EQ(gets, 1);
+	EXPECT_EQ(monitor_.coalesced_reads(), 0u);
+
+	constexpr int count = 64;
+	std::mutex mtx;
+	std::condition_variable cv;
+	int done = 0;
+	for (int i = 0; i < count; ++i) {
+		monitor_.async_get_path_value("/c", [&](const std::error_code& ec, std::optional<std::string>&& val) {
+			EXPECT_FALSE(ec);
+			EXPECT_EQ(val.value_or(""), "v");
+			std::lock_guard<std::mutex> lock(mtx);
+			++done;
+			cv.notify_all();
+		});
+	}
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		ASSERT_TRUE(cv.wait_for(lock, 3s, [&] { return done == count; }));
+	}
+	EXPECT_EQ(gets, 2);
+	EXPECT_EQ(monitor_.coalesced_reads(), count - 1u);
+
+	// the first sync caller reads alone, the ones arriving while it waits share one read
+	constexpr int threads = 8;
+	std::vector<std::thread> readers;
+	auto first = std::async(std::launch::async, [&] { return monitor_.get_path_value("/c"); });
+	std::this_thread::sleep_for(20ms);
+	for (int i = 0; i < threads; ++i) {
+		readers.emplace_back([&] {
+			EXPECT_EQ(std::get<1>(monitor_.get_path_value("/c")).value_or(""), "v");
+		});
+	}
+	for (auto& t : readers) {
+		t.join();
+	}
+	EXPECT_EQ(std::get<1>(first.get()).value_or(""), "v");
+	EXPECT_EQ(gets, 4);
+	EXPECT_EQ(monitor_.coalesced_reads(), count - 1u + threads - 1u);
+	server_.set_fault_hook({});
+};
+
+// A read after a write returned sees it, even with slow reads of the path in flight all along:
+// a read sent while the write was in flight may still be waiting for its caller to pick it up
+TEST_F(fake_zk_test, read_your_writes) {
+	monitor_.create_path("/rw", std::string("0"));
+	server_.set_fault_hook([](const zk::fake_request& req) {
+		zk::fake_fault fault;
+		if (req.op == ZOO_GETDATA_OP) {
+			fault.delay = 1ms;
+		}
+		return fault;
+	});
+	std::atomic<bool> stop = false;
+	std::vector<std::thread> readers;
+	for (int i = 0; i < 8; ++i) {
+		readers.emplace_back([&] {
+			while (!stop) {
+				monitor_.get_path_value("/rw");
+			}
+		});
+	}
+	for (int i = 1; i <= 100; ++i) {
+		auto value = std::to_string(i);
+		ASSERT_EQ(monitor_.set_path_value("/rw", value).value(), 0);
+		EXPECT_EQ(std::get<1>(monitor_.get_path_value("/rw")).value_or(""), value);
+
+		std::promise<std::optional<std::string>> pro;
+		value += "a";
+		monitor_.async_set_path_value("/rw", value, [&](const std::error_code&) {
+			monitor_.async_get_path_value("/rw", [&](const std::error_code&, std::optional<std::string>&& val) {
+				pro.set_value(std::move(val));
+			});
+		});
+		EXPECT_EQ(pro.get_future().get().value_or(""), value);
+	}
+	stop = true;
+	for (auto& t : readers) {
+		t.join();
+	}
+	server_.set_fault_hook({});
+};
+
+// Slow SetData keeps the slots taken, so the limit is reached on every call past it
+TEST_F(fake_zk_test, async_inflight_limit) {
+	auto& registry = cm::metrics_registry::instance();  // outlives monitor_
+	monitor_.register_metrics(registry, "instance=\"il\"");
+	monitor_.create_path("/il", std::string("v"));
+	server_.set_fault_hook([](const zk::fake_request& req) {
+		zk::fake_fault fault;
+		if (req.op == ZOO_SETDATA_OP) {
+			fault.delay = 50ms;
+		}
+		return fault;
+	});
+	std::mutex mtx;
+	std::vector<int> results;
+	auto record = [&](const std::error_code& ec) {
+		std::lock_guard<std::mutex> lock(mtx);
+		results.push_back(ec.value());
+	};
+	auto wait_results = [&](size_t count) {
+		for (int i = 0; i < 300; ++i) {
+			{
+				std::lock_guard<std::mutex> lock(mtx);
+				if (results.size() >= count) {
+					return std::exchange(results, {});
+				}
+			}
+			std::this_thread::sleep_for(10ms);
+		}
+		return std::vector<int>{};
+	};
+
+	// block: the third call waits for a slot
+	monitor_.set_inflight_limit(2);
+	std::thread caller([&] {
+		for (int i = 0; i < 3; ++i) {
+			monitor_.async_set_path_value("/il", "v", record);
+		}
+	});
+	for (int i = 0; i < 100 && monitor_.waiting_ops() == 0; ++i) {
+		std::this_thread::sleep_for(1ms);
+	}
+	EXPECT_EQ(monitor_.waiting_ops(), 1);
+	EXPECT_EQ(monitor_.inflight_ops(), 2);
+	EXPECT_NE(registry.render().find("zk_waiting_ops{instance=\"il\"} 1\n"), std::string::npos);
+	caller.join();
+	EXPECT_EQ(wait_results(3), std::vector<int>(3, 0));
+	EXPECT_EQ(monitor_.waiting_ops(), 0);
+	EXPECT_EQ(monitor_.throttled_ops(), 0u);
+
+	// fail_fast: the second call completes at once
+	monitor_.set_inflight_limit(1, zk::zk_backpressure::fail_fast);
+	monitor_.async_set_path_value("/il", "v", record);
+	monitor_.async_set_path_value("/il", "v", record);
+	EXPECT_EQ(wait_results(2), (std::vector<int>{ ZOO_ERRORS::ZTHROTTLEDOP, 0 }));
+	EXPECT_EQ(monitor_.throttled_ops(), 1u);
+
+	// notify: the same, then the ready callback once the slot is back
+	std::atomic<int> ready = 0;
+	monitor_.set_inflight_limit(1, zk::zk_backpressure::notify, [&ready] { ready++; });
+	monitor_.async_set_path_value("/il", "v", record);
+	monitor_.async_set_path_value("/il", "v", record);
+	EXPECT_EQ(wait_results(2), (std::vector<int>{ ZOO_ERRORS::ZTHROTTLEDOP, 0 }));
+	std::this_thread::sleep_for(100ms);
+	EXPECT_EQ(ready.load(), 1);
+	EXPECT_EQ(monitor_.throttled_ops(), 2u);
+
+	monitor_.set_inflight_limit(0);
+	server_.set_fault_hook({});
+};
+
+TEST_F(fake_zk_test, fault_hook) {
+	monitor_.create_path("/f", std::string("x"));
+	server_.set_fault_hook([](const zk::fake_request& req) {
+		zk::fake_fault fault;
+		if (req.op == ZOO_GETDATA_OP && req.path == "/f") {
+			fault.error = ZOO_ERRORS::ZOPERATIONTIMEOUT;
+		}
+		if (req.op == ZOO_SETDATA_OP) {
+			fault.delay = 200ms;
+		}
+		return fault;
+	});
+	auto [ec, _] = monitor_.get_path_value("/f");
+	EXPECT_EQ(ec.value(), ZOO_ERRORS::ZOPERATIONTIMEOUT);
+
+	auto start = std::chrono::steady_clock::now();
+	EXPECT_EQ(monitor_.set_path_value("/f", "y").value(), 0);
+	EXPECT_GE(std::chrono::steady_clock::now() - start, 200ms);
+	server_.set_fault_hook({});
+};
+
+TEST_F(fake_zk_test, latency_histograms) {
+	monitor_.latency(zk::zk_op::get_data, zk::zk_latency_phase::rtt, true);
+	monitor_.create_path("/l", std::string("x"));
+	for (int i = 0; i < 20; ++i) {
+		monitor_.get_path_value("/l");
+	}
+	// the callback phase ends after the callback that wakes us returns
+	std::this_thread::sleep_for(50ms);
+	auto rtt = monitor_.latency(zk::zk_op::get_data, zk::zk_latency_phase::rtt, true);
+	EXPECT_EQ(rtt.count, 20);
+	EXPECT_LE(rtt.percentile(0.5), rtt.percentile(0.99));
+	EXPECT_LE(rtt.percentile(0.99), rtt.max);
+	EXPECT_GE(rtt.mean(), 0.0);
+	EXPECT_EQ(monitor_.latency(zk::zk_op::get_data, zk::zk_latency_phase::rtt).count, 0);
+	EXPECT_EQ(monitor_.latency(zk::zk_op::get_data, zk::zk_latency_phase::queue).count, 20);
+	EXPECT_EQ(monitor_.latency(zk::zk_op::get_data, zk::zk_latency_phase::callback).count, 20);
+	EXPECT_GE(monitor_.latency(zk::zk_op::create, zk::zk_latency_phase::rtt).count, 1);
+
+	server_.set_fault_hook([](const zk::fake_request& req) {
+		zk::fake_fault fault;
+		if (req.op == ZOO_SETDATA_OP) {
+			fault.delay = 50ms;
+		}
+		return fault;
+	});
+	monitor_.set_path_value("/l", "y");
+	server_.set_fault_hook({});
+	auto set_rtt = monitor_.latency(zk::zk_op::set_data, zk::zk_latency_phase::rtt);
+	EXPECT_EQ(set_rtt.count, 1);
+	EXPECT_GE(set_rtt.percentile(0.5), 45000);
+};
+
+TEST_F(fake_zk_test, watch_stat_and_tracer) {
+	std::promise<cm::node_stat> changed;
+	monitor_.tracer().enable();
+	monitor_.create_path("/t", std::string("v1"));
+	monitor_.watch_path("/t", [&changed, fired = false](auto eve, auto&& val,
+		const cm::node_stat& stat) mutable {
+		if (eve == cm::path_event::changed && val == "v2" && !fired) {
+			fired = true;
+			changed.set_value(stat);
+		}
+	});
+	std::this_thread::sleep_for(100ms);
+	EXPECT_TRUE(monitor_.tracer().samples().empty());  // the first read is not a change
+
+	monitor_.set_path_value("/t", "v2");
+	auto f = changed.get_future();
+	ASSERT_EQ(f.wait_for(3s), std::future_status::ready);
+	auto stat = f.get();
+	EXPECT_EQ(stat.version, 1);
+	EXPECT_GT(stat.mzxid, stat.czxid);
+	EXPECT_GT(stat.mtime, 0);
+
+	std::this_thread::sleep_for(50ms);
+	auto samples = monitor_.tracer().samples(true);
+	ASSERT_EQ(samples.size(), 1u);
+	EXPECT_EQ(samples[0].path, "/t");
+	EXPECT_EQ(samples[0].mzxid, stat.mzxid);
+	EXPECT_LE(samples[0].received, samples[0].callback_start);
+	EXPECT_LE(samples[0].callback_start, samples[0].callback_end);
+	EXPECT_TRUE(monitor_.tracer().samples().empty());
+
+	std::ostringstream os;
+	cm::watch_tracer::write_json(os, samples);
+	EXPECT_NE(os.str().find("\"path\":\"/t\""), std::string::npos);
+};
+
+TEST_F(fake_zk_test, record_and_replay) {
+	std::mutex mtx;
+	std::condition_variable cv;
+	std::vector<std::string> events;
+	auto log = [&](std::string line) {
+		std::lock_guard<std::mutex> lock(mtx);
+		events.push_back(std::move(line));
+		cv.notify_all();
+	};
+	auto wait_for = [&](size_t count) {
+		std::unique_lock<std::mutex> lock(mtx);
+		return cv.wait_for(lock, 3s, [&] { return events.size() >= count; });
+	};
+	auto file = std::string("./record_and_replay.log");
+	ASSERT_TRUE(monitor_.recorder().open(file));
+
+	monitor_.create_path("/rr", std::string("v1"));
+	monitor_.create_path("/rs/x", std::string("x1"));
+	monitor_.watch_path("/rr", [&](auto eve, auto&& val) {
+		log("/rr " + std::to_string((int)eve) + " " + val.value_or("-"));
+	});
+	ASSERT_TRUE(wait_for(1));
+	monitor_.watch_sub_path("/rs", [&](auto eve, auto path, auto&& val) {
+		log(std::string(path) + " " + std::to_string((int)eve) + " " + val.value_or("-"));
+	});
+	ASSERT_TRUE(wait_for(2));
+	monitor_.set_path_value("/rr", "v2");
+	ASSERT_TRUE(wait_for(3));
+	monitor_.del_path("/rs/x");
+	ASSERT_TRUE(wait_for(4));
+	monitor_.recorder().close();
+	EXPECT_EQ(monitor_.recorder().recorded(), 4u);
+	EXPECT_EQ(monitor_.recorder().dropped(), 0u);
+
+	std::unique_lock<std::mutex> lock(mtx);
+	auto live = std::move(events);
+	events.clear();
+	lock.unlock();
+	EXPECT_EQ(live, (std::vector<std::string>{ "/rr 1 v1", "/rs/x 1 x1", "/rr 1 v2", "/rs/x 2 -" }));
+	EXPECT_EQ(monitor_.replay(file, 0), 4u);
+	lock.lock();
+	EXPECT_EQ(events, live);
+	lock.unlock();
+
+	// the original pace is kept, and a hash-only log gives no values
+	cm::event_log::reader reader;
+	ASSERT_TRUE(reader.open(file));
+	cm::event_record first;
+	cm::event_record r;
+	ASSERT_TRUE(reader.next(first));
+	auto last = first;
+	while (reader.next(r)) {
+		last = r;
+	}
+	EXPECT_EQ(last.path, "/rs/x");
+	EXPECT_EQ(first.value_hash, cm::fnv1a("v1"));
+	auto start = std::chrono::steady_clock::now();
+	monitor_.replay(file);
+	EXPECT_GE(std::chrono::steady_clock::now() - start, std::chrono::microseconds(last.time_us - first.time_us));
+
+	ASSERT_TRUE(monitor_.recorder().open(file, { 64, false, 10ms }));
+	monitor_.set_path_value("/rr", "v3");
+	ASSERT_TRUE(wait_for(9));
+	monitor_.recorder().close();
+	lock.lock();
+	events.clear();
+	lock.unlock();
+	EXPECT_EQ(monitor_.replay(file, 0), 1u);
+	lock.lock();
+	EXPECT_EQ(events, std::vector<std::string>{ "/rr 1 -" });
+	lock.unlock();
+	std::remove(file.c_str());
+};
+
+TEST_F(fake_zk_test, metrics) {
+	auto& registry = cm::metrics_registry::instance();  // outlives monitor_
+	monitor_.register_metrics(registry, "instance=\"ut\"");
+	monitor_.create_path("/p", std::string("x"));
+	monitor_.watch_path("/p", [](auto, auto&&) {});
+	std::this_thread::sleep_for(100ms);
+
+	auto text = registry.render();
+	EXPECT_NE(text.find("# TYPE zk_session_transitions_total counter"), std::string::npos);
+	EXPECT_NE(text.find("zk_session_transitions_total{instance=\"ut\",state=\"connected\"} 1\n"),
+		std::string::npos);
+	EXPECT_NE(text.find("zk_watches{instance=\"ut\",type=\"data\"} 1\n"), std::string::npos);
+	EXPECT_NE(text.find("zk_outstanding_requests{instance=\"ut\"} 0\n"), std::string::npos);
+
+	server_.drop_connections();
+	std::this_thread::sleep_for(1500ms);
+	text = registry.render();
+	EXPECT_NE(text.find("zk_reconnects_total{instance=\"ut\"} 1\n"), std::string::npos);
+	EXPECT_NE(text.find("zk_rewatch_replays_total{instance=\"ut\"} 1\n"), std::string::npos);
+	EXPECT_NE(text.find("# TYPE zk_rewatch_last_duration_seconds gauge"), std::string::npos);
+
+	char buf[64];
+	EXPECT_EQ(registry.render(buf, sizeof(buf)), text.size());
+	EXPECT_EQ(std::string(buf), text.substr(0, sizeof(buf) - 1));
+	EXPECT_TRUE(registry.write_file("./fake_zk_metrics.prom"));
+	std::ifstream in("./fake_zk_metrics.prom");
+	EXPECT_EQ(std::string(std::istreambuf_iterator<char>(in), {}), text);
+	std::remove("./fake_zk_metrics.prom");
+};
+
+// A scrape may run while an expired session is closed and replaced
+TEST_F(fake_zk_test, metrics_during_expiry) {
+	auto& registry = cm::metrics_registry::instance();  // outlives monitor_
+	monitor_.register_metrics(registry, "instance=\"ex\"");
+	std::atomic<bool> stop = false;
+	std::thread scraper([&] {
+		while (!stop) {
+			registry.render();
+		}
+	});
+	for (int i = 0; i < 3; ++i) {
+		server_.expire_all_sessions();
+		for (int j = 0; j < 300 && server_.session_ids().size() != 1; ++j) {
+			std::this_thread::sleep_for(10ms);
+		}
+		std::this_thread::sleep_for(100ms);
+	}
+	stop = true;
+	scraper.join();
+	EXPECT_EQ(server_.session_ids().size(), 1u);
+	EXPECT_NE(registry.render().find("zk_session_expirations_total{instance=\"ex\"} 3\n"), std::string::npos);
+};
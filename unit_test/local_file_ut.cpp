@@ -1,3 +1,9 @@
+#include <fstream>
+#include <future>
+
+#include "local_file/local_file.hpp"
+#include "gtest/gtest.h"
+
 //#include <future>
 //
 //#include "config_monitor.hpp"
@@ -510,4 +516,186 @@
 //        pro1.set_value(ec);
 //    });
 //    EXPECT_EQ(pro1.get_future().get().value(), 0);
-//};
\ No newline at end of file
+//};
+
+class loc_file_test : public ::testing::Test {
+protected:
+    std::string root = "./loc_file_test";
+    std::string session_dir = "./loc_file_test_session";
+
+public:
+    void TearDown() override {
+        std::filesystem::remove_all(root);
+        std::filesystem::remove_all(session_dir);
+    }
+
+    static auto create(loc::loc_file& file, std::string_view path,
+                       loc::file_create_mode mode, int64_t ttl = -1) {
+        std::promise<std::pair<loc::file_error, std::string>> pro;
+        file.create_path(path, "value", mode, [&pro](loc::file_error err, std::string&& p) {
+            pro.set_value({ err, std::move(p) });
+        }, ttl);
+        return pro.get_future().get();
+    }
+};
+
+TEST_F(loc_file_test, create_sequential_path) {
+    loc::loc_file file;
+    file.initialize(10, session_dir);
+    auto [err1, path1] = create(file, root + "/seq-", loc::file_create_mode::persistent_sequential);
+    EXPECT_EQ(err1, loc::file_error::ok);
+    EXPECT_EQ(path1, root + "/seq-0000000000");
+
+    auto [err2, path2] = create(file, root + "/seq-", loc::file_create_mode::persistent_sequential);
+    EXPECT_EQ(err2, loc::file_error::ok);
+    EXPECT_EQ(path2, root + "/seq-0000000001");
+    EXPECT_TRUE(std::filesystem::exists(path2));
+};
+
+TEST_F(loc_file_test, ttl_path_expired) {
+    loc::loc_file file;
+    file.initialize(10, session_dir);
+    auto [err, path] = create(file, root + "/ttl", loc::file_create_mode::persistent_with_ttl, 50);
+    EXPECT_EQ(err, loc::file_error::ok);
+    EXPECT_TRUE(std::filesystem::exists(path));
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    EXPECT_FALSE(std::filesystem::exists(path));
+};
+
+TEST_F(loc_file_test, ephemeral_path_removed_with_instance) {
+    std::string path;
+    {
+        loc::loc_file file;
+        file.initialize(10, session_dir);
+        auto [err, p] = create(file, root + "/ephemeral", loc::file_create_mode::ephemeral);
+        EXPECT_EQ(err, loc::file_error::ok);
+        EXPECT_TRUE(std::filesystem::exists(p));
+        path = std::move(p);
+    }
+    EXPECT_FALSE(std::filesystem::exists(path));
+};
+
+TEST_F(loc_file_test, ephemeral_path_removed_after_crash) {
+    auto path = std::filesystem::absolute(root + "/ephemeral").lexically_normal();
+    std::filesystem::create_directories(root);
+    std::filesystem::create_directories(session_dir);
+    std::ofstream(path) << "value";
+    std::ofstream(std::filesystem::path(session_dir) / "2147483600_0.session") << "e " << path.string() << '\n';
+
+    loc::loc_file file;
+    file.initialize(10, session_dir);
+    EXPECT_FALSE(std::filesystem::exists(path));
+};
+
+TEST_F(loc_file_test, watch_tree) {
+    std::filesystem::create_directories(root + "/a");
+    std::mutex mtx;
+    std::vector<std::pair<loc::file_event, std::string>> events;
+    loc::loc_file file;
+    file.initialize(10, session_dir);
+    file.watch_tree(root, [&](loc::file_error, loc::file_event eve, std::string_view path) {
+        std::lock_guard lock(mtx);
+        events.emplace_back(eve, std::string(path));
+    });
+    auto wait_events = [&](size_t count) {
+        decltype(events) taken;
+        for (int i = 0; i < 100 && taken.size() < count; ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            std::lock_guard lock(mtx);
+            if (events.size() >= count) {
+                taken.swap(events);
+            }
+        }
+        return taken;
+    };
+    auto first = wait_events(1);
+    ASSERT_EQ(first.size(), 1u);
+    EXPECT_EQ(first[0].first, loc::file_event::dummy_event);
+
+    std::filesystem::create_directories(root + "/a/b");
+    std::ofstream(root + "/a/b/c") << "value";
+    auto created = wait_events(2);
+    ASSERT_EQ(created.size(), 2u);
+    EXPECT_EQ(created[0], std::make_pair(loc::file_event::created_event, root + "/a/b"));
+    EXPECT_EQ(created[1], std::make_pair(loc::file_event::created_event, root + "/a/b/c"));
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    std::ofstream(root + "/a/b/c") << "changed";
+    auto changed = wait_events(1);
+    ASSERT_EQ(changed.size(), 1u);
+    EXPECT_EQ(changed[0], std::make_pair(loc::file_event::changed_event, root + "/a/b/c"));
+
+    std::filesystem::remove_all(root + "/a");
+    auto deleted = wait_events(3);
+    ASSERT_EQ(deleted.size(), 3u);
+    EXPECT_EQ(deleted[0], std::make_pair(loc::file_event::deleted_event, root + "/a/b/c"));
+    EXPECT_EQ(deleted[1], std::make_pair(loc::file_event::deleted_event, root + "/a/b"));
+    EXPECT_EQ(deleted[2], std::make_pair(loc::file_event::deleted_event, root + "/a"));
+};
+
+TEST_F(loc_file_test, watch_tree_symlink_loop) {
+    std::filesystem::create_directories(root + "/a");
+    std::filesystem::create_directory_symlink(std::filesystem::absolute(root), root + "/a/up");
+    std::mutex mtx;
+    std::vector<std::pair<loc::file_event, std::string>> events;
+    loc::loc_file file;
+    file.initialize(10, session_dir);
+    file.watch_tree(root, [&](loc::file_error, loc::file_event eve, std::string_view path) {
+        std::lock_guard lock(mtx);
+        events.emplace_back(eve, std::string(path));
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+    std::ofstream(root + "/a/f") << "value";
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    std::lock_guard lock(mtx);
+    ASSERT_EQ(events.size(), 2u);
+    EXPECT_EQ(events[0].first, loc::file_event::dummy_event);
+    EXPECT_EQ(events[1], std::make_pair(loc::file_event::created_event, root + "/a/f"));
+};
+
+TEST_F(loc_file_test, watch_with_poll_interval) {
+    std::filesystem::create_directories(root);
+    auto path = root + "/value";
+    std::ofstream(path) << "value";
+
+    auto pro = std::make_shared<std::promise<std::optional<std::string>>>();
+    std::atomic<int> count = 0;
+    loc::loc_file file;
+    file.initialize(5000, session_dir);  // default interval far beyond the wait below
+    file.get_path_value(path, [pro, &count](loc::file_error, std::optional<std::string>&& val) {
+        if (count++ == 1) {
+            pro->set_value(std::move(val));
+        }
+    }, loc::poll_interval{ std::chrono::milliseconds(10), std::chrono::milliseconds(40) });
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));  // backed off to max
+    std::ofstream(path) << "changed";
+    auto future = pro->get_future();
+    ASSERT_EQ(future.wait_for(std::chrono::milliseconds(500)), std::future_status::ready);
+    EXPECT_EQ(future.get(), "changed");
+};
+
+TEST_F(loc_file_test, scan_duration_metrics) {
+    std::filesystem::create_directories(root);
+    cm::metrics_registry registry;
+    auto scans = [&registry]() {
+        auto text = registry.render();
+        auto line = std::string("loc_file_scan_duration_seconds_count{kind=\"exist\"} ");
+        auto pos = text.find(line);
+        return pos == std::string::npos ? -1 : std::stoi(text.substr(pos + line.size()));
+    };
+    {
+        loc::loc_file file;
+        file.initialize(10, session_dir);
+        file.register_metrics(registry);
+        EXPECT_EQ(scans(), 0);
+        file.exists_path(root, [](loc::file_error, loc::file_event) {});
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        EXPECT_GT(scans(), 0);
+        EXPECT_NE(registry.render().find("# TYPE loc_file_scan_duration_seconds histogram"),
+                  std::string::npos);
+    }
+    EXPECT_EQ(registry.render(), "");
+};
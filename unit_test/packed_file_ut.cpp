@@ -0,0 +1,216 @@
+#include <cstdio>
+#include <filesystem>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include "config_monitor.hpp"
+#include "local_file/packed_file.hpp"
+#include "gtest/gtest.h"
+
+class packed_file_test : public ::testing::Test {
+protected:
+    std::string file_path = "./packed_file_test.log";
+    std::string main_path = "/packed_file_test";
+    std::string test_path = main_path + "/node";
+
+public:
+    void SetUp() override {
+        std::remove(file_path.c_str());
+    }
+
+    void TearDown() override {
+        std::remove(file_path.c_str());
+        std::remove((file_path + ".compact").c_str());
+    }
+};
+
+TEST_F(packed_file_test, create_get_set_delete) {
+    cm::config_monitor<loc::packed_file> file;
+    file.init(file_path, 10);
+    auto [ec, path] = file.create_path(test_path, "value");
+    EXPECT_EQ(ec.value(), 0);
+    EXPECT_EQ(path, test_path);
+
+    auto [ec1, path1] = file.create_path(test_path);
+    EXPECT_EQ(ec1.value(), static_cast<int>(loc::file_error::already_exist));
+
+    EXPECT_EQ(file.set_path_value(test_path, "changed").value(), 0);
+    auto [ec2, value] = file.get_path_value(test_path);
+    EXPECT_EQ(ec2.value(), 0);
+    EXPECT_EQ(value, "changed");
+
+    auto [ec3, sub_paths] = file.get_sub_path(main_path);
+    EXPECT_EQ(ec3.value(), 0);
+    EXPECT_EQ(sub_paths, std::vector<std::string>{ test_path });
+
+    EXPECT_EQ(file.del_path(main_path).value(), 0);
+    EXPECT_EQ(std::get<0>(file.get_path_value(test_path)).value(), static_cast<int>(loc::file_error::not_exist));
+    EXPECT_EQ(file.set_path_value(test_path, "value").value(), static_cast<int>(loc::file_error::not_exist));
+};
+
+TEST_F(packed_file_test, async_create_path) {
+    cm::config_monitor<loc::packed_file> file;
+    file.init(file_path, 10);
+    std::promise<std::pair<std::error_code, std::string>> pro;
+    file.async_create_path(test_path, [&pro](const std::error_code& ec, std::string&& path) {
+        pro.set_value({ ec, std::move(path) });
+    }, "value");
+    auto [ec, path] = pro.get_future().get();
+    EXPECT_EQ(ec.value(), 0);
+    EXPECT_EQ(path, test_path);
+};
+
+TEST_F(packed_file_test, create_sequential_path) {
+    cm::config_monitor<loc::packed_file> file;
+    file.init(file_path, 10);
+    auto [ec1, path1] = file.create_path(main_path + "/seq-", "1", cm::create_mode::persistent_sequential);
+    auto [ec2, path2] = file.create_path(main_path + "/seq-", "2", cm::create_mode::persistent_sequential);
+    EXPECT_EQ(ec1.value(), 0);
+    EXPECT_EQ(ec2.value(), 0);
+    EXPECT_EQ(path1, main_path + "/seq-0000000000");
+    EXPECT_EQ(path2, main_path + "/seq-0000000001");
+};
+
+TEST_F(packed_file_test, watch_path) {
+    std::mutex mtx;
+    std::vector<std::pair<cm::path_event, std::optional<std::string>>> events;
+    cm::config_monitor<loc::packed_file> file;
+    file.init(file_path, 10);
+    file.create_path(test_path, "value");
+
+    auto pro = std::make_shared<std::promise<void>>();
+    file.watch_path(test_path, [&](cm::path_event eve, std::optional<std::string>&& value) {
+        std::lock_guard lock(mtx);
+        events.emplace_back(eve, std::move(value));
+        if (events.size() == 3) {
+            pro->set_value();
+        }
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(30));
+    file.set_path_value(test_path, "changed");
+    std::this_thread::sleep_for(std::chrono::milliseconds(30));
+    file.del_path(test_path);
+    pro->get_future().get();
+
+    std::lock_guard lock(mtx);
+    EXPECT_EQ(events[0].first, cm::path_event::changed);
+    EXPECT_EQ(events[0].second, "value");
+    EXPECT_EQ(events[1].first, cm::path_event::changed);
+    EXPECT_EQ(events[1].second, "changed");
+    EXPECT_EQ(events[2].first, cm::path_event::del);
+};
+
+TEST_F(packed_file_test, watch_sub_path) {
+    std::mutex mtx;
+    std::set<std::string> values;
+    std::promise<void> pro;
+    cm::config_monitor<loc::packed_file> file;
+    file.init(file_path, 10);
+    file.create_path(main_path + "/1", "111");
+
+    file.watch_sub_path(main_path, [&](cm::path_event, std::string_view, std::optional<std::string>&& value) {
+        std::lock_guard lock(mtx);
+        values.emplace(value.value_or(""));
+        if (values.size() == 2) {
+            pro.set_value();
+        }
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(30));
+    file.create_path(main_path + "/2", "222");
+    pro.get_future().get();
+
+    std::lock_guard lock(mtx);
+    EXPECT_EQ(values, (std::set<std::string>{ "111", "222" }));
+};
+
+TEST_F(packed_file_test, reopen_keeps_nodes) {
+    {
+        cm::config_monitor<loc::packed_file> file;
+        file.init(file_path, 10);
+        file.create_path(test_path, "value");
+        file.create_path(main_path + "/ephemeral", "value", cm::create_mode::ephemeral);
+        file.set_path_value(test_path, "changed");
+    }
+    cm::config_monitor<loc::packed_file> file;
+    file.init(file_path, 10);
+    EXPECT_EQ(std::get<1>(file.get_path_value(test_path)), "changed");
+    auto [ec, value] = file.get_path_value(main_path + "/ephemeral");
+    EXPECT_EQ(ec.value(), static_cast<int>(loc::file_error::not_exist));
+};
+
+TEST_F(packed_file_test, compact_log) {
+    cm::config_monitor<loc::packed_file> file;
+    file.init(file_path, 10, 4096);
+    file.create_path(test_path, "0");
+    for (int i = 0; i < 1000; ++i) {
+        file.set_path_value(test_path, std::to_string(i));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    EXPECT_LT(std::filesystem::file_size(file_path), 4096u);
+    EXPECT_EQ(std::get<1>(file.get_path_value(test_path)), "999");
+    file.set_path_value(test_path, "after");
+    EXPECT_EQ(std::get<1>(file.get_path_value(test_path)), "after");
+};
+
+TEST_F(packed_file_test, compact_keeps_sequence) {
+    std::map<std::string, std::string> last;  // prefix, the latest name created
+    auto create_sequential = [&](cm::config_monitor<loc::packed_file>& file, const std::string& prefix) {
+        auto [ec, name] = file.create_path(prefix, "x", cm::create_mode::persistent_sequential);
+        EXPECT_EQ(ec.value(), 0);
+        EXPECT_GT(name, last[prefix]);
+        last[prefix] = name;
+        return name;
+    };
+    std::vector<std::string> prefixes = { "/s", main_path + "/s" };
+    {
+        cm::config_monitor<loc::packed_file> file;
+        file.init(file_path, 10, 4096);
+        for (const auto& prefix : prefixes) {
+            for (int i = 0; i < 5; ++i) {
+                auto name = create_sequential(file, prefix);
+                if (i % 2 == 0) {
+                    file.del_path(name);
+                }
+            }
+        }
+        file.create_path("/filler", "0");
+        for (int i = 0; i < 1000; ++i) {
+            file.set_path_value("/filler", std::to_string(i));
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        EXPECT_LT(std::filesystem::file_size(file_path), 4096u);
+
+        for (const auto& prefix : prefixes) {
+            create_sequential(file, prefix);
+        }
+    }
+    // and once replayed from the compacted log
+    cm::config_monitor<loc::packed_file> file;
+    file.init(file_path, 10, 4096);
+    for (const auto& prefix : prefixes) {
+        create_sequential(file, prefix);
+        create_sequential(file, prefix);
+    }
+};
+
+TEST_F(packed_file_test, shared_between_instances) {
+    std::promise<std::optional<std::string>> pro;
+    cm::config_monitor<loc::packed_file> writer;
+    writer.init(file_path, 10);
+    cm::config_monitor<loc::packed_file> reader;
+    reader.init(file_path, 10);
+    writer.create_path(test_path, "value");
+
+    reader.watch_path(test_path, [&pro](cm::path_event eve, std::optional<std::string>&& value) {
+        if (eve == cm::path_event::changed && value == "changed") {
+            pro.set_value(std::move(value));
+        }
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(30));
+    writer.set_path_value(test_path, "changed");
+    EXPECT_EQ(pro.get_future().get(), "changed");
+};